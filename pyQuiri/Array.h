@@ -0,0 +1,109 @@
+// ======================================================================== //
+// Copyright 2022-2022 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#pragma once
+
+#include "pyQuiri/common.h"
+
+namespace pyq {
+
+  /*! a flat array of plain-old-data elements that either owns its
+      memory (in a std::vector), or refers to read-only memory owned
+      by somebody else (eg, a memory-mapped file). In the latter case
+      the array keeps a reference to whatever object owns that
+      memory, and will only make a private copy once somebody asks
+      for a writable version of it */
+  template<typename T>
+  struct Array {
+    inline const T *data() const { return mapped ? mapped : owned.data(); }
+    inline size_t   size() const { return mapped ? numMapped : owned.size(); }
+    inline bool     empty() const { return size() == 0; }
+    inline const T &operator[](size_t i) const { return data()[i]; }
+
+    /*! returns if this array refers to memory it does not own */
+    inline bool isMapped() const { return mapped != nullptr; }
+
+    /*! returns a writable vector with this array's content; if this
+        array currently refers to external memory this will first
+        create a private copy of that memory */
+    std::vector<T> &writable()
+    {
+      if (mapped) {
+        owned = std::vector<T>(mapped,mapped+numMapped);
+        mapped    = nullptr;
+        numMapped = 0;
+        keepAlive = {};
+      }
+      return owned;
+    }
+
+    /*! makes this array refer to given external memory; 'keepAlive'
+        is whatever object owns this memory, and will be kept alive
+        for as long as this array refers to it */
+    void map(const T *ptr, size_t count, std::shared_ptr<void> keepAlive)
+    {
+      owned           = {};
+      this->mapped    = count ? ptr : nullptr;
+      this->numMapped = count;
+      this->keepAlive = count ? keepAlive : std::shared_ptr<void>();
+    }
+
+    /*! returns an object that keeps this array's current memory
+        alive (and unchanged) for as long as it lives; if the array
+        gets modified afterwards that will happen on a private copy */
+    std::shared_ptr<void> share()
+    {
+      if (!mapped && !owned.empty()) {
+        std::shared_ptr<std::vector<T>> shared
+          = std::make_shared<std::vector<T>>(std::move(owned));
+        map(shared->data(),shared->size(),shared);
+      }
+      return keepAlive;
+    }
+
+    /*! releases all memory (owned or mapped) */
+    void clear() { map(nullptr,0,{}); }
+
+  private:
+    std::vector<T>        owned;
+    const T              *mapped    = nullptr;
+    size_t                numMapped = 0;
+    std::shared_ptr<void> keepAlive;
+  };
+
+  /*! a read-only block of memory that can be handed out to python
+      (via the buffer protocol) without copying it; 'owner' is
+      whatever keeps that memory alive */
+  struct MemoryRef {
+    std::shared_ptr<void> owner;
+    const void           *ptr;
+    size_t                numBytes;
+  };
+
+  /*! returns a shared_ptr that keeps the given python object alive
+      for as long as it (or any copy of it) exists; the object gets
+      released under the GIL, no matter which thread drops the last
+      reference */
+  inline std::shared_ptr<void> keepPyObjectAlive(const py::object &object)
+  {
+    return std::shared_ptr<void>(new py::object(object),
+                                 [](void *ptr) {
+                                   py::gil_scoped_acquire gil;
+                                   delete (py::object *)ptr;
+                                 });
+  }
+
+} // ::pyq
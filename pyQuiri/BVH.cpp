@@ -0,0 +1,424 @@
+// ======================================================================== //
+// Copyright 2022-2022 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "pyQuiri/BVH.h"
+#include "pyQuiri/Morton.h"
+#include "pyQuiri/parallel.h"
+#include <queue>
+
+namespace pyq {
+
+  /*! number of primitives that get handed out to a thread at once
+      when computing overlapping pairs */
+  static const size_t BVH_PAIRS_BLOCK_SIZE = 256;
+  
+  void BVH::addPrim(PrimType type, const double *primData, const py::object &value)
+  {
+    for (int i=0;i<2*K;i++)
+      if (!std::isfinite(primData[i]))
+        throw py::value_error("pyQuiri: BVH primitives must have finite coordinates");
+    std::vector<double> box(2*K);
+    for (int d=0;d<K;d++)
+      switch (type) {
+      case PRIM_BOX:
+        if (primData[d] > primData[K+d])
+          throw py::value_error("pyQuiri: lower corner of box is above its upper corner");
+        box[d]   = primData[d];
+        box[K+d] = primData[K+d];
+        break;
+      case PRIM_SPHERE:
+        box[d]   = primData[d]-primData[K];
+        box[K+d] = primData[d]+primData[K];
+        break;
+      case PRIM_SEGMENT:
+        box[d]   = std::min(primData[d],primData[K+d]);
+        box[K+d] = std::max(primData[d],primData[K+d]);
+        break;
+      }
+    if (numPrims() >= size_t(std::numeric_limits<int32_t>::max()))
+      throw std::runtime_error("pyQuiri: too many primitives");
+    isBuilt = false;
+    types.push_back(type);
+    data.insert(data.end(),primData,primData+2*K);
+    bounds.insert(bounds.end(),box.begin(),box.end());
+    values.push_back(value);
+  }
+
+  void BVH::addBox(const std::vector<double> &lower, const std::vector<double> &upper,
+                   const py::object &value)
+  {
+    if ((int)lower.size() != K || (int)upper.size() != K)
+      throw py::type_error("box in BVH::add_box() does not match dimensionality of BVH");
+    std::vector<double> primData(lower);
+    primData.insert(primData.end(),upper.begin(),upper.end());
+    addPrim(PRIM_BOX,primData.data(),value);
+  }
+  
+  void BVH::addSphere(const std::vector<double> &center, double radius,
+                      const py::object &value)
+  {
+    if ((int)center.size() != K)
+      throw py::type_error("center in BVH::add_sphere() does not match dimensionality of BVH");
+    if (!(radius >= 0.))
+      throw py::value_error("pyQuiri: sphere radius must not be negative");
+    std::vector<double> primData(center);
+    primData.resize(2*K,0.);
+    primData[K] = radius;
+    addPrim(PRIM_SPHERE,primData.data(),value);
+  }
+
+  void BVH::addSegment(const std::vector<double> &a, const std::vector<double> &b,
+                       const py::object &value)
+  {
+    if ((int)a.size() != K || (int)b.size() != K)
+      throw py::type_error("segment in BVH::add_segment() does not match dimensionality of BVH");
+    std::vector<double> primData(a);
+    primData.insert(primData.end(),b.begin(),b.end());
+    addPrim(PRIM_SEGMENT,primData.data(),value);
+  }
+
+  void BVH::addBoxes(const PointArray &lower, const PointArray &upper)
+  {
+    if (lower.ndim() != 2 || lower.shape(1) != K ||
+        upper.ndim() != 2 || upper.shape(1) != K ||
+        lower.shape(0) != upper.shape(0))
+      throw py::type_error("pyQuiri: lower and upper corners must be given as two (M,"
+                           +std::to_string(K)+") arrays");
+    const size_t numBoxes = lower.shape(0);
+    std::vector<double> primData(2*K);
+    for (size_t i=0;i<numBoxes;i++) {
+      std::copy(lower.data()+i*K,lower.data()+i*K+K,primData.begin());
+      std::copy(upper.data()+i*K,upper.data()+i*K+K,primData.begin()+K);
+      addPrim(PRIM_BOX,primData.data(),py::int_(numPrims()));
+    }
+  }
+  
+  void BVH::build(int leafSize, int numThreads)
+  {
+    if (leafSize < 1)
+      throw py::value_error("pyQuiri: leaf_size must be at least 1");
+    nodes.clear();
+    nodeBoxes.clear();
+    const size_t N = numPrims();
+    primIDs.resize(N);
+    for (size_t i=0;i<N;i++)
+      primIDs[i] = int(i);
+    if (N > 0) {
+      py::gil_scoped_release noGIL;
+      // sort the primitives by the Morton codes of their bounding boxes' centers
+      std::vector<double> centers(N*K);
+      Box centerBounds(K);
+      for (size_t i=0;i<N;i++) {
+        for (int d=0;d<K;d++)
+          centers[i*K+d] = .5*(primBounds(int(i))[d]+primBounds(int(i))[K+d]);
+        centerBounds.grow(centers.data()+i*K);
+      }
+      const MortonQuantizer quantizer(centerBounds);
+      std::vector<uint64_t> codes(N);
+      parallel_for_blocked(N,4096,numThreads,[&](size_t begin, size_t end) {
+          for (size_t i=begin;i<end;i++)
+            codes[i] = quantizer.code(centers.data()+i*K);
+        });
+      radixSort(codes,primIDs,numThreads);
+      buildRec(codes,0,int(N),leafSize);
+    }
+    isBuilt = true;
+  }
+
+  int BVH::buildRec(const std::vector<uint64_t> &codes, int begin, int end,
+                    int leafSize)
+  {
+    const int nodeID = (int)nodes.size();
+    nodes.push_back({begin,end-begin,-1,-1});
+    nodeBoxes.resize(nodeBoxes.size()+2*K);
+    if (end-begin > leafSize) {
+      // split at the highest bit in which the (sorted) codes differ,
+      // or in the middle if they're all the same
+      int mid = (begin+end)/2;
+      const uint64_t diff = codes[begin] ^ codes[end-1];
+      if (diff) {
+        const uint64_t mask = uint64_t(1) << highestBit(diff);
+        mid = int(std::partition_point(codes.begin()+begin,codes.begin()+end,
+                                       [&](uint64_t code) { return !(code & mask); })
+                  -codes.begin());
+      }
+      const int lChild = buildRec(codes,begin,mid,leafSize);
+      const int rChild = buildRec(codes,mid,end,leafSize);
+      nodes[nodeID].lChild = lChild;
+      nodes[nodeID].rChild = rChild;
+      nodes[nodeID].count  = 0;
+      double *box = nodeBoxes.data()+size_t(nodeID)*2*K;
+      for (int d=0;d<K;d++) {
+        box[d]   = std::min(nodeBounds(lChild)[d],nodeBounds(rChild)[d]);
+        box[K+d] = std::max(nodeBounds(lChild)[K+d],nodeBounds(rChild)[K+d]);
+      }
+    } else {
+      double *box = nodeBoxes.data()+size_t(nodeID)*2*K;
+      std::fill(box,box+K,+std::numeric_limits<double>::infinity());
+      std::fill(box+K,box+2*K,-std::numeric_limits<double>::infinity());
+      for (int i=begin;i<end;i++)
+        for (int d=0;d<K;d++) {
+          box[d]   = std::min(box[d],primBounds(primIDs[i])[d]);
+          box[K+d] = std::max(box[K+d],primBounds(primIDs[i])[K+d]);
+        }
+    }
+    return nodeID;
+  }
+
+  /*! returns whether the boxes [aLower,aUpper] and [bLower,bUpper]
+      overlap (or touch) */
+  static inline bool boxesOverlap(const double *aLower, const double *aUpper,
+                                  const double *bLower, const double *bUpper, int K)
+  {
+    for (int d=0;d<K;d++)
+      if (aLower[d] > bUpper[d] || aUpper[d] < bLower[d])
+        return false;
+    return true;
+  }
+
+  /*! returns the squared distance between a point and the box
+      [lower,upper] */
+  static inline double sqrDistanceToBox(const double *point,
+                                        const double *lower, const double *upper, int K)
+  {
+    double dist2 = 0.;
+    for (int d=0;d<K;d++) {
+      const double outside = std::max(lower[d]-point[d],0.)+std::max(point[d]-upper[d],0.);
+      dist2 += outside*outside;
+    }
+    return dist2;
+  }
+  
+  template<typename Visit>
+  void BVH::traverse(const double *lower, const double *upper, const Visit &visit) const
+  {
+    if (nodes.empty()) return;
+    /* Morton codes have at most 64 bits, and ranges of equal codes
+       get split in the middle, so the hierarchy is less than 128
+       levels deep */
+    int stack[128];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+      const int nodeID = stack[--top];
+      if (!boxesOverlap(lower,upper,nodeBounds(nodeID),nodeBounds(nodeID)+K,K))
+        continue;
+      const Node &node = nodes[nodeID];
+      if (node.lChild < 0) {
+        for (int i=node.begin;i<node.begin+node.count;i++) {
+          const int primID = primIDs[i];
+          if (boxesOverlap(lower,upper,primBounds(primID),primBounds(primID)+K,K))
+            visit(primID);
+        }
+        continue;
+      }
+      stack[top++] = node.rChild;
+      stack[top++] = node.lChild;
+    }
+  }
+  
+  bool BVH::contains(int primID, const double *point) const
+  {
+    const double *prim = primData(primID);
+    switch (types[primID]) {
+    case PRIM_BOX:
+      return boxesOverlap(point,point,prim,prim+K,K);
+    case PRIM_SPHERE:
+      return sqrDistance(point,prim,K) <= prim[K]*prim[K];
+    default:
+      return distance(primID,point) == 0.;
+    }
+  }
+
+  bool BVH::overlaps(int primID, const double *lower, const double *upper) const
+  {
+    const double *prim = primData(primID);
+    switch (types[primID]) {
+    case PRIM_BOX:
+      return boxesOverlap(lower,upper,prim,prim+K,K);
+    case PRIM_SPHERE:
+      return sqrDistanceToBox(prim,lower,upper,K) <= prim[K]*prim[K];
+    default: {
+      // clip the segment a+t*(b-a), t in [0,1], against each slab
+      const double *a = prim, *b = prim+K;
+      double t0 = 0., t1 = 1.;
+      for (int d=0;d<K;d++) {
+        const double dir = b[d]-a[d];
+        if (dir == 0.) {
+          if (a[d] < lower[d] || a[d] > upper[d])
+            return false;
+          continue;
+        }
+        double tLower = (lower[d]-a[d])/dir;
+        double tUpper = (upper[d]-a[d])/dir;
+        if (tLower > tUpper) std::swap(tLower,tUpper);
+        t0 = std::max(t0,tLower);
+        t1 = std::min(t1,tUpper);
+        if (t0 > t1)
+          return false;
+      }
+      return true;
+    }
+    }
+  }
+
+  double BVH::distance(int primID, const double *point) const
+  {
+    const double *prim = primData(primID);
+    switch (types[primID]) {
+    case PRIM_BOX:
+      return sqrt(sqrDistanceToBox(point,prim,prim+K,K));
+    case PRIM_SPHERE:
+      return std::max(sqrt(sqrDistance(point,prim,K))-prim[K],0.);
+    default: {
+      // project the point onto the segment's line, clamped to the segment
+      const double *a = prim, *b = prim+K;
+      double dot = 0., len2 = 0.;
+      for (int d=0;d<K;d++) {
+        dot  += (point[d]-a[d])*(b[d]-a[d]);
+        len2 += (b[d]-a[d])*(b[d]-a[d]);
+      }
+      const double t = len2 > 0. ? std::max(0.,std::min(1.,dot/len2)) : 0.;
+      double dist2 = 0.;
+      for (int d=0;d<K;d++) {
+        const double diff = point[d]-(a[d]+t*(b[d]-a[d]));
+        dist2 += diff*diff;
+      }
+      return sqrt(dist2);
+    }
+    }
+  }
+  
+  void BVH::checkQuery(const std::vector<double> &coords) const
+  {
+    if (!isBuilt)
+      throw std::runtime_error("pyQuiri: BVH not built");
+    if ((int)coords.size() != K)
+      throw py::type_error("query does not match dimensionality of BVH");
+  }
+  
+  std::vector<py::object> BVH::findContaining(const std::vector<double> &point) const
+  {
+    checkQuery(point);
+    std::vector<int> found;
+    traverse(point.data(),point.data(),[&](int primID) {
+        if (contains(primID,point.data()))
+          found.push_back(primID);
+      });
+    std::sort(found.begin(),found.end());
+    std::vector<py::object> result;
+    for (auto primID : found)
+      result.push_back(value(primID));
+    return result;
+  }
+
+  std::vector<py::object> BVH::findOverlapping(const std::vector<double> &lower,
+                                              const std::vector<double> &upper) const
+  {
+    checkQuery(lower);
+    checkQuery(upper);
+    std::vector<int> found;
+    traverse(lower.data(),upper.data(),[&](int primID) {
+        if (overlaps(primID,lower.data(),upper.data()))
+          found.push_back(primID);
+      });
+    std::sort(found.begin(),found.end());
+    std::vector<py::object> result;
+    for (auto primID : found)
+      result.push_back(value(primID));
+    return result;
+  }
+
+  /*! best-first: nodes get visited in order of the distance to their
+      bounding box, until that is further than the closest primitive
+      found so far */
+  py::object BVH::findClosest(const std::vector<double> &point) const
+  {
+    checkQuery(point);
+    if (nodes.empty())
+      return py::none();
+    typedef std::pair<double,int> Entry;
+    std::priority_queue<Entry,std::vector<Entry>,std::greater<Entry>> queue;
+    queue.push({0.,0});
+    double closestDist = std::numeric_limits<double>::infinity();
+    int    closestPrim = -1;
+    while (!queue.empty()) {
+      const double nodeDist = queue.top().first;
+      const Node  &node     = nodes[queue.top().second];
+      queue.pop();
+      if (nodeDist > closestDist)
+        break;
+      if (node.lChild < 0) {
+        for (int i=node.begin;i<node.begin+node.count;i++) {
+          const int primID = primIDs[i];
+          const double dist = distance(primID,point.data());
+          if (dist < closestDist || (dist == closestDist && primID < closestPrim)) {
+            closestDist = dist;
+            closestPrim = primID;
+          }
+        }
+        continue;
+      }
+      for (int child : { node.lChild, node.rChild }) {
+        const double childDist
+          = sqrt(sqrDistanceToBox(point.data(),nodeBounds(child),nodeBounds(child)+K,K));
+        if (childDist <= closestDist)
+          queue.push({childDist,child});
+      }
+    }
+    return py::make_tuple(value(closestPrim),closestDist);
+  }
+
+  /*! every primitive queries the hierarchy with its bounding box, and
+      reports the overlapping primitives with a larger ID */
+  py::tuple BVH::overlapPairs(int numThreads) const
+  {
+    if (!isBuilt)
+      throw std::runtime_error("pyQuiri: BVH not built");
+    const size_t N = numPrims();
+    const size_t numBlocks = (N+BVH_PAIRS_BLOCK_SIZE-1)/BVH_PAIRS_BLOCK_SIZE;
+    std::vector<std::vector<std::pair<int,int>>> blockPairs(numBlocks);
+    {
+      py::gil_scoped_release noGIL;
+      parallel_for(numBlocks,numThreads,[&](size_t blockID) {
+          const size_t end = std::min((blockID+1)*BVH_PAIRS_BLOCK_SIZE,N);
+          std::vector<std::pair<int,int>> &pairs = blockPairs[blockID];
+          for (size_t i=blockID*BVH_PAIRS_BLOCK_SIZE;i<end;i++) {
+            const size_t first = pairs.size();
+            traverse(primBounds(int(i)),primBounds(int(i))+K,[&](int other) {
+                if (other > int(i))
+                  pairs.push_back({int(i),other});
+              });
+            std::sort(pairs.begin()+first,pairs.end());
+          }
+        });
+    }
+    size_t numPairs = 0;
+    for (auto &pairs : blockPairs)
+      numPairs += pairs.size();
+    py::array_t<int32_t> indicesA(numPairs);
+    py::array_t<int32_t> indicesB(numPairs);
+    int32_t *outA = indicesA.mutable_data();
+    int32_t *outB = indicesB.mutable_data();
+    for (auto &pairs : blockPairs)
+      for (auto &pair : pairs) {
+        *outA++ = pair.first;
+        *outB++ = pair.second;
+      }
+    return py::make_tuple(indicesA,indicesB);
+  }
+  
+} // ::pyq
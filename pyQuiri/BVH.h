@@ -0,0 +1,157 @@
+// ======================================================================== //
+// Copyright 2022-2022 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#pragma once
+
+#include "pyQuiri/common.h"
+#include <pybind11/numpy.h>
+
+namespace pyq {
+
+  /*! a bounding volume hierarchy over K-dimensional primitives
+      (axis-aligned boxes, spheres, and line segments), each with a
+      value: every node stores the bounding box of the primitives in
+      its subtree. Built like the kd-tree's "morton" build: the
+      primitives' centers get sorted along a Z-curve (with the same
+      parallel radix sort), and each range of sorted primitives gets
+      split where their Morton codes first differ */
+  struct BVH {
+    typedef std::shared_ptr<BVH> SP;
+    typedef py::array_t<double,py::array::c_style|py::array::forcecast> PointArray;
+
+    /*! the kinds of primitives */
+    typedef enum {
+      /*! data is the lower, then the upper corner */
+      PRIM_BOX,
+      /*! data is the center, then the radius */
+      PRIM_SPHERE,
+      /*! data is the two end points */
+      PRIM_SEGMENT
+    } PrimType;
+    
+    /*! one node of the hierarchy; its primitives are
+        primIDs[begin..begin+count) */
+    struct Node {
+      int32_t begin, count;
+      /*! children, or -1 for leaves */
+      int32_t lChild, rChild;
+    };
+
+    BVH(int K) : K(K) {}
+    
+    static SP create(int K) { return std::make_shared<BVH>(K); }
+
+    /*! adds an axis-aligned box (lower <= upper in all dimensions) */
+    void addBox(const std::vector<double> &lower, const std::vector<double> &upper,
+                const py::object &value);
+    
+    /*! adds a (solid) sphere */
+    void addSphere(const std::vector<double> &center, double radius,
+                   const py::object &value);
+
+    /*! adds the line segment between two points */
+    void addSegment(const std::vector<double> &a, const std::vector<double> &b,
+                    const py::object &value);
+
+    /*! adds one box per row of two (M,K) arrays of lower and upper
+        corners; their values are their indices (in order of add) */
+    void addBoxes(const PointArray &lower, const PointArray &upper);
+    
+    /*! builds the hierarchy (sorting with 'numThreads' threads) - MUST
+        be done before querying anything; nodes with at most leafSize
+        primitives become leaves */
+    void build(int leafSize, int numThreads);
+
+    /*! returns the values of all primitives that contain the point
+        (including their boundary) */
+    std::vector<py::object> findContaining(const std::vector<double> &point) const;
+
+    /*! returns the values of all primitives that overlap the given
+        box (including touching it) */
+    std::vector<py::object> findOverlapping(const std::vector<double> &lower,
+                                           const std::vector<double> &upper) const;
+
+    /*! returns (value, distance) of the primitive closest to the
+        point (at distance 0 if the point is inside a box or sphere),
+        or None if there are no primitives */
+    py::object findClosest(const std::vector<double> &point) const;
+
+    /*! finds all pairs of primitives whose bounding boxes overlap (ie,
+        the broad phase of a collision detection), using 'numThreads'
+        threads, and returns them as a tuple (indicesA, indicesB) of
+        numpy arrays of indices (in order of add), with
+        indicesA[i] < indicesB[i], sorted */
+    py::tuple overlapPairs(int numThreads) const;
+    
+    /*! number of primitives in this hierarchy */
+    inline size_t numPrims() const { return types.size(); }
+    
+    /*! the number of dimensions */
+    const int K;
+    
+  private:
+    /*! adds a primitive with given data (2*K values) */
+    void addPrim(PrimType type, const double *data, const py::object &value);
+    
+    /*! builds the subtree over primIDs[begin..end) (whose sorted
+        Morton codes are codes[begin..end)); returns its node ID */
+    int buildRec(const std::vector<uint64_t> &codes, int begin, int end,
+                 int leafSize);
+
+    /*! calls visit(primID) for every primitive whose bounding box
+        overlaps the box [lower,upper] */
+    template<typename Visit>
+    void traverse(const double *lower, const double *upper, const Visit &visit) const;
+    
+    /*! returns whether the primitive contains the given point */
+    bool contains(int primID, const double *point) const;
+
+    /*! returns whether the primitive overlaps the box [lower,upper] */
+    bool overlaps(int primID, const double *lower, const double *upper) const;
+
+    /*! returns the distance between the primitive and the point */
+    double distance(int primID, const double *point) const;
+
+    /*! checks that the hierarchy is built, and that a query has the
+        right dimensionality; throws an exception if not */
+    void checkQuery(const std::vector<double> &coords) const;
+    
+    inline const double *primData(int primID) const
+    { return data.data()+size_t(primID)*2*K; }
+    inline const double *primBounds(int primID) const
+    { return bounds.data()+size_t(primID)*2*K; }
+    inline const double *nodeBounds(int nodeID) const
+    { return nodeBoxes.data()+size_t(nodeID)*2*K; }
+    inline py::object value(int primID) const { return values[primID]; }
+    
+    /*! the type of every primitive, in order of add */
+    std::vector<uint8_t>    types;
+    /*! 2*K values per primitive, see PrimType */
+    std::vector<double>     data;
+    /*! 2*K values per primitive: its bounding box */
+    std::vector<double>     bounds;
+    /*! one value per primitive */
+    std::vector<py::object> values;
+    /*! the nodes, root first; empty if there are no primitives */
+    std::vector<Node>       nodes;
+    /*! 2*K values per node: the bounding box of its subtree */
+    std::vector<double>     nodeBoxes;
+    /*! the IDs of the primitives referenced by the nodes */
+    std::vector<int>        primIDs;
+    bool                    isBuilt = false;
+  };
+  
+} // ::pyq
@@ -0,0 +1,245 @@
+// ======================================================================== //
+// Copyright 2022-2022 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "pyQuiri/BallTree.h"
+#include <queue>
+
+namespace pyq {
+
+  BallTree::BallTree(int K, const std::string &metric)
+    : K(K), metric(parseMetric(metric))
+  {
+    if (!isTrueMetric(this->metric))
+      throw py::value_error("pyQuiri: ball trees only support metric 'euclidean',"
+                            " 'manhattan', or 'chebyshev'");
+  }
+
+  double BallTree::lowerBound(const double *query, int nodeID) const
+  {
+    const double centerDist = distance(query,centers.data()+size_t(nodeID)*K);
+    const double radius     = nodes[nodeID].radius;
+    // by the triangle inequality; minus some slack for the rounding
+    // errors in computing these distances
+    return std::max(centerDist-radius-1e-12*(centerDist+radius),0.);
+  }
+  
+  void BallTree::add(const std::vector<double> &coords, const py::object &value)
+  {
+    if ((int)coords.size() != K)
+      throw py::type_error
+        ("key in BallTree::add() does not match dimensionality of tree");
+    isBuilt = false;
+    points.insert(points.end(),coords.begin(),coords.end());
+    values.push_back(value);
+  }
+  
+  void BallTree::checkQuery(const std::vector<double> &coords) const
+  {
+    if (!isBuilt)
+      throw std::runtime_error("pyQuiri: tree not built");
+    if ((int)coords.size() != K)
+      throw py::type_error
+        ("query point does not match dimensionality of tree");
+  }
+  
+  void BallTree::build(int leafSize)
+  {
+    if (leafSize < 1)
+      throw py::value_error("pyQuiri: leaf_size must be at least 1");
+    if (numPoints() > size_t(std::numeric_limits<int32_t>::max()))
+      throw std::runtime_error("pyQuiri: too many points");
+    nodes.clear();
+    centers.clear();
+    itemIDs.resize(numPoints());
+    for (size_t i=0;i<numPoints();i++)
+      itemIDs[i] = (int)i;
+    if (numPoints() > 0)
+      buildRec(0,(int)numPoints(),leafSize);
+    isBuilt = true;
+  }
+
+  /*! builds a node whose ball is centered at the mean of its points;
+      inner nodes split their points at the median of their
+      projections onto the line between two far-apart points */
+  int BallTree::buildRec(int begin, int end, int leafSize)
+  {
+    const int nodeID = (int)nodes.size();
+    nodes.push_back({begin,end-begin,-1,-1,0.});
+    centers.resize(centers.size()+K,0.);
+    double *center = centers.data()+size_t(nodeID)*K;
+    for (int i=begin;i<end;i++)
+      for (int d=0;d<K;d++)
+        center[d] += pointCoords(itemIDs[i])[d];
+    for (int d=0;d<K;d++)
+      center[d] /= (end-begin);
+
+    // find the point furthest from the center, and the one furthest from that
+    double radius = 0.;
+    int    a      = itemIDs[begin];
+    for (int i=begin;i<end;i++) {
+      const double dist = distance(center,pointCoords(itemIDs[i]));
+      if (dist > radius) { radius = dist; a = itemIDs[i]; }
+    }
+    nodes[nodeID].radius = radius;
+    if (end-begin <= leafSize || radius == 0.)
+      return nodeID;
+    
+    int    b       = a;
+    double maxDist = -1.;
+    for (int i=begin;i<end;i++) {
+      const double dist = distance(pointCoords(a),pointCoords(itemIDs[i]));
+      if (dist > maxDist) { maxDist = dist; b = itemIDs[i]; }
+    }
+    std::vector<double> dir(K);
+    for (int d=0;d<K;d++)
+      dir[d] = pointCoords(b)[d]-pointCoords(a)[d];
+    auto projection = [&](int item) {
+      double res = 0.;
+      for (int d=0;d<K;d++)
+        res += pointCoords(item)[d]*dir[d];
+      return res;
+    };
+    const int mid = begin+(end-begin)/2;
+    std::nth_element(itemIDs.begin()+begin,itemIDs.begin()+mid,itemIDs.begin()+end,
+                     [&](int x, int y) { return projection(x) < projection(y); });
+    const int lChild = buildRec(begin,mid,leafSize);
+    const int rChild = buildRec(mid,end,leafSize);
+    nodes[nodeID].lChild = lChild;
+    nodes[nodeID].rChild = rChild;
+    return nodeID;
+  }
+
+  std::vector<std::pair<double,int>>
+  BallTree::closest(const double *query, int k, double maxDist) const
+  {
+    /* max-heap of the current candidates */
+    std::priority_queue<std::pair<double,int>> candidates;
+    auto bound = [&]() {
+      return (int)candidates.size() == k ? candidates.top().first : maxDist;
+    };
+    
+    /* best-first traversal, by lower bound on the distance to any
+       point in a node's ball */
+    typedef std::pair<double,int> Entry;
+    std::priority_queue<Entry,std::vector<Entry>,std::greater<Entry>> queue;
+    auto push = [&](int nodeID) {
+      const double dist = lowerBound(query,nodeID);
+      if (dist <= bound())
+        queue.push({dist,nodeID});
+    };
+    if (!nodes.empty() && k > 0)
+      push(0);
+    while (!queue.empty()) {
+      const Entry entry = queue.top();
+      queue.pop();
+      if (entry.first > bound())
+        break;
+      const Node &node = nodes[entry.second];
+      if (node.lChild >= 0) {
+        push(node.lChild);
+        push(node.rChild);
+        continue;
+      }
+      for (int i=node.begin;i<node.begin+node.count;i++) {
+        const int item = itemIDs[i];
+        const std::pair<double,int> candidate(distance(query,pointCoords(item)),item);
+        if ((int)candidates.size() < k) {
+          if (candidate.first <= maxDist)
+            candidates.push(candidate);
+        } else if (candidate < candidates.top()) {
+          candidates.pop();
+          candidates.push(candidate);
+        }
+      }
+    }
+    
+    std::vector<std::pair<double,int>> result;
+    for (;!candidates.empty();candidates.pop())
+      result.push_back(candidates.top());
+    std::reverse(result.begin(),result.end());
+    return result;
+  }
+  
+  std::vector<std::tuple<std::vector<double>,py::object>>
+  BallTree::kNN(int k, const std::vector<double> &coords, double maxRadius) const
+  {
+    if (numPoints() == 0)
+      return {};
+    checkQuery(coords);
+    std::vector<std::tuple<std::vector<double>,py::object>> result;
+    for (auto &found : closest(coords.data(),k,maxRadius))
+      result.push_back(std::make_tuple(pointVector(found.second),values[found.second]));
+    return result;
+  }
+
+  std::vector<std::tuple<std::vector<double>,py::object>>
+  BallTree::allPointsInRadius(const std::vector<double> &coords, double radius) const
+  {
+    if (numPoints() == 0)
+      return {};
+    checkQuery(coords);
+    std::vector<std::pair<double,int>> found;
+    std::vector<int> stack = { 0 };
+    while (!stack.empty()) {
+      const int nodeID = stack.back();
+      const Node &node = nodes[nodeID];
+      stack.pop_back();
+      if (lowerBound(coords.data(),nodeID) > radius)
+        continue;
+      if (node.lChild >= 0) {
+        stack.push_back(node.lChild);
+        stack.push_back(node.rChild);
+        continue;
+      }
+      for (int i=node.begin;i<node.begin+node.count;i++) {
+        const double dist = distance(coords.data(),pointCoords(itemIDs[i]));
+        if (dist <= radius)
+          found.push_back({dist,itemIDs[i]});
+      }
+    }
+    std::sort(found.begin(),found.end());
+    std::vector<std::tuple<std::vector<double>,py::object>> result;
+    for (auto &f : found)
+      result.push_back(std::make_tuple(pointVector(f.second),values[f.second]));
+    return result;
+  }
+
+  std::vector<py::object> BallTree::find(const std::vector<double> &coords) const
+  {
+    std::vector<py::object> result;
+    for (auto &found : allPointsInRadius(coords,0.))
+      result.push_back(std::get<1>(found));
+    return result;
+  }
+  
+  std::tuple<std::vector<double>,py::list>
+  BallTree::findClosest(const std::vector<double> &coords) const
+  {
+    if (numPoints() == 0)
+      return std::tuple<std::vector<double>,py::list>();
+    checkQuery(coords);
+    const std::vector<std::pair<double,int>> found
+      = closest(coords.data(),1,std::numeric_limits<double>::infinity());
+    if (found.empty())
+      return std::tuple<std::vector<double>,py::list>();
+    const std::vector<double> closestPoint = pointVector(found[0].second);
+    py::list values;
+    for (auto &value : find(closestPoint))
+      values.append(value);
+    return std::tuple<std::vector<double>,py::list>(closestPoint,values);
+  }
+  
+} // ::pyq
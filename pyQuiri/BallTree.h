@@ -0,0 +1,123 @@
+// ======================================================================== //
+// Copyright 2022-2022 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#pragma once
+
+#include "pyQuiri/Metric.h"
+
+namespace pyq {
+
+  /*! a ball tree: every node stores a center and a radius that
+      encloses all points in its subtree. Unlike the kd-tree's
+      axis-aligned cells, these bounds only rely on the triangle
+      inequality, so they keep pruning in higher dimensions (where
+      boxes become useless), and work for any metric. Offers the
+      same query API as KDTree */
+  struct BallTree {
+    typedef std::shared_ptr<BallTree> SP;
+
+    
+    /*! one node of the tree; its points are itemIDs[begin..begin+count) */
+    struct Node {
+      int32_t begin, count;
+      /*! children, or -1 for leaves */
+      int32_t lChild, rChild;
+      /*! radius of the ball (around centers[nodeID*K]) that encloses
+          all of this node's points */
+      double  radius;
+    };
+
+    BallTree(int K, const std::string &metric);
+    
+    static SP create(int K, const std::string &metric)
+    { return std::make_shared<BallTree>(K,metric); }
+
+    /*! add a new element to this tree */
+    void add(const std::vector<double> &coords, const py::object &value);
+
+    /*! builds the tree - MUST be done before querying anything;
+        nodes with at most leafSize points become leaves */
+    void build(int leafSize);
+
+    /*! returns all values whose coordinates match the queried coordinates */
+    std::vector<py::object> find(const std::vector<double> &coords) const;
+
+    /*! finds the closest data point, and returns ([coords],[values]),
+        with all values that share that point (see KDTree) */
+    std::tuple<std::vector<double>,py::list>
+    findClosest(const std::vector<double> &coords) const;
+
+    /*! find the (up to) k nearest neighbors within maxRadius, and
+        returns them as ([coords],value) pairs, closest first */
+    std::vector<std::tuple<std::vector<double>,py::object>>
+    kNN(int k, const std::vector<double> &coords, double maxRadius) const;
+
+    /*! returns ([coords],value) of all points within given radius,
+        closest first */
+    std::vector<std::tuple<std::vector<double>,py::object>>
+    allPointsInRadius(const std::vector<double> &coords, double radius) const;
+    
+    /*! number of data points in this tree */
+    inline size_t numPoints() const { return values.size(); }
+
+    /*! the number of dimensions */
+    const int    K;
+    /*! the metric used for all distances */
+    const Metric metric;
+    
+  private:
+    /*! builds the subtree over itemIDs[begin..end); returns its node ID */
+    int buildRec(int begin, int end, int leafSize);
+
+    /*! returns the distance between two points, in this tree's metric */
+    inline double distance(const double *a, const double *b) const
+    { return metricDistance(metric,a,b,K); }
+
+    /*! returns a lower bound on the distance between 'query' and any
+        point in the given node's ball */
+    double lowerBound(const double *query, int nodeID) const;
+    
+    /*! finds the (up to) k closest points within maxDist, and returns
+        them as (distance,item), sorted */
+    std::vector<std::pair<double,int>>
+    closest(const double *query, int k, double maxDist) const;
+
+    /*! checks that tree is built and the query has the right
+        dimensionality, and throws an exception if not */
+    void checkQuery(const std::vector<double> &coords) const;
+    
+    /*! returns the coordinates of the given data point */
+    inline const double *pointCoords(int item) const
+    { return points.data()+size_t(item)*K; }
+
+    /*! returns the coordinates of given data point as a std::vector */
+    inline std::vector<double> pointVector(int item) const
+    { return std::vector<double>(pointCoords(item),pointCoords(item)+K); }
+    
+    /*! N*K coordinates, in order of add() */
+    std::vector<double>     points;
+    /*! one value per point */
+    std::vector<py::object> values;
+    /*! the nodes, root first; empty if the tree has no points */
+    std::vector<Node>       nodes;
+    /*! K coordinates per node: the center of its ball */
+    std::vector<double>     centers;
+    /*! the IDs of the points referenced by the nodes */
+    std::vector<int>        itemIDs;
+    bool                    isBuilt = false;
+  };
+  
+} // ::pyq
@@ -0,0 +1,525 @@
+// ======================================================================== //
+// Copyright 2022-2022 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "pyQuiri/KDTree.h"
+#include "pyQuiri/LeafKernels.h"
+#include "pyQuiri/Morton.h"
+#include "pyQuiri/parallel.h"
+#include <algorithm>
+
+namespace pyq {
+
+  /*! number of (consecutive, in processing order) queries that get
+      handed out to a thread at once */
+  static const size_t BATCH_QUERY_BLOCK_SIZE = 256;
+
+  /*! largest number of queries in one packet */
+  static const int MAX_PACKET_SIZE = 64;
+  
+  /*! returns the query order of the given name */
+  static KDTree::QueryOrder parseQueryOrder(const std::string &name)
+  {
+    if (name == "none")    return KDTree::ORDER_NONE;
+    if (name == "morton")  return KDTree::ORDER_MORTON;
+    if (name == "hilbert") return KDTree::ORDER_HILBERT;
+    throw py::value_error("pyQuiri: unknown query order '"+name+"'"
+                          " (must be \"none\", \"morton\", or \"hilbert\")");
+  }
+
+  /*! checks that a packet size is valid; 1 means no packets */
+  static void checkPacketSize(int packetSize)
+  {
+    if (packetSize < 1 || packetSize > MAX_PACKET_SIZE)
+      throw py::value_error("pyQuiri: packet_size must be between 1 and "
+                            +std::to_string(int(MAX_PACKET_SIZE)));
+  }
+  
+  /*! checks that a batch of query points has the shape (M,K) */
+  static void checkQueryShape(const py::array_t<double> &queries, int K)
+  {
+    if (queries.ndim() != 2 || queries.shape(1) != K)
+      throw py::type_error("pyQuiri: query points must be given as a (M,"
+                           +std::to_string(K)+") array");
+  }
+  
+  std::vector<int> KDTree::queryOrder(const double *queries,
+                                      size_t numQueries,
+                                      QueryOrder order,
+                                      int numThreads) const
+  {
+    std::vector<int> result(numQueries);
+    for (size_t i=0;i<numQueries;i++)
+      result[i] = int(i);
+    if (order == ORDER_NONE || numQueries < 2)
+      return result;
+
+    Box bounds(K);
+    for (size_t i=0;i<numQueries;i++)
+      bounds.grow(queries+i*K);
+    const MortonQuantizer quantizer(bounds);
+    std::vector<uint64_t> keys(numQueries);
+    parallel_for_blocked(numQueries,BATCH_QUERY_BLOCK_SIZE,numThreads,
+                         [&](size_t begin, size_t end) {
+                           for (size_t i=begin;i<end;i++)
+                             keys[i] = (order == ORDER_HILBERT)
+                               ? quantizer.hilbert(queries+i*K)
+                               : quantizer.code(queries+i*K);
+                         });
+    radixSort(keys,result,numThreads);
+    return result;
+  }
+
+  int KDTree::kNNQuery(const double *query, int k, double maxRadius2,
+                       std::pair<double,int> *heap,
+                       QueryScratch &scratch) const
+  {
+    int heapSize = 0;
+    double maxDist2 = maxRadius2;
+    if (nodes.empty()) return 0;
+    const LeafKernels   &kernels = leafKernels();
+    CellStack           &stack   = scratch.stack;
+    std::vector<double> &lower   = scratch.lower;
+    std::vector<double> &upper   = scratch.upper;
+    std::vector<double> &dist2   = scratch.dist2;
+    stack.clear();
+    stack.pushRoot();
+    while (!stack.empty()) {
+      double cellDist2;
+      const int nodeID = stack.pop(lower.data(),upper.data(),&cellDist2);
+      if (cellDist2 > maxDist2) continue;
+      
+      const Node &node = nodes[nodeID];
+      if (node.count > (int)dist2.size())
+        dist2.resize(node.count);
+      nodeSqrDistances(kernels,node,query,maxDist2,dist2.data());
+      for (int i=0;i<node.count;i++) {
+        if (dist2[i] > maxDist2) continue;
+        const std::pair<double,int> candidate(dist2[i],itemIDs[node.begin+i]);
+        if (heapSize < k) {
+          heap[heapSize++] = candidate;
+          std::push_heap(heap,heap+heapSize);
+        } else if (candidate < heap[0]) {
+          std::pop_heap(heap,heap+heapSize);
+          heap[heapSize-1] = candidate;
+          std::push_heap(heap,heap+heapSize);
+        } else
+          continue;
+        if (heapSize == k)
+          maxDist2 = heap[0].first;
+      }
+      if (node.splitDim < 0) continue;
+
+      /* push the far child first, so the near one gets traversed first */
+      const int    dim      = node.splitDim;
+      const double planeDist = query[dim]-node.splitPos;
+      const bool   nearLeft = planeDist < 0.;
+      const int    farChild = nearLeft ? node.rChild : node.lChild;
+      const int   nearChild = nearLeft ? node.lChild : node.rChild;
+      if (farChild >= 0) {
+        /* the far cell is the query's distance to the current cell,
+           except in 'dim', where it is the distance to the plane */
+        const double inDim
+          = std::max(lower[dim]-query[dim],0.)+std::max(query[dim]-upper[dim],0.);
+        const double farDist2
+          = std::max(cellDist2-inDim*inDim,0.)+planeDist*planeDist;
+        if (farDist2 <= maxDist2)
+          stack.push(farChild,lower.data(),upper.data(),dim,node.splitPos,!nearLeft,farDist2);
+      }
+      if (nearChild >= 0)
+        stack.push(nearChild,lower.data(),upper.data(),dim,node.splitPos,nearLeft,cellDist2);
+    }
+    std::sort_heap(heap,heap+heapSize);
+    return heapSize;
+  }
+
+  void KDTree::radiusQuery(const double *query, double radius2,
+                           std::vector<std::pair<double,int>> &result,
+                           QueryScratch &scratch) const
+  {
+    if (nodes.empty()) return;
+    const LeafKernels   &kernels = leafKernels();
+    CellStack           &stack   = scratch.stack;
+    std::vector<double> &lower   = scratch.lower;
+    std::vector<double> &upper   = scratch.upper;
+    std::vector<double> &dist2   = scratch.dist2;
+    stack.clear();
+    stack.pushRoot();
+    while (!stack.empty()) {
+      double cellDist2;
+      const int nodeID = stack.pop(lower.data(),upper.data(),&cellDist2);
+      const Node &node = nodes[nodeID];
+      if (node.count > (int)dist2.size())
+        dist2.resize(node.count);
+      nodeSqrDistances(kernels,node,query,radius2,dist2.data());
+      for (int i=0;i<node.count;i++)
+        if (dist2[i] <= radius2)
+          result.push_back({dist2[i],itemIDs[node.begin+i]});
+      if (node.splitDim < 0) continue;
+
+      const int    dim      = node.splitDim;
+      const double planeDist = query[dim]-node.splitPos;
+      const bool   nearLeft = planeDist < 0.;
+      const int    farChild = nearLeft ? node.rChild : node.lChild;
+      const int   nearChild = nearLeft ? node.lChild : node.rChild;
+      if (farChild >= 0) {
+        const double inDim
+          = std::max(lower[dim]-query[dim],0.)+std::max(query[dim]-upper[dim],0.);
+        const double farDist2
+          = std::max(cellDist2-inDim*inDim,0.)+planeDist*planeDist;
+        if (farDist2 <= radius2)
+          stack.push(farChild,lower.data(),upper.data(),dim,node.splitPos,!nearLeft,farDist2);
+      }
+      if (nearChild >= 0)
+        stack.push(nearChild,lower.data(),upper.data(),dim,node.splitPos,nearLeft,cellDist2);
+    }
+  }
+
+  /*! The packet version of the near-first traversal in kNNQuery():
+      the packet's cell distances get computed for all its queries at
+      once (rather than incrementally), and the packet descends into
+      whichever child is nearer for the majority of its active
+      queries, like ray packets do in a BVH */
+  template<typename VisitPoints>
+  void KDTree::tracePacket(const double *const *queries, int numQueries,
+                           double *maxDist2,
+                           QueryScratch &scratch,
+                           const VisitPoints &visitPoints) const
+  {
+    if (nodes.empty()) return;
+    const LeafKernels    &kernels   = leafKernels();
+    CellStack            &stack     = scratch.stack;
+    std::vector<double>  &lower     = scratch.lower;
+    std::vector<double>  &upper     = scratch.upper;
+    std::vector<double>  &packet    = scratch.packet;
+    std::vector<double>  &cellDist2 = scratch.packetDist2;
+    std::vector<uint8_t> &active    = scratch.inside;
+    packet.resize(size_t(K)*numQueries);
+    cellDist2.resize(numQueries);
+    active.resize(std::max(active.size(),size_t(numQueries)));
+    for (int i=0;i<numQueries;i++)
+      for (int d=0;d<K;d++)
+        packet[size_t(d)*numQueries+i] = queries[i][d];
+    
+    stack.clear();
+    stack.pushRoot();
+    while (!stack.empty()) {
+      const int nodeID = stack.pop(lower.data(),upper.data());
+      leafKernelsFor(kernels,numQueries)
+        .boxSqrDistances(packet.data(),numQueries,K,
+                         lower.data(),upper.data(),cellDist2.data());
+      const Node &node = nodes[nodeID];
+      int numActive = 0;
+      for (int i=0;i<numQueries;i++) {
+        active[i] = cellDist2[i] <= maxDist2[i];
+        if (!active[i]) continue;
+        numActive++;
+        if (node.count > 0) visitPoints(i,node);
+      }
+      if (numActive == 0 || node.splitDim < 0) continue;
+
+      /* push the far child (if any active query can reach it) first,
+         so the near one gets traversed first */
+      const int dim = node.splitDim;
+      int numLeft = 0;
+      /* whether any query on the other side can reach the left (0)
+         or right (1) child, which is at least planeDist away */
+      bool reachable[2] = { false, false };
+      for (int i=0;i<numQueries;i++) {
+        if (!active[i]) continue;
+        const double planeDist = queries[i][dim]-node.splitPos;
+        const bool   isLeft    = planeDist < 0.;
+        numLeft += isLeft;
+        reachable[isLeft ? 1 : 0] |= planeDist*planeDist <= maxDist2[i];
+      }
+      const bool nearLeft  = 2*numLeft >= numActive;
+      const int  farChild  = nearLeft ? node.rChild : node.lChild;
+      const int  nearChild = nearLeft ? node.lChild : node.rChild;
+      const bool needFar   = nearLeft
+        ? (numLeft < numActive || reachable[1])
+        : (numLeft > 0         || reachable[0]);
+      if (farChild >= 0 && needFar)
+        stack.push(farChild,lower.data(),upper.data(),dim,node.splitPos,!nearLeft);
+      if (nearChild >= 0)
+        stack.push(nearChild,lower.data(),upper.data(),dim,node.splitPos,nearLeft);
+    }
+  }
+
+  void KDTree::kNNPacket(const double *const *queries, int numQueries,
+                         int k, double maxRadius2,
+                         std::pair<double,int> *heaps, int *found,
+                         QueryScratch &scratch) const
+  {
+    const LeafKernels &kernels = leafKernels();
+    std::vector<double> &dist2 = scratch.dist2;
+    double maxDist2[MAX_PACKET_SIZE];
+    for (int i=0;i<numQueries;i++) {
+      found[i]    = 0;
+      maxDist2[i] = maxRadius2;
+    }
+    tracePacket(queries,numQueries,maxDist2,scratch,[&](int i, const Node &node) {
+        if (node.count > (int)dist2.size())
+          dist2.resize(node.count);
+        nodeSqrDistances(kernels,node,queries[i],maxDist2[i],dist2.data());
+        std::pair<double,int> *heap = heaps+size_t(i)*k;
+        int &heapSize = found[i];
+        for (int j=0;j<node.count;j++) {
+          if (dist2[j] > maxDist2[i]) continue;
+          const std::pair<double,int> candidate(dist2[j],itemIDs[node.begin+j]);
+          if (heapSize < k) {
+            heap[heapSize++] = candidate;
+            std::push_heap(heap,heap+heapSize);
+          } else if (candidate < heap[0]) {
+            std::pop_heap(heap,heap+heapSize);
+            heap[heapSize-1] = candidate;
+            std::push_heap(heap,heap+heapSize);
+          } else
+            continue;
+          if (heapSize == k)
+            maxDist2[i] = heap[0].first;
+        }
+      });
+    for (int i=0;i<numQueries;i++)
+      std::sort_heap(heaps+size_t(i)*k,heaps+size_t(i)*k+found[i]);
+  }
+
+  void KDTree::radiusPacket(const double *const *queries, int numQueries,
+                            double radius2,
+                            std::vector<std::pair<double,int>> *results,
+                            QueryScratch &scratch) const
+  {
+    const LeafKernels &kernels = leafKernels();
+    std::vector<double> &dist2 = scratch.dist2;
+    double maxDist2[MAX_PACKET_SIZE];
+    for (int i=0;i<numQueries;i++)
+      maxDist2[i] = radius2;
+    tracePacket(queries,numQueries,maxDist2,scratch,[&](int i, const Node &node) {
+        if (node.count > (int)dist2.size())
+          dist2.resize(node.count);
+        nodeSqrDistances(kernels,node,queries[i],radius2,dist2.data());
+        for (int j=0;j<node.count;j++)
+          if (dist2[j] <= radius2)
+            results[i].push_back({dist2[j],itemIDs[node.begin+j]});
+      });
+  }
+  
+  /*! Runs all queries in the order given by queryOrder(), in blocks
+      of consecutive queries per thread, so that each thread keeps
+      touching the same nodes (and points) from one query to the
+      next; results get written straight to the query's row in the
+      (input-ordered) output arrays */
+  py::tuple KDTree::kNNBatch(const py::array_t<double,py::array::c_style|py::array::forcecast> &queries,
+                             int k,
+                             double maxRadius,
+                             int numThreads,
+                             const std::string &orderName,
+                             int packetSize,
+                             const std::string &metricName)
+  {
+    verifyTreeIsBuilt();
+    checkQueryShape(queries,K);
+    checkPacketSize(packetSize);
+    if (k < 1)
+      throw py::value_error("pyQuiri: knn_batch requires k >= 1");
+    // checked before squaring, which would make it positive again
+    if (!(maxRadius >= 0.))
+      throw py::value_error("pyQuiri: knn_batch requires a non-negative max_radius");
+    const QueryOrder order = parseQueryOrder(orderName);
+    const Metric metric = parseKNNMetric(metricName);
+    if (metric != EUCLIDEAN) {
+      if (maxRadius != std::numeric_limits<double>::infinity())
+        throw py::value_error("pyQuiri: max_radius is only supported for metric 'euclidean'");
+      prepareSimilarityBounds();
+      packetSize = 1;
+    }
+    /* what gets reported for a heap entry (or a missing one) */
+    auto reported = [metric](double key) {
+      if (metric == COSINE)        return 1.+key;
+      if (metric == INNER_PRODUCT) return -key;
+      return sqrt(key);
+    };
+    const double missing = metric == INNER_PRODUCT
+      ? -std::numeric_limits<double>::infinity()
+      : std::numeric_limits<double>::infinity();
+    prepareLeafCoords();
+    const size_t numQueries = queries.shape(0);
+    if (numQueries > (size_t)std::numeric_limits<int>::max())
+      throw std::runtime_error("pyQuiri: too many query points in one batch");
+    
+    py::array_t<int32_t> indices({numQueries,size_t(k)});
+    py::array_t<double>  distances({numQueries,size_t(k)});
+    const double *query    = queries.data();
+    int32_t      *outIDs   = indices.mutable_data();
+    double       *outDists = distances.mutable_data();
+    {
+      py::gil_scoped_release noGIL;
+      const std::vector<int> queryIDs = queryOrder(query,numQueries,order,numThreads);
+      parallel_for_blocked
+        (numQueries,BATCH_QUERY_BLOCK_SIZE,numThreads,[&](size_t begin, size_t end) {
+          std::vector<std::pair<double,int>> heaps(size_t(k)*packetSize);
+          const double *packet[MAX_PACKET_SIZE];
+          int           found[MAX_PACKET_SIZE];
+          QueryScratch scratch(K);
+          for (size_t i=begin;i<end;i+=packetSize) {
+            const int numInPacket = (int)std::min(size_t(packetSize),end-i);
+            if (metric != EUCLIDEAN)
+              found[0] = similarityQuery(query+size_t(queryIDs[i])*K,k,metric,
+                                         nullptr,0,heaps.data());
+            else if (packetSize == 1)
+              found[0] = kNNQuery(query+size_t(queryIDs[i])*K,k,maxRadius*maxRadius,
+                                  heaps.data(),scratch);
+            else {
+              for (int p=0;p<numInPacket;p++)
+                packet[p] = query+size_t(queryIDs[i+p])*K;
+              kNNPacket(packet,numInPacket,k,maxRadius*maxRadius,
+                        heaps.data(),found,scratch);
+            }
+            for (int p=0;p<numInPacket;p++) {
+              const size_t queryID = queryIDs[i+p];
+              const std::pair<double,int> *heap = heaps.data()+size_t(p)*k;
+              for (int j=0;j<k;j++) {
+                outIDs[queryID*k+j]   = j < found[p] ? heap[j].second : -1;
+                outDists[queryID*k+j] = j < found[p] ? reported(heap[j].first) : missing;
+              }
+            }
+          }
+        });
+    }
+    return py::make_tuple(indices,distances);
+  }
+  
+  /*! Same as kNNBatch(), except that the number of results per query
+      isn't known up front: each block of queries collects its
+      results in its own buffer, which then get scattered to the
+      (input-ordered) CSR arrays */
+  py::tuple KDTree::radiusBatch(const py::array_t<double,py::array::c_style|py::array::forcecast> &queries,
+                                double radius,
+                                int numThreads,
+                                const std::string &orderName,
+                                int packetSize)
+  {
+    verifyTreeIsBuilt();
+    checkQueryShape(queries,K);
+    checkPacketSize(packetSize);
+    if (!(radius >= 0.))
+      throw py::value_error("pyQuiri: radius_batch requires a non-negative radius");
+    const QueryOrder order = parseQueryOrder(orderName);
+    prepareLeafCoords();
+    const size_t numQueries = queries.shape(0);
+    if (numQueries > (size_t)std::numeric_limits<int>::max())
+      throw std::runtime_error("pyQuiri: too many query points in one batch");
+    const double *query = queries.data();
+
+    /* per block, the results of all its queries (in processing
+       order), and where each query's results start */
+    const size_t numBlocks = (numQueries+BATCH_QUERY_BLOCK_SIZE-1)/BATCH_QUERY_BLOCK_SIZE;
+    std::vector<std::vector<std::pair<double,int>>> blockResults(numBlocks);
+    std::vector<std::vector<size_t>>                blockOffsets(numBlocks);
+    std::vector<int>                                queryIDs;
+    std::vector<int64_t> rowPtr(numQueries+1,0);
+    {
+      py::gil_scoped_release noGIL;
+      queryIDs = queryOrder(query,numQueries,order,numThreads);
+      parallel_for(numBlocks,numThreads,[&](size_t blockID) {
+        const size_t begin = blockID*BATCH_QUERY_BLOCK_SIZE;
+        const size_t end   = std::min(begin+BATCH_QUERY_BLOCK_SIZE,numQueries);
+        std::vector<std::pair<double,int>> &results = blockResults[blockID];
+        std::vector<size_t>                &offsets = blockOffsets[blockID];
+        QueryScratch scratch(K);
+        if (packetSize == 1)
+          for (size_t i=begin;i<end;i++) {
+            const size_t queryID = queryIDs[i];
+            offsets.push_back(results.size());
+            radiusQuery(query+queryID*K,radius*radius,results,scratch);
+            rowPtr[queryID+1] = results.size()-offsets.back();
+          }
+        else {
+          const double *packet[MAX_PACKET_SIZE];
+          scratch.packetResults.resize(packetSize);
+          for (size_t i=begin;i<end;i+=packetSize) {
+            const int numInPacket = (int)std::min(size_t(packetSize),end-i);
+            for (int p=0;p<numInPacket;p++) {
+              packet[p] = query+size_t(queryIDs[i+p])*K;
+              scratch.packetResults[p].clear();
+            }
+            radiusPacket(packet,numInPacket,radius*radius,
+                         scratch.packetResults.data(),scratch);
+            for (int p=0;p<numInPacket;p++) {
+              const std::vector<std::pair<double,int>> &found = scratch.packetResults[p];
+              offsets.push_back(results.size());
+              results.insert(results.end(),found.begin(),found.end());
+              rowPtr[queryIDs[i+p]+1] = found.size();
+            }
+          }
+        }
+        offsets.push_back(results.size());
+      });
+      for (size_t i=0;i<numQueries;i++)
+        rowPtr[i+1] += rowPtr[i];
+    }
+    
+    const size_t numResults = rowPtr[numQueries];
+    py::array_t<int64_t> indptr(numQueries+1);
+    py::array_t<int32_t> indices(numResults);
+    py::array_t<double>  distances(numResults);
+    std::copy(rowPtr.begin(),rowPtr.end(),indptr.mutable_data());
+    int32_t *outIDs   = indices.mutable_data();
+    double  *outDists = distances.mutable_data();
+    {
+      py::gil_scoped_release noGIL;
+      parallel_for(numBlocks,numThreads,[&](size_t blockID) {
+        const size_t begin = blockID*BATCH_QUERY_BLOCK_SIZE;
+        const std::vector<std::pair<double,int>> &results = blockResults[blockID];
+        const std::vector<size_t>                &offsets = blockOffsets[blockID];
+        for (size_t i=0;i+1<offsets.size();i++) {
+          int64_t out = rowPtr[queryIDs[begin+i]];
+          for (size_t j=offsets[i];j<offsets[i+1];j++,out++) {
+            outIDs[out]   = results[j].second;
+            outDists[out] = sqrt(results[j].first);
+          }
+        }
+      });
+    }
+    return py::make_tuple(indptr,indices,distances);
+  }
+  
+  py::tuple KDTree::findBatch(const py::array_t<double,py::array::c_style|py::array::forcecast> &queries)
+  {
+    checkQueryShape(queries,K);
+    if (!hasHashIndex)
+      verifyTreeIsBuilt();
+
+    const size_t numQueries = queries.shape(0);
+    const double *query = queries.data();
+    std::vector<int64_t> rowPtr(numQueries+1,0);
+    std::vector<int>     items;
+    {
+      py::gil_scoped_release noGIL;
+      for (size_t i=0;i<numQueries;i++) {
+        const size_t begin = items.size();
+        findItems(query+i*K,items);
+        std::sort(items.begin()+begin,items.end());
+        rowPtr[i+1] = items.size();
+      }
+    }
+    
+    py::array_t<int64_t> indptr(numQueries+1);
+    py::array_t<int32_t> indices(items.size());
+    std::copy(rowPtr.begin(),rowPtr.end(),indptr.mutable_data());
+    std::copy(items.begin(),items.end(),indices.mutable_data());
+    return py::make_tuple(indptr,indices);
+  }
+  
+} // ::pyq
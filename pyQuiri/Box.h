@@ -40,6 +40,12 @@ namespace pyq {
       set_min(lower,other);
       set_max(upper,other);
     }
+    void grow(const double *other) {
+      for (int i=0;i<size();i++) {
+        lower[i] = std::min(lower[i],other[i]);
+        upper[i] = std::max(upper[i],other[i]);
+      }
+    }
       
     Box including(const Coords &point) const
     { return Box(min(lower,point),max(upper,point)); }
@@ -69,15 +75,55 @@ namespace pyq {
     return true;
   }
 
+  /*! checks if a box contains a point given as a raw array of
+      (same-dimensional) coordinates */
+  inline bool overlaps(const Box &a, const double *b)
+  {
+    for (int i=0;i<a.size();i++)
+      if (a.lower[i] > b[i] ||
+          a.upper[i] < b[i])
+        return false;
+    return true;
+  }
+
   /*! computes the smalest L2 distnace between a point and any point
       in the given box box */
   inline double distance(const Box &box, const Coords &point)
   {
-    assert(a.size() == b.size());
+    assert(box.size() == point.size());
     Coords closestPoint = min(max(box.lower,point),box.upper);
     return distance(closestPoint,point);
   }
   
+  /*! computes the squared L2 distance between a point and a box,
+      all given as raw arrays of K coordinates */
+  inline double sqrDistance(const double *lower, const double *upper,
+                            const double *point, int K)
+  {
+    double res = 0.;
+    for (int i=0;i<K;i++) {
+      const double diff
+        = std::max(lower[i]-point[i],0.)+std::max(point[i]-upper[i],0.);
+      res += diff*diff;
+    }
+    return res;
+  }
+  
+  /*! computes the smallest squared L2 distance between any two points
+      in two boxes, all given as raw arrays of K coordinates */
+  inline double sqrDistance(const double *aLower, const double *aUpper,
+                            const double *bLower, const double *bUpper,
+                            int K)
+  {
+    double res = 0.;
+    for (int i=0;i<K;i++) {
+      const double diff
+        = std::max(aLower[i]-bUpper[i],0.)+std::max(bLower[i]-aUpper[i],0.);
+      res += diff*diff;
+    }
+    return res;
+  }
+  
   inline std::ostream &operator<<(std::ostream &out, const Box &box)
   { out << "{" << box.lower << "," << box.upper << "}"; return out; }
   
@@ -0,0 +1,87 @@
+// ======================================================================== //
+// Copyright 2022-2022 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#pragma once
+
+#include "pyQuiri/Box.h"
+
+namespace pyq {
+
+  /*! a traversal stack of (nodeID, cell) entries, where a cell is the
+      region of space covered by a kd-tree node. All cells' bounds are
+      stored in one flat array, so once the stack has reached its
+      maximum depth pushing and popping no longer allocates
+      anything. Each entry can also carry a (lower-bound) distance to
+      whatever the traversal is looking for */
+  struct CellStack {
+    CellStack(int K) : K(K) {}
+
+    inline bool   empty() const { return nodeIDs.empty(); }
+    inline size_t size()  const { return nodeIDs.size(); }
+
+    /*! pushes a node with given cell bounds (K lower, then K upper) */
+    inline void push(int nodeID, const double *lower, const double *upper, double dist = 0.)
+    {
+      nodeIDs.push_back(nodeID);
+      dists.push_back(dist);
+      bounds.insert(bounds.end(),lower,lower+K);
+      bounds.insert(bounds.end(),upper,upper+K);
+    }
+
+    /*! pushes a node whose cell is the given cell, but with one side
+        replaced by a split plane (at 'splitPos' in 'splitDim');
+        'upperSide' says whether that is the upper or lower side */
+    inline void push(int nodeID, const double *lower, const double *upper,
+                     int splitDim, double splitPos, bool upperSide, double dist = 0.)
+    {
+      push(nodeID,lower,upper,dist);
+      bounds[bounds.size()-(upperSide?K:2*K)+splitDim] = splitPos;
+    }
+
+    /*! pushes the root node, whose cell is all of space */
+    inline void pushRoot()
+    {
+      nodeIDs.push_back(0);
+      dists.push_back(0.);
+      bounds.insert(bounds.end(),K,-std::numeric_limits<double>::infinity());
+      bounds.insert(bounds.end(),K,+std::numeric_limits<double>::infinity());
+    }
+
+    /*! pops the top entry, copying its cell into given arrays; returns
+        its nodeID */
+    inline int pop(double *lower, double *upper, double *dist = nullptr)
+    {
+      const int nodeID = nodeIDs.back();
+      const double *top = bounds.data()+bounds.size()-2*K;
+      std::copy(top,top+K,lower);
+      std::copy(top+K,top+2*K,upper);
+      if (dist) *dist = dists.back();
+      nodeIDs.pop_back();
+      dists.pop_back();
+      bounds.resize(bounds.size()-2*K);
+      return nodeID;
+    }
+
+    inline void clear() { nodeIDs.clear(); dists.clear(); bounds.clear(); }
+    
+  private:
+    const int           K;
+    std::vector<int>    nodeIDs;
+    std::vector<double> dists;
+    std::vector<double> bounds;
+  };
+  
+} // ::pyq
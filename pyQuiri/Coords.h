@@ -64,6 +64,25 @@ namespace pyq {
   /*! pretty-prints a coordinate class */
   inline std::ostream &operator<<(std::ostream &out, const Coords &coords);
 
+  /*! computes the squared L2 distance between a coords and a raw
+      array of (same-dimensional) coordinates */
+  inline double sqrDistance(const Coords &a, const double *b);
+
+  /*! computes the L2 distance between a coords and a raw array of
+      (same-dimensional) coordinates */
+  inline double distance(const Coords &a, const double *b);
+
+  /*! computes the squared L2 distance between two raw arrays of K
+      coordinates each */
+  inline double sqrDistance(const double *a, const double *b, int K);
+
+  /*! returns if a coords and a raw array of (same-dimensional)
+      coordinates are the same */
+  inline bool   equal(const Coords &a, const double *b);
+
+  /*! returns if two raw arrays of K coordinates each are the same */
+  inline bool   equal(const double *a, const double *b, int K);
+
 
   // ==================================================================
   // IMPLEMENTATION
@@ -148,6 +167,41 @@ namespace pyq {
     return out;
   }
 
+  inline double sqrDistance(const Coords &a, const double *b)
+  {
+    double res = 0.;
+    for (int i=0;i<a.size();i++) {
+      const double diff = a[i] - b[i];
+      res += diff*diff;
+    }
+    return res;
+  }
+  inline double sqrDistance(const double *a, const double *b, int K)
+  {
+    double res = 0.;
+    for (int i=0;i<K;i++) {
+      const double diff = a[i] - b[i];
+      res += diff*diff;
+    }
+    return res;
+  }
+  inline double distance(const Coords &a, const double *b)
+  {
+    return sqrt(sqrDistance(a,b));
+  }
+  inline bool equal(const Coords &a, const double *b)
+  {
+    for (int i=0;i<a.size();i++)
+      if (a[i] != b[i]) return false;
+    return true;
+  }
+  inline bool equal(const double *a, const double *b, int K)
+  {
+    for (int i=0;i<K;i++)
+      if (a[i] != b[i]) return false;
+    return true;
+  }
+
   inline Coords::Coords(int N, double defaultValue) : coords(N)
   {
     for (auto &v : coords) v = defaultValue;
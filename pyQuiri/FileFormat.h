@@ -0,0 +1,143 @@
+// ======================================================================== //
+// Copyright 2022-2022 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#pragma once
+
+#include "pyQuiri/common.h"
+#include <string.h>
+
+namespace pyq {
+
+  /*! binary layout of a serialized (built) kd-tree. The file starts
+      with this header, followed by the sections it points to; every
+      section starts at a multiple of FILE_SECTION_ALIGNMENT bytes,
+      so all of them can be used in-place once the file got
+      memory-mapped. All values are stored in the native byte order
+      of the machine that wrote the file (which 'endianTag' allows
+      to check) */
+  struct FileHeader {
+    enum { CURRENT_VERSION = 2 };
+    enum { ENDIAN_TAG = 0x01020304 };
+    enum { HAS_VALUES = 1 };
+    /*! set for trees that were not built (which only pickling
+        writes): the file then has no items and no nodes */
+    enum { UNBUILT = 2 };
+    /*! set for trees with dtype "float32": all coordinates (points
+        and leafCoords) are then stored as floats rather than doubles */
+    enum { SINGLE_PRECISION = 4 };
+
+    /*! a contiguous range of bytes within the file */
+    struct Section {
+      uint64_t offset;
+      uint64_t size;
+    };
+
+    char     magic[8];
+    uint32_t version;
+    uint32_t endianTag;
+    uint32_t K;
+    uint32_t flags;
+    uint64_t numPoints;
+    uint64_t numNodes;
+    /*! the leaf size the tree got built with (see KDTree::leafSize) */
+    uint32_t leafSize;
+    /*! the tree's KDTree::LeafCompression */
+    uint32_t leafCompression;
+
+    /*! numPoints*K coordinates, in the order the points were added */
+    Section  points;
+    /*! numPoints int32s (none if UNBUILT), the point IDs in the
+        order the nodes reference them */
+    Section  itemIDs;
+    /*! numNodes KDTree::Node's, root first */
+    Section  nodes;
+    /*! either empty, or numPoints*K coordinates: the tree's
+        KDTree::leafCoords, so queries can use them in-place */
+    Section  leafCoords;
+    /*! for compressed trees, either all empty, or the tree's
+        KDTree::leafCodes (numPoints*K codes of 1 or 2 bytes),
+        leafQuant (2*K floats per node that has points), and
+        leafQuantIndex (numNodes int32s) */
+    Section  leafCodes;
+    Section  leafQuant;
+    Section  leafQuantIndex;
+    /*! a pickled python list with one value per point; only present
+        if HAS_VALUES is set */
+    Section  values;
+
+    /*! total size (in bytes) of a file with this header */
+    inline uint64_t fileSize() const { return values.offset+values.size; }
+  };
+
+  /*! magic number that every pyQuiri file starts with */
+  static const char FILE_MAGIC[8] = { 'p','y','Q','u','i','r','i','\0' };
+
+  /*! alignment (in bytes) of every section within a file */
+  static const uint64_t FILE_SECTION_ALIGNMENT = 64;
+
+  /*! rounds a file offset up to the next section boundary */
+  inline uint64_t alignSectionOffset(uint64_t offset)
+  {
+    return (offset + FILE_SECTION_ALIGNMENT-1) / FILE_SECTION_ALIGNMENT * FILE_SECTION_ALIGNMENT;
+  }
+
+  /*! computes the offsets of all sections of the given header from
+      their sizes, so that they follow each other in file order */
+  inline void layoutSections(FileHeader &header)
+  {
+    uint64_t offset = sizeof(header);
+    for (FileHeader::Section *section : { &header.points, &header.itemIDs,
+                                          &header.nodes, &header.leafCoords,
+                                          &header.leafCodes, &header.leafQuant,
+                                          &header.leafQuantIndex, &header.values }) {
+      section->offset = alignSectionOffset(offset);
+      offset = section->offset+section->size;
+    }
+  }
+
+  /*! creates the header (including the layout of all sections) for
+      a tree with the given number of dimensions, points and nodes
+      (of 'nodeSize' bytes each), and pickled values; 'isBuilt' is
+      false for trees that only store their points (see UNBUILT). The
+      tree gets stored without leafCoords (or any compressed leaves),
+      with a leafSize of 1 */
+  inline FileHeader makeFileHeader(int K,
+                                   uint64_t numPoints,
+                                   uint64_t numNodes,
+                                   uint64_t nodeSize,
+                                   uint64_t valuesSize,
+                                   bool isBuilt = true)
+  {
+    FileHeader header;
+    memset(&header,0,sizeof(header));
+    memcpy(header.magic,FILE_MAGIC,sizeof(FILE_MAGIC));
+    header.version        = FileHeader::CURRENT_VERSION;
+    header.endianTag      = FileHeader::ENDIAN_TAG;
+    header.K              = K;
+    header.flags          = (valuesSize ? FileHeader::HAS_VALUES : 0)
+                          | (isBuilt ? 0 : FileHeader::UNBUILT);
+    header.numPoints      = numPoints;
+    header.numNodes       = numNodes;
+    header.leafSize       = 1;
+    header.points.size    = numPoints*K*sizeof(double);
+    header.itemIDs.size   = isBuilt ? numPoints*sizeof(int) : 0;
+    header.nodes.size     = numNodes*nodeSize;
+    header.values.size    = valuesSize;
+    layoutSections(header);
+    return header;
+  }
+
+} // ::pyq
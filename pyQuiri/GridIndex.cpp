@@ -0,0 +1,414 @@
+// ======================================================================== //
+// Copyright 2022-2022 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "pyQuiri/GridIndex.h"
+#include "pyQuiri/parallel.h"
+#include <atomic>
+
+namespace pyq {
+
+  /*! number of points (or queries) that get handed out to a thread at once */
+  static const size_t GRID_BLOCK_SIZE = 1024;
+  
+  GridIndex::GridIndex(int K, double cellSize, double skin)
+    : K(K), cellSize(cellSize), skin(skin)
+  {
+    if (K < 1)
+      throw py::value_error("pyQuiri: K must be at least 1");
+    if (!(cellSize > 0.) || std::isinf(cellSize))
+      throw py::value_error("pyQuiri: cell_size must be positive");
+    if (!(skin >= 0.) || std::isinf(skin))
+      throw py::value_error("pyQuiri: skin must not be negative");
+  }
+
+  void GridIndex::checkPoints(const PointArray &points, size_t numRows) const
+  {
+    if (points.ndim() != 2 || points.shape(1) != K)
+      throw py::type_error("pyQuiri: points must be given as a (N,"
+                           +std::to_string(K)+") array");
+    if (size_t(points.shape(0)) != numRows)
+      throw py::value_error("pyQuiri: update() requires the same number of points as build()");
+    const double *coords = points.data();
+    for (size_t i=0;i<size_t(points.size());i++)
+      if (!std::isfinite(coords[i]))
+        throw py::value_error("pyQuiri: grid_index requires finite coordinates");
+  }
+  
+  void GridIndex::verifyIsBuilt() const
+  {
+    if (!isBuilt)
+      throw std::runtime_error("pyQuiri: grid index not built");
+  }
+  
+  uint64_t GridIndex::bucketOf(const int64_t *cell) const
+  {
+    uint64_t hash = 0;
+    for (int d=0;d<K;d++) {
+      hash = (hash ^ uint64_t(cell[d])) * 0x9e3779b97f4a7c15ull;
+      hash ^= hash >> 29;
+    }
+    hash ^= hash >> 32;
+    return hash & bucketMask;
+  }
+
+  int64_t GridIndex::cellCoord(double x) const
+  {
+    // clamped, so that far-away points cannot overflow (they then
+    // merely share a cell)
+    const double cell = floor(x/cellSize);
+    return (int64_t)std::max(-4.e18,std::min(4.e18,cell));
+  }
+  
+  uint64_t GridIndex::bucketOfPoint(const double *point, int64_t *cell) const
+  {
+    for (int d=0;d<K;d++)
+      cell[d] = cellCoord(point[d]);
+    return bucketOf(cell);
+  }
+  
+  void GridIndex::build(const PointArray &newPoints, int numThreads)
+  {
+    if (newPoints.ndim() == 2 && size_t(newPoints.shape(0)) > size_t(std::numeric_limits<int32_t>::max()))
+      throw std::runtime_error("pyQuiri: too many points");
+    checkPoints(newPoints,newPoints.ndim() == 2 ? newPoints.shape(0) : 0);
+    points.assign(newPoints.data(),newPoints.data()+newPoints.size());
+    {
+      py::gil_scoped_release noGIL;
+      bin(numThreads);
+    }
+    isBuilt = true;
+  }
+
+  bool GridIndex::update(const PointArray &newPoints, int numThreads)
+  {
+    verifyIsBuilt();
+    checkPoints(newPoints,numPoints());
+    const double *coords = newPoints.data();
+    const size_t  N      = numPoints();
+    const size_t  numBlocks = (N+GRID_BLOCK_SIZE-1)/GRID_BLOCK_SIZE;
+    std::vector<double> blockMax(numBlocks,0.);
+    bool rebinned = false;
+    {
+      py::gil_scoped_release noGIL;
+      std::copy(coords,coords+N*K,points.begin());
+      parallel_for(numBlocks,numThreads,[&](size_t blockID) {
+          const size_t end = std::min((blockID+1)*GRID_BLOCK_SIZE,N);
+          for (size_t i=blockID*GRID_BLOCK_SIZE;i<end;i++) {
+            double dist2 = 0.;
+            for (int d=0;d<K;d++) {
+              const double diff = points[i*K+d]-refPoints[i*K+d];
+              dist2 += diff*diff;
+            }
+            blockMax[blockID] = std::max(blockMax[blockID],dist2);
+          }
+        });
+      maxDisplacement = 0.;
+      for (auto dist2 : blockMax)
+        maxDisplacement = std::max(maxDisplacement,sqrt(dist2));
+      
+      if (2.*maxDisplacement > skin) {
+        bin(numThreads);
+        rebinned = true;
+      } else
+        parallel_for_blocked(N,GRID_BLOCK_SIZE,numThreads,[&](size_t begin, size_t end) {
+            for (size_t i=begin;i<end;i++)
+              std::copy(points.data()+size_t(sortedIDs[i])*K,
+                        points.data()+size_t(sortedIDs[i])*K+K,
+                        sortedCoords.data()+i*K);
+          });
+    }
+    return rebinned;
+  }
+
+  /*! a counting sort of the points by bucket: counts and offsets are
+      atomic, so all threads can bin points at the same time. The
+      order of points within a bucket depends on the threads'
+      timing, so each bucket gets sorted by ID at the end */
+  void GridIndex::bin(int numThreads)
+  {
+    const size_t N = numPoints();
+    size_t numBuckets = 1;
+    while (numBuckets < 2*N) numBuckets *= 2;
+    bucketMask = numBuckets-1;
+    refPoints       = points;
+    maxDisplacement = 0.;
+    cachedCandidates = Neighbors();
+    cachedRadius    = -1.;
+    
+    std::vector<uint64_t> bucket(N);
+    std::unique_ptr<std::atomic<int32_t>[]> count(new std::atomic<int32_t>[numBuckets+1]);
+    parallel_for_blocked(numBuckets+1,64*GRID_BLOCK_SIZE,numThreads,[&](size_t begin, size_t end) {
+        for (size_t i=begin;i<end;i++)
+          count[i] = 0;
+      });
+    parallel_for_blocked(N,GRID_BLOCK_SIZE,numThreads,[&](size_t begin, size_t end) {
+        std::vector<int64_t> cell(K);
+        for (size_t i=begin;i<end;i++) {
+          bucket[i] = bucketOfPoint(points.data()+i*K,cell.data());
+          count[bucket[i]]++;
+        }
+      });
+
+    bucketBegin.resize(numBuckets+1);
+    int32_t sum = 0;
+    for (size_t b=0;b<=numBuckets;b++) {
+      bucketBegin[b] = sum;
+      sum += count[b];
+      count[b] = bucketBegin[b];
+    }
+    
+    sortedIDs.resize(N);
+    parallel_for_blocked(N,GRID_BLOCK_SIZE,numThreads,[&](size_t begin, size_t end) {
+        for (size_t i=begin;i<end;i++)
+          sortedIDs[count[bucket[i]]++] = int32_t(i);
+      });
+    
+    sortedCoords.resize(N*K);
+    parallel_for_blocked(numBuckets,64*GRID_BLOCK_SIZE,numThreads,[&](size_t begin, size_t end) {
+        for (size_t b=begin;b<end;b++) {
+          std::sort(sortedIDs.begin()+bucketBegin[b],sortedIDs.begin()+bucketBegin[b+1]);
+          for (int32_t i=bucketBegin[b];i<bucketBegin[b+1];i++)
+            std::copy(points.data()+size_t(sortedIDs[i])*K,
+                      points.data()+size_t(sortedIDs[i])*K+K,
+                      sortedCoords.data()+size_t(i)*K);
+        }
+      });
+    sortedRefCoords = sortedCoords;
+  }
+  
+  void GridIndex::radiusQuery(const double *query, double radius, bool atBinning,
+                              std::vector<std::pair<double,int>> &result,
+                              QueryScratch &scratch) const
+  {
+    const size_t N = numPoints();
+    if (N == 0 || !(radius >= 0.)) return;
+    const double *coords = atBinning ? sortedRefCoords.data() : sortedCoords.data();
+    const double  radius2 = radius*radius;
+    auto scan = [&](int32_t begin, int32_t end) {
+      for (int32_t i=begin;i<end;i++) {
+        double dist2 = 0.;
+        for (int d=0;d<K;d++) {
+          const double diff = coords[size_t(i)*K+d]-query[d];
+          dist2 += diff*diff;
+        }
+        if (dist2 <= radius2)
+          result.push_back({dist2,sortedIDs[i]});
+      }
+    };
+
+    /* the cells to look at are those the points were binned into, so
+       (unless we look at the binning-time positions) widen the search
+       by how far they moved since */
+    const double searchRadius = atBinning ? radius : radius+maxDisplacement;
+    scratch.lower.resize(K);
+    scratch.upper.resize(K);
+    double numCells = 1.;
+    for (int d=0;d<K;d++) {
+      scratch.lower[d] = cellCoord(query[d]-searchRadius);
+      scratch.upper[d] = cellCoord(query[d]+searchRadius);
+      numCells *= double(scratch.upper[d]-scratch.lower[d]+1);
+    }
+    if (numCells > double(bucketMask+1)) {
+      // more cells than buckets: cheaper to look at everything
+      scan(0,int32_t(N));
+      return;
+    }
+    
+    /* different cells can share a bucket, which must not get scanned twice */
+    scratch.buckets.clear();
+    scratch.cell = scratch.lower;
+    while (true) {
+      scratch.buckets.push_back(bucketOf(scratch.cell.data()));
+      int d = 0;
+      while (d < K && scratch.cell[d] == scratch.upper[d]) {
+        scratch.cell[d] = scratch.lower[d];
+        ++d;
+      }
+      if (d == K) break;
+      scratch.cell[d]++;
+    }
+    std::sort(scratch.buckets.begin(),scratch.buckets.end());
+    scratch.buckets.erase(std::unique(scratch.buckets.begin(),scratch.buckets.end()),
+                          scratch.buckets.end());
+    for (auto b : scratch.buckets)
+      scan(bucketBegin[b],bucketBegin[b+1]);
+  }
+
+  GridIndex::Neighbors GridIndex::radiusQueries(const double *queries, size_t numQueries,
+                                                const std::vector<int> *order,
+                                                double radius, bool atBinning,
+                                                int numThreads) const
+  {
+    const size_t numBlocks = (numQueries+GRID_BLOCK_SIZE-1)/GRID_BLOCK_SIZE;
+    std::vector<std::vector<std::pair<double,int>>> blockResults(numBlocks);
+    std::vector<std::vector<size_t>>                blockOffsets(numBlocks);
+    Neighbors neighbors;
+    neighbors.rowPtr.assign(numQueries+1,0);
+    parallel_for(numBlocks,numThreads,[&](size_t blockID) {
+        const size_t begin = blockID*GRID_BLOCK_SIZE;
+        const size_t end   = std::min(begin+GRID_BLOCK_SIZE,numQueries);
+        std::vector<std::pair<double,int>> &results = blockResults[blockID];
+        std::vector<size_t>                &offsets = blockOffsets[blockID];
+        QueryScratch scratch;
+        for (size_t i=begin;i<end;i++) {
+          const size_t queryID = order ? (*order)[i] : i;
+          offsets.push_back(results.size());
+          radiusQuery(queries+queryID*K,radius,atBinning,results,scratch);
+          neighbors.rowPtr[queryID+1] = results.size()-offsets.back();
+        }
+        offsets.push_back(results.size());
+      });
+    for (size_t i=0;i<numQueries;i++)
+      neighbors.rowPtr[i+1] += neighbors.rowPtr[i];
+
+    neighbors.entries.resize(neighbors.rowPtr[numQueries]);
+    parallel_for(numBlocks,numThreads,[&](size_t blockID) {
+        const size_t begin = blockID*GRID_BLOCK_SIZE;
+        const std::vector<std::pair<double,int>> &results = blockResults[blockID];
+        const std::vector<size_t>                &offsets = blockOffsets[blockID];
+        for (size_t i=0;i+1<offsets.size();i++) {
+          const size_t queryID = order ? (*order)[begin+i] : begin+i;
+          std::copy(results.begin()+offsets[i],results.begin()+offsets[i+1],
+                    neighbors.entries.begin()+neighbors.rowPtr[queryID]);
+        }
+      });
+    return neighbors;
+  }
+
+  py::tuple GridIndex::toNumpy(const Neighbors &neighbors)
+  {
+    const size_t numRows    = neighbors.rowPtr.size()-1;
+    const size_t numResults = neighbors.entries.size();
+    py::array_t<int64_t> indptr(numRows+1);
+    py::array_t<int32_t> indices(numResults);
+    py::array_t<double>  distances(numResults);
+    std::copy(neighbors.rowPtr.begin(),neighbors.rowPtr.end(),indptr.mutable_data());
+    int32_t *outIDs   = indices.mutable_data();
+    double  *outDists = distances.mutable_data();
+    for (size_t i=0;i<numResults;i++) {
+      outIDs[i]   = neighbors.entries[i].second;
+      outDists[i] = sqrt(neighbors.entries[i].first);
+    }
+    return py::make_tuple(indptr,indices,distances);
+  }
+  
+  std::vector<std::tuple<std::vector<double>,int>>
+  GridIndex::allPointsInRadius(const std::vector<double> &coords, double radius) const
+  {
+    verifyIsBuilt();
+    if ((int)coords.size() != K)
+      throw py::type_error("query point does not match dimensionality of grid");
+    std::vector<std::pair<double,int>> found;
+    QueryScratch scratch;
+    radiusQuery(coords.data(),radius,false,found,scratch);
+    std::sort(found.begin(),found.end());
+    std::vector<std::tuple<std::vector<double>,int>> result;
+    for (auto &f : found)
+      result.push_back({std::vector<double>(points.data()+size_t(f.second)*K,
+                                            points.data()+size_t(f.second)*K+K),
+                        f.second});
+    return result;
+  }
+
+  py::tuple GridIndex::radiusBatch(const PointArray &queries, double radius, int numThreads) const
+  {
+    verifyIsBuilt();
+    if (queries.ndim() != 2 || queries.shape(1) != K)
+      throw py::type_error("pyQuiri: query points must be given as a (M,"
+                           +std::to_string(K)+") array");
+    if (!(radius >= 0.))
+      throw py::value_error("pyQuiri: radius_batch requires a non-negative radius");
+    if (size_t(queries.shape(0)) > (size_t)std::numeric_limits<int>::max())
+      throw std::runtime_error("pyQuiri: too many query points in one batch");
+    Neighbors neighbors;
+    {
+      py::gil_scoped_release noGIL;
+      neighbors = radiusQueries(queries.data(),queries.shape(0),nullptr,
+                                radius,false,numThreads);
+    }
+    return toNumpy(neighbors);
+  }
+
+  py::tuple GridIndex::neighborLists(double radius, int numThreads, bool includeSelf)
+  {
+    verifyIsBuilt();
+    if (!(radius >= 0.))
+      throw py::value_error("pyQuiri: neighbor_lists requires a non-negative radius");
+    const size_t N = numPoints();
+    Neighbors neighbors;
+    {
+      py::gil_scoped_release noGIL;
+      /* process the points in bucket order, so consecutive queries
+         look at the same cells */
+      const std::vector<int> order(sortedIDs.begin(),sortedIDs.end());
+      if (skin == 0.) {
+        neighbors = radiusQueries(points.data(),N,&order,radius,false,numThreads);
+      } else {
+        if (cachedRadius != radius) {
+          cachedCandidates = radiusQueries(refPoints.data(),N,&order,
+                                           radius+skin,true,numThreads);
+          cachedRadius = radius;
+        }
+        // the candidates are a superset of the neighbors, but their
+        // distances are from binning time: count the actual
+        // neighbors, then fill them in
+        auto forEachNeighbor = [&](size_t i, auto &&func) {
+          for (int64_t j=cachedCandidates.rowPtr[i];j<cachedCandidates.rowPtr[i+1];j++) {
+            const int other = cachedCandidates.entries[j].second;
+            double dist2 = 0.;
+            for (int d=0;d<K;d++) {
+              const double diff = points[i*K+d]-points[size_t(other)*K+d];
+              dist2 += diff*diff;
+            }
+            if (dist2 <= radius*radius)
+              func(dist2,other);
+          }
+        };
+        neighbors.rowPtr.assign(N+1,0);
+        parallel_for_blocked(N,GRID_BLOCK_SIZE,numThreads,[&](size_t begin, size_t end) {
+            for (size_t i=begin;i<end;i++)
+              forEachNeighbor(i,[&](double, int) { neighbors.rowPtr[i+1]++; });
+          });
+        for (size_t i=0;i<N;i++)
+          neighbors.rowPtr[i+1] += neighbors.rowPtr[i];
+        neighbors.entries.resize(neighbors.rowPtr[N]);
+        parallel_for_blocked(N,GRID_BLOCK_SIZE,numThreads,[&](size_t begin, size_t end) {
+            for (size_t i=begin;i<end;i++) {
+              int64_t out = neighbors.rowPtr[i];
+              forEachNeighbor(i,[&](double dist2, int other) {
+                  neighbors.entries[out++] = {dist2,other};
+                });
+            }
+          });
+      }
+      if (!includeSelf) {
+        // drop each point from its own list, compacting in place
+        size_t out = 0;
+        int64_t rowBegin = 0;
+        for (size_t i=0;i<N;i++) {
+          for (int64_t j=rowBegin;j<neighbors.rowPtr[i+1];j++)
+            if (neighbors.entries[j].second != int(i))
+              neighbors.entries[out++] = neighbors.entries[j];
+          rowBegin = neighbors.rowPtr[i+1];
+          neighbors.rowPtr[i+1] = out;
+        }
+        neighbors.entries.resize(out);
+      }
+    }
+    return toNumpy(neighbors);
+  }
+  
+} // ::pyq
@@ -0,0 +1,164 @@
+// ======================================================================== //
+// Copyright 2022-2022 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#pragma once
+
+#include "pyQuiri/common.h"
+#include <pybind11/numpy.h>
+
+namespace pyq {
+
+  /*! a uniform grid of cubic cells for fixed-radius neighbor
+      searches in low dimensions (typically 2D or 3D): every point
+      gets binned into the cell that contains it, and cells get
+      hashed into a table of buckets, so only non-empty cells take
+      any memory. A radius query only looks at the buckets of the
+      cells that overlap the query's bounding box, which for radii
+      up to about cell_size is a handful of cells - and, unlike a
+      tree, needs no traversal at all.
+
+      For simulations whose points move a little between queries the
+      grid supports a 'skin' (as in Verlet lists): update() does not
+      re-bin the points until one of them has moved more than skin/2
+      since they were binned, and neighborLists() keeps the lists of
+      candidates within r+skin (at binning time), which remain a
+      superset of the neighbors within r until then */
+  struct GridIndex {
+    typedef std::shared_ptr<GridIndex> SP;
+    typedef py::array_t<double,py::array::c_style|py::array::forcecast> PointArray;
+
+    GridIndex(int K, double cellSize, double skin);
+    
+    static SP create(int K, double cellSize, double skin)
+    { return std::make_shared<GridIndex>(K,cellSize,skin); }
+
+    /*! (re-)builds the grid over the rows of a (N,K) array of points,
+        using 'numThreads' threads; queries report points by their
+        row index */
+    void build(const PointArray &points, int numThreads);
+
+    /*! replaces the points' positions by the rows of the given (N,K)
+        array; re-bins them only if any point moved more than skin/2
+        since they were last binned. Returns whether it did */
+    bool update(const PointArray &points, int numThreads);
+
+    /*! returns ([coords],index) of all points within given radius,
+        closest first */
+    std::vector<std::tuple<std::vector<double>,int>>
+    allPointsInRadius(const std::vector<double> &coords, double radius) const;
+
+    /*! finds all points within 'radius' of each of a (M,K) array of
+        query points, and returns them as a tuple (indptr, indices,
+        distances) of arrays in CSR layout (see KDTree::radiusBatch());
+        each query's results are in unspecified order */
+    py::tuple radiusBatch(const PointArray &queries, double radius, int numThreads) const;
+
+    /*! same as radiusBatch() with the points themselves as queries;
+        a point is only its own neighbor if 'includeSelf' is set. If
+        the grid has a skin this re-uses the candidates within
+        radius+skin found by an earlier call with the same radius, as
+        long as the points did not get re-binned since then */
+    py::tuple neighborLists(double radius, int numThreads, bool includeSelf);
+
+    /*! number of data points in this grid */
+    inline size_t numPoints() const { return points.size() / K; }
+    
+    /*! the number of dimensions */
+    const int    K;
+    /*! edge length of the grid's cells */
+    const double cellSize;
+    /*! how far (in total) points may move before they get re-binned */
+    const double skin;
+    
+  private:
+    /*! (squared distance, pointID) pairs in CSR layout */
+    struct Neighbors {
+      std::vector<int64_t>               rowPtr;
+      std::vector<std::pair<double,int>> entries;
+    };
+
+    /*! scratch space for a thread running radius queries */
+    struct QueryScratch {
+      std::vector<int64_t>  lower, upper, cell;
+      std::vector<uint64_t> buckets;
+    };
+    
+    /*! bins the current positions of all points into their cells'
+        buckets (with a parallel counting sort); afterwards, refPoints
+        hold the positions they got binned with */
+    void bin(int numThreads);
+
+    /*! returns the bucket of the cell with given integer coordinates */
+    uint64_t bucketOf(const int64_t *cell) const;
+    
+    /*! returns the (integer) coordinate of the cell that contains
+        the given coordinate */
+    int64_t cellCoord(double x) const;
+    
+    /*! returns the bucket that the given point falls into; 'cell'
+        is scratch space for K integer coordinates */
+    uint64_t bucketOfPoint(const double *point, int64_t *cell) const;
+
+    /*! appends (squared distance, pointID) of all points within
+        radius of the query point to 'result'; with 'atBinning' this
+        uses the positions the points had when they got binned,
+        otherwise their current ones */
+    void radiusQuery(const double *query, double radius, bool atBinning,
+                     std::vector<std::pair<double,int>> &result,
+                     QueryScratch &scratch) const;
+
+    /*! runs radiusQuery() for the given queries (in the given order,
+        if any), using 'numThreads' threads, and returns their results
+        in CSR layout (in input order) */
+    Neighbors radiusQueries(const double *queries, size_t numQueries,
+                            const std::vector<int> *order,
+                            double radius, bool atBinning, int numThreads) const;
+
+    /*! checks that a (N,K) array has the right shape and only
+        finite coordinates, and throws an exception if not */
+    void checkPoints(const PointArray &points, size_t numRows) const;
+    
+    /*! checks that grid is built, and throws an exception if not */
+    void verifyIsBuilt() const;
+
+    /*! converts the given results to numpy (indptr,indices,distances) */
+    static py::tuple toNumpy(const Neighbors &neighbors);
+    
+    /*! N*K coordinates: the current positions of the points */
+    std::vector<double>   points;
+    /*! N*K coordinates: the positions the points got binned with */
+    std::vector<double>   refPoints;
+    /*! how far any point moved (at most) since they got binned */
+    double                maxDisplacement = 0.;
+    /*! number of buckets (a power of two) minus one */
+    uint64_t              bucketMask = 0;
+    /*! for each bucket, where its points start in sortedIDs[]; has
+        one more entry than there are buckets */
+    std::vector<int32_t>  bucketBegin;
+    /*! the IDs of the points, sorted by bucket */
+    std::vector<int32_t>  sortedIDs;
+    /*! the current and binning-time coordinates of the points, in
+        the order of sortedIDs[] */
+    std::vector<double>   sortedCoords, sortedRefCoords;
+    /*! if the grid has a skin, the candidates within
+        cachedRadius+skin of each point at binning time; empty if
+        there are none (yet) */
+    Neighbors             cachedCandidates;
+    double                cachedRadius = -1.;
+    bool                  isBuilt = false;
+  };
+  
+} // ::pyq
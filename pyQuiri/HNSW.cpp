@@ -0,0 +1,320 @@
+// ======================================================================== //
+// Copyright 2022-2022 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "pyQuiri/HNSW.h"
+#include "pyQuiri/parallel.h"
+#include <queue>
+
+namespace pyq {
+
+  /*! number of locks that the points' links are spread over */
+  static const size_t NUM_LINK_LOCKS = 4096;
+
+  /*! how many points (or queries) of a batch get processed in one task */
+  static const size_t HNSW_BLOCK_SIZE = 256;
+
+  /*! levels are drawn from an exponential distribution, which (in
+      theory) is unbounded */
+  static const int HNSW_MAX_LEVEL = 32;
+  
+  HNSW::HNSW(int K, int M, int efConstruction, const std::string &metric, uint64_t seed)
+    : K(K), M(M), efConstruction(efConstruction), metric(parseMetric(metric)),
+      linkLocks(NUM_LINK_LOCKS), rng(seed)
+  {
+    if (M < 2)
+      throw py::value_error("pyQuiri: M must be at least 2");
+    if (efConstruction < 1)
+      throw py::value_error("pyQuiri: ef_construction must be at least 1");
+  }
+
+  void HNSW::VisitedSet::reset(size_t numPoints)
+  {
+    if (stamps.size() < numPoints || ++stamp == 0) {
+      stamps.assign(std::max(numPoints,stamps.size()),0);
+      stamp = 1;
+    }
+  }
+  
+  void HNSW::allocate(size_t numNewPoints)
+  {
+    const size_t numTotal = numPoints()+numNewPoints;
+    if (numTotal > size_t(std::numeric_limits<int32_t>::max()))
+      throw std::runtime_error("pyQuiri: too many points");
+    // level L has (on average) 1/M times as many points as level L-1
+    const double levelScale = 1./log(double(M));
+    std::uniform_real_distribution<double> uniform(0.,1.);
+    links0.resize(numTotal*(2*M+1),0);
+    upperLinks.resize(numTotal);
+    for (size_t i=levels.size();i<numTotal;i++) {
+      const int level = std::min(int(-log(1.-uniform(rng))*levelScale),HNSW_MAX_LEVEL);
+      levels.push_back(level);
+      upperLinks[i].assign(size_t(level)*(M+1),0);
+    }
+  }
+  
+  void HNSW::add(const std::vector<double> &coords, const py::object &value)
+  {
+    if ((int)coords.size() != K)
+      throw py::type_error
+        ("key in HNSW::add() does not match dimensionality of index");
+    for (size_t i=values.size();i<numPoints();i++)
+      values.push_back(py::int_(i));
+    points.insert(points.end(),coords.begin(),coords.end());
+    values.push_back(value);
+    allocate(1);
+    insert(int(numPoints()-1),visited);
+  }
+
+  void HNSW::addBatch(const py::array_t<double,py::array::c_style|py::array::forcecast> &newPoints,
+                      int numThreads)
+  {
+    if (newPoints.ndim() != 2 || newPoints.shape(1) != K)
+      throw py::type_error("pyQuiri: points must be given as a (M,"
+                           +std::to_string(K)+") array");
+    const size_t begin = numPoints();
+    const size_t numNew = newPoints.shape(0);
+    allocate(numNew);
+    points.insert(points.end(),newPoints.data(),newPoints.data()+newPoints.size());
+    {
+      py::gil_scoped_release noGIL;
+      parallel_for_blocked
+        (numNew,HNSW_BLOCK_SIZE,numThreads,[&](size_t blockBegin, size_t blockEnd) {
+          VisitedSet blockVisited;
+          for (size_t i=blockBegin;i<blockEnd;i++)
+            insert(int(begin+i),blockVisited);
+        });
+    }
+  }
+
+  void HNSW::getLinks(int item, int level, std::vector<int> &result) const
+  {
+    std::lock_guard<std::mutex> lock(linkLock(item));
+    const int32_t *list = links(item,level);
+    result.assign(list+1,list+1+list[0]);
+  }
+  
+  int HNSW::greedyDescent(const double *query, int entry, int fromLevel, int toLevel,
+                          double &dist) const
+  {
+    std::vector<int> neighbors;
+    for (int level=fromLevel;level>toLevel;--level) {
+      bool changed = true;
+      while (changed) {
+        changed = false;
+        getLinks(entry,level,neighbors);
+        for (auto neighbor : neighbors) {
+          const double neighborDist = searchDistance(query,pointCoords(neighbor));
+          if (neighborDist < dist) {
+            dist    = neighborDist;
+            entry   = neighbor;
+            changed = true;
+          }
+        }
+      }
+    }
+    return entry;
+  }
+  
+  void HNSW::searchLevel(const double *query, int entry, double entryDist,
+                         int ef, int level, VisitedSet &visited,
+                         std::vector<Candidate> &result) const
+  {
+    visited.reset(numPoints());
+    // points still to expand, closest first
+    std::priority_queue<Candidate,std::vector<Candidate>,std::greater<Candidate>> candidates;
+    // the ef closest points found so far, furthest first
+    std::priority_queue<Candidate> closest;
+    visited.visit(entry);
+    candidates.push({entryDist,entry});
+    closest.push({entryDist,entry});
+    
+    std::vector<int> neighbors;
+    while (!candidates.empty()) {
+      const Candidate current = candidates.top();
+      if (current.first > closest.top().first && (int)closest.size() >= ef)
+        break;
+      candidates.pop();
+      getLinks(current.second,level,neighbors);
+      for (auto neighbor : neighbors) {
+        if (visited.visit(neighbor))
+          continue;
+        const double dist = searchDistance(query,pointCoords(neighbor));
+        if ((int)closest.size() < ef || dist < closest.top().first) {
+          candidates.push({dist,neighbor});
+          closest.push({dist,neighbor});
+          if ((int)closest.size() > ef)
+            closest.pop();
+        }
+      }
+    }
+
+    result.resize(closest.size());
+    for (size_t i=result.size();i>0;--i) {
+      result[i-1] = closest.top();
+      closest.pop();
+    }
+  }
+
+  void HNSW::selectNeighbors(std::vector<Candidate> &candidates, int maxLinks) const
+  {
+    if ((int)candidates.size() <= maxLinks)
+      return;
+    std::vector<Candidate> selected;
+    for (auto &candidate : candidates) {
+      if ((int)selected.size() >= maxLinks)
+        break;
+      bool keep = true;
+      for (auto &other : selected)
+        if (searchDistance(pointCoords(candidate.second),pointCoords(other.second))
+            < candidate.first) {
+          keep = false;
+          break;
+        }
+      if (keep)
+        selected.push_back(candidate);
+    }
+    candidates = selected;
+  }
+
+  void HNSW::addLink(int from, int to, int level)
+  {
+    std::lock_guard<std::mutex> lock(linkLock(from));
+    int32_t *list = links(from,level);
+    if (list[0] < maxLinks(level)) {
+      list[1+list[0]++] = to;
+      return;
+    }
+    std::vector<Candidate> candidates;
+    for (int i=0;i<list[0];i++)
+      candidates.push_back({searchDistance(pointCoords(from),pointCoords(list[1+i])),list[1+i]});
+    candidates.push_back({searchDistance(pointCoords(from),pointCoords(to)),to});
+    std::sort(candidates.begin(),candidates.end());
+    selectNeighbors(candidates,maxLinks(level));
+    list[0] = (int32_t)candidates.size();
+    for (size_t i=0;i<candidates.size();i++)
+      list[1+i] = candidates[i].second;
+  }
+  
+  void HNSW::insert(int item, VisitedSet &visited)
+  {
+    const int level = levels[item];
+    int entry, entryLevel;
+    {
+      std::lock_guard<std::mutex> lock(entryLock);
+      if (entryPoint < 0) {
+        entryPoint = item;
+        maxLevel   = level;
+        return;
+      }
+      entry      = entryPoint;
+      entryLevel = maxLevel;
+    }
+    
+    const double *query = pointCoords(item);
+    double dist = searchDistance(query,pointCoords(entry));
+    entry = greedyDescent(query,entry,entryLevel,level,dist);
+    std::vector<Candidate> neighbors;
+    for (int l=std::min(level,entryLevel);l>=0;--l) {
+      searchLevel(query,entry,dist,efConstruction,l,visited,neighbors);
+      entry = neighbors[0].second;
+      dist  = neighbors[0].first;
+      selectNeighbors(neighbors,M);
+      {
+        std::lock_guard<std::mutex> lock(linkLock(item));
+        int32_t *list = links(item,l);
+        list[0] = (int32_t)neighbors.size();
+        for (size_t i=0;i<neighbors.size();i++)
+          list[1+i] = neighbors[i].second;
+      }
+      for (auto &neighbor : neighbors)
+        addLink(neighbor.second,item,l);
+    }
+    
+    // only now that all its links are in place can other searches
+    // start from this point
+    if (level > entryLevel) {
+      std::lock_guard<std::mutex> lock(entryLock);
+      if (level > maxLevel) {
+        entryPoint = item;
+        maxLevel   = level;
+      }
+    }
+  }
+
+  void HNSW::search(const double *query, int k, int ef, VisitedSet &visited,
+                    std::vector<Candidate> &result) const
+  {
+    result.clear();
+    if (k <= 0 || entryPoint < 0)
+      return;
+    double dist = searchDistance(query,pointCoords(entryPoint));
+    const int entry = greedyDescent(query,entryPoint,maxLevel,0,dist);
+    searchLevel(query,entry,dist,std::max(ef,k),0,visited,result);
+    if ((int)result.size() > k)
+      result.resize(k);
+  }
+  
+  std::vector<std::tuple<std::vector<double>,py::object>>
+  HNSW::kNN(int k, const std::vector<double> &queryPoint, int ef) const
+  {
+    if ((int)queryPoint.size() != K)
+      throw py::type_error
+        ("query point in HNSW::knn() does not match dimensionality of index");
+    std::vector<Candidate> closest;
+    search(queryPoint.data(),k,ef,visited,closest);
+    std::vector<std::tuple<std::vector<double>,py::object>> result;
+    for (auto &c : closest)
+      result.push_back({std::vector<double>(pointCoords(c.second),pointCoords(c.second)+K),
+                        value(c.second)});
+    return result;
+  }
+
+  py::tuple HNSW::kNNBatch(const py::array_t<double,py::array::c_style|py::array::forcecast> &queries,
+                           int k, int ef, int numThreads) const
+  {
+    if (queries.ndim() != 2 || queries.shape(1) != K)
+      throw py::type_error("pyQuiri: query points must be given as a (M,"
+                           +std::to_string(K)+") array");
+    if (k < 0)
+      throw py::value_error("pyQuiri: k must not be negative");
+    const size_t numQueries = queries.shape(0);
+    py::array_t<int32_t> indices({numQueries,size_t(k)});
+    py::array_t<double>  distances({numQueries,size_t(k)});
+    const double *queryData    = queries.data();
+    int32_t      *indexData    = indices.mutable_data();
+    double       *distanceData = distances.mutable_data();
+    {
+      py::gil_scoped_release noGIL;
+      parallel_for_blocked
+        (numQueries,HNSW_BLOCK_SIZE,numThreads,[&](size_t begin, size_t end) {
+          VisitedSet blockVisited;
+          std::vector<Candidate> closest;
+          for (size_t q=begin;q<end;q++) {
+            search(queryData+q*K,k,ef,blockVisited,closest);
+            for (int i=0;i<k;i++) {
+              const bool valid = i < (int)closest.size();
+              indexData[q*k+i]    = valid ? closest[i].second : -1;
+              distanceData[q*k+i] = valid
+                ? toDistance(closest[i].first)
+                : toDistance(std::numeric_limits<double>::infinity());
+            }
+          }
+        });
+    }
+    return py::make_tuple(indices,distances);
+  }
+  
+} // ::pyq
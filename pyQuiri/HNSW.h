@@ -0,0 +1,210 @@
+// ======================================================================== //
+// Copyright 2022-2022 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#pragma once
+
+#include "pyQuiri/Metric.h"
+#include <pybind11/numpy.h>
+#include <mutex>
+#include <random>
+
+namespace pyq {
+
+  /*! a hierarchical navigable small world graph (Malkov and
+      Yashunin): an approximate kNN index for high-dimensional data,
+      in which every point is linked to (up to) M of its neighbors,
+      on a random number of levels with exponentially fewer points
+      each. Queries greedily walk down from the sparsest level, and
+      then do a best-first search with a list of 'ef' candidates on
+      the densest one; larger ef means higher recall, but slower
+      queries. Unlike the trees, points can be added at any time
+      without re-building anything */
+  struct HNSW {
+    typedef std::shared_ptr<HNSW> SP;
+
+    HNSW(int K, int M, int efConstruction, const std::string &metric, uint64_t seed);
+    
+    static SP create(int K, int M, int efConstruction,
+                     const std::string &metric, uint64_t seed)
+    { return std::make_shared<HNSW>(K,M,efConstruction,metric,seed); }
+
+    /*! adds (and links) a new element */
+    void add(const std::vector<double> &coords, const py::object &value);
+
+    /*! adds (and links) all rows of a (M,K) array of points, using
+        'numThreads' threads; their values are their indices (in
+        order of add()) */
+    void addBatch(const py::array_t<double,py::array::c_style|py::array::forcecast> &points,
+                  int numThreads);
+    
+    /*! finds (approximately) the k nearest neighbors of the query
+        point, with a candidate list of max(ef,k) points; returns
+        ([coords],value) pairs, closest first */
+    std::vector<std::tuple<std::vector<double>,py::object>>
+    kNN(int k, const std::vector<double> &query, int ef) const;
+    
+    /*! same as kNN() for each of a (M,K) array of query points;
+        returns a tuple of (M,k) arrays of indices (in order of add())
+        and distances (for INNER_PRODUCT: dot products), padded with
+        -1 and infinity (for INNER_PRODUCT: -infinity) */
+    py::tuple kNNBatch(const py::array_t<double,py::array::c_style|py::array::forcecast> &queries,
+                       int k, int ef, int numThreads) const;
+    
+    /*! number of data points in this index */
+    inline size_t numPoints() const { return levels.size(); }
+
+    /*! the number of dimensions */
+    const int    K;
+    /*! max number of links per point on every level but the lowest
+        one (which allows 2*M) */
+    const int    M;
+    /*! size of the candidate list used for finding a new point's
+        neighbors */
+    const int    efConstruction;
+    /*! the metric used for all distances */
+    const Metric metric;
+
+  private:
+    /*! marks which points a search has already visited; one per
+        thread, and re-usable across searches */
+    struct VisitedSet {
+      /*! clears the set, for a graph of (up to) numPoints points */
+      void reset(size_t numPoints);
+      /*! marks the given point, and returns whether it was marked before */
+      inline bool visit(int item)
+      { if (stamps[item] == stamp) return true; stamps[item] = stamp; return false; }
+      
+      std::vector<uint32_t> stamps;
+      uint32_t              stamp = 0;
+    };
+
+    /*! a (distance,pointID) pair */
+    typedef std::pair<double,int> Candidate;
+    
+    /*! allocates storage for the given number of (new) points, and
+        draws their levels */
+    void allocate(size_t numNewPoints);
+    
+    /*! links the (already allocated) given point into the graph */
+    void insert(int item, VisitedSet &visited);
+
+    /*! finds the (up to) k closest points to the query, with a
+        candidate list of ef points, and writes them to result */
+    void search(const double *query, int k, int ef, VisitedSet &visited,
+                std::vector<Candidate> &result) const;
+    
+    /*! greedily walks from 'entry' towards the query on all levels
+        above 'level'; returns the closest point found (and sets
+        'dist' to its distance) */
+    int greedyDescent(const double *query, int entry, int fromLevel, int toLevel,
+                      double &dist) const;
+
+    /*! best-first search of the given level from 'entry', with a
+        candidate list of ef points; returns the closest points
+        found, sorted by distance */
+    void searchLevel(const double *query, int entry, double entryDist,
+                     int ef, int level, VisitedSet &visited,
+                     std::vector<Candidate> &result) const;
+
+    /*! selects (up to) maxLinks of the given candidates (which must
+        be sorted by distance) as neighbors: a candidate is skipped
+        if it is closer to an already selected one than to the point
+        itself, so links spread out into all directions */
+    void selectNeighbors(std::vector<Candidate> &candidates, int maxLinks) const;
+
+    /*! adds a link from 'from' to 'to' on the given level; if 'from'
+        then has too many links, prunes them with selectNeighbors() */
+    void addLink(int from, int to, int level);
+
+    /*! copies the given point's links on the given level */
+    void getLinks(int item, int level, std::vector<int> &links) const;
+    
+    /*! returns the list of links of the given point on the given
+        level; the first int is the number of links */
+    inline int32_t *links(int item, int level)
+    {
+      return level == 0
+        ? links0.data()+size_t(item)*(2*M+1)
+        : upperLinks[item].data()+size_t(level-1)*(M+1);
+    }
+    inline const int32_t *links(int item, int level) const
+    { return const_cast<HNSW *>(this)->links(item,level); }
+
+    /*! max number of links on the given level */
+    inline int maxLinks(int level) const { return level == 0 ? 2*M : M; }
+    
+    /*! returns the distance used during searches: squared L2 for
+        the euclidean metric (which ranks the same), the actual
+        distance (see metricDistance()) otherwise */
+    inline double searchDistance(const double *a, const double *b) const
+    {
+      if (metric != EUCLIDEAN)
+        return metricDistance(metric,a,b,K);
+      double res = 0.;
+      for (int d=0;d<K;d++) {
+        const double diff = a[d]-b[d];
+        res += diff*diff;
+      }
+      return res;
+    }
+
+    /*! turns a searchDistance() into what knn_batch() reports: the
+        distance, or for INNER_PRODUCT the dot product */
+    inline double toDistance(double dist) const
+    {
+      if (metric == EUCLIDEAN) return sqrt(dist);
+      if (metric == INNER_PRODUCT) return -dist;
+      return dist;
+    }
+    
+    /*! returns the coordinates of the given data point */
+    inline const double *pointCoords(int item) const
+    { return points.data()+size_t(item)*K; }
+
+    /*! returns the value of the given data point; for points added
+        by addBatch() this is the point's index */
+    inline py::object value(int item) const
+    { return item < (int)values.size() ? values[item] : py::int_(item); }
+
+    /*! returns the lock that protects the given point's links */
+    inline std::mutex &linkLock(int item) const
+    { return linkLocks[size_t(item) % linkLocks.size()]; }
+    
+    /*! N*K coordinates, in order of add() */
+    std::vector<double>               points;
+    /*! one value per point; empty for points added by addBatch() */
+    std::vector<py::object>           values;
+    /*! the highest level of every point */
+    std::vector<int>                  levels;
+    /*! 2*M+1 ints per point: the number of links on level 0, then the links */
+    std::vector<int32_t>              links0;
+    /*! per point, M+1 ints for each of the levels above 0 */
+    std::vector<std::vector<int32_t>> upperLinks;
+    /*! point that all searches start with, on level maxLevel; -1
+        while the graph is empty */
+    int                               entryPoint = -1;
+    int                               maxLevel   = -1;
+    /*! protects entryPoint and maxLevel during batch insertion */
+    std::mutex                        entryLock;
+    /*! striped locks for the links of the points */
+    mutable std::vector<std::mutex>   linkLocks;
+    /*! random number generator for the levels of new points */
+    std::mt19937_64                   rng;
+    /*! visited set for add() and kNN(), which both run under the GIL */
+    mutable VisitedSet                visited;
+  };
+  
+} // ::pyq
@@ -0,0 +1,80 @@
+// ======================================================================== //
+// Copyright 2022-2022 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "pyQuiri/HashIndex.h"
+#include <string.h>
+
+namespace pyq {
+
+  void HashIndex::clear()
+  {
+    slots.clear();
+    previousSame.clear();
+  }
+  
+  template<typename T>
+  uint64_t HashIndex::hash(const T *coords, int K)
+  {
+    uint64_t h = 0x9e3779b97f4a7c15ull;
+    for (int i=0;i<K;i++) {
+      const double value = coords[i] == 0. ? 0. : double(coords[i]);
+      uint64_t bits;
+      memcpy(&bits,&value,sizeof(bits));
+      // splitmix64 finalizer
+      h ^= bits + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2);
+      h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+      h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+      h ^= h >> 31;
+    }
+    return h;
+  }
+
+  template<typename T>
+  void HashIndex::rehash(const T *points, int K, size_t numSlots)
+  {
+    const size_t numItems = previousSame.size();
+    slots.assign(numSlots,-1);
+    previousSame.clear();
+    previousSame.reserve(numItems);
+    while (previousSame.size() < numItems)
+      insert(points,K);
+  }
+  
+  template<typename T>
+  void HashIndex::insert(const T *points, int K)
+  {
+    const int item = (int)previousSame.size();
+    // keep the table at most half full
+    if (2*(previousSame.size()+1) > slots.size()) {
+      rehash(points,K,std::max(size_t(64),2*slots.size()));
+      return insert(points,K);
+    }
+
+    const T *coords = points+size_t(item)*K;
+    const size_t mask = slots.size()-1;
+    size_t slot = hash(coords,K) & mask;
+    while (slots[slot] >= 0 &&
+           !std::equal(coords,coords+K,points+size_t(slots[slot])*K))
+      slot = (slot+1) & mask;
+    previousSame.push_back(slots[slot]);
+    slots[slot] = item;
+  }
+
+  template void HashIndex::insert(const double *points, int K);
+  template void HashIndex::insert(const float *points, int K);
+  template uint64_t HashIndex::hash(const double *coords, int K);
+  
+} // ::pyq
@@ -0,0 +1,88 @@
+// ======================================================================== //
+// Copyright 2022-2022 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#pragma once
+
+#include "pyQuiri/common.h"
+
+namespace pyq {
+
+  /*! a hash table over the (bits of the) coordinates of a set of
+      points, for exact-match lookups in O(1) expected time without
+      any tree. Points are referred to by their index into a flat
+      array of N*K coordinates that the caller passes to every
+      operation (so that array may move, as long as it keeps its
+      content); those coordinates may be stored as doubles or floats
+      (T), and get compared and hashed as doubles. Uses open
+      addressing with linear probing; each slot refers to the most
+      recently inserted point with a given coordinate, and all
+      earlier points with the same coordinates are chained via
+      previousSame[] */
+  struct HashIndex {
+    /*! removes all points */
+    void clear();
+
+    /*! returns the number of points in the index */
+    inline size_t size() const { return previousSame.size(); }
+    
+    /*! inserts the next point, ie, points[size()*K..) */
+    template<typename T>
+    void insert(const T *points, int K);
+
+    /*! calls lambda(item) for every point that has exactly the given
+        coordinates, in reverse order of insertion */
+    template<typename T, typename Lambda>
+    void forEachMatch(const T *points, int K,
+                      const double *query,
+                      const Lambda &lambda) const;
+    
+  private:
+    /*! returns the hash of given coordinates; +0 and -0 hash the same
+        because they compare equal */
+    template<typename T>
+    static uint64_t hash(const T *coords, int K);
+
+    /*! re-inserts all points into a table of given (power-of-two)
+        number of slots */
+    template<typename T>
+    void rehash(const T *points, int K, size_t numSlots);
+    
+    /*! the slots of the hash table, -1 if empty */
+    std::vector<int> slots;
+    /*! for each point, the previously inserted point with the same
+        coordinates, or -1 */
+    std::vector<int> previousSame;
+  };
+
+  template<typename T, typename Lambda>
+  void HashIndex::forEachMatch(const T *points, int K,
+                               const double *query,
+                               const Lambda &lambda) const
+  {
+    if (slots.empty())
+      return;
+    const size_t mask = slots.size()-1;
+    for (size_t slot = hash(query,K) & mask; slots[slot] >= 0; slot = (slot+1) & mask) {
+      const int item = slots[slot];
+      if (!std::equal(query,query+K,points+size_t(item)*K))
+        continue;
+      for (int i=item;i>=0;i=previousSame[i])
+        lambda(i);
+      return;
+    }
+  }
+  
+} // ::pyq
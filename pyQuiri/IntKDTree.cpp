@@ -0,0 +1,359 @@
+// ======================================================================== //
+// Copyright 2022-2022 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "pyQuiri/IntKDTree.h"
+#include <queue>
+
+namespace pyq {
+
+  py::object ExactSqrDist::toPython() const
+  {
+    py::object result = py::int_(w[2]);
+    for (int i=1;i>=0;--i)
+      result = result.attr("__lshift__")(64).attr("__or__")(py::int_(w[i]));
+    return result;
+  }
+
+  /*! returns the squared distance between 'query' and the box
+      [lower,upper] */
+  template<typename T>
+  static ExactSqrDist boxSqrDist(const T *lower, const T *upper,
+                                 const T *query, int K)
+  {
+    ExactSqrDist result;
+    for (int d=0;d<K;d++)
+      if (query[d] < lower[d])
+        result.addSquare(absDiff(lower[d],query[d]));
+      else if (query[d] > upper[d])
+        result.addSquare(absDiff(query[d],upper[d]));
+    return result;
+  }
+  
+  template<typename T>
+  void IntKDTree<T>::add(const std::vector<T> &coords, const py::object &value)
+  {
+    if ((int)coords.size() != K)
+      throw py::type_error
+        ("key in KDTree::add() does not match dimensionality of tree");
+    if (!leafCoords.empty())
+      unpackPoints();
+    isBuilt = false;
+    points.insert(points.end(),coords.begin(),coords.end());
+    values.push_back(value);
+  }
+
+  template<typename T>
+  void IntKDTree<T>::unpackPoints()
+  {
+    points.resize(leafCoords.size());
+    for (auto &node : nodes) {
+      if (node.lChild >= 0) continue;
+      const T *soa = leafCoords.data()+size_t(node.begin)*K;
+      for (int i=0;i<node.count;i++)
+        for (int d=0;d<K;d++)
+          points[size_t(itemIDs[node.begin+i])*K+d] = soa[size_t(d)*node.count+i];
+    }
+    std::vector<T>().swap(leafCoords);
+    std::vector<int>().swap(slotOf);
+  }
+
+  template<typename T>
+  std::vector<T> IntKDTree<T>::pointVector(int item) const
+  {
+    // descend to the leaf whose range of itemIDs holds the point
+    const int slot = slotOf[item];
+    int nodeID = 0;
+    while (nodes[nodeID].lChild >= 0) {
+      const Node &lChild = nodes[nodes[nodeID].lChild];
+      nodeID = slot < lChild.begin+lChild.count
+        ? nodes[nodeID].lChild
+        : nodes[nodeID].rChild;
+    }
+    return leafPoint(nodes[nodeID],slot-nodes[nodeID].begin);
+  }
+
+  template<typename T>
+  void IntKDTree<T>::checkQuery(const std::vector<T> &coords) const
+  {
+    if (!isBuilt)
+      throw std::runtime_error("pyQuiri: tree not built");
+    if ((int)coords.size() != K)
+      throw py::type_error
+        ("query point does not match dimensionality of tree");
+  }
+  
+  template<typename T>
+  void IntKDTree<T>::build(int leafSize)
+  {
+    if (leafSize < 1)
+      throw py::value_error("pyQuiri: leaf_size must be at least 1");
+    if (numPoints() > size_t(std::numeric_limits<int32_t>::max()))
+      throw std::runtime_error("pyQuiri: too many points");
+    if (!leafCoords.empty())
+      unpackPoints();
+    nodes.clear();
+    bounds.clear();
+    itemIDs.resize(numPoints());
+    for (size_t i=0;i<numPoints();i++)
+      itemIDs[i] = (int)i;
+    if (numPoints() > 0)
+      buildRec(0,(int)numPoints(),leafSize);
+    
+    leafCoords.resize(points.size());
+    for (auto &node : nodes) {
+      if (node.lChild >= 0) continue;
+      T *soa = leafCoords.data()+size_t(node.begin)*K;
+      for (int i=0;i<node.count;i++)
+        for (int d=0;d<K;d++)
+          soa[size_t(d)*node.count+i] = points[size_t(itemIDs[node.begin+i])*K+d];
+    }
+    slotOf.resize(numPoints());
+    for (size_t i=0;i<itemIDs.size();i++)
+      slotOf[itemIDs[i]] = (int)i;
+    // from here on, the leaves hold the only copy of the coordinates
+    std::vector<T>().swap(points);
+    isBuilt = true;
+  }
+
+  template<typename T>
+  int IntKDTree<T>::buildRec(int begin, int end, int leafSize)
+  {
+    const int nodeID = (int)nodes.size();
+    nodes.push_back({begin,end-begin,-1,-1});
+    bounds.resize(bounds.size()+2*K);
+    T *lower = bounds.data()+size_t(nodeID)*2*K;
+    T *upper = lower+K;
+    for (int d=0;d<K;d++) {
+      lower[d] = std::numeric_limits<T>::max();
+      upper[d] = std::numeric_limits<T>::min();
+    }
+    for (int i=begin;i<end;i++)
+      for (int d=0;d<K;d++) {
+        const T x = points[size_t(itemIDs[i])*K+d];
+        lower[d] = std::min(lower[d],x);
+        upper[d] = std::max(upper[d],x);
+      }
+    int      dim    = 0;
+    uint64_t extent = 0;
+    for (int d=0;d<K;d++)
+      if (absDiff(upper[d],lower[d]) > extent) {
+        extent = absDiff(upper[d],lower[d]);
+        dim = d;
+      }
+    if (end-begin <= leafSize || extent == 0)
+      return nodeID;
+
+    // median split; points equal to the median may end up on either side
+    const int mid = begin+(end-begin)/2;
+    std::nth_element(itemIDs.begin()+begin,itemIDs.begin()+mid,itemIDs.begin()+end,
+                     [&](int a, int b) {
+                       return points[size_t(a)*K+dim] < points[size_t(b)*K+dim];
+                     });
+    const int lChild = buildRec(begin,mid,leafSize);
+    const int rChild = buildRec(mid,end,leafSize);
+    nodes[nodeID].lChild = lChild;
+    nodes[nodeID].rChild = rChild;
+    return nodeID;
+  }
+
+  template<typename T>
+  std::vector<py::object> IntKDTree<T>::find(const std::vector<T> &coords) const
+  {
+    checkQuery(coords);
+    std::vector<int> found;
+    forEachInRange(coords,coords,[&](const Node &leaf, int i) {
+        found.push_back(itemIDs[leaf.begin+i]);
+      });
+    std::sort(found.begin(),found.end());
+    std::vector<py::object> result;
+    for (auto item : found)
+      result.push_back(values[item]);
+    return result;
+  }
+  
+  template<typename T>
+  template<typename Lambda>
+  void IntKDTree<T>::forEachInRange(const std::vector<T> &lower,
+                                    const std::vector<T> &upper,
+                                    const Lambda &lambda) const
+  {
+    if (nodes.empty()) return;
+    // nodes, and whether they are known to be inside the query box
+    std::vector<std::pair<int,bool>> stack = { { 0,false } };
+    std::vector<uint8_t>             inside;
+    while (!stack.empty()) {
+      const int  nodeID = stack.back().first;
+      const bool within = stack.back().second;
+      stack.pop_back();
+      const Node &node = nodes[nodeID];
+      if (within) {
+        if (node.lChild >= 0) {
+          stack.push_back({node.rChild,true});
+          stack.push_back({node.lChild,true});
+        } else
+          for (int i=0;i<node.count;i++)
+            lambda(node,i);
+        continue;
+      }
+      const T *nodeLower = bounds.data()+size_t(nodeID)*2*K;
+      const T *nodeUpper = nodeLower+K;
+      bool overlaps = true, contained = true;
+      for (int d=0;d<K;d++) {
+        overlaps  &= nodeUpper[d] >= lower[d] && nodeLower[d] <= upper[d];
+        contained &= nodeLower[d] >= lower[d] && nodeUpper[d] <= upper[d];
+      }
+      if (!overlaps)
+        continue;
+      if (node.lChild >= 0) {
+        stack.push_back({node.rChild,contained});
+        stack.push_back({node.lChild,contained});
+        continue;
+      }
+      if (contained) {
+        for (int i=0;i<node.count;i++)
+          lambda(node,i);
+        continue;
+      }
+      // leaf: branch-free compares over the SoA coordinates, which
+      // the compiler can vectorize
+      const T *soa = leafCoords.data()+size_t(node.begin)*K;
+      inside.assign(node.count,1);
+      for (int d=0;d<K;d++) {
+        const T lo = lower[d], hi = upper[d];
+        const T *x = soa+size_t(d)*node.count;
+        for (int i=0;i<node.count;i++)
+          inside[i] &= (x[i] >= lo) & (x[i] <= hi);
+      }
+      for (int i=0;i<node.count;i++)
+        if (inside[i]) lambda(node,i);
+    }
+  }
+  
+  template<typename T>
+  std::vector<std::tuple<std::vector<T>,py::object>>
+  IntKDTree<T>::allPointsInRange(const std::vector<T> &lower,
+                                 const std::vector<T> &upper) const
+  {
+    checkQuery(lower);
+    checkQuery(upper);
+    std::vector<std::tuple<std::vector<T>,py::object>> result;
+    forEachInRange(lower,upper,[&](const Node &leaf, int i) {
+        result.push_back(std::make_tuple(leafPoint(leaf,i),values[itemIDs[leaf.begin+i]]));
+      });
+    return result;
+  }
+
+  template<typename T>
+  std::vector<py::object>
+  IntKDTree<T>::allValuesInRange(const std::vector<T> &lower,
+                                 const std::vector<T> &upper) const
+  {
+    checkQuery(lower);
+    checkQuery(upper);
+    std::vector<py::object> result;
+    forEachInRange(lower,upper,[&](const Node &leaf, int i) {
+        result.push_back(values[itemIDs[leaf.begin+i]]);
+      });
+    return result;
+  }
+  
+  template<typename T>
+  py::list IntKDTree<T>::kNN(int k, const std::vector<T> &query,
+                             const py::object &maxSqrRadius) const
+  {
+    checkQuery(query);
+    if (k < 1)
+      throw py::value_error("pyQuiri: k must be at least 1");
+
+    /* max-heap of the current candidates; once it is full, its top
+       is the largest distance we still need to look at */
+    typedef std::pair<ExactSqrDist,int> Candidate;
+    std::priority_queue<Candidate> candidates;
+    ExactSqrDist maxDist = ExactSqrDist::max();
+    if (!maxSqrRadius.is_none()) {
+      // split the python int into words; negative radii find nothing
+      py::int_ value = maxSqrRadius.cast<py::int_>();
+      if (value.attr("__lt__")(0).cast<bool>())
+        return py::list();
+      if (value.attr("bit_length")().cast<int>() > 192)
+        throw py::value_error("pyQuiri: max_sqr_radius too large");
+      for (int i=0;i<3;i++) {
+        maxDist.w[i] = value.attr("__and__")(py::int_(~uint64_t(0))).cast<uint64_t>();
+        value = value.attr("__rshift__")(64);
+      }
+    }
+    auto bound = [&]() {
+      return (int)candidates.size() == k ? candidates.top().first : maxDist;
+    };
+
+    /* near-first traversal, with nodes and their box distances on a stack */
+    std::vector<std::pair<ExactSqrDist,int>> stack;
+    if (!nodes.empty())
+      stack.push_back({boxSqrDist(bounds.data(),bounds.data()+K,query.data(),K),0});
+    while (!stack.empty()) {
+      const ExactSqrDist nodeDist = stack.back().first;
+      const int          nodeID   = stack.back().second;
+      stack.pop_back();
+      if (nodeDist > bound())
+        continue;
+      const Node &node = nodes[nodeID];
+      if (node.lChild >= 0) {
+        const ExactSqrDist lDist
+          = boxSqrDist(&bounds[size_t(node.lChild)*2*K],&bounds[size_t(node.lChild)*2*K+K],
+                       query.data(),K);
+        const ExactSqrDist rDist
+          = boxSqrDist(&bounds[size_t(node.rChild)*2*K],&bounds[size_t(node.rChild)*2*K+K],
+                       query.data(),K);
+        if (lDist < rDist) {
+          stack.push_back({rDist,node.rChild});
+          stack.push_back({lDist,node.lChild});
+        } else {
+          stack.push_back({lDist,node.lChild});
+          stack.push_back({rDist,node.rChild});
+        }
+        continue;
+      }
+      const T *soa = leafCoords.data()+size_t(node.begin)*K;
+      for (int i=0;i<node.count;i++) {
+        ExactSqrDist dist;
+        for (int d=0;d<K;d++)
+          dist.addSquare(absDiff(soa[size_t(d)*node.count+i],query[d]));
+        const Candidate candidate(dist,itemIDs[node.begin+i]);
+        if ((int)candidates.size() < k) {
+          if (dist <= maxDist)
+            candidates.push(candidate);
+        } else if (candidate < candidates.top()) {
+          candidates.pop();
+          candidates.push(candidate);
+        }
+      }
+    }
+
+    std::vector<Candidate> sorted;
+    for (;!candidates.empty();candidates.pop())
+      sorted.push_back(candidates.top());
+    py::list result;
+    for (auto it = sorted.rbegin(); it != sorted.rend(); ++it)
+      result.append(py::make_tuple(pointVector(it->second),
+                                   values[it->second],
+                                   it->first.toPython()));
+    return result;
+  }
+
+  template struct IntKDTree<int32_t>;
+  template struct IntKDTree<int64_t>;
+  
+} // ::pyq
@@ -0,0 +1,191 @@
+// ======================================================================== //
+// Copyright 2022-2022 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#pragma once
+
+#include "pyQuiri/common.h"
+
+namespace pyq {
+
+  /*! an exact squared distance between points with (up to 64-bit)
+      integer coordinates: each dimension contributes a square of up
+      to 128 bits, so this uses a 192-bit accumulator, which is exact
+      for any number of dimensions */
+  struct ExactSqrDist {
+    /*! the value, least significant word first */
+    uint64_t w[3] = { 0, 0, 0 };
+
+    /*! returns the largest possible value */
+    static ExactSqrDist max()
+    { ExactSqrDist d; d.w[0] = d.w[1] = d.w[2] = ~uint64_t(0); return d; }
+    
+    /*! adds diff*diff */
+    inline void addSquare(uint64_t diff)
+    {
+      uint64_t lo, hi;
+#if defined(__SIZEOF_INT128__)
+      const unsigned __int128 sqr = (unsigned __int128)diff*diff;
+      lo = (uint64_t)sqr;
+      hi = (uint64_t)(sqr >> 64);
+#else
+      const uint64_t a = diff & 0xffffffffull, b = diff >> 32;
+      const uint64_t aa = a*a, ab = a*b, bb = b*b;
+      const uint64_t mid = (aa >> 32) + (ab & 0xffffffffull)*2;
+      lo = (aa & 0xffffffffull) | (mid << 32);
+      hi = bb + (ab >> 32)*2 + (mid >> 32);
+#endif
+      w[0] += lo;
+      const uint64_t c0 = w[0] < lo;
+      const uint64_t t = w[1] + hi;
+      const uint64_t c1 = t < hi;
+      w[1] = t + c0;
+      const uint64_t c2 = w[1] < c0;
+      w[2] += c1 + c2;
+    }
+
+    /*! returns the value as a python int */
+    py::object toPython() const;
+    
+    inline bool operator<(const ExactSqrDist &other) const
+    {
+      for (int i=2;i>=0;--i)
+        if (w[i] != other.w[i]) return w[i] < other.w[i];
+      return false;
+    }
+    inline bool operator>(const ExactSqrDist &other) const { return other < *this; }
+    inline bool operator<=(const ExactSqrDist &other) const { return !(other < *this); }
+  };
+
+  /*! returns |a-b|, which always fits into a uint64_t */
+  template<typename T>
+  inline uint64_t absDiff(T a, T b)
+  {
+    return a >= b
+      ? uint64_t(int64_t(a)) - uint64_t(int64_t(b))
+      : uint64_t(int64_t(b)) - uint64_t(int64_t(a));
+  }
+  
+  /*! a kd-tree over points with integer (int32_t or int64_t)
+      coordinates, for data like grid cells or voxel IDs that would
+      lose exactness (and waste space) as doubles. All comparisons and
+      (squared) distances get computed exactly, in integer
+      arithmetic. Nodes store the tight bounding boxes of their
+      points, and only leaves store points, with their coordinates
+      in SoA layout (see leafCoords) */
+  template<typename T>
+  struct IntKDTree {
+    typedef std::shared_ptr<IntKDTree> SP;
+
+    /*! one node of the tree; its points are itemIDs[begin..begin+count) */
+    struct Node {
+      int32_t begin, count;
+      /*! children, or -1 for leaves */
+      int32_t lChild, rChild;
+    };
+
+    IntKDTree(int K) : K(K) {}
+    
+    static SP create(int K) { return std::make_shared<IntKDTree>(K); }
+
+    /*! adds a new point with given value */
+    void add(const std::vector<T> &coords, const py::object &value);
+
+    /*! builds the tree; nodes with at most leafSize points become
+        leaves. Must be done before querying anything */
+    void build(int leafSize);
+
+    /*! returns the values of all points with exactly the given
+        coordinates */
+    std::vector<py::object> find(const std::vector<T> &coords) const;
+    
+    /*! returns the (up to) k closest points within the given maximum
+        squared distance (None for infinite) as a list of tuples
+        ([coords], value, squared distance), closest first; points at
+        the same distance get reported in order of add() */
+    py::list kNN(int k, const std::vector<T> &query,
+                 const py::object &maxSqrRadius) const;
+
+    /*! returns ([coords], value) of all points within the box
+        [lower,upper] (bounds included) */
+    std::vector<std::tuple<std::vector<T>,py::object>>
+    allPointsInRange(const std::vector<T> &lower,
+                     const std::vector<T> &upper) const;
+
+    /*! returns the values of all points within the box [lower,upper] */
+    std::vector<py::object>
+    allValuesInRange(const std::vector<T> &lower,
+                     const std::vector<T> &upper) const;
+
+    /*! number of points in this tree */
+    inline size_t numPoints() const { return values.size(); }
+
+    /*! the number of dimensions */
+    const int K;
+    
+  private:
+    /*! builds the subtree over itemIDs[begin..end); returns its node ID */
+    int buildRec(int begin, int end, int leafSize);
+
+    /*! calls lambda(leaf,i) for all points within [lower,upper],
+        where i is the point's index within that leaf */
+    template<typename Lambda>
+    void forEachInRange(const std::vector<T> &lower,
+                        const std::vector<T> &upper,
+                        const Lambda &lambda) const;
+
+    /*! moves the coordinates from leafCoords back into points, in
+        order of add(), to add to or re-build the tree */
+    void unpackPoints();
+    
+    /*! checks that the tree is built, and that the given coordinates
+        have the right dimensionality */
+    void checkQuery(const std::vector<T> &coords) const;
+    
+    /*! returns the coordinates of the i-th point in given leaf */
+    inline std::vector<T> leafPoint(const Node &leaf, int i) const
+    {
+      std::vector<T> result(K);
+      const T *soa = leafCoords.data()+size_t(leaf.begin)*K;
+      for (int d=0;d<K;d++)
+        result[d] = soa[size_t(d)*leaf.count+i];
+      return result;
+    }
+
+    /*! returns the coordinates of given point (of a built tree) */
+    std::vector<T> pointVector(int item) const;
+    
+    /*! N*K coordinates, in order of add(); only kept until the tree
+        gets built, which moves them into leafCoords */
+    std::vector<T>          points;
+    /*! one value per point */
+    std::vector<py::object> values;
+    /*! the nodes, root first; empty if the tree has no points */
+    std::vector<Node>       nodes;
+    /*! for each node 2*K values: the lower and upper bounds of its
+        points */
+    std::vector<T>          bounds;
+    /*! the IDs of the points referenced by the nodes */
+    std::vector<int>        itemIDs;
+    /*! the coordinates of the points in the order of itemIDs, with
+        each leaf's points in SoA layout (x's at begin*K, y's at
+        begin*K+count, etc) */
+    std::vector<T>          leafCoords;
+    /*! for each point, its position in itemIDs (and leafCoords) */
+    std::vector<int>        slotOf;
+    bool                    isBuilt = false;
+  };
+
+} // ::pyq
@@ -15,21 +15,26 @@
 // ======================================================================== //
 
 #include "pyQuiri/KDTree.h"
+#include "pyQuiri/LeafKernels.h"
 #include <stack>
 #include <deque>
 #include <queue>
 
 namespace pyq {
 
-  KDTree::KDTree(int K)
-    : K(K)
+  KDTree::KDTree(int K, const std::string &dtype)
+    : K(K),
+      singlePrecision(dtype == "float32")
   {
+    if (dtype != "float32" && dtype != "float64")
+      throw py::value_error("pyQuiri: unknown dtype '"+dtype
+                            +"' (must be 'float32', 'float64', 'int32', or 'int64')");
   }
 
     /*! checks that tree is built, and throws an exception if not */
   void KDTree::verifyTreeIsBuilt()
   {
-    if (!root)
+    if (!isBuilt)
       throw std::runtime_error("pyQuiri::KDTree hasn't been built yet (-> kdTree.build()).");
   }
 
@@ -44,65 +49,417 @@ namespace pyq {
     return Coords(_coords);
   }
 
-  KDTree::Node::SP KDTree::buildRec(std::vector<int> &items)
+  /*! returns the value of the given data point; for trees that were
+    loaded without values this is the point's index */
+  py::object KDTree::value(int item) const
   {
-    if (items.empty()) return {};
+    if (objects.empty())
+      return py::int_(item);
+    return objects[item];
+  }
+
+  /*! marks the tree as no longer built, and makes sure all arrays
+    are writable (ie, not referring to any mapped memory) */
+  void KDTree::invalidate()
+  {
+    isBuilt = false;
+    version++;
+    nodes.clear();
+    itemIDs.clear();
+    leafCoords.clear();
+    leafCoordsFloat.clear();
+    leafCodes.clear();
+    leafQuant.clear();
+    leafQuantIndex.clear();
+    labelMasks.clear();
+    subtreeBounds.clear();
+    pointNorms.clear();
+    points.writable();
+    pointsFloat.writable();
+  }
+  
+  /*! computes the bounding boxes of all nodes, see KDTree.h */
+  std::vector<double> KDTree::computeNodeBounds() const
+  {
+    const size_t stride = 4*size_t(K);
+    std::vector<double> bounds(nodes.size()*stride);
+    if (nodes.empty()) return bounds;
     
-    Box bounds(K);
-    for (auto id : items)
-      bounds.grow(coords[id]);
+    /* depth-first order, so every node comes before its children */
+    std::vector<int> order;
+    order.reserve(nodes.size());
+    std::vector<int> stack = { 0 };
+    while (!stack.empty()) {
+      const int nodeID = stack.back();
+      stack.pop_back();
+      order.push_back(nodeID);
+      if (nodes[nodeID].lChild >= 0) stack.push_back(nodes[nodeID].lChild);
+      if (nodes[nodeID].rChild >= 0) stack.push_back(nodes[nodeID].rChild);
+    }
     
-    if (items.size() == 1 || bounds.lower == bounds.upper) {
-      KDTree::Node::SP node = std::make_shared<KDTree::Node>();
-      node->items = items;
-      node->splitDim = -1;
-      return node;
+    std::vector<double> buffer(K);
+    for (auto it = order.rbegin(); it != order.rend(); ++it) {
+      const Node &node = nodes[*it];
+      double *subtree = bounds.data()+size_t(*it)*stride;
+      double *own     = subtree+2*K;
+      std::fill(own,own+K,+std::numeric_limits<double>::infinity());
+      std::fill(own+K,own+2*K,-std::numeric_limits<double>::infinity());
+      for (int i=0;i<node.count;i++) {
+        const double *point = pointCoords(itemIDs[node.begin+i],buffer.data());
+        for (int d=0;d<K;d++) {
+          own[d]   = std::min(own[d],point[d]);
+          own[K+d] = std::max(own[K+d],point[d]);
+        }
+      }
+      std::copy(own,own+2*K,subtree);
+      for (int child : { node.lChild, node.rChild }) {
+        if (child < 0) continue;
+        const double *childBounds = bounds.data()+size_t(child)*stride;
+        for (int d=0;d<K;d++) {
+          subtree[d]   = std::min(subtree[d],childBounds[d]);
+          subtree[K+d] = std::max(subtree[K+d],childBounds[K+d]);
+        }
+      }
     }
+    return bounds;
+  }
+  
+  /*! makes sure leafCoords is up to date, see KDTree.h */
+  void KDTree::prepareLeafCoords()
+  {
+    if (leafCompression != LEAF_COMPRESSION_NONE)
+      return prepareLeafCodes();
+    if (leafSize == 1)
+      // queries read points[] directly
+      return;
+    
+    auto prepare = [&](auto &array) {
+      if (array.size() == itemIDs.size()*K)
+        return;
+      auto &leafCoords = array.writable();
+      leafCoords.resize(itemIDs.size()*K);
+      for (size_t nodeID=0;nodeID<nodes.size();nodeID++) {
+        const Node &node = nodes[nodeID];
+        auto *soa = leafCoords.data()+size_t(node.begin)*K;
+        for (int i=0;i<node.count;i++)
+          for (int d=0;d<K;d++)
+            soa[size_t(d)*node.count+i] = pointCoord(itemIDs[node.begin+i],d);
+      }
+    };
+    if (singlePrecision)
+      prepare(leafCoordsFloat);
+    else
+      prepare(leafCoords);
+  }
+  
+  /*! returns the leaf compression of the given name */
+  static KDTree::LeafCompression parseLeafCompression(const std::string &name)
+  {
+    if (name == "none") return KDTree::LEAF_COMPRESSION_NONE;
+    if (name == "u8")   return KDTree::LEAF_COMPRESSION_U8;
+    if (name == "u16")  return KDTree::LEAF_COMPRESSION_U16;
+    throw py::value_error("pyQuiri: unknown leaf compression '"+name
+                          +"' (must be 'none', 'u8', or 'u16')");
+  }
+  
+  /*! returns the split strategy of the given name */
+  static KDTree::SplitStrategy parseSplitStrategy(const std::string &name)
+  {
+    if (name == "midpoint_item")    return KDTree::MIDPOINT_ITEM;
+    if (name == "median")           return KDTree::MEDIAN;
+    if (name == "sliding_midpoint") return KDTree::SLIDING_MIDPOINT;
+    if (name == "cost_model")       return KDTree::COST_MODEL;
+    throw py::value_error("pyQuiri: unknown split strategy '"+name
+                          +"' (must be 'midpoint_item', 'median', "
+                          +"'sliding_midpoint', or 'cost_model')");
+  }
+  
+  /*! sliding-midpoint rule: split the cell's widest dimension (among
+      those the points actually extend in) in its middle; if all
+      points are on one side of that plane, slide it towards the
+      points until it separates at least one of them */
+  void KDTree::chooseSlidingMidpointSplit(const std::vector<int> &items,
+                                          const Box &cell,
+                                          const Box &bounds,
+                                          int &splitDim, double &splitPos)
+  {
+    splitDim = -1;
+    for (int d=0;d<K;d++)
+      if (bounds.lower[d] < bounds.upper[d] &&
+          (splitDim < 0 ||
+           cell.upper[d]-cell.lower[d] > cell.upper[splitDim]-cell.lower[splitDim]))
+        splitDim = d;
+    
+    splitPos = 0.5*(cell.lower[splitDim]+cell.upper[splitDim]);
+    if (splitPos > bounds.upper[splitDim])
+      // all points on the left: only the right-most one(s) go right
+      splitPos = bounds.upper[splitDim];
+    else if (splitPos <= bounds.lower[splitDim]) {
+      // all points on the right: only the left-most one(s) go left
+      splitPos = bounds.upper[splitDim];
+      for (auto item : items) {
+        const double x = pointCoord(item,splitDim);
+        if (x > bounds.lower[splitDim]) splitPos = std::min(splitPos,x);
+      }
+    }
+  }
 
-    int splitDim = widestDimension(bounds);
-    double mid = 0.5*(bounds.lower[splitDim]+bounds.upper[splitDim]);
-    int closestItem = -1;
-    double closestDist = std::numeric_limits<double>::infinity();
-    for (auto item : items) {
-      double dist = abs(coords[item][splitDim] - mid);
-      if (dist < closestDist) {
-        closestDist = dist;
-        closestItem = item;
+  /*! cost-model rule: evaluates a set of candidate planes in every
+      dimension, and picks the one that minimizes the expected number
+      of points visited by a query of 'queryRadius' that falls into
+      this cell, assuming the probability of visiting a child is
+      proportional to the volume of its cell grown by that radius */
+  void KDTree::chooseCostModelSplit(const std::vector<int> &items,
+                                    const Box &cell,
+                                    const Box &bounds,
+                                    double queryRadius,
+                                    int &splitDim, double &splitPos)
+  {
+    enum { NUM_BINS = 16 };
+    
+    // extent of the cell in given dimension, grown by the query radius
+    auto grownExtent = [&](int d) { return cell.upper[d]-cell.lower[d]+2*queryRadius; };
+    double bestCost = std::numeric_limits<double>::infinity();
+    splitDim = -1;
+    for (int d=0;d<K;d++) {
+      const double lo = bounds.lower[d], hi = bounds.upper[d];
+      if (!(lo < hi)) continue;
+      
+      int binCount[NUM_BINS] = { 0 };
+      const double binScale = NUM_BINS/(hi-lo);
+      for (auto item : items) {
+        const int bin = int((pointCoord(item,d)-lo)*binScale);
+        binCount[std::max(0,std::min(NUM_BINS-1,bin))]++;
       }
+      
+      double otherExtents = 1.;
+      for (int o=0;o<K;o++)
+        if (o != d) otherExtents *= grownExtent(o);
+      const double cellVolume = grownExtent(d)*otherExtents;
+      
+      int numLeft = 0;
+      for (int plane=1;plane<NUM_BINS;plane++) {
+        numLeft += binCount[plane-1];
+        const int numRight = (int)items.size()-numLeft;
+        if (numLeft == 0 || numRight == 0) continue;
+        const double pos = lo+plane/binScale;
+        const double volLeft  = (pos-cell.lower[d]+2*queryRadius)*otherExtents;
+        const double volRight = (cell.upper[d]-pos+2*queryRadius)*otherExtents;
+        const double cost = (volLeft*numLeft+volRight*numRight)/cellVolume;
+        if (cost < bestCost) {
+          bestCost = cost;
+          splitDim = d;
+          splitPos = pos;
+        }
+      }
+    }
+    
+    if (splitDim < 0)
+      // points too tightly clustered for the bins to separate them
+      chooseSlidingMidpointSplit(items,cell,bounds,splitDim,splitPos);
+  }
+  
+  int KDTree::buildRec(std::vector<int> &items,
+                       const Box &cell,
+                       SplitStrategy strategy,
+                       double queryRadius,
+                       int leafSize)
+  {
+    if (items.empty()) return -1;
+    
+    Box bounds(K);
+    std::vector<double> buffer(K);
+    for (auto id : items)
+      bounds.grow(pointCoords(id,buffer.data()));
+
+    std::vector<Node> &nodes   = this->nodes.writable();
+    std::vector<int>  &itemIDs = this->itemIDs.writable();
+    const int nodeID = (int)nodes.size();
+    Node node;
+    node.begin  = (int)itemIDs.size();
+    node.lChild = -1;
+    node.rChild = -1;
+    node.pad    = 0;
+    
+    if (items.size() <= size_t(leafSize) || bounds.lower == bounds.upper) {
+      node.splitDim = -1;
+      node.splitPos = 0.;
+      node.count    = (int)items.size();
+      itemIDs.insert(itemIDs.end(),items.begin(),items.end());
+      nodes.push_back(node);
+      return nodeID;
     }
 
     std::vector<int> left, right, same;
-    const Coords &nodeCoords = this->coords[closestItem];
-    for (auto item : items) {
-      const Coords &coords = this->coords[item];
-      if (coords == nodeCoords)
-        same.push_back(item);
-      else if (coords[splitDim] < nodeCoords[splitDim])
-        left.push_back(item);
+    int    splitDim;
+    double splitPos;
+    if (strategy == MIDPOINT_ITEM || strategy == MEDIAN) {
+      // split at a data point, which gets stored in this node
+      splitDim = widestDimension(bounds);
+      int nodeItem = -1;
+      if (strategy == MEDIAN) {
+        std::nth_element(items.begin(),items.begin()+items.size()/2,items.end(),
+                         [&](int a, int b)
+                         { return pointCoord(a,splitDim) < pointCoord(b,splitDim); });
+        nodeItem = items[items.size()/2];
+      } else {
+        double mid = 0.5*(bounds.lower[splitDim]+bounds.upper[splitDim]);
+        double closestDist = std::numeric_limits<double>::infinity();
+        for (auto item : items) {
+          double dist = std::abs(pointCoord(item,splitDim) - mid);
+          if (dist < closestDist) {
+            closestDist = dist;
+            nodeItem = item;
+          }
+        }
+      }
+
+      splitPos = pointCoord(nodeItem,splitDim);
+      for (auto item : items) {
+        if (samePoints(item,nodeItem))
+          same.push_back(item);
+        else if (pointCoord(item,splitDim) < splitPos)
+          left.push_back(item);
+        else
+          right.push_back(item);
+      }
+    } else {
+      // split at an arbitrary plane; node stores no data points
+      if (strategy == SLIDING_MIDPOINT)
+        chooseSlidingMidpointSplit(items,cell,bounds,splitDim,splitPos);
       else
-        right.push_back(item);
+        chooseCostModelSplit(items,cell,bounds,queryRadius,splitDim,splitPos);
+      for (auto item : items)
+        (pointCoord(item,splitDim) < splitPos ? left : right).push_back(item);
     }
     items.clear();
     
-    KDTree::Node::SP node = std::make_shared<KDTree::Node>();
-    node->splitDim = splitDim;
-    node->items    = same;
-    node->lChild   = buildRec(left);
-    node->rChild   = buildRec(right);
-    return node;
+    node.splitDim = splitDim;
+    node.splitPos = splitPos;
+    node.count    = (int)same.size();
+    itemIDs.insert(itemIDs.end(),same.begin(),same.end());
+    nodes.push_back(node);
+
+    Box leftCell = cell, rightCell = cell;
+    leftCell.upper[splitDim] = splitPos;
+    rightCell.lower[splitDim] = splitPos;
+    const int lChild = buildRec(left,leftCell,strategy,queryRadius,leafSize);
+    const int rChild = buildRec(right,rightCell,strategy,queryRadius,leafSize);
+    nodes[nodeID].lChild = lChild;
+    nodes[nodeID].rChild = rChild;
+    return nodeID;
   }
   
   /*! build kd-tree - MUST be done before querying anything */
-  void KDTree::build()
+  void KDTree::build(const std::string &method,
+                     int numThreads,
+                     const std::string &splitStrategyName,
+                     int leafSize,
+                     const py::object &labels,
+                     const std::string &leafCompressionName)
+  {
+    std::vector<int32_t> newLabels;
+    if (!labels.is_none()) {
+      auto array = labels.cast<py::array_t<int32_t,py::array::c_style|py::array::forcecast>>();
+      if (array.ndim() != 1 || (size_t)array.shape(0) != numPoints())
+        throw py::value_error("pyQuiri: labels must have exactly one entry per data point");
+      newLabels.assign(array.data(),array.data()+array.shape(0));
+    }
+    build(method,numThreads,splitStrategyName,leafSize,leafCompressionName);
+    if (!labels.is_none()) {
+      this->labels.swap(newLabels);
+      labelMasks.clear();
+      computeLabelMasks();
+    }
+  }
+  
+  void KDTree::build(const std::string &method,
+                     int numThreads,
+                     const std::string &splitStrategyName,
+                     int leafSize,
+                     const std::string &leafCompressionName)
   {
-    if (root)
+    if (method != "top_down" && method != "morton")
+      throw py::value_error("pyQuiri: unknown build method '"+method
+                            +"' (must be 'top_down' or 'morton')");
+    if (leafSize < 1)
+      throw py::value_error("pyQuiri: leaf_size must be at least 1");
+    const SplitStrategy splitStrategy = parseSplitStrategy(splitStrategyName);
+    const LeafCompression leafCompression = parseLeafCompression(leafCompressionName);
+    if (leafCompression != LEAF_COMPRESSION_NONE &&
+        (isBuilt ? this->leafSize : leafSize) < MIN_COMPRESSED_LEAF_SIZE)
+      throw py::value_error("pyQuiri: leaf_compression requires a leaf_size of at least "
+                            +std::to_string(int(MIN_COMPRESSED_LEAF_SIZE)));
+    if (leafCompression != this->leafCompression) {
+      this->leafCompression = leafCompression;
+      leafCoords.clear();
+      leafCoordsFloat.clear();
+      leafCodes.clear();
+      leafQuant.clear();
+      leafQuantIndex.clear();
+      // anything that still refers to the old leaf data is outdated
+      version++;
+    }
+    if (labels.size() != numPoints())
+      // labels are stale, points got added since
+      labels.clear();
+    
+    if (isBuilt) {
       // tree is already built!
+      computeLabelMasks();
       return;
-    
-    std::vector<int> items(objects.size());
-    for (int i=0;i<objects.size();i++)
-      items[i] = i;
-    root = buildRec(items);
+    }
+
+    nodes.writable().clear();
+    itemIDs.writable().clear();
+    this->leafSize = leafSize;
+
+    if (method == "morton")
+      buildMorton(numThreads,leafSize);
+    else if (numPoints() > 0) {
+      std::vector<int> items(numPoints());
+      Box bounds(K);
+      std::vector<double> buffer(K);
+      for (int i=0;i<(int)items.size();i++) {
+        items[i] = i;
+        bounds.grow(pointCoords(i,buffer.data()));
+      }
+      
+      // for the cost model: the typical distance between points,
+      // assuming they were uniformly distributed over their bounds
+      double volume = 1.;
+      int    numExtents = 0;
+      for (int d=0;d<K;d++)
+        if (bounds.upper[d] > bounds.lower[d]) {
+          volume *= bounds.upper[d]-bounds.lower[d];
+          numExtents++;
+        }
+      const double queryRadius
+        = numExtents ? pow(volume/items.size(),1./numExtents) : 0.;
+      
+      buildRec(items,bounds,splitStrategy,queryRadius,leafSize);
+    }
+    isBuilt = true;
+    computeLabelMasks();
+  }
+
+  /*! computes labelMasks[] from labels[], see KDTree.h */
+  void KDTree::computeLabelMasks()
+  {
+    if (labels.empty() || labelMasks.size() == nodes.size())
+      return;
+    labelMasks.assign(nodes.size(),0);
+    // children always come after their parent, so going backwards
+    // sees every subtree before the node it belongs to
+    for (int nodeID=(int)nodes.size()-1;nodeID>=0;--nodeID) {
+      const Node &node = nodes[nodeID];
+      uint64_t mask = 0;
+      for (int i=node.begin;i<node.begin+node.count;i++)
+        mask |= labelBit(labels[itemIDs[i]]);
+      if (node.lChild >= 0) mask |= labelMasks[node.lChild];
+      if (node.rChild >= 0) mask |= labelMasks[node.rChild];
+      labelMasks[nodeID] = mask;
+    }
   }
 
   /*! performs (exact) element search for the given coordinates and
@@ -110,24 +467,75 @@ namespace pyq {
     coordinates */
   std::vector<py::object> KDTree::find(const std::vector<double> &_coords)
   {
-    verifyTreeIsBuilt();
+    if (!hasHashIndex)
+      verifyTreeIsBuilt();
     const Coords queryCoords = makeCheckCoords(_coords);
     
+    std::vector<int> items;
+    findItems(queryCoords.coords.data(),items);
     std::vector<py::object> result;
+    for (auto item : items)
+      result.push_back(value(item));
+    return result;
+  }
+
+  void KDTree::findItems(const double *coords, std::vector<int> &items) const
+  {
+    // single-precision trees store their points rounded (see add()),
+    // so the query has to be rounded the same way to match them
+    std::vector<double> rounded, buffer;
+    if (singlePrecision) {
+      rounded.resize(K);
+      buffer.resize(K);
+      for (int d=0;d<K;d++)
+        rounded[d] = (float)coords[d];
+      coords = rounded.data();
+    }
     
-    Node::SP node = root;
-    while (node) {
-      const Coords &nodeCoords = this->coords[node->items[0]];
-      if (nodeCoords == queryCoords) {
-        for (auto item : node->items)
-          result.push_back(objects[item]);
-        return result;
-      } else if (queryCoords[node->splitDim] < nodeCoords[node->splitDim])
-        node = node->lChild;
+    if (hasHashIndex) {
+      auto addItem = [&](int item) { items.push_back(item); };
+      if (singlePrecision)
+        hashIndex.forEachMatch(pointsFloat.data(),K,coords,addItem);
       else
-        node = node->rChild;
+        hashIndex.forEachMatch(points.data(),K,coords,addItem);
+      return;
     }
-    return result;
+    if (nodes.empty())
+      return;
+    
+    int nodeID = 0;
+    while (nodeID >= 0) {
+      const Node &node = nodes[nodeID];
+      bool found = false;
+      for (int i=node.begin;i<node.begin+node.count;i++) {
+        const int item = itemIDs[i];
+        if (equal(coords,pointCoords(item,buffer.data()),K)) {
+          items.push_back(item);
+          found = true;
+        }
+      }
+      if (found || node.splitDim < 0)
+        // all points with the same coordinates always end up in the same node
+        return;
+      
+      if (coords[node.splitDim] < node.splitPos)
+        nodeID = node.lChild;
+      else
+        nodeID = node.rChild;
+    }
+  }
+  
+  void KDTree::enableHashIndex()
+  {
+    if (hasHashIndex)
+      return;
+    hashIndex.clear();
+    for (size_t i=0;i<numPoints();i++)
+      if (singlePrecision)
+        hashIndex.insert(pointsFloat.data(),K);
+      else
+        hashIndex.insert(points.data(),K);
+    hasHashIndex = true;
   }
     
   /*! returns a list with (only) the values value of all poitnts within given box */
@@ -135,20 +543,23 @@ namespace pyq {
   KDTree::allValuesInRange(const std::vector<double> &_lower,
                            const std::vector<double> &_upper)
   {
-    if (objects.empty())
+    if (numPoints() == 0)
       return {};
     
     verifyTreeIsBuilt();
     Box queryBox(makeCheckCoords(_lower),
                  makeCheckCoords(_upper));
+    prepareLeafCoords();
+    const LeafKernels &kernels = leafKernels();
+    std::vector<uint8_t> inside;
     
     std::vector<py::object> result;
-    std::stack<std::pair<Box,Node::SP>> nodeStack;
-    nodeStack.push({Box::infinite(K),root});
+    std::stack<std::pair<Box,int>> nodeStack;
+    nodeStack.push({Box::infinite(K),0});
     while (!nodeStack.empty()) {
       // pop latest from stack
       Box subtreeBounds = nodeStack.top().first;
-      Node::SP node  = nodeStack.top().second;
+      const Node &node  = nodes[nodeStack.top().second];
       nodeStack.pop();
 
       // cull if not in range
@@ -156,21 +567,27 @@ namespace pyq {
         continue;
 
       // process node itself
-      const Coords &nodeCoords = this->coords[node->items[0]];
-      if (overlaps(queryBox,nodeCoords))
-        for (auto item : node->items)
-          result.push_back(this->objects[item]);
+      if (node.count > (int)inside.size())
+        inside.resize(node.count);
+      if (nodeInBox(kernels,node,
+                    queryBox.lower.coords.data(),queryBox.upper.coords.data(),
+                    inside.data()))
+        for (int i=0;i<node.count;i++) {
+          if (!inside[i]) continue;
+          const int item = itemIDs[node.begin+i];
+          result.push_back(value(item));
+        }
 
       // push children
-      if (node->lChild) {
+      if (node.lChild >= 0) {
         Box childBounds = subtreeBounds;
-        childBounds.upper[node->splitDim] = nodeCoords[node->splitDim];
-        nodeStack.push(std::pair<Box,Node::SP>{childBounds,node->lChild});
+        childBounds.upper[node.splitDim] = node.splitPos;
+        nodeStack.push(std::pair<Box,int>{childBounds,node.lChild});
       }
-      if (node->rChild) {
+      if (node.rChild >= 0) {
         Box childBounds = subtreeBounds;
-        childBounds.lower[node->splitDim] = nodeCoords[node->splitDim];
-        nodeStack.push(std::pair<Box,Node::SP>{childBounds,node->rChild});
+        childBounds.lower[node.splitDim] = node.splitPos;
+        nodeStack.push(std::pair<Box,int>{childBounds,node.rChild});
       }
     }
     
@@ -178,27 +595,54 @@ namespace pyq {
   }
 
 
+  /*! returns a list with all key:value pairs within the given radius
+    of the given point, sorted by distance */
+  std::vector<std::tuple<std::vector<double>,py::object>>
+  KDTree::allPointsInRadius(const std::vector<double> &_coords,
+                            double radius)
+  {
+    if (numPoints() == 0)
+      return {};
+    
+    verifyTreeIsBuilt();
+    const Coords queryPoint = makeCheckCoords(_coords);
+    prepareLeafCoords();
+    QueryScratch scratch(K);
+    std::vector<std::pair<double,int>> found;
+    if (radius >= 0.)
+      radiusQuery(queryPoint.coords.data(),radius*radius,found,scratch);
+    std::sort(found.begin(),found.end());
+
+    std::vector<std::tuple<std::vector<double>,py::object>> result;
+    for (auto &f : found)
+      result.push_back(std::make_tuple(pointVector(f.second),value(f.second)));
+    return result;
+  }
+  
   /*! returns a list with (only) the values value of all poitnts within given box */
   std::vector<std::pair<std::vector<double>,py::object>> 
   KDTree::allPointsInRange(const std::vector<double> &_lower,
                            const std::vector<double> &_upper)
   {
-    if (objects.empty())
+    if (numPoints() == 0)
       return {};//py::list{};
     
     verifyTreeIsBuilt();
     Box queryBox(makeCheckCoords(_lower),
                  makeCheckCoords(_upper));
+    prepareLeafCoords();
+    const LeafKernels &kernels = leafKernels();
+    std::vector<uint8_t> inside;
     // std::vector<py::object> result;
     // py::list result;
     std::vector<std::pair<std::vector<double>,py::object>> result;
     
-    std::stack<std::pair<Box,Node::SP>> nodeStack;
-    nodeStack.push({Box::infinite(K),root});
+    std::stack<std::pair<Box,int>> nodeStack;
+    nodeStack.push({Box::infinite(K),0});
     while (!nodeStack.empty()) {
       // pop latest from stack
       Box subtreeBounds = nodeStack.top().first;
-      Node::SP node  = nodeStack.top().second;
+      const Node &node  = nodes[nodeStack.top().second];
       nodeStack.pop();
 
       // cull if not in range
@@ -206,22 +650,27 @@ namespace pyq {
         continue;
 
       // process node itself
-      const Coords &nodeCoords = this->coords[node->items[0]];
-      if (overlaps(queryBox,nodeCoords))
-        for (auto item : node->items) {
-          result.push_back({nodeCoords.coords,this->objects[item]});
+      if (node.count > (int)inside.size())
+        inside.resize(node.count);
+      if (nodeInBox(kernels,node,
+                    queryBox.lower.coords.data(),queryBox.upper.coords.data(),
+                    inside.data()))
+        for (int i=0;i<node.count;i++) {
+          if (!inside[i]) continue;
+          const int item = itemIDs[node.begin+i];
+          result.push_back({pointVector(item),value(item)});
         }
 
       // push children
-      if (node->lChild) {
+      if (node.lChild >= 0) {
         Box childBounds = subtreeBounds;
-        childBounds.upper[node->splitDim] = nodeCoords[node->splitDim];
-        nodeStack.push(std::pair<Box,Node::SP>{childBounds,node->lChild});
+        childBounds.upper[node.splitDim] = node.splitPos;
+        nodeStack.push(std::pair<Box,int>{childBounds,node.lChild});
       }
-      if (node->rChild) {
+      if (node.rChild >= 0) {
         Box childBounds = subtreeBounds;
-        childBounds.lower[node->splitDim] = nodeCoords[node->splitDim];
-        nodeStack.push(std::pair<Box,Node::SP>{childBounds,node->rChild});
+        childBounds.lower[node.splitDim] = node.splitPos;
+        nodeStack.push(std::pair<Box,int>{childBounds,node.rChild});
       }
     }
 
@@ -237,81 +686,143 @@ namespace pyq {
   KDTree::findClosest(const std::vector<double> &_coords,
                       const py::kwargs &kwargs)
   {
-    if (objects.empty())
+    if (numPoints() == 0)
       return std::tuple<std::vector<double>,py::list>();
     
     verifyTreeIsBuilt();
     const Coords queryCoords = makeCheckCoords(_coords);
     
-    std::stack<std::pair<double,Node::SP>> nodeStack;
-    nodeStack.push(std::pair<double,Node::SP>{ 0.,root });
+    std::stack<std::pair<double,int>> nodeStack;
+    nodeStack.push(std::pair<double,int>{ 0.,0 });
     
-    Node::SP closestNode;
+    int      closestNode = -1;
+    int      closestItem = -1;
     double   closestDist = std::numeric_limits<double>::infinity();
+    std::vector<double> buffer(K);
     while (!nodeStack.empty()) {
       double subTreeMinDist = nodeStack.top().first;
-      Node::SP node  = nodeStack.top().second;
+      const int nodeID = nodeStack.top().second;
+      const Node &node = nodes[nodeID];
       nodeStack.pop();
 
       if (subTreeMinDist >= closestDist)
         continue;
       
-      assert(node);
-      const Coords &nodeCoords = this->coords[node->items[0]];
-      double dist = distance(nodeCoords,queryCoords);
-      if (dist <= closestDist) {
-        closestDist = dist;
-        closestNode = node;
+      for (int i=node.begin;i<node.begin+node.count;i++) {
+        const int item = itemIDs[i];
+        double dist = distance(queryCoords,pointCoords(item,buffer.data()));
+        if (dist < closestDist) {
+          closestDist = dist;
+          closestItem = item;
+          closestNode = nodeID;
+        }
       }
+      if (node.splitDim < 0)
+        continue;
+      
       const double farSideMinDist = 
         std::max(subTreeMinDist,
-                 abs(queryCoords[node->splitDim]-nodeCoords[node->splitDim]));
-      const bool queryOnLeftSide = (queryCoords[node->splitDim] < nodeCoords[node->splitDim]);
-      Node::SP closeChild = queryOnLeftSide?node->lChild:node->rChild;
-      Node::SP farChild   = queryOnLeftSide?node->rChild:node->lChild;
-      if (farChild)   nodeStack.push({farSideMinDist,farChild});
-      if (closeChild) nodeStack.push({subTreeMinDist,closeChild});
+                 std::abs(queryCoords[node.splitDim]-node.splitPos));
+      const bool queryOnLeftSide = (queryCoords[node.splitDim] < node.splitPos);
+      int closeChild = queryOnLeftSide?node.lChild:node.rChild;
+      int farChild   = queryOnLeftSide?node.rChild:node.lChild;
+      if (farChild >= 0)   nodeStack.push({farSideMinDist,farChild});
+      if (closeChild >= 0) nodeStack.push({subTreeMinDist,closeChild});
     }
     
-    if (!closestNode)
+    if (closestItem < 0)
       return std::tuple<std::vector<double>,py::list>();
-    
-    const Coords &foundCoords = this->coords[closestNode->items[0]];
+
+    // all points with the same coordinates always end up in the same node
+    const Node &node = nodes[closestNode];
     py::list values;
-    for (auto item : closestNode->items)
-      values.append(this->objects[item]);
+    for (int i=node.begin;i<node.begin+node.count;i++) {
+      const int item = itemIDs[i];
+      if (samePoints(item,closestItem))
+        values.append(value(item));
+    }
     
-    return std::tuple<std::vector<double>,py::list>(foundCoords.coords,values);
+    return std::tuple<std::vector<double>,py::list>(pointVector(closestItem),values);
   }
 
   /*! find k-nearest neighbors (kNN) to a query point */
   std::vector<std::tuple<std::vector<double>,py::object>>
   KDTree::kNN(int k,
               const std::vector<double> &_coords,
-              double initMaxRadius)
+              double initMaxRadius,
+              const py::object &labels,
+              const std::string &metricName)
   {
-    if (objects.empty())
+    if (numPoints() == 0)
       return {};
+    if (k < 1)
+      throw py::value_error("pyQuiri: knn requires k >= 1");
     
     verifyTreeIsBuilt();
     const Coords queryPoint = makeCheckCoords(_coords);
 
+    /* the requested labels (sorted), and the mask of all subtrees
+       that may contain any of them */
+    const bool filter = !labels.is_none();
+    std::vector<int32_t> wantedLabels;
+    uint64_t wantedMask = 0;
+    if (filter) {
+      if (this->labels.empty())
+        throw std::runtime_error("pyQuiri: knn() with labels requires a tree that got built with labels");
+      wantedLabels = labels.cast<std::vector<int32_t>>();
+      std::sort(wantedLabels.begin(),wantedLabels.end());
+      for (auto label : wantedLabels)
+        wantedMask |= labelBit(label);
+      if (wantedMask == 0)
+        return {};
+    }
+
+    const Metric metric = parseKNNMetric(metricName);
+    if (metric != EUCLIDEAN) {
+      if (initMaxRadius != std::numeric_limits<double>::infinity())
+        throw py::value_error("pyQuiri: max_radius is only supported for metric 'euclidean'");
+      prepareSimilarityBounds();
+      std::vector<std::pair<double,int>> heap(std::max(k,0));
+      const int numFound
+        = similarityQuery(queryPoint.coords.data(),k,metric,
+                          filter ? &wantedLabels : nullptr,wantedMask,heap.data());
+      std::vector<std::tuple<std::vector<double>,py::object>> result;
+      for (int i=0;i<numFound;i++)
+        result.push_back({pointVector(heap[i].second),value(heap[i].second)});
+      return result;
+    }
+    
+    auto isWanted = [&](int item) {
+      return !filter || std::binary_search(wantedLabels.begin(),wantedLabels.end(),
+                                           this->labels[item]);
+    };
+    auto mayContainWanted = [&](int nodeID) {
+      return !filter || (labelMasks[nodeID] & wantedMask);
+    };
+
     /* the list of current candidates at any point during traversal -
-       will get updated with new nodes as they get found (possibly
-       evicting other ones). Careful: nodes can contain more than one
-       data point, so we need to separately track how many values we
-       have in there */
-    std::priority_queue<std::pair<double,Node::SP>> currentCandidateNodes;
+       will get updated with new points as they get found (possibly
+       evicting other ones). Careful: the same point can occur more
+       than once, so each candidate is a range of items (in
+       itemIDs[]) that all share the same coordinates, and we need
+       to separately track how many values we have in there */
+    struct Candidate {
+      double dist;
+      int    begin, count;
+      bool operator<(const Candidate &other) const { return dist < other.dist; }
+    };
+    std::priority_queue<Candidate> currentCandidates;
     int    numValuesInCandidates = 0;
     double currentMaxRadius = initMaxRadius;
+    std::vector<double> buffer(K);
 
     /* the node(s) we still need to check for additional candidates */
-    std::stack<std::pair<Box,Node::SP>> nodeStack;
-    nodeStack.push({Box::infinite(K),root});
+    std::stack<std::pair<Box,int>> nodeStack;
+    nodeStack.push({Box::infinite(K),0});
     while (!nodeStack.empty()) {
       // pop latest from stack
       Box subtreeBounds = nodeStack.top().first;
-      Node::SP node  = nodeStack.top().second;
+      const Node &node  = nodes[nodeStack.top().second];
       nodeStack.pop();
 
       const double distToSubtree
@@ -320,50 +831,64 @@ namespace pyq {
         // cull if entire subtree already out of range
         continue;
 
-      // process node itself
-      const Coords &nodeCoords = this->coords[node->items[0]];
-      const double distToPoint = distance(nodeCoords,queryPoint);
-      if (distToPoint <= currentMaxRadius) {
-        // first, add this point, with all its values
-        currentCandidateNodes.push({distToPoint,node});
-        numValuesInCandidates += node->items.size();
-        while (true) {
-          const int numValuesInFurthestCandidate
-            = currentCandidateNodes.top().second->items.size();
-          if (numValuesInCandidates-numValuesInFurthestCandidate >= k) {
-            /*! even if we drop the furthest one, we'd still have enough! */
-            numValuesInCandidates -= numValuesInFurthestCandidate;
-            currentCandidateNodes.pop();
-            continue;
+      // process node itself, one group of same-coordinate items at a
+      // time (or, when filtering, one item at a time)
+      for (int begin=node.begin;begin<node.begin+node.count;) {
+        if (!isWanted(itemIDs[begin])) {
+          ++begin;
+          continue;
+        }
+        int end = begin+1;
+        while (!filter && end < node.begin+node.count &&
+               samePoints(itemIDs[end],itemIDs[begin]))
+          ++end;
+        
+        const double distToPoint
+          = distance(queryPoint,pointCoords(itemIDs[begin],buffer.data()));
+        if (distToPoint <= currentMaxRadius) {
+          // first, add this point, with all its values
+          currentCandidates.push({distToPoint,begin,end-begin});
+          numValuesInCandidates += end-begin;
+          while (true) {
+            const int numValuesInFurthestCandidate
+              = currentCandidates.top().count;
+            if (numValuesInCandidates-numValuesInFurthestCandidate >= k) {
+              /*! even if we drop the furthest one, we'd still have enough! */
+              numValuesInCandidates -= numValuesInFurthestCandidate;
+              currentCandidates.pop();
+              continue;
+            }
+            break;
           }
-          break;
+          if (numValuesInCandidates >= k)
+            currentMaxRadius = currentCandidates.top().dist;
         }
-        if (numValuesInCandidates >= k)
-          currentMaxRadius = currentCandidateNodes.top().first;
+        begin = end;
       }
 
       // push children
-      if (node->lChild) {
+      if (node.lChild >= 0 && mayContainWanted(node.lChild)) {
         Box childBounds = subtreeBounds;
-        childBounds.upper[node->splitDim] = nodeCoords[node->splitDim];
+        childBounds.upper[node.splitDim] = node.splitPos;
         const double dist = distance(childBounds,queryPoint);
         if (dist <= currentMaxRadius)
-          nodeStack.push({childBounds,node->lChild});
+          nodeStack.push({childBounds,node.lChild});
       }
-      if (node->rChild) {
+      if (node.rChild >= 0 && mayContainWanted(node.rChild)) {
         Box childBounds = subtreeBounds;
-        childBounds.lower[node->splitDim] = nodeCoords[node->splitDim];
+        childBounds.lower[node.splitDim] = node.splitPos;
         const double dist = distance(childBounds,queryPoint);
         if (dist <= currentMaxRadius)
-          nodeStack.push({childBounds,node->rChild});
+          nodeStack.push({childBounds,node.rChild});
       }
     }
 
     std::vector<int> finalCandidates;
-    while (!currentCandidateNodes.empty()) {
-      for (auto item : currentCandidateNodes.top().second->items)
-        finalCandidates.push_back(item);
-      currentCandidateNodes.pop();
+    while (!currentCandidates.empty()) {
+      const Candidate &candidate = currentCandidates.top();
+      for (int i=candidate.begin;i<candidate.begin+candidate.count;i++)
+        finalCandidates.push_back(itemIDs[i]);
+      currentCandidates.pop();
     }
     // reverse the list, so we'll report result sorted by distance, closest comes first
     for (int i=0;i<finalCandidates.size()/2;i++)
@@ -371,10 +896,9 @@ namespace pyq {
 
     std::vector<std::tuple<std::vector<double>,py::object>> result;
     for (auto item : finalCandidates) {
-      double dist = distance(this->coords[item],queryPoint);
       std::tuple<std::vector<double>,py::object> entry
-        (this->coords[item].coords,
-         this->objects[item]);
+        (pointVector(item),
+         value(item));
       result.push_back(entry);
     }
     
@@ -388,12 +912,27 @@ namespace pyq {
     if (coords.size() != K)
       throw py::type_error
         ("key in KDTree::add() does not match dimensionality of tree");
+
+    // invalidate the kd-tree:
+    invalidate();
+
+    // trees loaded without values use the point index as value
+    for (size_t i=objects.size();i<numPoints();i++)
+      objects.push_back(py::int_(i));
     
-    this->coords.push_back(Coords(coords));
+    if (singlePrecision) {
+      std::vector<float> &points = pointsFloat.writable();
+      for (auto c : coords)
+        points.push_back((float)c);
+      if (hasHashIndex)
+        hashIndex.insert(points.data(),K);
+    } else {
+      std::vector<double> &points = this->points.writable();
+      points.insert(points.end(),coords.begin(),coords.end());
+      if (hasHashIndex)
+        hashIndex.insert(points.data(),K);
+    }
     this->objects.push_back(object);
-    
-    // invalidate the kd-tree:
-    root = {};
   }
 
 }
@@ -17,17 +17,52 @@
 #pragma once
 
 #include "pyQuiri/Box.h"
+#include "pyQuiri/Array.h"
+#include "pyQuiri/CellStack.h"
+#include "pyQuiri/HashIndex.h"
+#include "pyQuiri/LeafKernels.h"
+#include "pyQuiri/Metric.h"
+#include <pybind11/numpy.h>
 
 namespace pyq {
 
   typedef std::shared_ptr<py::object> PyHandle;
 
+  struct FileHeader;
+
   struct KDTree {
     typedef std::shared_ptr<KDTree> SP;
 
-    KDTree(int K);
+    /*! one node of the (flattened) kd-tree. Every node can store a
+        list of data points (given as range in the itemIDs[] array);
+        inner nodes additionally split space along 'splitDim', with
+        all data points in the left subtree having coordinates
+        strictly smaller than 'splitPos' in that dimension, and all
+        in the right subtree having coordinates >= splitPos. Since
+        this gets written to (and memory-mapped from) files this has
+        to remain a plain-old-data struct */
+    struct Node {
+      /*! position of the splitting plane, if inner node */
+      double  splitPos;
+      /*! dimension this node splits in, or -1 if this is a leaf */
+      int32_t splitDim;
+      /*! range of data points stored in this node, as offset and
+          count into the itemIDs[] array */
+      int32_t begin, count;
+      /*! indices of the children in the nodes[] array, or -1 if the
+          respective subtree is empty */
+      int32_t lChild, rChild;
+      int32_t pad;
+    };
+
+    /*! creates an empty tree for K-dimensional points; with dtype
+        "float32" all coordinates get rounded to single precision on
+        add(), and get stored (in pointsFloat and leafCoordsFloat) in
+        half the memory */
+    KDTree(int K, const std::string &dtype="float64");
     
-    static SP create(int K) { return std::make_shared<KDTree>(K); }
+    static SP create(int K, const std::string &dtype="float64")
+    { return std::make_shared<KDTree>(K,dtype); }
 
     /*! add a new element to this kdtree */
     // void add(const py::list &coords,
@@ -40,6 +75,18 @@ namespace pyq {
       coordinates */
     std::vector<py::object> find(const std::vector<double> &coords);
 
+    /*! creates a hash index over all data points' coordinates (see
+        HashIndex.h), which from then on gets updated by add(); with
+        that, find() and findBatch() no longer need the tree to be
+        built, and take O(1) expected time */
+    void enableHashIndex();
+    
+    /*! performs find() for each of a (M,K) array of query points, and
+        returns the matches as a tuple (indptr, indices) of arrays in
+        CSR layout, with the indices (in order of add()) of the points
+        matching query i in indices[indptr[i]:indptr[i+1]], sorted */
+    py::tuple findBatch(const py::array_t<double,py::array::c_style|py::array::forcecast> &queries);
+
     /*! finds the closest data point to given query point, and returns
       a tuple [ point, (values) ]; the 'values' is a *list* of all
       the values that share that data point (ie, it is always a list
@@ -48,16 +95,82 @@ namespace pyq {
     //    py::tuple
     findClosest(const std::vector<double> &coords, const py::kwargs &kwargs);
 
-    /*! returns a list with all key:value pairs with the given point and radius */
+    /*! returns a list with all key:value pairs within the given
+        radius of the given point, sorted by distance */
     std::vector<std::tuple<std::vector<double>,py::object>>
-    all_points_in_radius(const std::vector<double> &coords,
-                         double radius);
+    allPointsInRadius(const std::vector<double> &coords,
+                      double radius);
     
-    /*! find k-nearest neighbors (kNN) to a query point */
+    /*! find k-nearest neighbors (kNN) to a query point; if 'labels'
+        is not None only data points whose label (see build()) is in
+        that list are considered. With metric "cosine" or
+        "inner_product" this instead finds the k data points with
+        the largest cosine similarity or dot product to the query
+        (see similarityQuery()), which does not support a maxRadius */
     std::vector<std::tuple<std::vector<double>,py::object>>
     kNN(int k,
         const std::vector<double> &coords,
-        double maxRadius=std::numeric_limits<double>::infinity());
+        double maxRadius=std::numeric_limits<double>::infinity(),
+        const py::object &labels=py::none(),
+        const std::string &metric="euclidean");
+    
+    /*! computes the k-nearest-neighbor graph of all data points
+        (using 'numThreads' threads, see KNNGraph.cpp), and returns
+        it as a tuple (indptr, indices, distances) of numpy arrays in
+        CSR layout: the neighbors of point i (in order of add()) are
+        indices[indptr[i]:indptr[i+1]], sorted by increasing
+        distance. Unless 'includeSelf' is set a point is not its own
+        neighbor (but other points at the same coordinates are) */
+    py::tuple knnGraph(int k, int numThreads, bool includeSelf);
+
+    /*! finds all pairs of data points (one from each tree) that are
+        at most 'radius' apart (using 'numThreads' threads, see
+        RadiusJoin.cpp), and returns them as a tuple (indicesA,
+        indicesB) of numpy arrays, in unspecified order; indices are
+        in order of add(). Joining a tree with itself reports every
+        pair in both orders, and every point with itself */
+    static py::tuple radiusJoin(const SP &a, const SP &b,
+                                double radius, int numThreads);
+    
+    /*! in which order the queries of a batch get processed */
+    typedef enum {
+      /*! in input order */
+      ORDER_NONE,
+      /*! sorted along a Morton (Z-order) curve */
+      ORDER_MORTON,
+      /*! sorted along a Hilbert curve */
+      ORDER_HILBERT
+    } QueryOrder;
+    
+    /*! finds the k nearest data points for each of a (M,K) array of
+        query points (see BatchQueries.cpp); queries get processed in
+        the given order ("none", "morton", or "hilbert"), using
+        'numThreads' threads. With a packetSize > 1, groups of that many
+        consecutive queries traverse the tree together (see
+        tracePacket()). Returns a tuple of two (M,k) arrays with
+        the indices (in order of add()) and distances of the
+        neighbors, closest first; rows with fewer than k neighbors
+        within maxRadius are padded with -1 and infinity. For metric
+        "cosine" the distances are 1-cosine similarity, for
+        "inner_product" they are the dot products (largest first,
+        padded with -infinity); neither uses packets */
+    py::tuple kNNBatch(const py::array_t<double,py::array::c_style|py::array::forcecast> &queries,
+                       int k,
+                       double maxRadius,
+                       int numThreads,
+                       const std::string &order,
+                       int packetSize,
+                       const std::string &metric);
+
+    /*! finds all data points within 'radius' of each of a (M,K) array
+        of query points (see kNNBatch()), and returns them as a tuple
+        (indptr, indices, distances) of arrays in CSR layout; each
+        query's results are in unspecified order */
+    py::tuple radiusBatch(const py::array_t<double,py::array::c_style|py::array::forcecast> &queries,
+                          double radius,
+                          int numThreads,
+                          const std::string &order,
+                          int packetSize);
     
     /*! returns a list with all key:value pairs with the given box */
     std::vector<std::pair<std::vector<double>,py::object>>
@@ -74,21 +187,291 @@ namespace pyq {
     // all_values_in_radius(const std::vector<double> &coords,
     //                      double radius);
     
-    /*! build kd-tree - MUST be done before querying anything */
-    void build();
+    /*! how the "top_down" build decides where to split a node */
+    typedef enum {
+      /*! widest dimension, at the point closest to its middle */
+      MIDPOINT_ITEM,
+      /*! widest dimension, at the median point */
+      MEDIAN,
+      /*! widest dimension of the node's cell, in its middle, but
+          slid towards the points if they're all on one side */
+      SLIDING_MIDPOINT,
+      /*! best of a set of candidate planes according to a cost model
+          of how many points a query has to visit */
+      COST_MODEL
+    } SplitStrategy;
+
+    /*! how the coordinates scanned by queries get stored */
+    typedef enum {
+      /*! as a full copy (see leafCoords) */
+      LEAF_COMPRESSION_NONE,
+      /*! as 8- or 16-bit codes relative to each node's bounds, see
+          LeafCodes.cpp */
+      LEAF_COMPRESSION_U8,
+      LEAF_COMPRESSION_U16
+    } LeafCompression;
+
+    /*! smallest leaf size that leaf compression can be used with:
+        for smaller leaves each node's lo/step values cost about as
+        much as its codes save (and with a leaf size of 1 there is no
+        copy of the coordinates to compress in the first place) */
+    enum { MIN_COMPRESSED_LEAF_SIZE = 8 };
+    
+    /*! build kd-tree - MUST be done before querying anything. Method
+        is either "top_down" (recursively splitting nodes according
+        to the given split strategy, see SplitStrategy), or "morton"
+        (for up to 3-dimensional data only: sorts the points along a
+        Morton curve, using 'numThreads' threads, and derives the
+        hierarchy from that order). Nodes with at most 'leafSize'
+        points become leaves, whose points then get scanned with the
+        SIMD kernels in LeafKernels.h. 'labels' optionally assigns an
+        int32 label to each data point (in order of add()), by which
+        kNN() can then filter; if None, the previous labels are kept
+        as long as no points got added since. 'leafCompression'
+        ("none", "u8", or "u16") selects how the coordinates that
+        queries scan get stored (see LeafCompression), and requires
+        a leaf size of at least MIN_COMPRESSED_LEAF_SIZE; unlike the
+        other options, this also applies to an already built tree
+        (which keeps the leaf size it got built with) */
+    void build(const std::string &method="top_down",
+               int numThreads=0,
+               const std::string &splitStrategy="midpoint_item",
+               int leafSize=1,
+               const py::object &labels=py::none(),
+               const std::string &leafCompression="none");
+
+    /*! same as above, but keeps the current labels (as long as no
+        points got added since); touches no python objects, so this
+        can run without holding the GIL (see StreamBuilder) */
+    void build(const std::string &method,
+               int numThreads,
+               const std::string &splitStrategy,
+               int leafSize,
+               const std::string &leafCompression);
+
+    /*! writes the built tree (and, if requested, its values) into a
+        binary file that load() can later memory-map */
+    void save(const std::string &fileName, bool includeValues);
+
+    /*! loads a tree previously written by save(); if 'useMMap' is
+        true the file's node, item and point arrays get used in-place
+        rather than being read into memory */
+    static SP load(const std::string &fileName, bool useMMap);
+
+    /*! writes this (built) tree into a newly created shared-memory
+        segment of the given name, from which other processes can
+        then attachSharedMemory() it. Afterwards this tree itself
+        uses the segment's memory, too, so there is only one copy of
+        the tree's arrays across all processes */
+    void exportSharedMemory(const std::string &name, bool includeValues);
+
+    /*! creates a (read-only) tree that uses the shared-memory segment
+        written by exportSharedMemory() in-place */
+    static SP attachSharedMemory(const std::string &name);
+    
+    /*! returns this tree as a single blob of bytes, in the same
+        format that save() writes (for unbuilt trees: only their
+        points and values, which unpickle as an unbuilt tree); this
+        is what __getstate__ returns */
+    py::bytes getState();
+
+    /*! creates a tree from a blob returned by getState(); the tree
+        will use that blob's memory in-place */
+    static SP fromState(const py::bytes &state);
+
+    /*! implements python's __reduce_ex__: for pickle protocol 5 or
+        newer the state is a tuple (header, buffers, values), in which
+        all of the tree's arrays (see forEachSection()) get passed as
+        out-of-band pickle buffers (see fromBuffers()); for older
+        protocols, and for trees that are not built, it's what
+        getState() returns */
+    py::tuple reduceEx(int protocol);
+
+    /*! re-creates a pickled tree from the header, buffers, and
+        values generated by reduceEx(); buffers get used in-place
+        wherever possible */
+    static SP fromBuffers(const py::bytes &header,
+                          const py::tuple &buffers,
+                          const py::object &values);
+
+    /*! number of data points in this tree */
+    inline size_t numPoints() const
+    { return (singlePrecision ? pointsFloat.size() : points.size()) / K; }
 
   private:
-    struct Node {
-      typedef std::shared_ptr<Node> SP;
+    friend struct StreamBuilder;
+    friend struct RangeIterator;
+    friend struct NearestIterator;
+    
+    int buildRec(std::vector<int> &objectIDs,
+                 const Box &cell,
+                 SplitStrategy strategy,
+                 double queryRadius,
+                 int leafSize);
+
+    /*! computes the split plane for the SLIDING_MIDPOINT strategy */
+    void chooseSlidingMidpointSplit(const std::vector<int> &items,
+                                    const Box &cell,
+                                    const Box &bounds,
+                                    int &splitDim, double &splitPos);
+
+    /*! computes the split plane for the COST_MODEL strategy */
+    void chooseCostModelSplit(const std::vector<int> &items,
+                              const Box &cell,
+                              const Box &bounds,
+                              double queryRadius,
+                              int &splitDim, double &splitPos);
+
+    /*! builds the tree by sorting the points along a Morton curve,
+        and emitting the hierarchy from the split bits of the sorted
+        codes (see MortonBuild.cpp) */
+    void buildMorton(int numThreads, int leafSize);
+
+    /*! returns the order in which to process a batch of query
+        points, as a list of indices into that batch */
+    std::vector<int> queryOrder(const double *queries,
+                                size_t numQueries,
+                                QueryOrder order,
+                                int numThreads) const;
 
-      int splitDim;
-      
-      std::vector<int>      items;
-      Node::SP              lChild,rChild;
+    /*! scratch space for a thread running queries, so that running
+        many queries doesn't allocate anything */
+    struct QueryScratch {
+      QueryScratch(int K) : stack(K), lower(K), upper(K) {}
+      CellStack            stack;
+      std::vector<double>  lower, upper;
+      /*! per data point of the current node */
+      std::vector<double>  dist2;
+      std::vector<uint8_t> inside;
+      /*! per query of the current packet */
+      std::vector<double>  packet, packetDist2;
+      std::vector<std::vector<std::pair<double,int>>> packetResults;
     };
+    
+    /*! finds the (up to) k closest data points within sqrt(maxRadius2)
+        of the query point, and writes them into heap[0..k), sorted by
+        (squared distance, pointID); returns how many were found.
+        Requires prepareLeafCoords() */
+    int kNNQuery(const double *query, int k, double maxRadius2,
+                 std::pair<double,int> *heap,
+                 QueryScratch &scratch) const;
+
+    /*! appends (squared distance, pointID) of all data points within
+        sqrt(radius2) of the query point to 'result'; see kNNQuery() */
+    void radiusQuery(const double *query, double radius2,
+                     std::vector<std::pair<double,int>> &result,
+                     QueryScratch &scratch) const;
+
+    /*! traverses the tree with a whole packet of queries at once: a
+        node gets visited if any query in the packet still needs it
+        (ie, its cell is within sqrt(maxDist2[i]) of query i), and
+        then calls visitPoints(i,node) for every such query (which
+        may shrink maxDist2[i]). Which queries need a node gets
+        decided with the SIMD kernels, over the packet's queries in
+        SoA layout; see BatchQueries.cpp */
+    template<typename VisitPoints>
+    void tracePacket(const double *const *queries, int numQueries,
+                     double *maxDist2,
+                     QueryScratch &scratch,
+                     const VisitPoints &visitPoints) const;
+
+    /*! same as kNNQuery(), for a packet of queries; the results of
+        query i go to heaps[i*k..), their number to found[i] */
+    void kNNPacket(const double *const *queries, int numQueries,
+                   int k, double maxRadius2,
+                   std::pair<double,int> *heaps, int *found,
+                   QueryScratch &scratch) const;
+
+    /*! same as radiusQuery(), for a packet of queries; the results of
+        query i get appended to results[i] */
+    void radiusPacket(const double *const *queries, int numQueries,
+                      double radius2,
+                      std::vector<std::pair<double,int>> *results,
+                      QueryScratch &scratch) const;
+    
+    /*! makes sure leafCoords (or, for compressed trees, leafCodes)
+        is up to date with the (built) tree; has to be called before
+        any query that uses the leaf kernels, and while holding the
+        GIL */
+    void prepareLeafCoords();
+
+    /*! returns the metric of the given name, and throws an
+        exception if kNN queries do not support it */
+    static Metric parseKNNMetric(const std::string &name);
+    
+    /*! makes sure subtreeBounds and pointNorms are up to date with
+        the (built) tree; has to be called before any
+        similarityQuery(), and while holding the GIL */
+    void prepareSimilarityBounds();
+    
+    /*! finds the (up to) k data points with the largest cosine
+        similarity (for COSINE) or dot product (for INNER_PRODUCT)
+        with the query point, and writes them into heap[0..k) as
+        (-similarity, pointID), sorted; returns how many were
+        found. Subtrees get visited best-first by an upper bound of
+        the similarity over their bounding box. If wantedLabels is
+        not null only points with one of these (sorted) labels count,
+        and subtrees whose labelMasks do not intersect wantedMask get
+        skipped. See SimilarityQueries.cpp */
+    int similarityQuery(const double *query, int k, Metric metric,
+                        const std::vector<int32_t> *wantedLabels,
+                        uint64_t wantedMask,
+                        std::pair<double,int> *heap) const;
+
+    /*! computes leafCodes, leafQuant, and leafQuantIndex, see
+        LeafCodes.cpp */
+    void prepareLeafCodes();
 
-    Node::SP buildRec(std::vector<int> &objectIDs);
+    /*! nodeSqrDistances() for compressed trees */
+    void codedSqrDistances(const Node &node, const double *query,
+                           double maxDist2, double *dist2) const;
 
+    /*! nodeInBox() for compressed trees */
+    int codedInBox(const Node &node,
+                   const double *lower, const double *upper,
+                   uint8_t *inside) const;
+
+    /*! computes the squared distances of all data points of given
+        node to 'query', using the given leaf kernels on the node's
+        SoA coordinates (see leafCoords), or reading its points from
+        points[] for trees without those. Distances of points further
+        than sqrt(maxDist2) may be replaced by any value > maxDist2 */
+    inline void nodeSqrDistances(const LeafKernels &kernels, const Node &node,
+                                 const double *query, double maxDist2,
+                                 double *dist2) const
+    {
+      const size_t offset = size_t(node.begin)*K;
+      if (leafCompression != LEAF_COMPRESSION_NONE)
+        codedSqrDistances(node,query,maxDist2,dist2);
+      else if (leafSize == 1 && singlePrecision)
+        gatherSqrDistances(pointsFloat.data(),itemIDs.data()+node.begin,node.count,K,query,dist2);
+      else if (leafSize == 1)
+        gatherSqrDistances(points.data(),itemIDs.data()+node.begin,node.count,K,query,dist2);
+      else if (singlePrecision)
+        leafKernelsFor(kernels,node.count).sqrDistancesFloat(leafCoordsFloat.data()+offset,node.count,K,query,dist2);
+      else
+        leafKernelsFor(kernels,node.count).sqrDistances(leafCoords.data()+offset,node.count,K,query,dist2);
+    }
+
+    /*! determines which data points of given node are inside the box
+        [lower,upper], see nodeSqrDistances() */
+    inline int nodeInBox(const LeafKernels &kernels, const Node &node,
+                         const double *lower, const double *upper,
+                         uint8_t *inside) const
+    {
+      const size_t offset = size_t(node.begin)*K;
+      if (leafCompression != LEAF_COMPRESSION_NONE)
+        return codedInBox(node,lower,upper,inside);
+      else if (leafSize == 1 && singlePrecision)
+        return gatherInBox(pointsFloat.data(),itemIDs.data()+node.begin,node.count,K,lower,upper,inside);
+      else if (leafSize == 1)
+        return gatherInBox(points.data(),itemIDs.data()+node.begin,node.count,K,lower,upper,inside);
+      else if (singlePrecision)
+        return leafKernelsFor(kernels,node.count).inBoxFloat(leafCoordsFloat.data()+offset,node.count,K,lower,upper,inside);
+      else
+        return leafKernelsFor(kernels,node.count).inBox(leafCoords.data()+offset,node.count,K,lower,upper,inside);
+    }
+    
     /*! checks that tree is built, and throws an exception if not */
     void verifyTreeIsBuilt();
     
@@ -97,18 +480,219 @@ namespace pyq {
       throws an exception if thi sis not the case */
     Coords makeCheckCoords(const std::vector<double> &);
 
-    /*! one entry per input data point, containing the coordinates of each data point */
-    std::vector<Coords>     coords;
+    /*! computes the (tight) bounding boxes of all nodes' data
+        points: for each node 4*K values, namely the lower and upper
+        coordinates of the points in its subtree, followed by those
+        of the points stored in the node itself (which is an inverted
+        box if there are none) */
+    std::vector<double> computeNodeBounds() const;
+    
+    /*! appends the indices of all data points with exactly the given
+        coordinates to 'items' (in unspecified order), using the hash
+        index if there is one, and the tree otherwise; for
+        single-precision trees the coordinates get rounded first */
+    void findItems(const double *coords, std::vector<int> &items) const;
+    
+    /*! computes labelMasks[] from labels[] for the built tree */
+    void computeLabelMasks();
+
+    /*! returns the bit that represents given label in labelMasks[] */
+    static inline uint64_t labelBit(int32_t label)
+    { return uint64_t(1) << (uint32_t(label) & 63); }
+    
+    /*! returns coordinate d of the given data point */
+    inline double pointCoord(int item, int d) const
+    {
+      const size_t i = size_t(item)*K+d;
+      return singlePrecision ? double(pointsFloat[i]) : points[i];
+    }
+    
+    /*! returns the coordinates of the given data point: for
+        double-precision trees the stored ones, for single-precision
+        trees those converted to double in 'buffer' (which has to
+        have room for K values) */
+    inline const double *pointCoords(int item, double *buffer) const
+    {
+      if (!singlePrecision)
+        return points.data()+size_t(item)*K;
+      const float *point = pointsFloat.data()+size_t(item)*K;
+      std::copy(point,point+K,buffer);
+      return buffer;
+    }
+
+    /*! returns the coordinates of given data point as a std::vector */
+    inline std::vector<double> pointVector(int item) const
+    {
+      std::vector<double> result(K);
+      for (int d=0;d<K;d++)
+        result[d] = pointCoord(item,d);
+      return result;
+    }
+
+    /*! returns the squared distance between given data point and
+        'query', computed as sqrDistance() (Coords.h) does */
+    inline double pointSqrDistance(int item, const double *query) const
+    {
+      double res = 0.;
+      for (int d=0;d<K;d++) {
+        const double diff = pointCoord(item,d) - query[d];
+        res += diff*diff;
+      }
+      return res;
+    }
+
+    /*! returns whether two data points have the same coordinates */
+    inline bool samePoints(int a, int b) const
+    {
+      for (int d=0;d<K;d++)
+        if (pointCoord(a,d) != pointCoord(b,d)) return false;
+      return true;
+    }
+
+    /*! returns the value of the given data point; for trees that
+        were loaded without values this is the point's index */
+    py::object value(int item) const;
+
+    /*! marks the tree as no longer built, and makes sure all arrays
+        are writable (ie, not referring to any mapped memory) */
+    void invalidate();
+    
+    /*! returns the tree's values, pickled as one python list, or an
+        empty string if there are none (or they are not requested) */
+    std::string pickleValues(bool includeValues);
+    
+    /*! writes this tree (only its points, if it is not built) in
+        the format described in FileFormat.h to the given stream */
+    void serialize(std::ostream &out, bool includeValues);
+
+    /*! writes this tree (only its points, if it is not built), with
+        the given (already pickled) values, in the format described
+        in FileFormat.h to the given stream */
+    void serialize(std::ostream &out, const std::string &pickledValues);
+    
+    /*! sets the tree's content from the given serialized tree (in
+        the format written by save()), starting at 'base'. If
+        'keepAlive' is non-null the tree's arrays will refer to this
+        memory in-place, and keep 'keepAlive' alive for as long as
+        they do; otherwise this memory gets copied */
+    void deserialize(const char *base, size_t numBytes,
+                     std::shared_ptr<void> keepAlive);
+
+    /*! returns the header (see FileFormat.h) for serializing this
+        tree with pickled values of the given size; this first makes
+        sure the tree's leafCoords are up to date, so they get stored
+        as well */
+    FileHeader fileHeader(size_t valuesSize);
+
+    /*! calls lambda(array, section) for each of the tree's arrays
+        that get stored as their own section of a serialized tree
+        (see FileFormat.h), in file order */
+    template<typename Lambda>
+    void forEachSection(const FileHeader &header, const Lambda &lambda);
+    
+    /*! checks that the nodes and itemIDs (as read by deserialize()
+        or fromBuffers()) only refer to valid nodes, items, and
+        dimensions, so that a corrupt file or buffer gets reported
+        rather than causing out-of-bounds accesses; throws an
+        exception if not */
+    void checkStructure() const;
     
-    /*! one entry per input data point, containing the value for the given data point */
+    /*! N*K entries, containing the coordinates of each input data
+        point; empty for single-precision trees, which store these
+        in pointsFloat instead */
+    Array<double>           points;
+
+    /*! for single-precision trees: same as points (which then
+        remains empty), in single precision */
+    Array<float>            pointsFloat;
+    
+    /*! one entry per input data point, containing the value for the
+        given data point; may be empty if the tree got loaded without
+        values */
     std::vector<py::object> objects;
     
-    /*! the root of the kd-tree, if built; or {} if not */
-    Node::SP                root;
+    /*! the nodes of the kd-tree, root first; empty if the tree has no
+        data */
+    Array<Node>             nodes;
+
+    /*! the IDs of the data points referenced by the nodes */
+    Array<int>              itemIDs;
+
+    /*! one label per data point (in order of add()) as passed to
+        build(), or empty if the tree has no labels. These do not get
+        saved, pickled, or shared */
+    std::vector<int32_t>    labels;
+
+    /*! if the tree has labels, one entry per node: a bit mask that
+        has labelBit(l) set for every label l of the data points in
+        that node's subtree, so kNN() can skip subtrees that cannot
+        contain any of the requested labels */
+    std::vector<uint64_t>   labelMasks;
+
+    /*! the coordinates of the data points in the order of itemIDs[],
+        with each node's points stored in SoA layout (see
+        LeafKernels.h): node n's x coordinates start at
+        n.begin*K, followed by its y coordinates at
+        n.begin*K+n.count, etc. This is derived from the other arrays
+        (lazily, by prepareLeafCoords()), but gets saved and shared
+        along with them, so loaded trees can use it in-place. Trees
+        with a leafSize of 1 do not have this copy: their leaves
+        hardly ever have more than one point, so queries read those
+        from points[] (or pointsFloat[]) directly */
+    Array<double>           leafCoords;
+    
+    /*! for single-precision trees: same as leafCoords (which then
+        remains empty), in single precision */
+    Array<float>            leafCoordsFloat;
+
+    /*! how the coordinates scanned by queries get stored; with
+        compression, leafCoords[Float] remain empty, and there are
+        leafCodes and leafQuant instead */
+    LeafCompression         leafCompression = LEAF_COMPRESSION_NONE;
+
+    /*! the compressed coordinates of the data points, in the same
+        order and layout as leafCoords, as uint8 or uint16 codes */
+    Array<uint8_t>          leafCodes;
+    
+    /*! for each node that has points 2*K values: the lower bounds of
+        its points' coordinates, followed by the step sizes of their
+        codes */
+    Array<float>            leafQuant;
+
+    /*! for each node, the index of its values in leafQuant (in units
+        of 2*K), or -1 if it has no points */
+    Array<int32_t>          leafQuantIndex;
+    
+    /*! for each node 2*K values, the lower and upper coordinates of
+        the points in its subtree; only used (and lazily computed) by
+        similarityQuery() */
+    std::vector<double>     subtreeBounds;
+
+    /*! the L2 norm of every data point (in order of add()); only
+        used (and lazily computed) by similarityQuery() */
+    std::vector<double>     pointNorms;
+    
+    /*! exact-match index over the points, if enableHashIndex() got
+        called; unlike the tree this does not get invalidated by add() */
+    HashIndex               hashIndex;
+    bool                    hasHashIndex = false;
+    
+    /*! gets incremented whenever the tree gets invalidated, so that
+        anything referring to its nodes (eg, a RangeIterator) can
+        tell that they're gone */
+    uint64_t                version = 0;
+    
+    /*! whether the tree is currently built */
+    bool                    isBuilt = false;
+
+    /*! the leafSize the tree got (last) built with */
+    int                     leafSize = 1;
     
     /*! the number of dimensions */
     const int K;
+
+    /*! whether this tree got created with dtype "float32" */
+    const bool singlePrecision;
   };
   
-}
-
+}
\ No newline at end of file
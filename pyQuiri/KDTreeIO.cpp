@@ -0,0 +1,471 @@
+// ======================================================================== //
+// Copyright 2022-2022 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "pyQuiri/KDTree.h"
+#include "pyQuiri/FileFormat.h"
+#include "pyQuiri/MappedFile.h"
+#include "pyQuiri/SharedMemory.h"
+#include <fstream>
+#include <string.h>
+
+namespace pyq {
+
+  /*! sanity-checks the header of a serialized tree (other than
+      whether its sections fit into the file); throws an exception
+      if this does not look like a valid tree */
+  static void checkHeader(const FileHeader &header)
+  {
+    if (memcmp(header.magic,FILE_MAGIC,sizeof(FILE_MAGIC)) != 0)
+      throw std::runtime_error("pyQuiri: not a pyQuiri kd-tree file (wrong magic number)");
+    if (header.endianTag != FileHeader::ENDIAN_TAG)
+      throw std::runtime_error("pyQuiri: kd-tree file was written on a machine with different byte order");
+    if (header.version != FileHeader::CURRENT_VERSION)
+      throw std::runtime_error("pyQuiri: unsupported kd-tree file version "
+                               +std::to_string(header.version));
+
+    // (keeps the expected section sizes below from overflowing)
+    if (header.K == 0 || header.K > (1u<<20) ||
+        header.numPoints > (uint64_t)std::numeric_limits<int32_t>::max() ||
+        header.numNodes > (uint64_t)std::numeric_limits<int32_t>::max())
+      throw std::runtime_error("pyQuiri: corrupt or truncated kd-tree file");
+
+    auto checkSize = [&](const FileHeader::Section &section, uint64_t expectedSize) {
+      if (section.size != expectedSize)
+        throw std::runtime_error("pyQuiri: corrupt or truncated kd-tree file");
+    };
+    const uint64_t numCoords = header.numPoints*header.K;
+    const uint64_t coordSize
+      = (header.flags & FileHeader::SINGLE_PRECISION) ? sizeof(float) : sizeof(double);
+    checkSize(header.points,numCoords*coordSize);
+    const bool isBuilt = !(header.flags & FileHeader::UNBUILT);
+    if (isBuilt ? header.leafSize < 1 : header.numNodes != 0)
+      throw std::runtime_error("pyQuiri: corrupt or truncated kd-tree file");
+    checkSize(header.itemIDs,isBuilt ? header.numPoints*sizeof(int) : 0);
+    checkSize(header.nodes,header.numNodes*sizeof(KDTree::Node));
+    if (header.leafCompression > KDTree::LEAF_COMPRESSION_U16)
+      throw std::runtime_error("pyQuiri: corrupt or truncated kd-tree file");
+    const bool isCompressed = header.leafCompression != KDTree::LEAF_COMPRESSION_NONE;
+    // leafCoords are optional (and only used with leafSize > 1)
+    const bool hasLeafCoords
+      = isBuilt && !isCompressed && header.leafSize > 1 && header.leafCoords.size;
+    checkSize(header.leafCoords,hasLeafCoords ? numCoords*coordSize : 0);
+    // and so are compressed leaves, of which leafQuant only has
+    // entries for nodes with points (see checkStructure())
+    const bool hasLeafCodes = isBuilt && isCompressed && header.leafQuantIndex.size;
+    const uint64_t codeSize
+      = header.leafCompression == KDTree::LEAF_COMPRESSION_U8 ? 1 : 2;
+    const uint64_t quantSize = 2*header.K*sizeof(float);
+    checkSize(header.leafCodes,hasLeafCodes ? numCoords*codeSize : 0);
+    checkSize(header.leafQuantIndex,hasLeafCodes ? header.numNodes*sizeof(int32_t) : 0);
+    if ((header.leafQuant.size % quantSize) != 0 ||
+        header.leafQuant.size > (hasLeafCodes ? header.numNodes*quantSize : 0))
+      throw std::runtime_error("pyQuiri: corrupt or truncated kd-tree file");
+  }
+
+  /*! creates an empty tree with the dimensionality and dtype of the
+      given (checked) header */
+  static KDTree::SP createTree(const FileHeader &header)
+  {
+    return KDTree::create(header.K,(header.flags & FileHeader::SINGLE_PRECISION)
+                          ? "float32" : "float64");
+  }
+  
+  /*! reads and sanity-checks the header of a serialized tree;
+      throws an exception if this does not look like a valid tree */
+  static FileHeader readHeader(const char *base, size_t numBytes)
+  {
+    FileHeader header;
+    if (numBytes < sizeof(header))
+      throw std::runtime_error("pyQuiri: not a pyQuiri kd-tree file (file too small)");
+    memcpy(&header,base,sizeof(header));
+    checkHeader(header);
+    for (const FileHeader::Section *section : { &header.points, &header.itemIDs,
+                                                &header.nodes, &header.leafCoords,
+                                                &header.leafCodes, &header.leafQuant,
+                                                &header.leafQuantIndex, &header.values })
+      if (section->offset > numBytes || section->size > numBytes - section->offset)
+        throw std::runtime_error("pyQuiri: corrupt or truncated kd-tree file");
+    return header;
+  }
+
+  /*! see KDTree.h */
+  template<typename Lambda>
+  void KDTree::forEachSection(const FileHeader &header, const Lambda &lambda)
+  {
+    if (singlePrecision)
+      lambda(pointsFloat,header.points);
+    else
+      lambda(points,header.points);
+    lambda(itemIDs,header.itemIDs);
+    lambda(nodes,header.nodes);
+    if (singlePrecision)
+      lambda(leafCoordsFloat,header.leafCoords);
+    else
+      lambda(leafCoords,header.leafCoords);
+    lambda(leafCodes,header.leafCodes);
+    lambda(leafQuant,header.leafQuant);
+    lambda(leafQuantIndex,header.leafQuantIndex);
+  }
+
+  /*! returns the header for serializing this tree, see KDTree.h */
+  FileHeader KDTree::fileHeader(size_t valuesSize)
+  {
+    if (isBuilt)
+      prepareLeafCoords();
+    FileHeader header
+      = makeFileHeader(K,numPoints(),isBuilt ? nodes.size() : 0,
+                       sizeof(Node),valuesSize,isBuilt);
+    header.leafSize              = leafSize;
+    header.leafCompression       = leafCompression;
+    header.leafCodes.size        = leafCodes.size();
+    header.leafQuant.size        = leafQuant.size()*sizeof(float);
+    header.leafQuantIndex.size   = leafQuantIndex.size()*sizeof(int32_t);
+    if (singlePrecision) {
+      header.flags          |= FileHeader::SINGLE_PRECISION;
+      header.points.size     = pointsFloat.size()*sizeof(float);
+      header.leafCoords.size = leafCoordsFloat.size()*sizeof(float);
+    } else
+      header.leafCoords.size = leafCoords.size()*sizeof(double);
+    layoutSections(header);
+    return header;
+  }
+
+  /*! see KDTree.h; children always come after their parent (which
+      also rules out cycles) */
+  void KDTree::checkStructure() const
+  {
+    const size_t numItems = itemIDs.size();
+    const size_t numNodes = nodes.size();
+    if (numItems != numPoints() || (numNodes == 0 && numItems != 0))
+      throw std::runtime_error("pyQuiri: corrupt or truncated kd-tree");
+    for (size_t nodeID=0;nodeID<numNodes;nodeID++) {
+      const Node &node = nodes[nodeID];
+      const bool isInner = node.lChild >= 0 || node.rChild >= 0;
+      auto validChild = [&](int32_t child) {
+        return child == -1 || (child > (int64_t)nodeID && size_t(child) < numNodes);
+      };
+      if (node.splitDim < -1 || node.splitDim >= K ||
+          (isInner && node.splitDim < 0) ||
+          !validChild(node.lChild) || !validChild(node.rChild) ||
+          node.begin < 0 || node.count < 0 ||
+          size_t(node.begin)+size_t(node.count) > numItems)
+        throw std::runtime_error("pyQuiri: corrupt or truncated kd-tree");
+    }
+    for (size_t i=0;i<numItems;i++)
+      if (itemIDs[i] < 0 || size_t(itemIDs[i]) >= numItems)
+        throw std::runtime_error("pyQuiri: corrupt or truncated kd-tree");
+    // every node with points needs lo/step values
+    const size_t numQuant = leafQuant.size()/(2*size_t(K));
+    for (size_t nodeID=0;nodeID<leafQuantIndex.size();nodeID++)
+      if (nodes[nodeID].count > 0 &&
+          (leafQuantIndex[nodeID] < 0 || size_t(leafQuantIndex[nodeID]) >= numQuant))
+        throw std::runtime_error("pyQuiri: corrupt or truncated kd-tree");
+  }
+
+  /*! returns the tree's values, pickled as one python list, or an
+    empty string if there are none (or they are not requested) */
+  std::string KDTree::pickleValues(bool includeValues)
+  {
+    if (!includeValues || objects.empty())
+      return {};
+    
+    py::list values;
+    for (auto &object : objects)
+      values.append(object);
+    py::bytes pickled
+      = py::module_::import("pickle").attr("dumps")(values,-1);
+    return pickled;
+  }
+  
+  /*! writes this tree (only its points, if it is not built) in the
+    format described in FileFormat.h to the given stream */
+  void KDTree::serialize(std::ostream &out, bool includeValues)
+  {
+    serialize(out,pickleValues(includeValues));
+  }
+  
+  /*! writes this tree (only its points, if it is not built), with
+    the given (already pickled) values, in the format described in
+    FileFormat.h to the given stream */
+  void KDTree::serialize(std::ostream &out, const std::string &pickledValues)
+  {
+    const FileHeader header = fileHeader(pickledValues.size());
+
+    uint64_t writePos = 0;
+    auto writeSection = [&](const FileHeader::Section &section, const void *data) {
+      static const char zeroes[FILE_SECTION_ALIGNMENT] = { 0 };
+      out.write(zeroes,section.offset-writePos);
+      out.write((const char *)data,section.size);
+      writePos = section.offset+section.size;
+    };
+    out.write((const char *)&header,sizeof(header));
+    writePos = sizeof(header);
+    forEachSection(header,[&](const auto &array, const FileHeader::Section &section) {
+        writeSection(section,array.data());
+      });
+    writeSection(header.values,pickledValues.data());
+    if (!out)
+      throw std::runtime_error("pyQuiri: error writing kd-tree");
+  }
+
+  /*! sets the tree's content from the given serialized tree (in the
+    format written by save()), starting at 'base'. If 'keepAlive' is
+    non-null the tree's arrays will refer to this memory in-place,
+    and keep 'keepAlive' alive for as long as they do; otherwise this
+    memory gets copied */
+  void KDTree::deserialize(const char *base, size_t numBytes,
+                           std::shared_ptr<void> keepAlive)
+  {
+    const FileHeader header = readHeader(base,numBytes);
+    if (header.K != (uint32_t)K ||
+        bool(header.flags & FileHeader::SINGLE_PRECISION) != singlePrecision)
+      throw std::runtime_error("pyQuiri: dimensionality or dtype of serialized kd-tree does not match");
+
+    if (keepAlive && (size_t(base) % alignof(Node)) != 0)
+      // can only use the memory in-place if it's properly aligned
+      keepAlive = {};
+
+    auto setArray = [&](auto &array, const FileHeader::Section &section) {
+      typedef typename std::remove_reference<decltype(array[0])>::type Qualified;
+      typedef typename std::remove_const<Qualified>::type T;
+      const T *begin = (const T *)(base+section.offset);
+      const size_t count = section.size/sizeof(T);
+      if (keepAlive)
+        array.map(begin,count,keepAlive);
+      else
+        array.writable().assign(begin,begin+count);
+    };
+    forEachSection(header,setArray);
+    leafSize        = header.leafSize;
+    leafCompression = (LeafCompression)header.leafCompression;
+    isBuilt         = !(header.flags & FileHeader::UNBUILT);
+    if (isBuilt)
+      checkStructure();
+
+    objects.clear();
+    if (header.flags & FileHeader::HAS_VALUES) {
+      py::bytes pickled(base+header.values.offset,header.values.size);
+      py::list values = py::module_::import("pickle").attr("loads")(pickled);
+      if (values.size() != header.numPoints)
+        throw std::runtime_error("pyQuiri: corrupt or truncated kd-tree file");
+      for (auto value : values)
+        objects.push_back(py::reinterpret_borrow<py::object>(value));
+    }
+  }
+
+  /*! writes the built tree (and, if requested, its values) into a
+    binary file that load() can later memory-map */
+  void KDTree::save(const std::string &fileName, bool includeValues)
+  {
+    // before opening the file, which truncates it
+    verifyTreeIsBuilt();
+    std::ofstream out(fileName,std::ios::binary);
+    if (!out)
+      throw std::runtime_error("pyQuiri: could not open file '"+fileName+"' for writing");
+    serialize(out,includeValues);
+  }
+
+  /*! loads a tree previously written by save(); if 'useMMap' is true
+    the file's node, item and point arrays get used in-place rather
+    than being read into memory */
+  KDTree::SP KDTree::load(const std::string &fileName, bool useMMap)
+  {
+    const char *base = nullptr;
+    size_t numBytes = 0;
+    std::shared_ptr<void> keepAlive;
+    if (useMMap) {
+      MappedFile::SP file = MappedFile::open(fileName);
+      base      = file->data();
+      numBytes  = file->size();
+      keepAlive = file;
+    } else {
+      std::ifstream in(fileName,std::ios::binary|std::ios::ate);
+      if (!in)
+        throw std::runtime_error("pyQuiri: could not open file '"+fileName+"'");
+      // read into a (suitably aligned) buffer that the tree can then
+      // use in-place
+      std::shared_ptr<std::vector<uint64_t>> buffer
+        = std::make_shared<std::vector<uint64_t>>();
+      numBytes = (size_t)in.tellg();
+      buffer->resize((numBytes+sizeof(uint64_t)-1)/sizeof(uint64_t));
+      in.seekg(0);
+      in.read((char *)buffer->data(),numBytes);
+      if (!in)
+        throw std::runtime_error("pyQuiri: error reading file '"+fileName+"'");
+      base      = (const char *)buffer->data();
+      keepAlive = buffer;
+    }
+
+    KDTree::SP tree = createTree(readHeader(base,numBytes));
+    tree->deserialize(base,numBytes,keepAlive);
+    return tree;
+  }
+
+  /*! a stream buffer that writes into a fixed block of memory */
+  struct MemoryStreamBuf : public std::streambuf {
+    MemoryStreamBuf(char *begin, size_t numBytes) { setp(begin,begin+numBytes); }
+  };
+  
+  /*! writes this (built) tree into a newly created shared-memory
+    segment of the given name, from which other processes can then
+    attachSharedMemory() it */
+  void KDTree::exportSharedMemory(const std::string &name, bool includeValues)
+  {
+    verifyTreeIsBuilt();
+    
+    const std::string pickledValues = pickleValues(includeValues);
+    const FileHeader header = fileHeader(pickledValues.size());
+    SharedMemory::SP shm = SharedMemory::create(name,header.fileSize());
+    try {
+      MemoryStreamBuf buffer(shm->data(),shm->size());
+      std::ostream out(&buffer);
+      serialize(out,pickledValues);
+    } catch (...) {
+      SharedMemory::unlink(name);
+      throw;
+    }
+
+    // switch this tree over to the shared copy (but keep our values,
+    // which may not have been exported)
+    std::vector<py::object> values = std::move(objects);
+    deserialize(shm->data(),shm->size(),shm);
+    objects = std::move(values);
+  }
+
+  /*! creates a (read-only) tree that uses the shared-memory segment
+    written by exportSharedMemory() in-place */
+  KDTree::SP KDTree::attachSharedMemory(const std::string &name)
+  {
+    SharedMemory::SP shm = SharedMemory::attach(name);
+    KDTree::SP tree = createTree(readHeader(shm->data(),shm->size()));
+    tree->deserialize(shm->data(),shm->size(),shm);
+    return tree;
+  }
+
+  /*! returns this tree as a single blob of bytes, in the same format
+    that save() writes; unbuilt trees only store their points and
+    values (see FileHeader::UNBUILT), and get unpickled unbuilt */
+  py::bytes KDTree::getState()
+  {
+    std::ostringstream out;
+    serialize(out,true);
+    return py::bytes(out.str());
+  }
+
+  /*! creates a tree from a blob returned by getState(); the tree will
+    use that blob's memory in-place */
+  KDTree::SP KDTree::fromState(const py::bytes &state)
+  {
+    char *base = nullptr;
+    ssize_t numBytes = 0;
+    PyBytes_AsStringAndSize(state.ptr(),&base,&numBytes);
+    
+    KDTree::SP tree = createTree(readHeader(base,numBytes));
+    tree->deserialize(base,numBytes,keepPyObjectAlive(state));
+    return tree;
+  }
+
+  /*! implements python's __reduce_ex__: for pickle protocol 5 or
+    newer the state is the tree's header, its arrays as out-of-band
+    pickle buffers, and its values (see fromBuffers()); for older
+    protocols (and unbuilt trees) this falls back to getState() */
+  py::tuple KDTree::reduceEx(int protocol)
+  {
+    // same as what python does for classes with __getstate__ (and
+    // pybind11's __setstate__ will accept either form of state)
+    py::object newObj = py::module_::import("copyreg").attr("__newobj__");
+    py::tuple  newObjArgs = py::make_tuple(py::type::of<KDTree>());
+    if (protocol < 5 || !isBuilt)
+      return py::make_tuple(newObj,newObjArgs,getState());
+
+    // (the values get passed as a list, rather than pickled into the
+    // state)
+    const FileHeader header = fileHeader(0);
+    py::object pickleBuffer = py::module_::import("pickle").attr("PickleBuffer");
+    py::list buffers;
+    forEachSection(header,[&](auto &array, const FileHeader::Section &) {
+        MemoryRef ref;
+        ref.owner    = array.share();
+        ref.ptr      = array.data();
+        ref.numBytes = array.size()*sizeof(array[0]);
+        buffers.append(pickleBuffer(py::cast(ref)));
+      });
+    py::object values = py::none();
+    if (!objects.empty()) {
+      py::list list;
+      for (auto &object : objects)
+        list.append(object);
+      values = list;
+    }
+    return py::make_tuple(newObj,newObjArgs,
+                          py::make_tuple(py::bytes((const char *)&header,sizeof(header)),
+                                         py::tuple(buffers),
+                                         values));
+  }
+
+  /*! re-creates a pickled tree from the header, buffers, and values
+    generated by reduceEx(); buffers get used in-place wherever
+    possible */
+  KDTree::SP KDTree::fromBuffers(const py::bytes &headerBytes,
+                                 const py::tuple &buffers,
+                                 const py::object &values)
+  {
+    const std::string bytes = headerBytes;
+    FileHeader header;
+    if (bytes.size() != sizeof(header))
+      throw std::runtime_error("pyQuiri: invalid buffer for pickled kd-tree");
+    memcpy(&header,bytes.data(),sizeof(header));
+    checkHeader(header);
+    
+    KDTree::SP tree = createTree(header);
+    size_t numBuffers = 0;
+    auto setArray = [&](auto &array, const FileHeader::Section &section) {
+      typedef typename std::remove_reference<decltype(array[0])>::type Qualified;
+      typedef typename std::remove_const<Qualified>::type T;
+      if (numBuffers >= buffers.size())
+        throw std::runtime_error("pyQuiri: invalid buffer for pickled kd-tree");
+      py::buffer buffer = buffers[numBuffers++];
+      py::buffer_info info = buffer.request();
+      const size_t numBytes = size_t(info.size*info.itemsize);
+      if ((info.ndim > 1) ||
+          (info.ndim == 1 && info.strides[0] != info.itemsize) ||
+          numBytes != section.size)
+        throw std::runtime_error("pyQuiri: invalid buffer for pickled kd-tree");
+      const T *begin = (const T *)info.ptr;
+      const size_t count = numBytes/sizeof(T);
+      if ((size_t(begin) % alignof(T)) == 0)
+        array.map(begin,count,keepPyObjectAlive(buffer));
+      else
+        array.writable().assign(begin,begin+count);
+    };
+    tree->forEachSection(header,setArray);
+    if (numBuffers != buffers.size())
+      throw std::runtime_error("pyQuiri: invalid buffer for pickled kd-tree");
+    tree->leafSize        = header.leafSize;
+    tree->leafCompression = (LeafCompression)header.leafCompression;
+    tree->isBuilt         = !(header.flags & FileHeader::UNBUILT);
+    if (tree->isBuilt)
+      tree->checkStructure();
+    if (!values.is_none()) {
+      for (auto value : py::list(values))
+        tree->objects.push_back(py::reinterpret_borrow<py::object>(value));
+      if (tree->objects.size() != tree->numPoints())
+        throw std::runtime_error("pyQuiri: invalid values for pickled kd-tree");
+    }
+    return tree;
+  }
+
+}
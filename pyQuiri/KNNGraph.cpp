@@ -0,0 +1,178 @@
+// ======================================================================== //
+// Copyright 2022-2022 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "pyQuiri/KDTree.h"
+#include "pyQuiri/LeafKernels.h"
+#include "pyQuiri/parallel.h"
+#include <pybind11/numpy.h>
+#include <algorithm>
+
+namespace pyq {
+
+  /*! number of query points that share one traversal of the tree
+      when computing the kNN graph */
+  static const int KNN_GRAPH_BLOCK_SIZE = 32;
+  
+  /*! Computes the kNN graph by letting blocks of query points
+      traverse the tree together: the data points' order in itemIDs[]
+      keeps each subtree's points together, so consecutive runs of
+      that array form spatially coherent blocks. Each block gets
+      traversed with its bounding box, and a subtree gets culled once
+      its cell is farther away from that box than the current k-th
+      neighbor of *every* query point in the block - so the pruning
+      decisions (and the node and point fetches) get shared across
+      all queries in the block, rather than each query restarting its
+      own search from the root */
+  py::tuple KDTree::knnGraph(int k, int numThreads, bool includeSelf)
+  {
+    verifyTreeIsBuilt();
+    if (k < 1)
+      throw py::value_error("pyQuiri: knn_graph requires k >= 1");
+    
+    const size_t N = numPoints();
+    if (N > (size_t)std::numeric_limits<int>::max())
+      throw std::runtime_error("pyQuiri: knn_graph only supports up to 2^31-1 points");
+    /* every row has the same number of neighbors - k, unless there
+       aren't that many (other) points to begin with */
+    const int rowSize
+      = (int)std::min(size_t(k),includeSelf ? N : (N ? N-1 : 0));
+
+    py::array_t<int64_t> indptr(N+1);
+    py::array_t<int32_t> indices(N*rowSize);
+    py::array_t<double>  distances(N*rowSize);
+    int64_t *outPtr   = indptr.mutable_data();
+    int32_t *outIDs   = indices.mutable_data();
+    double  *outDists = distances.mutable_data();
+    for (size_t i=0;i<=N;i++)
+      outPtr[i] = int64_t(i)*rowSize;
+    if (rowSize == 0)
+      return py::make_tuple(indptr,indices,distances);
+    prepareLeafCoords();
+    const LeafKernels &kernels = leafKernels();
+
+    /* computes the rows of all query points in itemIDs[blockBegin,blockEnd) */
+    auto computeBlock = [&](size_t blockBegin, size_t blockEnd) {
+        const int *queries    = itemIDs.data()+blockBegin;
+        const int  numQueries = int(blockEnd-blockBegin);
+
+        /* the block's query points, and their bounding box */
+        std::vector<double> queryCoords(size_t(numQueries)*K);
+        std::vector<double> blockLower(K,+std::numeric_limits<double>::infinity());
+        std::vector<double> blockUpper(K,-std::numeric_limits<double>::infinity());
+        for (int q=0;q<numQueries;q++) {
+          double *point = queryCoords.data()+size_t(q)*K;
+          for (int d=0;d<K;d++) {
+            point[d] = pointCoord(queries[q],d);
+            blockLower[d] = std::min(blockLower[d],point[d]);
+            blockUpper[d] = std::max(blockUpper[d],point[d]);
+          }
+        }
+        
+        /* per query a max-heap of (squared distance,pointID) of the
+           closest points found so far, and the squared distance a
+           new point has to beat to get in */
+        typedef std::pair<double,int> Neighbor;
+        std::vector<Neighbor> heaps(size_t(numQueries)*rowSize);
+        std::vector<int>      heapSizes(numQueries,0);
+        std::vector<double>   maxDist2(numQueries,std::numeric_limits<double>::infinity());
+        double blockMaxDist2 = std::numeric_limits<double>::infinity();
+        
+        std::vector<double> lower(K), upper(K), dist2;
+        CellStack stack(K);
+        stack.pushRoot();
+        while (!stack.empty()) {
+          double cellDist2;
+          const int nodeID = stack.pop(lower.data(),upper.data(),&cellDist2);
+          // the bound may have shrunk since this got pushed
+          if (cellDist2 > blockMaxDist2) continue;
+          
+          const Node &node = nodes[nodeID];
+          bool boundChanged = false;
+          if (node.count > (int)dist2.size())
+            dist2.resize(node.count);
+          for (int q=0;q<numQueries && node.count > 0;q++) {
+            const double *query = queryCoords.data()+size_t(q)*K;
+            if (sqrDistance(lower.data(),upper.data(),query,K) > maxDist2[q])
+              continue;
+            nodeSqrDistances(kernels,node,query,maxDist2[q],dist2.data());
+            Neighbor *heap = heaps.data()+size_t(q)*rowSize;
+            int &heapSize = heapSizes[q];
+            for (int i=0;i<node.count;i++) {
+              if (dist2[i] > maxDist2[q]) continue;
+              const int item = itemIDs[node.begin+i];
+              if (!includeSelf && item == queries[q]) continue;
+              const Neighbor candidate(dist2[i],item);
+              if (heapSize < rowSize) {
+                heap[heapSize++] = candidate;
+                std::push_heap(heap,heap+heapSize);
+              } else if (candidate < heap[0]) {
+                std::pop_heap(heap,heap+heapSize);
+                heap[heapSize-1] = candidate;
+                std::push_heap(heap,heap+heapSize);
+              } else
+                continue;
+              if (heapSize == rowSize) {
+                maxDist2[q] = heap[0].first;
+                boundChanged = true;
+              }
+            }
+          }
+          if (boundChanged)
+            blockMaxDist2 = *std::max_element(maxDist2.begin(),maxDist2.end());
+          
+          if (node.splitDim < 0) continue;
+
+          /* push the children, farther one first so the closer one
+             gets traversed first */
+          const int    dim   = node.splitDim;
+          const double saved[2] = { lower[dim], upper[dim] };
+          upper[dim] = node.splitPos;
+          const double lDist2
+            = sqrDistance(blockLower.data(),blockUpper.data(),lower.data(),upper.data(),K);
+          upper[dim] = saved[1];
+          lower[dim] = node.splitPos;
+          const double rDist2
+            = sqrDistance(blockLower.data(),blockUpper.data(),lower.data(),upper.data(),K);
+          lower[dim] = saved[0];
+          
+          const bool leftFirst = lDist2 <= rDist2;
+          for (int side=0;side<2;side++) {
+            const bool   pushLeft   = (side == 0) != leftFirst;
+            const int    child      = pushLeft ? node.lChild : node.rChild;
+            const double childDist2 = pushLeft ? lDist2 : rDist2;
+            if (child < 0 || childDist2 > blockMaxDist2) continue;
+            stack.push(child,lower.data(),upper.data(),dim,node.splitPos,pushLeft,childDist2);
+          }
+        }
+
+        for (int q=0;q<numQueries;q++) {
+          Neighbor *heap = heaps.data()+size_t(q)*rowSize;
+          std::sort_heap(heap,heap+heapSizes[q]);
+          const size_t row = size_t(queries[q])*rowSize;
+          for (int j=0;j<rowSize;j++) {
+            outIDs[row+j]   = heap[j].second;
+            outDists[row+j] = sqrt(heap[j].first);
+          }
+        }
+      };
+    {
+      py::gil_scoped_release noGIL;
+      parallel_for_blocked(N,KNN_GRAPH_BLOCK_SIZE,numThreads,computeBlock);
+    }
+    return py::make_tuple(indptr,indices,distances);
+  }
+  
+} // ::pyq
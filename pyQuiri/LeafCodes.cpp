@@ -0,0 +1,249 @@
+// ======================================================================== //
+// Copyright 2022-2022 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "pyQuiri/KDTree.h"
+
+/* compressed leaf coordinates: instead of a full copy of its points'
+   coordinates, each node stores, per dimension, the lower bound 'lo'
+   of its points and a step size 'step' that splits their extent into
+   2^8 or 2^16 equal intervals; each coordinate then gets stored as
+   the (8- or 16-bit) index 'c' of the interval [lo+c*step,
+   lo+(c+1)*step] that contains it. Scans first compute lower bounds
+   on the points' distances from these intervals, and only fetch the
+   exact coordinates (from the points[] array, which may well be
+   memory-mapped) for points whose bound survives. 'lo' and 'step'
+   get stored in single precision (and only for nodes that have
+   points), but all decoding happens in double */
+
+namespace pyq {
+
+  /*! lower end of the interval of code c */
+  static inline double decodeLower(double lo, double step, double c)
+  { return lo+c*step; }
+  
+  /*! upper end of the interval of code c */
+  static inline double decodeUpper(double lo, double step, double c)
+  { return lo+(c+1.)*step; }
+
+  /*! encodes all points of given node (with given, already computed
+      lo/step values) into 'codes' (in SoA layout). Codes get picked
+      such that each point is guaranteed to lie within its decoded
+      interval (as computed by decodeLower/Upper(), ie, including
+      floating-point rounding) */
+  template<typename Code, typename T>
+  static void encodeNode(const KDTree::Node &node,
+                         const int *itemIDs,
+                         const T *points,
+                         int K,
+                         const float *quant,
+                         Code *codes)
+  {
+    const double maxCode = std::numeric_limits<Code>::max();
+    for (int d=0;d<K;d++) {
+      const double lo = quant[d], step = quant[K+d];
+      for (int i=0;i<node.count;i++) {
+        const double x = points[size_t(itemIDs[node.begin+i])*K+d];
+        double c = 0.;
+        if (step > 0.) {
+          c = std::min(std::max(floor((x-lo)/step),0.),maxCode);
+          while (c > 0. && decodeLower(lo,step,c) > x) c -= 1.;
+          while (c < maxCode && decodeUpper(lo,step,c) < x) c += 1.;
+        }
+        codes[size_t(d)*node.count+i] = (Code)c;
+      }
+    }
+  }
+
+  /*! computes the lo/step values of given node, see top of file;
+      'lo' gets rounded down to the next float, and 'step' picked
+      such that the (decoded) intervals still cover all points */
+  template<typename Code, typename T>
+  static void computeQuantization(const KDTree::Node &node,
+                                  const int *itemIDs,
+                                  const T *points,
+                                  int K,
+                                  float *quant)
+  {
+    const float inf = std::numeric_limits<float>::infinity();
+    const double numIntervals = double(std::numeric_limits<Code>::max())+1.;
+    for (int d=0;d<K;d++) {
+      double lo = +std::numeric_limits<double>::infinity();
+      double hi = -std::numeric_limits<double>::infinity();
+      for (int i=0;i<node.count;i++) {
+        const double x = points[size_t(itemIDs[node.begin+i])*K+d];
+        lo = std::min(lo,x);
+        hi = std::max(hi,x);
+      }
+      float loF = (float)lo;
+      if (loF > lo)
+        loF = nextafterf(loF,-inf);
+      float stepF = (float)((hi-loF)/numIntervals);
+      if (stepF < (hi-loF)/numIntervals)
+        stepF = nextafterf(stepF,inf);
+      if (!std::isfinite(loF) || !std::isfinite(hi) || !std::isfinite(stepF))
+        // non-finite coordinates (or ones beyond the range of
+        // floats): NaN intervals, which make every scan fall back to
+        // the exact coordinates
+        loF = stepF = std::numeric_limits<float>::quiet_NaN();
+      else
+        // make sure the last interval includes 'hi' despite rounding
+        while (decodeUpper(loF,stepF,numIntervals-1.) < hi)
+          stepF = nextafterf(stepF,inf);
+      quant[d]   = loF;
+      quant[K+d] = stepF;
+    }
+  }
+
+  /*! see KDTree.h */
+  void KDTree::prepareLeafCodes()
+  {
+    const size_t codeSize = leafCompression == LEAF_COMPRESSION_U8 ? 1 : 2;
+    if (leafCodes.size() == itemIDs.size()*K*codeSize &&
+        leafQuantIndex.size() == nodes.size())
+      return;
+    std::vector<int32_t> &quantIndex = leafQuantIndex.writable();
+    quantIndex.resize(nodes.size());
+    int32_t numQuant = 0;
+    for (size_t nodeID=0;nodeID<nodes.size();nodeID++)
+      quantIndex[nodeID] = nodes[nodeID].count > 0 ? numQuant++ : -1;
+    std::vector<uint8_t> &leafCodes = this->leafCodes.writable();
+    std::vector<float>   &leafQuant = this->leafQuant.writable();
+    leafCodes.resize(itemIDs.size()*K*codeSize);
+    leafQuant.resize(size_t(numQuant)*2*K);
+    auto encode = [&](const auto *points) {
+      for (size_t nodeID=0;nodeID<nodes.size();nodeID++) {
+        const Node &node = nodes[nodeID];
+        if (node.count == 0) continue;
+        float *quant = leafQuant.data()+size_t(quantIndex[nodeID])*2*K;
+        uint8_t *codes = leafCodes.data()+size_t(node.begin)*K*codeSize;
+        if (codeSize == 1) {
+          computeQuantization<uint8_t>(node,itemIDs.data(),points,K,quant);
+          encodeNode(node,itemIDs.data(),points,K,quant,(uint8_t*)codes);
+        } else {
+          computeQuantization<uint16_t>(node,itemIDs.data(),points,K,quant);
+          encodeNode(node,itemIDs.data(),points,K,quant,(uint16_t*)codes);
+        }
+      }
+    };
+    if (singlePrecision)
+      encode(pointsFloat.data());
+    else
+      encode(points.data());
+  }
+
+  /*! computes lower bounds for the squared distances of a node's
+      points to 'query'. Every operation is monotonic in the
+      coordinate it bounds, and terms get summed in the same order as
+      in the exact kernels, so the bounds never exceed the exact
+      (floating-point) distances */
+  template<typename Code>
+  static void lowerBoundSqrDistances(const Code *codes, const float *quant,
+                                     int count, int K,
+                                     const double *query,
+                                     double *dist2)
+  {
+    for (int i=0;i<count;i++)
+      dist2[i] = 0.;
+    for (int d=0;d<K;d++) {
+      const double lo = quant[d], step = quant[K+d], q = query[d];
+      const Code *dimCodes = codes+size_t(d)*count;
+      for (int i=0;i<count;i++) {
+        const double c = dimCodes[i];
+        const double diff
+          = std::max(std::max(decodeLower(lo,step,c)-q,q-decodeUpper(lo,step,c)),0.);
+        dist2[i] += diff*diff;
+      }
+    }
+  }
+  
+  void KDTree::codedSqrDistances(const Node &node, const double *query,
+                                 double maxDist2, double *dist2) const
+  {
+    if (node.count == 0)
+      // (has no lo/step values)
+      return;
+    const size_t nodeID = &node-nodes.data();
+    const float *quant = leafQuant.data()+size_t(leafQuantIndex[nodeID])*2*K;
+    if (leafCompression == LEAF_COMPRESSION_U8)
+      lowerBoundSqrDistances(leafCodes.data()+size_t(node.begin)*K,
+                             quant,node.count,K,query,dist2);
+    else
+      lowerBoundSqrDistances((const uint16_t*)leafCodes.data()+size_t(node.begin)*K,
+                             quant,node.count,K,query,dist2);
+    for (int i=0;i<node.count;i++)
+      // (written such that NaN bounds get refined, too)
+      if (!(dist2[i] > maxDist2))
+        dist2[i] = pointSqrDistance(itemIDs[node.begin+i],query);
+  }
+  
+  /*! classifies a node's points against the box [lower,upper]:
+      inside[i] = 1 if point i's intervals are all inside the box, 0
+      if any is outside, and 2 if that can't be decided from the
+      intervals alone */
+  template<typename Code>
+  static void classifyInBox(const Code *codes, const float *quant,
+                            int count, int K,
+                            const double *lower, const double *upper,
+                            uint8_t *inside)
+  {
+    for (int i=0;i<count;i++)
+      inside[i] = 1;
+    for (int d=0;d<K;d++) {
+      const double lo = quant[d], step = quant[K+d];
+      const Code *dimCodes = codes+size_t(d)*count;
+      for (int i=0;i<count;i++) {
+        if (inside[i] == 0) continue;
+        const double c = dimCodes[i];
+        const double a = decodeLower(lo,step,c), b = decodeUpper(lo,step,c);
+        if (b < lower[d] || a > upper[d])
+          inside[i] = 0;
+        else if (!(a >= lower[d] && b <= upper[d]))
+          inside[i] = 2;
+      }
+    }
+  }
+  
+  int KDTree::codedInBox(const Node &node,
+                         const double *lower, const double *upper,
+                         uint8_t *inside) const
+  {
+    if (node.count == 0)
+      return 0;
+    const size_t nodeID = &node-nodes.data();
+    const float *quant = leafQuant.data()+size_t(leafQuantIndex[nodeID])*2*K;
+    if (leafCompression == LEAF_COMPRESSION_U8)
+      classifyInBox(leafCodes.data()+size_t(node.begin)*K,
+                    quant,node.count,K,lower,upper,inside);
+    else
+      classifyInBox((const uint16_t*)leafCodes.data()+size_t(node.begin)*K,
+                    quant,node.count,K,lower,upper,inside);
+    int numInside = 0;
+    for (int i=0;i<node.count;i++) {
+      if (inside[i] == 2) {
+        const int item = itemIDs[node.begin+i];
+        inside[i] = 1;
+        for (int d=0;d<K;d++) {
+          const double x = pointCoord(item,d);
+          // same (NaN-)semantics as overlaps(Box,...)
+          if (lower[d] > x || upper[d] < x) { inside[i] = 0; break; }
+        }
+      }
+      numInside += inside[i];
+    }
+    return numInside;
+  }
+  
+} // ::pyq
@@ -0,0 +1,412 @@
+// ======================================================================== //
+// Copyright 2022-2022 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "pyQuiri/LeafKernels.h"
+#include <atomic>
+
+/* the SIMD kernels use per-function target attributes, so the rest
+   of the library does not have to be compiled for any particular
+   instruction set; that (and the runtime CPU check) is only
+   available with gcc and clang, on x86-64 */
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+# define PYQ_HAVE_SIMD_KERNELS 1
+# include <immintrin.h>
+#endif
+
+namespace pyq {
+
+  /* the kernels that scan points are templated over how those points
+     are stored (T = double or float); single-precision coordinates
+     get converted to double on load, and from there on everything is
+     computed exactly as for double-precision ones */
+  
+  // ------------------------------------------------------------------
+  // scalar reference kernels; also process the tails of the SIMD ones
+  // ------------------------------------------------------------------
+  
+  template<typename T>
+  static void sqrDistancesScalar(const T *soa, int count, int K,
+                                 const double *query, double *dist2,
+                                 int begin = 0)
+  {
+    for (int i=begin;i<count;i++) {
+      double res = 0.;
+      for (int d=0;d<K;d++) {
+        const double diff = double(soa[size_t(d)*count+i]) - query[d];
+        res += diff*diff;
+      }
+      dist2[i] = res;
+    }
+  }
+  
+  static void boxSqrDistancesScalar(const double *soa, int count, int K,
+                                    const double *lower, const double *upper,
+                                    double *dist2, int begin = 0)
+  {
+    for (int i=begin;i<count;i++) {
+      double res = 0.;
+      for (int d=0;d<K;d++) {
+        const double x = soa[size_t(d)*count+i];
+        const double diff = std::max(lower[d]-x,0.)+std::max(x-upper[d],0.);
+        res += diff*diff;
+      }
+      dist2[i] = res;
+    }
+  }
+  
+  template<typename T>
+  static int inBoxScalar(const T *soa, int count, int K,
+                         const double *lower, const double *upper,
+                         uint8_t *inside, int begin = 0)
+  {
+    int numInside = 0;
+    for (int i=begin;i<count;i++) {
+      bool in = true;
+      for (int d=0;d<K;d++) {
+        const double x = soa[size_t(d)*count+i];
+        // same (NaN-)semantics as overlaps(Box,...)
+        if (lower[d] > x || upper[d] < x) { in = false; break; }
+      }
+      inside[i] = in;
+      numInside += in;
+    }
+    return numInside;
+  }
+
+  template<typename T>
+  static void sqrDistancesScalarKernel(const T *soa, int count, int K,
+                                       const double *query, double *dist2)
+  { sqrDistancesScalar(soa,count,K,query,dist2); }
+  
+  static void boxSqrDistancesScalarKernel(const double *soa, int count, int K,
+                                          const double *lower, const double *upper,
+                                          double *dist2)
+  { boxSqrDistancesScalar(soa,count,K,lower,upper,dist2); }
+  
+  template<typename T>
+  static int inBoxScalarKernel(const T *soa, int count, int K,
+                               const double *lower, const double *upper,
+                               uint8_t *inside)
+  { return inBoxScalar(soa,count,K,lower,upper,inside); }
+
+#if PYQ_HAVE_SIMD_KERNELS
+  // ------------------------------------------------------------------
+  // SSE4: 2 points per instruction
+  // ------------------------------------------------------------------
+
+  __attribute__((target("sse4.1")))
+  static inline __m128d load2(const double *p)
+  { return _mm_loadu_pd(p); }
+  
+  __attribute__((target("sse4.1")))
+  static inline __m128d load2(const float *p)
+  { return _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64((const __m128i *)p))); }
+  
+  template<typename T>
+  __attribute__((target("sse4.1")))
+  static void sqrDistancesSSE4(const T *soa, int count, int K,
+                               const double *query, double *dist2)
+  {
+    int i=0;
+    for (;i+2<=count;i+=2) {
+      __m128d sum = _mm_setzero_pd();
+      for (int d=0;d<K;d++) {
+        const __m128d diff = _mm_sub_pd(load2(soa+size_t(d)*count+i),
+                                        _mm_set1_pd(query[d]));
+        sum = _mm_add_pd(sum,_mm_mul_pd(diff,diff));
+      }
+      _mm_storeu_pd(dist2+i,sum);
+    }
+    sqrDistancesScalar(soa,count,K,query,dist2,i);
+  }
+
+  __attribute__((target("sse4.1")))
+  static void boxSqrDistancesSSE4(const double *soa, int count, int K,
+                                  const double *lower, const double *upper,
+                                  double *dist2)
+  {
+    const __m128d zero = _mm_setzero_pd();
+    int i=0;
+    for (;i+2<=count;i+=2) {
+      __m128d sum = zero;
+      for (int d=0;d<K;d++) {
+        const __m128d x = _mm_loadu_pd(soa+size_t(d)*count+i);
+        const __m128d diff
+          = _mm_add_pd(_mm_max_pd(_mm_sub_pd(_mm_set1_pd(lower[d]),x),zero),
+                       _mm_max_pd(_mm_sub_pd(x,_mm_set1_pd(upper[d])),zero));
+        sum = _mm_add_pd(sum,_mm_mul_pd(diff,diff));
+      }
+      _mm_storeu_pd(dist2+i,sum);
+    }
+    boxSqrDistancesScalar(soa,count,K,lower,upper,dist2,i);
+  }
+  
+  template<typename T>
+  __attribute__((target("sse4.1,popcnt")))
+  static int inBoxSSE4(const T *soa, int count, int K,
+                       const double *lower, const double *upper,
+                       uint8_t *inside)
+  {
+    int numInside = 0;
+    int i=0;
+    for (;i+2<=count;i+=2) {
+      __m128d in = _mm_castsi128_pd(_mm_set1_epi32(-1));
+      for (int d=0;d<K;d++) {
+        const __m128d x = load2(soa+size_t(d)*count+i);
+        in = _mm_and_pd(in,_mm_and_pd(_mm_cmpngt_pd(_mm_set1_pd(lower[d]),x),
+                                      _mm_cmpnlt_pd(_mm_set1_pd(upper[d]),x)));
+      }
+      const int mask = _mm_movemask_pd(in);
+      inside[i]   = mask & 1;
+      inside[i+1] = (mask >> 1) & 1;
+      numInside  += _mm_popcnt_u32(mask);
+    }
+    return numInside + inBoxScalar(soa,count,K,lower,upper,inside,i);
+  }
+  
+  // ------------------------------------------------------------------
+  // AVX2: 4 points per instruction
+  // ------------------------------------------------------------------
+  
+  __attribute__((target("avx2")))
+  static inline __m256d load4(const double *p)
+  { return _mm256_loadu_pd(p); }
+  
+  __attribute__((target("avx2")))
+  static inline __m256d load4(const float *p)
+  { return _mm256_cvtps_pd(_mm_loadu_ps(p)); }
+  
+  template<typename T>
+  __attribute__((target("avx2")))
+  static void sqrDistancesAVX2(const T *soa, int count, int K,
+                               const double *query, double *dist2)
+  {
+    int i=0;
+    for (;i+4<=count;i+=4) {
+      __m256d sum = _mm256_setzero_pd();
+      for (int d=0;d<K;d++) {
+        const __m256d diff = _mm256_sub_pd(load4(soa+size_t(d)*count+i),
+                                           _mm256_set1_pd(query[d]));
+        // no fma, so results are identical to the scalar code
+        sum = _mm256_add_pd(sum,_mm256_mul_pd(diff,diff));
+      }
+      _mm256_storeu_pd(dist2+i,sum);
+    }
+    sqrDistancesScalar(soa,count,K,query,dist2,i);
+  }
+
+  __attribute__((target("avx2")))
+  static void boxSqrDistancesAVX2(const double *soa, int count, int K,
+                                  const double *lower, const double *upper,
+                                  double *dist2)
+  {
+    const __m256d zero = _mm256_setzero_pd();
+    int i=0;
+    for (;i+4<=count;i+=4) {
+      __m256d sum = zero;
+      for (int d=0;d<K;d++) {
+        const __m256d x = _mm256_loadu_pd(soa+size_t(d)*count+i);
+        const __m256d diff
+          = _mm256_add_pd(_mm256_max_pd(_mm256_sub_pd(_mm256_set1_pd(lower[d]),x),zero),
+                          _mm256_max_pd(_mm256_sub_pd(x,_mm256_set1_pd(upper[d])),zero));
+        sum = _mm256_add_pd(sum,_mm256_mul_pd(diff,diff));
+      }
+      _mm256_storeu_pd(dist2+i,sum);
+    }
+    boxSqrDistancesScalar(soa,count,K,lower,upper,dist2,i);
+  }
+  
+  template<typename T>
+  __attribute__((target("avx2,popcnt")))
+  static int inBoxAVX2(const T *soa, int count, int K,
+                       const double *lower, const double *upper,
+                       uint8_t *inside)
+  {
+    int numInside = 0;
+    int i=0;
+    for (;i+4<=count;i+=4) {
+      __m256d in = _mm256_castsi256_pd(_mm256_set1_epi32(-1));
+      for (int d=0;d<K;d++) {
+        const __m256d x = load4(soa+size_t(d)*count+i);
+        in = _mm256_and_pd(in,_mm256_and_pd(_mm256_cmp_pd(_mm256_set1_pd(lower[d]),x,_CMP_NGT_UQ),
+                                            _mm256_cmp_pd(_mm256_set1_pd(upper[d]),x,_CMP_NLT_UQ)));
+      }
+      const int mask = _mm256_movemask_pd(in);
+      for (int j=0;j<4;j++)
+        inside[i+j] = (mask >> j) & 1;
+      numInside += _mm_popcnt_u32(mask);
+    }
+    return numInside + inBoxScalar(soa,count,K,lower,upper,inside,i);
+  }
+
+  // ------------------------------------------------------------------
+  // AVX-512: 8 points per instruction
+  // ------------------------------------------------------------------
+  
+  __attribute__((target("avx512f")))
+  static inline __m512d load8(const double *p)
+  { return _mm512_loadu_pd(p); }
+  
+  __attribute__((target("avx512f")))
+  static inline __m512d load8(const float *p)
+  { return _mm512_cvtps_pd(_mm256_loadu_ps(p)); }
+  
+  template<typename T>
+  __attribute__((target("avx512f")))
+  static void sqrDistancesAVX512(const T *soa, int count, int K,
+                                 const double *query, double *dist2)
+  {
+    int i=0;
+    for (;i+8<=count;i+=8) {
+      __m512d sum = _mm512_setzero_pd();
+      for (int d=0;d<K;d++) {
+        const __m512d diff = _mm512_sub_pd(load8(soa+size_t(d)*count+i),
+                                           _mm512_set1_pd(query[d]));
+        sum = _mm512_add_pd(sum,_mm512_mul_pd(diff,diff));
+      }
+      _mm512_storeu_pd(dist2+i,sum);
+    }
+    sqrDistancesScalar(soa,count,K,query,dist2,i);
+  }
+
+  __attribute__((target("avx512f")))
+  static void boxSqrDistancesAVX512(const double *soa, int count, int K,
+                                    const double *lower, const double *upper,
+                                    double *dist2)
+  {
+    const __m512d zero = _mm512_setzero_pd();
+    int i=0;
+    for (;i+8<=count;i+=8) {
+      __m512d sum = zero;
+      for (int d=0;d<K;d++) {
+        const __m512d x = _mm512_loadu_pd(soa+size_t(d)*count+i);
+        const __m512d diff
+          = _mm512_add_pd(_mm512_max_pd(_mm512_sub_pd(_mm512_set1_pd(lower[d]),x),zero),
+                          _mm512_max_pd(_mm512_sub_pd(x,_mm512_set1_pd(upper[d])),zero));
+        sum = _mm512_add_pd(sum,_mm512_mul_pd(diff,diff));
+      }
+      _mm512_storeu_pd(dist2+i,sum);
+    }
+    boxSqrDistancesScalar(soa,count,K,lower,upper,dist2,i);
+  }
+  
+  template<typename T>
+  __attribute__((target("avx512f,popcnt")))
+  static int inBoxAVX512(const T *soa, int count, int K,
+                         const double *lower, const double *upper,
+                         uint8_t *inside)
+  {
+    int numInside = 0;
+    int i=0;
+    for (;i+8<=count;i+=8) {
+      __mmask8 in = 0xff;
+      for (int d=0;d<K && in;d++) {
+        const __m512d x = load8(soa+size_t(d)*count+i);
+        in = _mm512_mask_cmp_pd_mask(in,_mm512_set1_pd(lower[d]),x,_CMP_NGT_UQ);
+        in = _mm512_mask_cmp_pd_mask(in,_mm512_set1_pd(upper[d]),x,_CMP_NLT_UQ);
+      }
+      for (int j=0;j<8;j++)
+        inside[i+j] = (in >> j) & 1;
+      numInside += _mm_popcnt_u32(in);
+    }
+    return numInside + inBoxScalar(soa,count,K,lower,upper,inside,i);
+  }
+#endif
+
+  // ------------------------------------------------------------------
+  // runtime dispatch
+  // ------------------------------------------------------------------
+
+#define PYQ_LEAF_KERNELS(name,width,isa)                                \
+  { name, width,                                                        \
+    sqrDistances##isa<double>, boxSqrDistances##isa, inBox##isa<double>, \
+    sqrDistances##isa<float>, inBox##isa<float> }
+  
+  /*! all kernels, from slowest to fastest */
+  static const LeafKernels allLeafKernels[] = {
+    PYQ_LEAF_KERNELS("scalar",1,ScalarKernel),
+#if PYQ_HAVE_SIMD_KERNELS
+    PYQ_LEAF_KERNELS("sse4",2,SSE4),
+    PYQ_LEAF_KERNELS("avx2",4,AVX2),
+    PYQ_LEAF_KERNELS("avx512",8,AVX512),
+#endif
+  };
+#undef PYQ_LEAF_KERNELS
+
+  /*! returns whether this CPU can run the given kernels */
+  static bool isSupported(const LeafKernels &kernels)
+  {
+    const std::string name = kernels.name;
+    if (name == "scalar") return true;
+#if PYQ_HAVE_SIMD_KERNELS
+    __builtin_cpu_init();
+    if (name == "sse4")
+      return __builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("popcnt");
+    if (name == "avx2")
+      return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+    if (name == "avx512")
+      return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("popcnt");
+#endif
+    return false;
+  }
+
+  /*! returns the fastest kernels this CPU supports */
+  static const LeafKernels *bestLeafKernels()
+  {
+    const LeafKernels *best = &allLeafKernels[0];
+    for (auto &kernels : allLeafKernels)
+      if (isSupported(kernels)) best = &kernels;
+    return best;
+  }
+  
+  static std::atomic<const LeafKernels *> currentLeafKernels(bestLeafKernels());
+
+  const LeafKernels &scalarLeafKernels()
+  {
+    return allLeafKernels[0];
+  }
+  
+  const LeafKernels &leafKernels()
+  {
+    return *currentLeafKernels.load();
+  }
+
+  void selectLeafKernels(const std::string &name)
+  {
+    if (name == "auto") {
+      currentLeafKernels = bestLeafKernels();
+      return;
+    }
+    for (auto &kernels : allLeafKernels)
+      if (name == kernels.name) {
+        if (!isSupported(kernels))
+          throw std::runtime_error("pyQuiri: this CPU does not support '"+name+"'");
+        currentLeafKernels = &kernels;
+        return;
+      }
+    throw py::value_error("pyQuiri: unknown or unavailable instruction set '"+name+"'");
+  }
+
+  std::vector<std::string> supportedLeafKernels()
+  {
+    std::vector<std::string> result;
+    for (auto &kernels : allLeafKernels)
+      if (isSupported(kernels))
+        result.push_back(kernels.name);
+    return result;
+  }
+  
+} // ::pyq
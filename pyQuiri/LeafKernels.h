@@ -0,0 +1,130 @@
+// ======================================================================== //
+// Copyright 2022-2022 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#pragma once
+
+#include "pyQuiri/common.h"
+
+namespace pyq {
+
+  /*! the kernels that scan all data points of a node, with those
+      points' coordinates given in SoA layout: 'count' x coordinates,
+      then 'count' y coordinates, etc. There is one implementation per
+      instruction set (see LeafKernels.cpp), and the best one that the
+      CPU supports gets picked at runtime. All implementations compute
+      bit-for-bit the same results as the scalar code in Coords.h and
+      Box.h */
+  struct LeafKernels {
+    /*! name of the instruction set: "scalar", "sse4", "avx2", or "avx512" */
+    const char *name;
+
+    /*! number of points these kernels process per instruction (1
+        for the scalar ones); see leafKernelsFor() */
+    int width;
+    
+    /*! computes dist2[i] = squared distance between 'query' and point i */
+    void (*sqrDistances)(const double *soa, int count, int K,
+                         const double *query,
+                         double *dist2);
+
+    /*! computes dist2[i] = squared distance between point i and the
+        box [lower,upper] (0 if inside) */
+    void (*boxSqrDistances)(const double *soa, int count, int K,
+                            const double *lower, const double *upper,
+                            double *dist2);
+    
+    /*! sets inside[i] to whether point i is inside the box [lower,upper]
+        (bounds included); returns the number of points inside */
+    int (*inBox)(const double *soa, int count, int K,
+                 const double *lower, const double *upper,
+                 uint8_t *inside);
+
+    /*! same as sqrDistances, for points stored in single precision;
+        those get converted to double, so the results are exactly
+        those for the same points stored in double precision */
+    void (*sqrDistancesFloat)(const float *soa, int count, int K,
+                              const double *query,
+                              double *dist2);
+    
+    /*! same as inBox, for points stored in single precision */
+    int (*inBoxFloat)(const float *soa, int count, int K,
+                      const double *lower, const double *upper,
+                      uint8_t *inside);
+  };
+
+  /*! same as LeafKernels::sqrDistances (and bit-for-bit the same
+      results as its scalar version), for 'count' points that get
+      read from an array of K coordinates per point, by their IDs;
+      this is for nodes that do not have an SoA copy of their points */
+  template<typename T>
+  inline void gatherSqrDistances(const T *points, const int *ids, int count, int K,
+                                 const double *query, double *dist2)
+  {
+    for (int i=0;i<count;i++) {
+      const T *point = points+size_t(ids[i])*K;
+      double res = 0.;
+      for (int d=0;d<K;d++) {
+        const double diff = double(point[d]) - query[d];
+        res += diff*diff;
+      }
+      dist2[i] = res;
+    }
+  }
+
+  /*! same as LeafKernels::inBox, for points given as in
+      gatherSqrDistances() */
+  template<typename T>
+  inline int gatherInBox(const T *points, const int *ids, int count, int K,
+                         const double *lower, const double *upper,
+                         uint8_t *inside)
+  {
+    int numInside = 0;
+    for (int i=0;i<count;i++) {
+      const T *point = points+size_t(ids[i])*K;
+      bool in = true;
+      for (int d=0;d<K;d++) {
+        const double x = point[d];
+        if (lower[d] > x || upper[d] < x) { in = false; break; }
+      }
+      inside[i] = in;
+      numInside += in;
+    }
+    return numInside;
+  }
+  
+  /*! returns the currently selected kernels */
+  const LeafKernels &leafKernels();
+
+  /*! returns the scalar kernels */
+  const LeafKernels &scalarLeafKernels();
+
+  /*! returns the kernels to scan 'count' points with: 'kernels',
+      unless there are fewer points than those process at once (in
+      which case they would only run their scalar tail code, at the
+      cost of switching instruction sets), so the scalar kernels */
+  inline const LeafKernels &leafKernelsFor(const LeafKernels &kernels, int count)
+  { return count < kernels.width ? scalarLeafKernels() : kernels; }
+  
+  /*! selects the kernels for the given instruction set, or the best
+      supported one for "auto"; throws if the CPU (or this build)
+      doesn't support it */
+  void selectLeafKernels(const std::string &name);
+
+  /*! returns the names of all instruction sets that this CPU and
+      build support, from slowest to fastest */
+  std::vector<std::string> supportedLeafKernels();
+  
+} // ::pyq
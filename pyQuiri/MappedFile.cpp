@@ -0,0 +1,82 @@
+// ======================================================================== //
+// Copyright 2022-2022 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "pyQuiri/MappedFile.h"
+#ifndef _WIN32
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <fcntl.h>
+# include <unistd.h>
+#endif
+
+namespace pyq {
+
+  MappedFile::SP MappedFile::open(const std::string &fileName)
+  {
+    MappedFile::SP mf(new MappedFile);
+#ifdef _WIN32
+    mf->file = CreateFileA(fileName.c_str(),GENERIC_READ,FILE_SHARE_READ,
+                           NULL,OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,NULL);
+    if (mf->file == INVALID_HANDLE_VALUE)
+      throw std::runtime_error("pyQuiri: could not open file '"+fileName+"'");
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(mf->file,&fileSize))
+      throw std::runtime_error("pyQuiri: could not query size of file '"+fileName+"'");
+    mf->numBytes = (size_t)fileSize.QuadPart;
+    if (mf->numBytes == 0)
+      return mf;
+    mf->mapping = CreateFileMappingA(mf->file,NULL,PAGE_READONLY,0,0,NULL);
+    if (!mf->mapping)
+      throw std::runtime_error("pyQuiri: could not map file '"+fileName+"'");
+    mf->ptr = MapViewOfFile(mf->mapping,FILE_MAP_READ,0,0,0);
+    if (!mf->ptr)
+      throw std::runtime_error("pyQuiri: could not map file '"+fileName+"'");
+#else
+    int fd = ::open(fileName.c_str(),O_RDONLY);
+    if (fd < 0)
+      throw std::runtime_error("pyQuiri: could not open file '"+fileName+"'");
+    struct stat st;
+    if (fstat(fd,&st) != 0) {
+      ::close(fd);
+      throw std::runtime_error("pyQuiri: could not query size of file '"+fileName+"'");
+    }
+    mf->numBytes = (size_t)st.st_size;
+    if (mf->numBytes == 0) {
+      ::close(fd);
+      return mf;
+    }
+    void *ptr = mmap(NULL,mf->numBytes,PROT_READ,MAP_SHARED,fd,0);
+    // the mapping stays valid after the descriptor is closed
+    ::close(fd);
+    if (ptr == MAP_FAILED)
+      throw std::runtime_error("pyQuiri: could not map file '"+fileName+"'");
+    mf->ptr = ptr;
+#endif
+    return mf;
+  }
+
+  MappedFile::~MappedFile()
+  {
+#ifdef _WIN32
+    if (ptr) UnmapViewOfFile(ptr);
+    if (mapping) CloseHandle(mapping);
+    if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+    if (ptr) munmap(ptr,numBytes);
+#endif
+  }
+
+} // ::pyq
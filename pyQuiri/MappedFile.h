@@ -0,0 +1,49 @@
+// ======================================================================== //
+// Copyright 2022-2022 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#pragma once
+
+#include "pyQuiri/common.h"
+
+namespace pyq {
+
+  /*! a file that is mapped read-only into this process' address
+      space; the mapping stays valid for as long as this object is
+      alive, and pages get shared with any other process that maps
+      the same file */
+  struct MappedFile {
+    typedef std::shared_ptr<MappedFile> SP;
+
+    /*! maps the given file; throws an exception if that fails */
+    static SP open(const std::string &fileName);
+
+    ~MappedFile();
+
+    inline const char *data() const { return (const char *)ptr; }
+    inline size_t      size() const { return numBytes; }
+
+  private:
+    MappedFile() = default;
+
+    void   *ptr      = nullptr;
+    size_t  numBytes = 0;
+#ifdef _WIN32
+    HANDLE  file     = INVALID_HANDLE_VALUE;
+    HANDLE  mapping  = NULL;
+#endif
+  };
+
+} // ::pyq
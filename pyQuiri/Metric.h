@@ -0,0 +1,103 @@
+// ======================================================================== //
+// Copyright 2022-2022 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#pragma once
+
+#include "pyQuiri/common.h"
+
+namespace pyq {
+
+  /*! the distance metrics supported by the indices that are not
+      restricted to L2 distances. COSINE and INNER_PRODUCT rank by
+      similarity (largest first) rather than distance, and are not
+      metrics in the strict sense (no triangle inequality) */
+  typedef enum {
+    /*! L2 distance */
+    EUCLIDEAN,
+    /*! L1 distance */
+    MANHATTAN,
+    /*! L-infinity distance */
+    CHEBYSHEV,
+    /*! cosine of the angle between two points (as vectors) */
+    COSINE,
+    /*! dot product of two points (as vectors) */
+    INNER_PRODUCT
+  } Metric;
+
+  /*! returns whether the given metric satisfies the triangle inequality */
+  inline bool isTrueMetric(Metric metric)
+  { return metric == EUCLIDEAN || metric == MANHATTAN || metric == CHEBYSHEV; }
+
+  /*! returns the metric of the given name */
+  inline Metric parseMetric(const std::string &name)
+  {
+    if (name == "euclidean") return EUCLIDEAN;
+    if (name == "manhattan") return MANHATTAN;
+    if (name == "chebyshev") return CHEBYSHEV;
+    if (name == "cosine") return COSINE;
+    if (name == "inner_product") return INNER_PRODUCT;
+    throw py::value_error("pyQuiri: unknown metric '"+name
+                          +"' (must be 'euclidean', 'manhattan', 'chebyshev',"
+                          " 'cosine', or 'inner_product')");
+  }
+
+  /*! returns the cosine of the angle between two K-dimensional
+      points, or 0 if either of them is the origin */
+  inline double cosineSimilarity(const double *a, const double *b, int K)
+  {
+    double dot = 0., normA = 0., normB = 0.;
+    for (int d=0;d<K;d++) {
+      dot   += a[d]*b[d];
+      normA += a[d]*a[d];
+      normB += b[d]*b[d];
+    }
+    if (normA == 0. || normB == 0.)
+      return 0.;
+    return std::max(-1.,std::min(1.,dot/sqrt(normA*normB)));
+  }
+  
+  /*! returns the distance between two K-dimensional points in the
+      given metric; for COSINE that is 1-cosine, and for
+      INNER_PRODUCT the negated dot product, so that smaller is
+      always closer */
+  inline double metricDistance(Metric metric, const double *a, const double *b, int K)
+  {
+    double res = 0.;
+    switch (metric) {
+    case EUCLIDEAN:
+      for (int d=0;d<K;d++) {
+        const double diff = a[d]-b[d];
+        res += diff*diff;
+      }
+      return sqrt(res);
+    case MANHATTAN:
+      for (int d=0;d<K;d++)
+        res += std::abs(a[d]-b[d]);
+      return res;
+    case COSINE:
+      return 1.-cosineSimilarity(a,b,K);
+    case INNER_PRODUCT:
+      for (int d=0;d<K;d++)
+        res -= a[d]*b[d];
+      return res;
+    default:
+      for (int d=0;d<K;d++)
+        res = std::max(res,std::abs(a[d]-b[d]));
+      return res;
+    }
+  }
+  
+} // ::pyq
@@ -0,0 +1,189 @@
+// ======================================================================== //
+// Copyright 2022-2022 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#pragma once
+
+#include "pyQuiri/Box.h"
+#ifdef _MSC_VER
+# include <intrin.h>
+#endif
+
+namespace pyq {
+
+  /*! returns the index of the highest set bit in x (x must not be 0) */
+  inline int highestBit(uint64_t x)
+  {
+#ifdef _MSC_VER
+    unsigned long idx;
+    _BitScanReverse64(&idx,x);
+    return (int)idx;
+#else
+    return 63-__builtin_clzll(x);
+#endif
+  }
+  
+  /*! quantizes (up to 3-dimensional) points to a regular grid over a
+      given box, and computes 64-bit Morton (Z-order) codes from that.
+      Bit 'j*K+d' of a code is bit j of the quantized coordinate in
+      dimension d.
+
+      Quantization is done such that a point gets a quantized
+      coordinate >= q exactly if its actual coordinate is >=
+      threshold(q,dim), so splitting a range of sorted codes at a
+      code bit is exactly the same as splitting the points at the
+      respective threshold */
+  struct MortonQuantizer {
+    enum { MAX_DIMS = 3 };
+    
+    MortonQuantizer(const Box &bounds)
+      : K(bounds.size()),
+        bitsPerDim(std::min(32,64/bounds.size())),
+        lower(bounds.lower),
+        cellWidth(bounds.size())
+    {
+      for (int d=0;d<K;d++) {
+        cellWidth[d] = (bounds.upper[d]-bounds.lower[d])/double(uint64_t(1)<<bitsPerDim);
+        if (!(cellWidth[d] > 0.))
+          cellWidth[d] = 1.;
+      }
+    }
+
+    /*! lowest coordinate that gets quantized to (at least) q */
+    inline double threshold(uint64_t q, int dim) const
+    { return lower[dim]+double(q)*cellWidth[dim]; }
+    
+    /*! quantizes a coordinate in given dimension; coordinates outside
+        the quantizer's box get clamped to it */
+    inline uint32_t quantize(double x, int dim) const
+    {
+      const uint64_t maxQ = (uint64_t(1)<<bitsPerDim)-1;
+      const double f = (x-lower[dim])/cellWidth[dim];
+      uint64_t q = (f <= 0.) ? 0 : ((f >= double(maxQ)) ? maxQ : uint64_t(f));
+      // make sure we're exactly consistent with threshold()
+      while (q > 0 && x < threshold(q,dim)) --q;
+      while (q < maxQ && x >= threshold(q+1,dim)) ++q;
+      return (uint32_t)q;
+    }
+
+    /*! computes the morton code of the given (K-dimensional) point */
+    inline uint64_t code(const double *point) const
+    {
+      switch (K) {
+      case 2:
+        return spreadBits2(quantize(point[0],0)) | (spreadBits2(quantize(point[1],1)) << 1);
+      case 3:
+        return spreadBits3(quantize(point[0],0))
+          | (spreadBits3(quantize(point[1],1)) << 1)
+          | (spreadBits3(quantize(point[2],2)) << 2);
+      default: {
+        uint64_t code = 0;
+        for (int d=0;d<K;d++) {
+          const uint64_t q = quantize(point[d],d);
+          for (int j=0;j<bitsPerDim;j++)
+            code |= ((q >> j) & 1) << (j*K+d);
+        }
+        return code;
+      }
+      }
+    }
+
+    /*! computes the index of the given (K-dimensional) point along a
+        Hilbert curve over the same grid that code() uses; this
+        orders points more coherently than Morton codes (consecutive
+        cells are always neighbors), but is more expensive to compute
+        and cannot be used to derive split planes. Uses Skilling's
+        "transpose" formulation (AIP Conf. Proc. 707, 2004) */
+    inline uint64_t hilbert(const double *point) const
+    {
+      if (bitsPerDim == 0) return 0;
+      uint32_t x[64];
+      for (int d=0;d<K;d++)
+        x[d] = quantize(point[d],d);
+      // inverse undo of the excess work
+      const uint32_t M = uint32_t(1) << (bitsPerDim-1);
+      for (uint32_t Q=M;Q>1;Q>>=1) {
+        const uint32_t P = Q-1;
+        for (int d=0;d<K;d++)
+          if (x[d] & Q)
+            x[0] ^= P;
+          else {
+            const uint32_t t = (x[0]^x[d]) & P;
+            x[0] ^= t;
+            x[d] ^= t;
+          }
+      }
+      // gray encode
+      for (int d=1;d<K;d++)
+        x[d] ^= x[d-1];
+      uint32_t t = 0;
+      for (uint32_t Q=M;Q>1;Q>>=1)
+        if (x[K-1] & Q) t ^= Q-1;
+      for (int d=0;d<K;d++)
+        x[d] ^= t;
+      // interleave the transposed bits, x[0] most significant
+      uint64_t index = 0;
+      for (int j=bitsPerDim-1;j>=0;--j)
+        for (int d=0;d<K;d++)
+          index = (index << 1) | ((x[d] >> j) & 1);
+      return index;
+    }
+    
+    /*! returns the quantized coordinate in given dimension that the
+        given code was generated from */
+    inline uint64_t extract(uint64_t code, int dim) const
+    {
+      uint64_t q = 0;
+      for (int j=0;j<bitsPerDim;j++)
+        q |= ((code >> (j*K+dim)) & 1) << j;
+      return q;
+    }
+
+    /*! spreads the 32 bits of x to every second bit */
+    static inline uint64_t spreadBits2(uint64_t x)
+    {
+      x = (x | (x << 16)) & 0x0000FFFF0000FFFFull;
+      x = (x | (x << 8))  & 0x00FF00FF00FF00FFull;
+      x = (x | (x << 4))  & 0x0F0F0F0F0F0F0F0Full;
+      x = (x | (x << 2))  & 0x3333333333333333ull;
+      x = (x | (x << 1))  & 0x5555555555555555ull;
+      return x;
+    }
+    
+    /*! spreads the lower 21 bits of x to every third bit */
+    static inline uint64_t spreadBits3(uint64_t x)
+    {
+      x &= 0x1FFFFF;
+      x = (x | (x << 32)) & 0x001F00000000FFFFull;
+      x = (x | (x << 16)) & 0x001F0000FF0000FFull;
+      x = (x | (x << 8))  & 0x100F00F00F00F00Full;
+      x = (x | (x << 4))  & 0x10C30C30C30C30C3ull;
+      x = (x | (x << 2))  & 0x1249249249249249ull;
+      return x;
+    }
+    
+    const int           K;
+    const int           bitsPerDim;
+    const Coords        lower;
+    std::vector<double> cellWidth;
+  };
+
+  /*! sorts 'keys' (and 'values' along with them) by key, using a
+      parallel, stable LSD radix sort */
+  void radixSort(std::vector<uint64_t> &keys,
+                 std::vector<int> &values,
+                 int numThreads);
+  
+} // ::pyq
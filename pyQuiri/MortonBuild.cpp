@@ -0,0 +1,251 @@
+// ======================================================================== //
+// Copyright 2022-2022 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "pyQuiri/KDTree.h"
+#include "pyQuiri/Morton.h"
+#include "pyQuiri/parallel.h"
+
+namespace pyq {
+
+  /*! sorts 'keys' (and 'values' along with them) by key, using a
+    parallel, stable LSD radix sort */
+  void radixSort(std::vector<uint64_t> &keys,
+                 std::vector<int> &values,
+                 int numThreads)
+  {
+    enum { BITS_PER_PASS = 8, NUM_BUCKETS = 1<<BITS_PER_PASS };
+    const size_t numItems = keys.size();
+    const int numBlocks
+      = (int)std::min(size_t(resolveNumThreads(numThreads)),numItems/4096+1);
+    const size_t blockSize = (numItems+numBlocks-1)/numBlocks;
+
+    std::vector<uint64_t> tmpKeys(numItems);
+    std::vector<int>      tmpValues(numItems);
+    std::vector<size_t>   offsets(numBlocks*NUM_BUCKETS);
+    for (int shift=0;shift<64;shift+=BITS_PER_PASS) {
+      // per-block histograms ...
+      std::fill(offsets.begin(),offsets.end(),0);
+      parallel_for(numBlocks,numThreads,[&](size_t blockID) {
+        size_t *histogram = offsets.data()+blockID*NUM_BUCKETS;
+        const size_t end = std::min(numItems,(blockID+1)*blockSize);
+        for (size_t i=blockID*blockSize;i<end;i++)
+          histogram[(keys[i] >> shift) & (NUM_BUCKETS-1)]++;
+      });
+      
+      // ... turned into (per-block) output offsets; if all keys share
+      // the same digit there is nothing to do in this pass
+      bool allInOneBucket = false;
+      size_t sum = 0;
+      for (int bucket=0;bucket<NUM_BUCKETS;bucket++) {
+        size_t bucketSize = 0;
+        for (int blockID=0;blockID<numBlocks;blockID++) {
+          size_t &offset = offsets[blockID*NUM_BUCKETS+bucket];
+          const size_t count = offset;
+          offset = sum;
+          sum += count;
+          bucketSize += count;
+        }
+        if (bucketSize == numItems) allInOneBucket = true;
+      }
+      if (allInOneBucket)
+        continue;
+
+      // scatter
+      parallel_for(numBlocks,numThreads,[&](size_t blockID) {
+        size_t *offset = offsets.data()+blockID*NUM_BUCKETS;
+        const size_t end = std::min(numItems,(blockID+1)*blockSize);
+        for (size_t i=blockID*blockSize;i<end;i++) {
+          const size_t pos = offset[(keys[i] >> shift) & (NUM_BUCKETS-1)]++;
+          tmpKeys[pos]   = keys[i];
+          tmpValues[pos] = values[i];
+        }
+      });
+      keys.swap(tmpKeys);
+      values.swap(tmpValues);
+    }
+  }
+
+  /*! emits the kd-tree over a range of sorted morton codes, the way
+      an LBVH does: each inner node splits at the highest bit in
+      which the range's codes differ. Ranges with only one code (or
+      with at most leafSize points) become leaves */
+  struct MortonEmitter {
+    MortonEmitter(const std::vector<uint64_t> &codes,
+                  const MortonQuantizer &quantizer,
+                  int leafSize)
+      : codes(codes), quantizer(quantizer), leafSize(leafSize)
+    {}
+
+    /*! returns if given range has to become a leaf */
+    inline bool isLeaf(int begin, int end) const
+    { return end-begin <= leafSize || codes[begin] == codes[end-1]; }
+
+    /*! returns the leaf node for given range */
+    inline KDTree::Node makeLeaf(int begin, int end) const
+    {
+      KDTree::Node node;
+      node.splitPos = 0.;
+      node.splitDim = -1;
+      node.begin    = begin;
+      node.count    = end-begin;
+      node.lChild   = -1;
+      node.rChild   = -1;
+      node.pad      = 0;
+      return node;
+    }
+    
+    /*! returns the inner node for the given range (with children yet
+        to be set), and where to split that range */
+    inline KDTree::Node makeInner(int begin, int end, int &mid) const
+    {
+      const int bit = highestBit(codes[begin]^codes[end-1]);
+      const uint64_t mask = uint64_t(1)<<bit;
+      // all codes in the range share the bits above 'bit', so those
+      // with that bit cleared all come first
+      mid = int(std::partition_point(codes.begin()+begin,codes.begin()+end,
+                                     [mask](uint64_t code) { return !(code & mask); })
+                - codes.begin());
+      const int dim   = bit % quantizer.K;
+      const int level = bit / quantizer.K;
+      const uint64_t q = quantizer.extract(codes[begin],dim);
+      const uint64_t threshold = ((q >> (level+1)) << (level+1)) | (uint64_t(1) << level);
+
+      KDTree::Node node = makeLeaf(begin,begin);
+      node.splitDim = dim;
+      node.splitPos = quantizer.threshold(threshold,dim);
+      return node;
+    }
+
+    /*! serially emits the subtree over the given range, in
+        pre-order; returns its root's index in 'nodes' */
+    int emitRec(std::vector<KDTree::Node> &nodes, int begin, int end) const
+    {
+      const int nodeID = (int)nodes.size();
+      if (isLeaf(begin,end)) {
+        nodes.push_back(makeLeaf(begin,end));
+        return nodeID;
+      }
+      int mid;
+      nodes.push_back(makeInner(begin,end,mid));
+      const int lChild = emitRec(nodes,begin,mid);
+      const int rChild = emitRec(nodes,mid,end);
+      nodes[nodeID].lChild = lChild;
+      nodes[nodeID].rChild = rChild;
+      return nodeID;
+    }
+
+    /*! emits the top levels of the tree over the given range, down to
+        the given depth (or until ranges get small), and records the
+        remaining ranges as tasks to be emitted in parallel. Returns
+        either the ID of the created node, or the task, encoded as
+        -2-taskID */
+    int emitTopRec(std::vector<KDTree::Node> &nodes,
+                   std::vector<std::pair<int,int>> &tasks,
+                   int begin, int end, int depth) const
+    {
+      if (depth == 0 || end-begin < 4096 || isLeaf(begin,end)) {
+        tasks.push_back({begin,end});
+        return -2-int(tasks.size()-1);
+      }
+      const int nodeID = (int)nodes.size();
+      int mid;
+      nodes.push_back(makeInner(begin,end,mid));
+      const int lChild = emitTopRec(nodes,tasks,begin,mid,depth-1);
+      const int rChild = emitTopRec(nodes,tasks,mid,end,depth-1);
+      nodes[nodeID].lChild = lChild;
+      nodes[nodeID].rChild = rChild;
+      return nodeID;
+    }
+    
+    const std::vector<uint64_t> &codes;
+    const MortonQuantizer       &quantizer;
+    const int                    leafSize;
+  };
+  
+  /*! builds the tree by sorting the points along a Morton curve, and
+    emitting the hierarchy from the split bits of the sorted codes */
+  void KDTree::buildMorton(int numThreads, int leafSize)
+  {
+    if (K > MortonQuantizer::MAX_DIMS)
+      throw std::runtime_error("pyQuiri: morton build only supports up to 3-dimensional data");
+    
+    const size_t N = numPoints();
+    if (N == 0)
+      return;
+    std::vector<Node> &nodes   = this->nodes.writable();
+    std::vector<int>  &itemIDs = this->itemIDs.writable();
+    
+    // compute bounds ...
+    const size_t blockSize = 1<<16;
+    std::vector<Box> blockBounds((N+blockSize-1)/blockSize,Box(K));
+    parallel_for(blockBounds.size(),numThreads,[&](size_t blockID) {
+      const size_t end = std::min(N,(blockID+1)*blockSize);
+      std::vector<double> buffer(K);
+      for (size_t i=blockID*blockSize;i<end;i++)
+        blockBounds[blockID].grow(pointCoords((int)i,buffer.data()));
+    });
+    Box bounds(K);
+    for (auto &box : blockBounds) {
+      set_min(bounds.lower,box.lower);
+      set_max(bounds.upper,box.upper);
+    }
+    
+    // ... compute and sort morton codes ...
+    const MortonQuantizer quantizer(bounds);
+    std::vector<uint64_t> codes(N);
+    itemIDs.resize(N);
+    parallel_for_blocked(N,blockSize,numThreads,[&](size_t begin, size_t end) {
+      std::vector<double> buffer(K);
+      for (size_t i=begin;i<end;i++) {
+        codes[i]   = quantizer.code(pointCoords((int)i,buffer.data()));
+        itemIDs[i] = (int)i;
+      }
+    });
+    radixSort(codes,itemIDs,numThreads);
+
+    // ... and emit the hierarchy: top levels serially, then the
+    // subtrees below those in parallel
+    const MortonEmitter emitter(codes,quantizer,leafSize);
+    std::vector<std::pair<int,int>> tasks;
+    int topDepth = 0;
+    while ((1<<topDepth) < 4*resolveNumThreads(numThreads)) topDepth++;
+    emitter.emitTopRec(nodes,tasks,0,(int)N,topDepth);
+    const size_t numTopNodes = nodes.size();
+
+    std::vector<std::vector<Node>> subtrees(tasks.size());
+    parallel_for(tasks.size(),numThreads,[&](size_t taskID) {
+      emitter.emitRec(subtrees[taskID],tasks[taskID].first,tasks[taskID].second);
+    });
+    
+    std::vector<int> subtreeRoot(tasks.size());
+    for (size_t taskID=0;taskID<tasks.size();taskID++) {
+      const int base = (int)nodes.size();
+      subtreeRoot[taskID] = base;
+      for (auto node : subtrees[taskID]) {
+        if (node.lChild >= 0) node.lChild += base;
+        if (node.rChild >= 0) node.rChild += base;
+        nodes.push_back(node);
+      }
+      subtrees[taskID] = {};
+    }
+    for (size_t nodeID=0;nodeID<numTopNodes;nodeID++) {
+      Node &node = nodes[nodeID];
+      if (node.lChild < -1) node.lChild = subtreeRoot[-2-node.lChild];
+      if (node.rChild < -1) node.rChild = subtreeRoot[-2-node.rChild];
+    }
+  }
+  
+} // ::pyq
@@ -0,0 +1,87 @@
+// ======================================================================== //
+// Copyright 2022-2022 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "pyQuiri/NearestIterator.h"
+
+namespace pyq {
+
+  NearestIterator::NearestIterator(const KDTree::SP &tree,
+                                   const std::vector<double> &query)
+    : tree(tree),
+      treeVersion(tree->version),
+      K(tree->K),
+      query(tree->makeCheckCoords(query).coords)
+  {
+    tree->verifyTreeIsBuilt();
+    if (!tree->nodes.empty()) {
+      const std::vector<double> lower(K,-std::numeric_limits<double>::infinity());
+      const std::vector<double> upper(K,+std::numeric_limits<double>::infinity());
+      pushNode(0,lower.data(),upper.data());
+    }
+  }
+
+  void NearestIterator::pushNode(int nodeID, const double *lower, const double *upper)
+  {
+    int64_t cell;
+    if (freeCells.empty()) {
+      cell = cells.size();
+      cells.resize(cells.size()+2*K);
+    } else {
+      cell = freeCells.back();
+      freeCells.pop_back();
+    }
+    std::copy(lower,lower+K,cells.data()+cell);
+    std::copy(upper,upper+K,cells.data()+cell+K);
+    queue.push({sqrDistance(lower,upper,query.data(),K),nodeID,cell});
+  }
+  
+  std::tuple<std::vector<double>,py::object> NearestIterator::next()
+  {
+    if (tree->version != treeVersion)
+      throw std::runtime_error("pyQuiri: tree was modified during iteration");
+
+    std::vector<double> lower(K), upper(K), buffer(K);
+    while (!queue.empty()) {
+      const Entry entry = queue.top();
+      queue.pop();
+      if (entry.cell < 0)
+        return std::make_tuple(tree->pointVector(entry.id),tree->value(entry.id));
+
+      // expand node: queue its data points and its children
+      std::copy(cells.data()+entry.cell,cells.data()+entry.cell+K,lower.data());
+      std::copy(cells.data()+entry.cell+K,cells.data()+entry.cell+2*K,upper.data());
+      freeCells.push_back(entry.cell);
+      
+      const KDTree::Node &node = tree->nodes[entry.id];
+      for (int i=0;i<node.count;i++) {
+        const int item = tree->itemIDs[node.begin+i];
+        queue.push({sqrDistance(query.data(),tree->pointCoords(item,buffer.data()),K),item,-1});
+      }
+      if (node.lChild >= 0) {
+        const double saved = upper[node.splitDim];
+        upper[node.splitDim] = node.splitPos;
+        pushNode(node.lChild,lower.data(),upper.data());
+        upper[node.splitDim] = saved;
+      }
+      if (node.rChild >= 0) {
+        lower[node.splitDim] = node.splitPos;
+        pushNode(node.rChild,lower.data(),upper.data());
+      }
+    }
+    throw py::stop_iteration();
+  }
+  
+} // ::pyq
@@ -0,0 +1,78 @@
+// ======================================================================== //
+// Copyright 2022-2022 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#pragma once
+
+#include "pyQuiri/KDTree.h"
+#include <queue>
+
+namespace pyq {
+
+  /*! a python iterator that returns the data points in order of
+      increasing distance to a query point, one at a time and only as
+      far as asked for ("distance browsing", Hjaltason and Samet,
+      TODS 1999): a single priority queue holds both nodes (keyed by
+      the distance to their cell) and data points (keyed by their
+      own distance), so whenever a data point is at the top of that
+      queue nothing still in the queue can be closer. Each step costs
+      amortized logarithmic time, and nothing gets traversed twice */
+  struct NearestIterator {
+    typedef std::shared_ptr<NearestIterator> SP;
+
+    NearestIterator(const KDTree::SP &tree,
+                    const std::vector<double> &query);
+    
+    static SP create(const KDTree::SP &tree,
+                     const std::vector<double> &query)
+    { return std::make_shared<NearestIterator>(tree,query); }
+
+    /*! returns the next closest data point as ([coords],value);
+        throws py::stop_iteration once all points have been returned */
+    std::tuple<std::vector<double>,py::object> next();
+
+  private:
+    /*! a node (with its cell stored at cells[cell]) or a data point
+        (with cell == -1) in the queue */
+    struct Entry {
+      double  dist2;
+      int     id;
+      int64_t cell;
+      /*! ordering for a min-queue over distance, with data points
+          before nodes at the same distance */
+      bool operator<(const Entry &other) const
+      {
+        if (dist2 != other.dist2) return dist2 > other.dist2;
+        return (cell < 0) < (other.cell < 0);
+      }
+    };
+
+    /*! pushes a node with given cell */
+    void pushNode(int nodeID, const double *lower, const double *upper);
+    
+    const KDTree::SP          tree;
+    /*! the tree's version when this iterator got created, to detect
+        modifications of the tree during iteration */
+    const uint64_t            treeVersion;
+    const int                 K;
+    const std::vector<double> query;
+    std::priority_queue<Entry> queue;
+    /*! the cells of all nodes in the queue (2*K values each); slots
+        of popped nodes get re-used */
+    std::vector<double>       cells;
+    std::vector<int64_t>      freeCells;
+  };
+  
+} // ::pyq
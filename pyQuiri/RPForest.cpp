@@ -0,0 +1,259 @@
+// ======================================================================== //
+// Copyright 2022-2022 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "pyQuiri/RPForest.h"
+#include "pyQuiri/Coords.h"
+#include "pyQuiri/parallel.h"
+#include <random>
+#include <queue>
+
+namespace pyq {
+
+  /*! how many random pairs of points to try for a split plane that
+      actually separates a node's points, before splitting them
+      arbitrarily */
+  static const int MAX_SPLIT_TRIES = 8;
+
+  /*! how many queries of a batch get processed in one task */
+  static const size_t RP_QUERY_BLOCK_SIZE = 64;
+  
+  RPForest::RPForest(int K, int numTrees, int leafSize, uint64_t seed)
+    : K(K), numTrees(numTrees), leafSize(leafSize), seed(seed)
+  {
+    if (numTrees < 1)
+      throw py::value_error("pyQuiri: n_trees must be at least 1");
+    if (leafSize < 1)
+      throw py::value_error("pyQuiri: leaf_size must be at least 1");
+  }
+  
+  void RPForest::add(const std::vector<double> &coords, const py::object &value)
+  {
+    if ((int)coords.size() != K)
+      throw py::type_error
+        ("key in RPForest::add() does not match dimensionality of forest");
+    for (size_t i=values.size();i<numPoints();i++)
+      values.push_back(py::int_(i));
+    isBuilt = false;
+    points.insert(points.end(),coords.begin(),coords.end());
+    values.push_back(value);
+  }
+
+  void RPForest::addBatch(const py::array_t<double,py::array::c_style|py::array::forcecast> &newPoints)
+  {
+    if (newPoints.ndim() != 2 || newPoints.shape(1) != K)
+      throw py::type_error("pyQuiri: points must be given as a (M,"
+                           +std::to_string(K)+") array");
+    isBuilt = false;
+    points.insert(points.end(),newPoints.data(),newPoints.data()+newPoints.size());
+  }
+  
+  void RPForest::build(int numThreads)
+  {
+    if (numPoints() > size_t(std::numeric_limits<int32_t>::max()))
+      throw std::runtime_error("pyQuiri: too many points");
+    trees.clear();
+    trees.resize(numTrees);
+    {
+      py::gil_scoped_release noGIL;
+      parallel_for(numTrees,numThreads,[&](size_t treeID) {
+          buildTree(trees[treeID],seed*1000003+treeID);
+        });
+    }
+    isBuilt = true;
+  }
+
+  void RPForest::buildTree(Tree &tree, uint64_t seed) const
+  {
+    std::mt19937_64 rng(seed);
+    tree.itemIDs.resize(numPoints());
+    for (size_t i=0;i<numPoints();i++)
+      tree.itemIDs[i] = (int)i;
+    if (numPoints() == 0)
+      return;
+    
+    std::vector<int> stack = { 0 };
+    tree.nodes.push_back({0.,0,(int32_t)numPoints(),-1,-1,-1,0});
+    std::vector<double> normal(K);
+    std::vector<double> side;
+    while (!stack.empty()) {
+      const int nodeID = stack.back();
+      stack.pop_back();
+      const int begin = tree.nodes[nodeID].begin;
+      const int count = tree.nodes[nodeID].count;
+      if (count <= leafSize)
+        continue;
+      int *items = tree.itemIDs.data()+begin;
+
+      // try a few planes halfway between two random points
+      int    numLeft = 0;
+      double offset  = 0.;
+      for (int tries=0;tries<MAX_SPLIT_TRIES;tries++) {
+        const int a = items[rng()%count];
+        const int b = items[rng()%count];
+        offset = 0.;
+        for (int d=0;d<K;d++) {
+          normal[d] = pointCoords(a)[d]-pointCoords(b)[d];
+          offset += normal[d]*.5*(pointCoords(a)[d]+pointCoords(b)[d]);
+        }
+        numLeft = 0;
+        side.resize(count);
+        for (int i=0;i<count;i++) {
+          double dot = 0.;
+          for (int d=0;d<K;d++)
+            dot += normal[d]*pointCoords(items[i])[d];
+          side[i] = dot;
+          numLeft += dot < offset;
+        }
+        if (numLeft > 0 && numLeft < count)
+          break;
+      }
+
+      int mid;
+      if (numLeft > 0 && numLeft < count) {
+        mid = 0;
+        for (int i=0;i<count;i++)
+          if (side[i] < offset) {
+            std::swap(items[i],items[mid]);
+            std::swap(side[i],side[mid]);
+            mid++;
+          }
+      } else {
+        // (nearly) identical points: split them arbitrarily, with a
+        // plane that does not prefer either side
+        std::shuffle(items,items+count,rng);
+        mid = count/2;
+        std::fill(normal.begin(),normal.end(),0.);
+        offset = 0.;
+      }
+      
+      const int lChild = (int)tree.nodes.size();
+      tree.nodes.push_back({0.,begin,mid,-1,-1,-1,0});
+      tree.nodes.push_back({0.,begin+mid,count-mid,-1,-1,-1,0});
+      Node &node = tree.nodes[nodeID];
+      node.offset = offset;
+      node.lChild = lChild;
+      node.rChild = lChild+1;
+      node.normal = int32_t(tree.normals.size()/K);
+      tree.normals.insert(tree.normals.end(),normal.begin(),normal.end());
+      stack.push_back(lChild);
+      stack.push_back(lChild+1);
+    }
+  }
+
+  void RPForest::query(const double *query, int k, int searchK,
+                       std::vector<std::pair<double,int>> &result) const
+  {
+    result.clear();
+    if (k <= 0 || numPoints() == 0)
+      return;
+    if (searchK < 0)
+      searchK = numTrees*k;
+    searchK = std::max(searchK,k);
+
+    // a max-heap of (priority,tree,node): the priority of a node is
+    // the smallest (signed) margin by which the query is on the
+    // node's side of any of the planes on the way to it
+    typedef std::tuple<double,int,int> Entry;
+    std::priority_queue<Entry> queue;
+    for (int treeID=0;treeID<numTrees;treeID++)
+      queue.push(Entry(std::numeric_limits<double>::infinity(),treeID,0));
+
+    std::vector<int> candidates;
+    while (!queue.empty() && (int)candidates.size() < searchK) {
+      const double priority = std::get<0>(queue.top());
+      const Tree  &tree     = trees[std::get<1>(queue.top())];
+      const Node  &node     = tree.nodes[std::get<2>(queue.top())];
+      queue.pop();
+      if (node.lChild < 0) {
+        candidates.insert(candidates.end(),
+                          tree.itemIDs.begin()+node.begin,
+                          tree.itemIDs.begin()+node.begin+node.count);
+        continue;
+      }
+      const double *normal = tree.normals.data()+size_t(node.normal)*K;
+      double margin = -node.offset;
+      for (int d=0;d<K;d++)
+        margin += normal[d]*query[d];
+      const int treeID = int(&tree-trees.data());
+      queue.push(Entry(std::min(priority,-margin),treeID,node.lChild));
+      queue.push(Entry(std::min(priority,+margin),treeID,node.rChild));
+    }
+
+    // every tree contains every point, so candidates will have
+    // duplicates
+    std::sort(candidates.begin(),candidates.end());
+    candidates.erase(std::unique(candidates.begin(),candidates.end()),candidates.end());
+    for (auto item : candidates)
+      result.push_back({sqrDistance(pointCoords(item),query,K),item});
+    const size_t numResults = std::min(result.size(),size_t(k));
+    std::partial_sort(result.begin(),result.begin()+numResults,result.end());
+    result.resize(numResults);
+  }
+  
+  std::vector<std::tuple<std::vector<double>,py::object>>
+  RPForest::kNN(int k, const std::vector<double> &queryPoint, int searchK) const
+  {
+    if (!isBuilt)
+      throw std::runtime_error("pyQuiri: RPForest must be built before querying");
+    if ((int)queryPoint.size() != K)
+      throw py::type_error
+        ("query point in RPForest::knn() does not match dimensionality of forest");
+    std::vector<std::pair<double,int>> closest;
+    query(queryPoint.data(),k,searchK,closest);
+    std::vector<std::tuple<std::vector<double>,py::object>> result;
+    for (auto &c : closest)
+      result.push_back({std::vector<double>(pointCoords(c.second),pointCoords(c.second)+K),
+                        value(c.second)});
+    return result;
+  }
+
+  py::tuple RPForest::kNNBatch(const py::array_t<double,py::array::c_style|py::array::forcecast> &queries,
+                               int k, int searchK, int numThreads) const
+  {
+    if (!isBuilt)
+      throw std::runtime_error("pyQuiri: RPForest must be built before querying");
+    if (queries.ndim() != 2 || queries.shape(1) != K)
+      throw py::type_error("pyQuiri: query points must be given as a (M,"
+                           +std::to_string(K)+") array");
+    if (k < 0)
+      throw py::value_error("pyQuiri: k must not be negative");
+    const size_t numQueries = queries.shape(0);
+    py::array_t<int32_t> indices({numQueries,size_t(k)});
+    py::array_t<double>  distances({numQueries,size_t(k)});
+    const double *queryData    = queries.data();
+    int32_t      *indexData    = indices.mutable_data();
+    double       *distanceData = distances.mutable_data();
+    {
+      py::gil_scoped_release noGIL;
+      parallel_for_blocked
+        (numQueries,RP_QUERY_BLOCK_SIZE,numThreads,[&](size_t begin, size_t end) {
+          std::vector<std::pair<double,int>> closest;
+          for (size_t q=begin;q<end;q++) {
+            query(queryData+q*K,k,searchK,closest);
+            for (int i=0;i<k;i++) {
+              const bool valid = i < (int)closest.size();
+              indexData[q*k+i]    = valid ? closest[i].second : -1;
+              distanceData[q*k+i] = valid
+                ? sqrt(closest[i].first)
+                : std::numeric_limits<double>::infinity();
+            }
+          }
+        });
+    }
+    return py::make_tuple(indices,distances);
+  }
+  
+} // ::pyq
@@ -0,0 +1,120 @@
+// ======================================================================== //
+// Copyright 2022-2022 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#pragma once
+
+#include "pyQuiri/common.h"
+#include <pybind11/numpy.h>
+
+namespace pyq {
+
+  /*! an approximate kNN index for high-dimensional data (in the
+      style of Annoy): a forest of trees that each recursively split
+      their points by a random hyperplane (the one halfway between two
+      randomly picked points), down to buckets of at most leafSize
+      points. A query walks all trees at once, always descending into
+      the node whose splitting planes it is furthest on the right side
+      of, until it collected 'searchK' candidate points, and then
+      returns the closest of these. More trees and larger searchK
+      mean higher recall, but slower queries */
+  struct RPForest {
+    typedef std::shared_ptr<RPForest> SP;
+
+    /*! one node of a tree; its points are itemIDs[begin..begin+count) */
+    struct Node {
+      /*! for inner nodes, points p with dot(normal,p) < offset are
+          in the left child, all others in the right one */
+      double  offset;
+      int32_t begin, count;
+      /*! children, or -1 for leaves */
+      int32_t lChild, rChild;
+      /*! index of the node's plane normal in normals[], in units of K */
+      int32_t normal;
+      int32_t pad;
+    };
+
+    /*! one tree of the forest */
+    struct Tree {
+      std::vector<Node>   nodes;
+      std::vector<double> normals;
+      std::vector<int>    itemIDs;
+    };
+    
+    RPForest(int K, int numTrees, int leafSize, uint64_t seed);
+    
+    static SP create(int K, int numTrees, int leafSize, uint64_t seed)
+    { return std::make_shared<RPForest>(K,numTrees,leafSize,seed); }
+
+    /*! add a new element to this forest */
+    void add(const std::vector<double> &coords, const py::object &value);
+
+    /*! adds all rows of a (M,K) array of points; their values are
+        their indices (in order of add()) */
+    void addBatch(const py::array_t<double,py::array::c_style|py::array::forcecast> &points);
+    
+    /*! builds all trees (in parallel, using 'numThreads' threads) -
+        MUST be done before querying anything */
+    void build(int numThreads);
+
+    /*! finds (approximately) the k nearest neighbors of the query
+        point, looking at (at least) searchK candidates (numTrees*k
+        if < 0); returns ([coords],value) pairs, closest first */
+    std::vector<std::tuple<std::vector<double>,py::object>>
+    kNN(int k, const std::vector<double> &query, int searchK) const;
+    
+    /*! same as kNN() for each of a (M,K) array of query points;
+        returns a tuple of (M,k) arrays of indices (in order of add())
+        and distances, padded with -1 and infinity */
+    py::tuple kNNBatch(const py::array_t<double,py::array::c_style|py::array::forcecast> &queries,
+                       int k, int searchK, int numThreads) const;
+    
+    /*! number of data points in this forest */
+    inline size_t numPoints() const { return points.size() / K; }
+
+    const int      K;
+    const int      numTrees;
+    const int      leafSize;
+    const uint64_t seed;
+    
+  private:
+    /*! builds the given tree, using a random number generator
+        seeded with 'seed' */
+    void buildTree(Tree &tree, uint64_t seed) const;
+
+    /*! finds the (up to) k closest points among (at least) searchK
+        candidates, and writes them as (squared distance, pointID) to
+        result, sorted */
+    void query(const double *query, int k, int searchK,
+               std::vector<std::pair<double,int>> &result) const;
+    
+    /*! returns the coordinates of the given data point */
+    inline const double *pointCoords(int item) const
+    { return points.data()+size_t(item)*K; }
+
+    /*! returns the value of the given data point; for points added
+        by addBatch() this is the point's index */
+    inline py::object value(int item) const
+    { return item < (int)values.size() ? values[item] : py::int_(item); }
+    
+    /*! N*K coordinates, in order of add() */
+    std::vector<double>     points;
+    /*! one value per point; empty for points added by addBatch() */
+    std::vector<py::object> values;
+    std::vector<Tree>       trees;
+    bool                    isBuilt = false;
+  };
+  
+} // ::pyq
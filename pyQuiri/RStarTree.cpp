@@ -0,0 +1,725 @@
+// ======================================================================== //
+// Copyright 2022-2022 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+
+#include "pyQuiri/RStarTree.h"
+#include <numeric>
+#include <queue>
+
+namespace pyq {
+
+  /*! fraction of its children that a node re-inserts (rather than
+      splitting) on its first overflow during an insertion */
+  static const double RSTAR_REINSERT_FRACTION = .3;
+
+  /*! fraction of max_entries that every node but the root holds at
+      least */
+  static const double RSTAR_MIN_FILL = .4;
+
+  static inline double boxArea(const double *box, int K)
+  {
+    double area = 1.;
+    for (int d=0;d<K;d++)
+      area *= box[K+d]-box[d];
+    return area;
+  }
+
+  static inline double boxMargin(const double *box, int K)
+  {
+    double margin = 0.;
+    for (int d=0;d<K;d++)
+      margin += box[K+d]-box[d];
+    return margin;
+  }
+
+  static inline double overlapArea(const double *a, const double *b, int K)
+  {
+    double area = 1.;
+    for (int d=0;d<K;d++) {
+      const double lo = std::max(a[d],b[d]);
+      const double hi = std::min(a[K+d],b[K+d]);
+      if (hi < lo)
+        return 0.;
+      area *= hi-lo;
+    }
+    return area;
+  }
+
+  static inline void extendBox(double *box, const double *other, int K)
+  {
+    for (int d=0;d<K;d++) {
+      box[d]   = std::min(box[d],other[d]);
+      box[K+d] = std::max(box[K+d],other[K+d]);
+    }
+  }
+
+  static inline void emptyBox(double *box, int K)
+  {
+    for (int d=0;d<K;d++) {
+      box[d]   = +std::numeric_limits<double>::infinity();
+      box[K+d] = -std::numeric_limits<double>::infinity();
+    }
+  }
+
+  static inline double sqrDistToBox(const double *query, const double *box, int K)
+  {
+    double sqrDist = 0.;
+    for (int d=0;d<K;d++) {
+      const double diff
+        = std::max(box[d]-query[d],0.)+std::max(query[d]-box[K+d],0.);
+      sqrDist += diff*diff;
+    }
+    return sqrDist;
+  }
+
+  /*! sorts the children in [begin,end) into Sort-Tile-Recursive
+      order: by their centers along dimension 'dim', then each slab
+      (of a multiple of nodeSize children) along the next dimension,
+      so that consecutive runs of nodeSize children form compact
+      tiles */
+  static void strSort(std::vector<int>::iterator begin,
+                      std::vector<int>::iterator end,
+                      int dim, int K, int nodeSize,
+                      const std::vector<double> &boxes)
+  {
+    auto center = [&](int child) {
+      const double *box = boxes.data()+size_t(child)*2*K;
+      return box[dim]+box[K+dim];
+    };
+    std::sort(begin,end,[&](int a, int b) { return center(a) < center(b); });
+    const size_t count    = end-begin;
+    const size_t numPages = (count+nodeSize-1)/nodeSize;
+    if (dim == K-1 || numPages <= 1)
+      return;
+    const size_t numSlabs
+      = (size_t)std::ceil(std::pow((double)numPages,1./(K-dim))-1e-9);
+    const size_t slabSize = (numPages+numSlabs-1)/numSlabs*nodeSize;
+    for (size_t b=0;b<count;b+=slabSize)
+      strSort(begin+b,begin+std::min(count,b+slabSize),dim+1,K,nodeSize,boxes);
+  }
+
+  RStarTree::RStarTree(int K, int maxEntries)
+    : K(K),
+      maxEntries(maxEntries),
+      minEntries(std::max(2,int(RSTAR_MIN_FILL*maxEntries)))
+  {
+    if (K < 1)
+      throw py::value_error("pyQuiri: K must be at least 1");
+    if (maxEntries < 4)
+      throw py::value_error("pyQuiri: max_entries must be at least 4");
+    root = newNode(0);
+  }
+
+  int RStarTree::newNode(int level)
+  {
+    int nodeID;
+    if (freeNodes.empty()) {
+      nodeID = (int)nodes.size();
+      nodes.push_back(Node());
+    } else {
+      nodeID = freeNodes.back();
+      freeNodes.pop_back();
+    }
+    nodes[nodeID].level  = level;
+    nodes[nodeID].parent = -1;
+    return nodeID;
+  }
+
+  void RStarTree::freeNode(int nodeID)
+  {
+    nodes[nodeID].children.clear();
+    nodes[nodeID].boxes.clear();
+    freeNodes.push_back(nodeID);
+  }
+
+  void RStarTree::addChild(int nodeID, int child, const double *box)
+  {
+    Node &node = nodes[nodeID];
+    node.children.push_back(child);
+    node.boxes.insert(node.boxes.end(),box,box+2*K);
+    if (node.level > 0)
+      nodes[child].parent = nodeID;
+  }
+
+  void RStarTree::computeBox(int nodeID, double *box) const
+  {
+    const Node &node = nodes[nodeID];
+    emptyBox(box,K);
+    for (size_t i=0;i<node.children.size();i++)
+      extendBox(box,node.boxes.data()+i*2*K,K);
+  }
+
+  int RStarTree::slotInParent(int nodeID) const
+  {
+    const std::vector<int> &siblings = nodes[nodes[nodeID].parent].children;
+    return int(std::find(siblings.begin(),siblings.end(),nodeID)-siblings.begin());
+  }
+
+  void RStarTree::refreshBoxes(int nodeID)
+  {
+    while (nodes[nodeID].parent >= 0) {
+      const int parent = nodes[nodeID].parent;
+      computeBox(nodeID,nodes[parent].boxes.data()+size_t(slotInParent(nodeID))*2*K);
+      nodeID = parent;
+    }
+  }
+
+  void RStarTree::checkPoint(const std::vector<double> &coords, const char *what) const
+  {
+    if ((int)coords.size() != K)
+      throw py::type_error(std::string(what)+" does not match dimensionality of tree");
+  }
+
+  /*! descends from the root along the children whose boxes need the
+      least enlargement to include the new one; right above the
+      leaves R* instead minimizes how much overlap with their
+      siblings that enlargement adds */
+  int RStarTree::chooseSubtree(const double *box, int level) const
+  {
+    std::vector<double> enlarged(2*K);
+    int nodeID = root;
+    while (nodes[nodeID].level > level) {
+      const Node &node = nodes[nodeID];
+      const int numChildren = (int)node.children.size();
+      int    best = 0;
+      double bestOverlap = std::numeric_limits<double>::infinity();
+      double bestEnlargement = std::numeric_limits<double>::infinity();
+      double bestArea = std::numeric_limits<double>::infinity();
+      for (int i=0;i<numChildren;i++) {
+        const double *childBox = node.boxes.data()+size_t(i)*2*K;
+        std::copy(childBox,childBox+2*K,enlarged.begin());
+        extendBox(enlarged.data(),box,K);
+        const double area        = boxArea(childBox,K);
+        const double enlargement = boxArea(enlarged.data(),K)-area;
+        double overlap = 0.;
+        if (node.level == 1)
+          for (int j=0;j<numChildren;j++) {
+            if (j == i) continue;
+            const double *otherBox = node.boxes.data()+size_t(j)*2*K;
+            overlap
+              += overlapArea(enlarged.data(),otherBox,K)
+              -  overlapArea(childBox,otherBox,K);
+          }
+        if (std::make_tuple(overlap,enlargement,area)
+            < std::make_tuple(bestOverlap,bestEnlargement,bestArea)) {
+          best            = i;
+          bestOverlap     = overlap;
+          bestEnlargement = enlargement;
+          bestArea        = area;
+        }
+      }
+      nodeID = node.children[best];
+    }
+    return nodeID;
+  }
+
+  void RStarTree::insert(const double *box, int child, int level,
+                         std::vector<bool> &reinserted)
+  {
+    int nodeID = chooseSubtree(box,level);
+    addChild(nodeID,child,box);
+    std::vector<double> nodeBox(2*K);
+    while (true) {
+      int sibling = -1;
+      if ((int)nodes[nodeID].children.size() > maxEntries) {
+        const int nodeLevel = nodes[nodeID].level;
+        if ((int)reinserted.size() <= nodeLevel)
+          reinserted.resize(nodeLevel+1,false);
+        if (nodeID != root && !reinserted[nodeLevel]) {
+          // reinsert() takes care of the boxes further up
+          reinserted[nodeLevel] = true;
+          reinsert(nodeID,reinserted);
+          return;
+        }
+        sibling = split(nodeID);
+      }
+      const int parent = nodes[nodeID].parent;
+      if (parent < 0) {
+        if (sibling >= 0) {
+          // the root got split: grow the tree by one level
+          root = newNode(nodes[nodeID].level+1);
+          computeBox(nodeID,nodeBox.data());
+          addChild(root,nodeID,nodeBox.data());
+          computeBox(sibling,nodeBox.data());
+          addChild(root,sibling,nodeBox.data());
+        }
+        return;
+      }
+      computeBox(nodeID,nodes[parent].boxes.data()+size_t(slotInParent(nodeID))*2*K);
+      if (sibling >= 0) {
+        computeBox(sibling,nodeBox.data());
+        addChild(parent,sibling,nodeBox.data());
+      }
+      nodeID = parent;
+    }
+  }
+
+  void RStarTree::reinsert(int nodeID, std::vector<bool> &reinserted)
+  {
+    const int level = nodes[nodeID].level;
+    std::vector<int>    children;
+    std::vector<double> boxes;
+    std::swap(children,nodes[nodeID].children);
+    std::swap(boxes,nodes[nodeID].boxes);
+
+    std::vector<double> center(2*K);
+    emptyBox(center.data(),K);
+    for (size_t i=0;i<children.size();i++)
+      extendBox(center.data(),boxes.data()+i*2*K,K);
+    std::vector<std::pair<double,int>> byDistance;
+    for (size_t i=0;i<children.size();i++) {
+      const double *box = boxes.data()+i*2*K;
+      double sqrDist = 0.;
+      for (int d=0;d<K;d++) {
+        const double diff = (box[d]+box[K+d])-(center[d]+center[K+d]);
+        sqrDist += diff*diff;
+      }
+      byDistance.push_back({sqrDist,(int)i});
+    }
+    std::sort(byDistance.begin(),byDistance.end());
+
+    const int numReinserted
+      = std::max(1,int(RSTAR_REINSERT_FRACTION*maxEntries));
+    const int numKept = (int)children.size()-numReinserted;
+    for (int i=0;i<numKept;i++) {
+      const int slot = byDistance[i].second;
+      addChild(nodeID,children[slot],boxes.data()+size_t(slot)*2*K);
+    }
+    refreshBoxes(nodeID);
+    // "close reinsert": the ones closest to the center go first
+    for (int i=numKept;i<(int)children.size();i++) {
+      const int slot = byDistance[i].second;
+      insert(boxes.data()+size_t(slot)*2*K,children[slot],level,reinserted);
+    }
+  }
+
+  int RStarTree::split(int nodeID)
+  {
+    const int level = nodes[nodeID].level;
+    std::vector<int>    children;
+    std::vector<double> boxes;
+    std::swap(children,nodes[nodeID].children);
+    std::swap(boxes,nodes[nodeID].boxes);
+    const int count = (int)children.size();
+    const int minCount = minEntries;
+
+    // sorts the children along an axis (by lower or by upper bound
+    // of their boxes), and computes the boxes of every prefix and
+    // suffix of that order
+    std::vector<int>    order(count);
+    std::vector<double> prefix(size_t(count)*2*K), suffix(size_t(count)*2*K);
+    auto sortAlong = [&](int axis, bool byUpper) {
+      std::iota(order.begin(),order.end(),0);
+      const int key = byUpper ? K+axis : axis;
+      std::sort(order.begin(),order.end(),[&](int a, int b) {
+          return boxes[size_t(a)*2*K+key] < boxes[size_t(b)*2*K+key];
+        });
+      double *box = prefix.data();
+      emptyBox(box,K);
+      for (int i=0;i<count;i++) {
+        if (i > 0)
+          std::copy(box-2*K,box,box);
+        extendBox(box,boxes.data()+size_t(order[i])*2*K,K);
+        box += 2*K;
+      }
+      box = suffix.data()+size_t(count-1)*2*K;
+      emptyBox(box,K);
+      for (int i=count-1;i>=0;--i) {
+        if (i < count-1)
+          std::copy(box+2*K,box+4*K,box);
+        extendBox(box,boxes.data()+size_t(order[i])*2*K,K);
+        box -= 2*K;
+      }
+    };
+
+    // the first group is order[0..split), for every split in
+    // [minCount,count-minCount]; the axis is the one with the least
+    // total margin over all those distributions
+    int    bestAxis = 0;
+    double bestMargin = std::numeric_limits<double>::infinity();
+    for (int axis=0;axis<K;axis++) {
+      double margin = 0.;
+      for (int byUpper=0;byUpper<2;byUpper++) {
+        sortAlong(axis,byUpper);
+        for (int s=minCount;s<=count-minCount;s++)
+          margin
+            += boxMargin(prefix.data()+size_t(s-1)*2*K,K)
+            +  boxMargin(suffix.data()+size_t(s)*2*K,K);
+      }
+      if (margin < bestMargin) {
+        bestMargin = margin;
+        bestAxis   = axis;
+      }
+    }
+
+    // along that axis, take the distribution with the least overlap
+    // (then the least area) between its two groups
+    bool   bestByUpper = false;
+    int    bestSplit = minCount;
+    double bestOverlap = std::numeric_limits<double>::infinity();
+    double bestArea = std::numeric_limits<double>::infinity();
+    for (int byUpper=0;byUpper<2;byUpper++) {
+      sortAlong(bestAxis,byUpper);
+      for (int s=minCount;s<=count-minCount;s++) {
+        const double *a = prefix.data()+size_t(s-1)*2*K;
+        const double *b = suffix.data()+size_t(s)*2*K;
+        const double overlap = overlapArea(a,b,K);
+        const double area    = boxArea(a,K)+boxArea(b,K);
+        if (overlap < bestOverlap || (overlap == bestOverlap && area < bestArea)) {
+          bestOverlap = overlap;
+          bestArea    = area;
+          bestByUpper = byUpper;
+          bestSplit   = s;
+        }
+      }
+    }
+    sortAlong(bestAxis,bestByUpper);
+
+    const int sibling = newNode(level);
+    for (int i=0;i<count;i++)
+      addChild(i < bestSplit ? nodeID : sibling,
+               children[order[i]],boxes.data()+size_t(order[i])*2*K);
+    return sibling;
+  }
+
+  void RStarTree::add(const std::vector<double> &coords, const py::object &value)
+  {
+    checkPoint(coords,"key in RStarTree::add()");
+    for (double c : coords)
+      if (!std::isfinite(c))
+        throw py::value_error("pyQuiri: R*-tree points must have finite coordinates");
+    int entryID;
+    if (freeEntries.empty()) {
+      if (values.size() >= size_t(std::numeric_limits<int32_t>::max()))
+        throw std::runtime_error("pyQuiri: too many points");
+      entryID = (int)values.size();
+      values.push_back(value);
+      points.insert(points.end(),coords.begin(),coords.end());
+    } else {
+      entryID = freeEntries.back();
+      freeEntries.pop_back();
+      values[entryID] = value;
+      std::copy(coords.begin(),coords.end(),points.begin()+size_t(entryID)*K);
+    }
+    std::vector<double> box(coords);
+    box.insert(box.end(),coords.begin(),coords.end());
+    std::vector<bool> reinserted(height(),false);
+    insert(box.data(),entryID,0,reinserted);
+  }
+
+  bool RStarTree::remove(const std::vector<double> &coords, const py::object &value)
+  {
+    checkPoint(coords,"key in RStarTree::remove()");
+    std::vector<int> stack = { root };
+    while (!stack.empty()) {
+      const int nodeID = stack.back();
+      stack.pop_back();
+      const Node &node = nodes[nodeID];
+      for (size_t i=0;i<node.children.size();i++) {
+        const double *box = node.boxes.data()+i*2*K;
+        bool inside = true;
+        for (int d=0;d<K && inside;d++)
+          inside = (box[d] <= coords[d] && coords[d] <= box[K+d]);
+        if (!inside)
+          continue;
+        if (node.level > 0) {
+          stack.push_back(node.children[i]);
+          continue;
+        }
+        const int entryID = node.children[i];
+        if (!value.is_none() && !values[entryID].equal(value))
+          continue;
+        Node &leaf = nodes[nodeID];
+        leaf.children.erase(leaf.children.begin()+i);
+        leaf.boxes.erase(leaf.boxes.begin()+i*2*K,leaf.boxes.begin()+(i+1)*2*K);
+        values[entryID] = py::none();
+        freeEntries.push_back(entryID);
+        condense(nodeID);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void RStarTree::condense(int leafID)
+  {
+    // children of removed nodes, with the level they go back to
+    std::vector<std::pair<int,int>> orphans;
+    std::vector<double>             orphanBoxes;
+    int nodeID = leafID;
+    while (nodeID != root) {
+      const int parent = nodes[nodeID].parent;
+      const int slot   = slotInParent(nodeID);
+      Node &node = nodes[nodeID];
+      if ((int)node.children.size() < minEntries) {
+        for (int child : node.children)
+          orphans.push_back({child,node.level});
+        orphanBoxes.insert(orphanBoxes.end(),node.boxes.begin(),node.boxes.end());
+        Node &parentNode = nodes[parent];
+        parentNode.children.erase(parentNode.children.begin()+slot);
+        parentNode.boxes.erase(parentNode.boxes.begin()+size_t(slot)*2*K,
+                               parentNode.boxes.begin()+size_t(slot+1)*2*K);
+        freeNode(nodeID);
+      } else
+        computeBox(nodeID,nodes[parent].boxes.data()+size_t(slot)*2*K);
+      nodeID = parent;
+    }
+    // a non-leaf root always keeps at least one child here (only one
+    // of its children can have become underfull), so there is a
+    // path down to every orphan's level
+    for (size_t i=0;i<orphans.size();i++) {
+      std::vector<bool> reinserted(height(),false);
+      insert(orphanBoxes.data()+i*2*K,orphans[i].first,orphans[i].second,reinserted);
+    }
+    while (nodes[root].level > 0 && nodes[root].children.size() == 1) {
+      const int oldRoot = root;
+      root = nodes[oldRoot].children[0];
+      nodes[root].parent = -1;
+      freeNode(oldRoot);
+    }
+  }
+
+  std::vector<int> RStarTree::packLevel(std::vector<int> &children,
+                                        const std::vector<double> &childBoxes,
+                                        int level)
+  {
+    strSort(children.begin(),children.end(),0,K,maxEntries,childBoxes);
+    const int count = (int)children.size();
+    std::vector<int> begins;
+    for (int b=0;b<count;b+=maxEntries)
+      begins.push_back(b);
+    // don't leave an underfull last node: split the last two nodes'
+    // children evenly instead
+    if (begins.size() > 1 && count-begins.back() < minEntries)
+      begins.back() = (begins[begins.size()-2]+count)/2;
+    begins.push_back(count);
+
+    std::vector<int> packed;
+    for (size_t n=0;n+1<begins.size();n++) {
+      const int nodeID = newNode(level);
+      for (int i=begins[n];i<begins[n+1];i++)
+        addChild(nodeID,children[i],childBoxes.data()+size_t(children[i])*2*K);
+      packed.push_back(nodeID);
+    }
+    return packed;
+  }
+
+  void RStarTree::bulkLoad(const PointArray &newPoints, const py::object &newValues)
+  {
+    if (newPoints.ndim() != 2 || newPoints.shape(1) != K)
+      throw py::type_error("points in RStarTree::bulk_load() do not match dimensionality of tree");
+    const size_t numNew = newPoints.shape(0);
+    if (!newValues.is_none() && py::len(newValues) != numNew)
+      throw py::value_error("pyQuiri: number of values does not match number of points");
+    const double *coords = newPoints.data();
+    for (size_t i=0;i<numNew*K;i++)
+      if (!std::isfinite(coords[i]))
+        throw py::value_error("pyQuiri: R*-tree points must have finite coordinates");
+    if (numEntries()+numNew > size_t(std::numeric_limits<int32_t>::max()))
+      throw std::runtime_error("pyQuiri: too many points");
+
+    // compact the entries that are already in the tree, and append
+    // the new ones
+    std::vector<bool> isFree(values.size(),false);
+    for (int entryID : freeEntries)
+      isFree[entryID] = true;
+    std::vector<double>     packedPoints;
+    std::vector<py::object> packedValues;
+    for (size_t i=0;i<values.size();i++)
+      if (!isFree[i]) {
+        packedPoints.insert(packedPoints.end(),entryPoint((int)i),entryPoint((int)i)+K);
+        packedValues.push_back(values[i]);
+      }
+    packedPoints.insert(packedPoints.end(),coords,coords+numNew*K);
+    for (size_t i=0;i<numNew;i++)
+      packedValues.push_back(newValues.is_none()
+                             ? py::object(py::int_(i))
+                             : py::object(newValues[py::int_(i)]));
+    points.swap(packedPoints);
+    values.swap(packedValues);
+    freeEntries.clear();
+    nodes.clear();
+    freeNodes.clear();
+
+    // pack the entries into leaves, and each level's nodes into the
+    // next one's, until there is a single root
+    const int count = (int)values.size();
+    std::vector<int>    children(count);
+    std::vector<double> childBoxes(size_t(count)*2*K);
+    for (int i=0;i<count;i++) {
+      children[i] = i;
+      std::copy(entryPoint(i),entryPoint(i)+K,childBoxes.begin()+size_t(i)*2*K);
+      std::copy(entryPoint(i),entryPoint(i)+K,childBoxes.begin()+size_t(i)*2*K+K);
+    }
+    if (count == 0) {
+      root = newNode(0);
+      return;
+    }
+    for (int level=0;;level++) {
+      std::vector<int> packed = packLevel(children,childBoxes,level);
+      if (packed.size() == 1) {
+        root = packed[0];
+        return;
+      }
+      childBoxes.resize(nodes.size()*2*K);
+      for (int nodeID : packed)
+        computeBox(nodeID,childBoxes.data()+size_t(nodeID)*2*K);
+      children.swap(packed);
+    }
+  }
+
+  template<typename Visit>
+  void RStarTree::traverse(const double *lower, const double *upper,
+                           const Visit &visit) const
+  {
+    std::vector<int> stack = { root };
+    while (!stack.empty()) {
+      const Node &node = nodes[stack.back()];
+      stack.pop_back();
+      for (size_t i=0;i<node.children.size();i++) {
+        const double *box = node.boxes.data()+i*2*K;
+        bool overlaps = true;
+        for (int d=0;d<K && overlaps;d++)
+          overlaps = (box[d] <= upper[d] && lower[d] <= box[K+d]);
+        if (!overlaps)
+          continue;
+        if (node.level > 0)
+          stack.push_back(node.children[i]);
+        else
+          visit(node.children[i]);
+      }
+    }
+  }
+
+  /*! best-first search: nodes and entries get visited in order of
+      (their boxes') distance to the query, so the first k entries
+      that come off the queue are the k closest ones */
+  std::vector<std::pair<double,int>>
+  RStarTree::closest(const double *query, int k, double maxRadius) const
+  {
+    std::vector<std::pair<double,int>> result;
+    // squaring would turn a negative radius into a positive one
+    if (maxRadius < 0.)
+      return result;
+    const double maxSqrDist = maxRadius*maxRadius;
+    // nodes are >= 0, entries are -1-entryID
+    std::priority_queue<std::pair<double,int>,
+                        std::vector<std::pair<double,int>>,
+                        std::greater<std::pair<double,int>>> queue;
+    queue.push({0.,root});
+    while (!queue.empty() && (int)result.size() < k) {
+      const std::pair<double,int> top = queue.top();
+      queue.pop();
+      if (top.second < 0) {
+        result.push_back({top.first,-1-top.second});
+        continue;
+      }
+      const Node &node = nodes[top.second];
+      for (size_t i=0;i<node.children.size();i++) {
+        const double sqrDist = sqrDistToBox(query,node.boxes.data()+i*2*K,K);
+        if (sqrDist > maxSqrDist)
+          continue;
+        queue.push({sqrDist,node.level > 0 ? node.children[i] : -1-node.children[i]});
+      }
+    }
+    return result;
+  }
+
+  std::vector<py::object> RStarTree::find(const std::vector<double> &coords) const
+  {
+    checkPoint(coords,"query point");
+    std::vector<py::object> result;
+    traverse(coords.data(),coords.data(),
+             [&](int entryID) { result.push_back(values[entryID]); });
+    return result;
+  }
+
+  std::tuple<std::vector<double>,py::list>
+  RStarTree::findClosest(const std::vector<double> &coords) const
+  {
+    checkPoint(coords,"query point");
+    const std::vector<std::pair<double,int>> found
+      = closest(coords.data(),1,std::numeric_limits<double>::infinity());
+    if (found.empty())
+      return std::tuple<std::vector<double>,py::list>();
+    const std::vector<double> closestPoint = pointVector(found[0].second);
+    py::list values;
+    for (auto &value : find(closestPoint))
+      values.append(value);
+    return std::tuple<std::vector<double>,py::list>(closestPoint,values);
+  }
+
+  RStarTree::PointList
+  RStarTree::kNN(int k, const std::vector<double> &coords, double maxRadius) const
+  {
+    checkPoint(coords,"query point");
+    PointList result;
+    for (auto &found : closest(coords.data(),k,maxRadius))
+      result.push_back(std::make_tuple(pointVector(found.second),values[found.second]));
+    return result;
+  }
+
+  RStarTree::PointList
+  RStarTree::allPointsInRadius(const std::vector<double> &coords, double radius) const
+  {
+    checkPoint(coords,"query point");
+    std::vector<double> lower(K), upper(K);
+    for (int d=0;d<K;d++) {
+      lower[d] = coords[d]-radius;
+      upper[d] = coords[d]+radius;
+    }
+    std::vector<std::pair<double,int>> found;
+    traverse(lower.data(),upper.data(),[&](int entryID) {
+        const double *point = entryPoint(entryID);
+        double sqrDist = 0.;
+        for (int d=0;d<K;d++)
+          sqrDist += (point[d]-coords[d])*(point[d]-coords[d]);
+        if (sqrDist <= radius*radius)
+          found.push_back({sqrDist,entryID});
+      });
+    std::sort(found.begin(),found.end());
+    PointList result;
+    for (auto &f : found)
+      result.push_back(std::make_tuple(pointVector(f.second),values[f.second]));
+    return result;
+  }
+
+  std::vector<std::pair<std::vector<double>,py::object>>
+  RStarTree::allPointsInRange(const std::vector<double> &lower,
+                              const std::vector<double> &upper) const
+  {
+    checkPoint(lower,"lower bound of query range");
+    checkPoint(upper,"upper bound of query range");
+    std::vector<std::pair<std::vector<double>,py::object>> result;
+    traverse(lower.data(),upper.data(),[&](int entryID) {
+        result.push_back({pointVector(entryID),values[entryID]});
+      });
+    return result;
+  }
+
+  std::vector<py::object>
+  RStarTree::allValuesInRange(const std::vector<double> &lower,
+                              const std::vector<double> &upper) const
+  {
+    checkPoint(lower,"lower bound of query range");
+    checkPoint(upper,"upper bound of query range");
+    std::vector<py::object> result;
+    traverse(lower.data(),upper.data(),
+             [&](int entryID) { result.push_back(values[entryID]); });
+    return result;
+  }
+
+} // ::pyq
@@ -0,0 +1,181 @@
+// ======================================================================== //
+// Copyright 2022-2022 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+
+#pragma once
+
+#include "pyQuiri/common.h"
+#include <pybind11/numpy.h>
+
+namespace pyq {
+
+  /*! a dynamic R*-tree (Beckmann et al.) over K-dimensional points:
+      unlike the kd-tree it never needs to get rebuilt, since every
+      add() and remove() only touches one root-to-leaf path (plus the
+      entries that R* re-inserts instead of splitting a node right
+      away), so the tree stays balanced and is always ready for
+      queries. Large data sets should get bulk loaded, which packs
+      full nodes with Sort-Tile-Recursive (STR) */
+  struct RStarTree {
+    typedef std::shared_ptr<RStarTree> SP;
+    typedef py::array_t<double,py::array::c_style|py::array::forcecast> PointArray;
+    typedef std::vector<std::tuple<std::vector<double>,py::object>> PointList;
+
+    /*! one node of the tree; the children of leaves (level 0) are
+        entry IDs, those of all other nodes are node IDs */
+    struct Node {
+      int level;
+      /*! -1 for the root */
+      int parent;
+      std::vector<int>    children;
+      /*! 2*K values per child: its bounding box (lower, then upper) */
+      std::vector<double> boxes;
+    };
+
+    RStarTree(int K, int maxEntries);
+
+    static SP create(int K, int maxEntries)
+    { return std::make_shared<RStarTree>(K,maxEntries); }
+
+    /*! inserts a new ([coords],value) pair */
+    void add(const std::vector<double> &coords, const py::object &value);
+
+    /*! removes one entry with the given coordinates (and, unless
+        value is None, an equal value); returns whether there was
+        one */
+    bool remove(const std::vector<double> &coords, const py::object &value);
+
+    /*! adds one entry per row of a (N,K) array (whose values are the
+        given list's, or the row indices if that is None), and re-packs
+        the whole tree - including all entries it already had - with
+        STR */
+    void bulkLoad(const PointArray &points, const py::object &values);
+
+    /*! returns a list of all the values whose coordinates match the
+        queried coordinates */
+    std::vector<py::object> find(const std::vector<double> &coords) const;
+
+    /*! finds the closest data point to given query point, and returns
+        a tuple [ point, (values) ] (see KDTree::findClosest()) */
+    std::tuple<std::vector<double>,py::list>
+    findClosest(const std::vector<double> &coords) const;
+
+    /*! the k nearest neighbors within maxRadius, closest first */
+    PointList kNN(int k, const std::vector<double> &coords, double maxRadius) const;
+
+    /*! all key:value pairs within the given radius, sorted by distance */
+    PointList allPointsInRadius(const std::vector<double> &coords, double radius) const;
+
+    /*! all key:value pairs within the given box (bounds included) */
+    std::vector<std::pair<std::vector<double>,py::object>>
+    allPointsInRange(const std::vector<double> &lower,
+                     const std::vector<double> &upper) const;
+
+    /*! the values of all points within the given box */
+    std::vector<py::object>
+    allValuesInRange(const std::vector<double> &lower,
+                     const std::vector<double> &upper) const;
+
+    /*! number of entries in the tree */
+    inline size_t numEntries() const { return values.size()-freeEntries.size(); }
+
+    /*! number of levels of the tree (1 if the root is a leaf) */
+    inline int height() const { return nodes[root].level+1; }
+
+    /*! the number of dimensions */
+    const int K;
+    /*! the maximum and minimum number of children per (non-root) node */
+    const int maxEntries, minEntries;
+
+  private:
+    /*! inserts a child (an entry ID if level is 0, else a node ID of
+        level-1) with given bounding box into a node of the given
+        level; 'reinserted' tracks the levels on which this insertion
+        already did a forced reinsert */
+    void insert(const double *box, int child, int level,
+                std::vector<bool> &reinserted);
+
+    /*! picks the node of given level to insert a box into */
+    int chooseSubtree(const double *box, int level) const;
+
+    /*! removes the 30% of an overflowing node's children that are
+        furthest from its center, and inserts them again */
+    void reinsert(int nodeID, std::vector<bool> &reinserted);
+
+    /*! splits an overflowing node along the axis with the smallest
+        total margin, at the distribution with the least overlap;
+        returns the new node (with the second half of the children) */
+    int split(int nodeID);
+
+    /*! after removing an entry from given leaf: removes the nodes on
+        its path that became underfull (re-inserting their children),
+        and shrinks the bounding boxes of the others */
+    void condense(int leafID);
+
+    /*! appends a child to a node */
+    void addChild(int nodeID, int child, const double *box);
+
+    /*! writes the bounding box of all children of a node into 'box' */
+    void computeBox(int nodeID, double *box) const;
+
+    /*! re-computes the bounding box of a node in its parent, and so
+        on up to the root */
+    void refreshBoxes(int nodeID);
+
+    /*! returns the slot of a (non-root) node in its parent */
+    int slotInParent(int nodeID) const;
+
+    /*! returns a new (empty) node of the given level */
+    int newNode(int level);
+    void freeNode(int nodeID);
+
+    /*! packs the given children (entries if level is 0, else nodes of
+        level-1) with STR into full nodes of the given level; returns
+        the new nodes */
+    std::vector<int> packLevel(std::vector<int> &children,
+                               const std::vector<double> &childBoxes,
+                               int level);
+
+    /*! the (ascending) squared distances and entry IDs of the (up to)
+        k closest entries within maxRadius */
+    std::vector<std::pair<double,int>> closest(const double *query, int k,
+                                               double maxRadius) const;
+
+    /*! calls visit(entryID) for all entries within [lower,upper] */
+    template<typename Visit>
+    void traverse(const double *lower, const double *upper, const Visit &visit) const;
+
+    /*! checks that a point has the right dimensionality; throws an
+        exception if not */
+    void checkPoint(const std::vector<double> &coords, const char *what) const;
+
+    inline const double *entryPoint(int entryID) const
+    { return points.data()+size_t(entryID)*K; }
+    inline std::vector<double> pointVector(int entryID) const
+    { return std::vector<double>(entryPoint(entryID),entryPoint(entryID)+K); }
+
+    std::vector<Node>       nodes;
+    std::vector<int>        freeNodes;
+    int                     root;
+    /*! K coordinates per entry ID */
+    std::vector<double>     points;
+    /*! one value per entry ID; None for removed entries */
+    std::vector<py::object> values;
+    /*! the IDs of removed entries, to be re-used by the next add() */
+    std::vector<int>        freeEntries;
+  };
+
+} // ::pyq
@@ -0,0 +1,162 @@
+// ======================================================================== //
+// Copyright 2022-2022 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "pyQuiri/KDTree.h"
+#include "pyQuiri/parallel.h"
+#include <pybind11/numpy.h>
+#include <algorithm>
+
+namespace pyq {
+
+  /*! number of parts of tree A (per thread) that radiusJoin() hands
+      out as separate tasks */
+  static const int RADIUS_JOIN_TASKS_PER_THREAD = 16;
+
+  /*! Finds all pairs by a simultaneous traversal of both trees. Each
+      stack entry is a pair of "parts", where a part is either a whole
+      subtree (nodeID >= 0) or only the data points stored in node
+      ~nodeID itself. A pair gets dropped as soon as the bounding
+      boxes of its parts are farther than 'radius' apart; otherwise
+      the part with the larger box gets split into its own data
+      points and its two children. Tight boxes (rather than the
+      nodes' cells, which always touch their neighbors) are what
+      makes this prune well. To parallelize, tree A first gets cut
+      into a frontier of parts, each of which gets joined with all of
+      tree B as a separate task */
+  py::tuple KDTree::radiusJoin(const KDTree::SP &a, const KDTree::SP &b,
+                               double radius, int numThreads)
+  {
+    if (!a || !b)
+      throw py::type_error("pyQuiri: radius_join requires two kd-trees");
+    if (a->K != b->K)
+      throw py::type_error("pyQuiri: radius_join requires two trees with the same number of dimensions");
+    if (!(radius >= 0.))
+      throw py::value_error("pyQuiri: radius_join requires a non-negative radius");
+    a->verifyTreeIsBuilt();
+    b->verifyTreeIsBuilt();
+    const int    K       = a->K;
+    const size_t stride  = 4*size_t(K);
+    const double radius2 = radius*radius;
+    
+    std::vector<std::vector<int32_t>> pairsA, pairsB;
+    if (a->numPoints() > 0 && b->numPoints() > 0) {
+      py::gil_scoped_release noGIL;
+      const std::vector<double> boundsA = a->computeNodeBounds();
+      const std::vector<double> boundsB = b->computeNodeBounds();
+      /* returns the lower coordinates of a part's box; the upper ones follow */
+      auto partBox = [&](const std::vector<double> &bounds, int part) {
+        return part >= 0
+          ? bounds.data()+size_t(part)*stride
+          : bounds.data()+size_t(~part)*stride+2*K;
+      };
+
+      /* cut tree A into (roughly) enough tasks */
+      std::vector<int> tasks = { 0 };
+      const size_t numTasksWanted
+        = size_t(resolveNumThreads(numThreads))*RADIUS_JOIN_TASKS_PER_THREAD;
+      for (size_t i=0;i<tasks.size() && tasks.size() < numTasksWanted;) {
+        const int nodeID = tasks[i];
+        if (nodeID < 0 || a->nodes[nodeID].splitDim < 0) { ++i; continue; }
+        const Node &node = a->nodes[nodeID];
+        if (node.count > 0)
+          tasks[i++] = ~nodeID;
+        else
+          tasks.erase(tasks.begin()+i);
+        if (node.lChild >= 0) tasks.push_back(node.lChild);
+        if (node.rChild >= 0) tasks.push_back(node.rChild);
+      }
+      
+      pairsA.resize(tasks.size());
+      pairsB.resize(tasks.size());
+      parallel_for(tasks.size(),numThreads,[&](size_t taskID) {
+        std::vector<int32_t> &outA = pairsA[taskID];
+        std::vector<int32_t> &outB = pairsB[taskID];
+        std::vector<std::pair<int,int>> stack;
+        std::vector<double> bufferA(K), bufferB(K);
+
+        /* pushes the given pair of parts, unless they're too far apart */
+        auto pushPair = [&](int partA, int partB) {
+          const double *boxA = partBox(boundsA,partA);
+          const double *boxB = partBox(boundsB,partB);
+          if (sqrDistance(boxA,boxA+K,boxB,boxB+K,K) > radius2) return;
+          stack.push_back({partA,partB});
+        };
+        pushPair(tasks[taskID],0);
+        
+        while (!stack.empty()) {
+          const int partA = stack.back().first;
+          const int partB = stack.back().second;
+          stack.pop_back();
+          const Node &nodeA = a->nodes[partA < 0 ? ~partA : partA];
+          const Node &nodeB = b->nodes[partB < 0 ? ~partB : partB];
+          const bool splittableA = partA >= 0 && nodeA.splitDim >= 0;
+          const bool splittableB = partB >= 0 && nodeB.splitDim >= 0;
+
+          if (!splittableA && !splittableB) {
+            /* two sets of data points - test all pairs */
+            const double *boxB = partBox(boundsB,partB);
+            for (int i=0;i<nodeA.count;i++) {
+              const int     itemA  = a->itemIDs[nodeA.begin+i];
+              const double *pointA = a->pointCoords(itemA,bufferA.data());
+              if (sqrDistance(boxB,boxB+K,pointA,K) > radius2) continue;
+              for (int j=0;j<nodeB.count;j++) {
+                const int itemB = b->itemIDs[nodeB.begin+j];
+                if (sqrDistance(pointA,b->pointCoords(itemB,bufferB.data()),K) > radius2) continue;
+                outA.push_back(itemA);
+                outB.push_back(itemB);
+              }
+            }
+            continue;
+          }
+
+          /* split whichever side has the larger box (or can be split) */
+          bool splitA = splittableA;
+          if (splittableA && splittableB) {
+            const double *boxA = partBox(boundsA,partA);
+            const double *boxB = partBox(boundsB,partB);
+            double extentA = 0., extentB = 0.;
+            for (int d=0;d<K;d++) {
+              extentA = std::max(extentA,boxA[K+d]-boxA[d]);
+              extentB = std::max(extentB,boxB[K+d]-boxB[d]);
+            }
+            splitA = extentA >= extentB;
+          }
+          if (splitA) {
+            if (nodeA.count > 0)   pushPair(~partA,partB);
+            if (nodeA.lChild >= 0) pushPair(nodeA.lChild,partB);
+            if (nodeA.rChild >= 0) pushPair(nodeA.rChild,partB);
+          } else {
+            if (nodeB.count > 0)   pushPair(partA,~partB);
+            if (nodeB.lChild >= 0) pushPair(partA,nodeB.lChild);
+            if (nodeB.rChild >= 0) pushPair(partA,nodeB.rChild);
+          }
+        }
+      });
+    }
+
+    size_t numPairs = 0;
+    for (auto &out : pairsA) numPairs += out.size();
+    py::array_t<int32_t> indicesA(numPairs), indicesB(numPairs);
+    int32_t *outA = indicesA.mutable_data();
+    int32_t *outB = indicesB.mutable_data();
+    for (size_t taskID=0;taskID<pairsA.size();taskID++) {
+      outA = std::copy(pairsA[taskID].begin(),pairsA[taskID].end(),outA);
+      outB = std::copy(pairsB[taskID].begin(),pairsB[taskID].end(),outB);
+    }
+    return py::make_tuple(indicesA,indicesB);
+  }
+  
+} // ::pyq
@@ -0,0 +1,104 @@
+// ======================================================================== //
+// Copyright 2022-2022 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "pyQuiri/RangeIterator.h"
+#include "pyQuiri/LeafKernels.h"
+
+namespace pyq {
+
+  RangeIterator::RangeIterator(const KDTree::SP &tree,
+                               const std::vector<double> &lower,
+                               const std::vector<double> &upper,
+                               size_t chunkSize)
+    : tree(tree),
+      treeVersion(tree->version),
+      K(tree->K),
+      chunkSize(chunkSize),
+      lower(tree->makeCheckCoords(lower).coords),
+      upper(tree->makeCheckCoords(upper).coords),
+      stack(tree->K),
+      cellLower(tree->K),
+      cellUpper(tree->K)
+  {
+    tree->verifyTreeIsBuilt();
+    if (chunkSize == 0)
+      throw py::value_error("pyQuiri: chunk_size must be at least 1");
+    tree->prepareLeafCoords();
+    if (!tree->nodes.empty())
+      stack.pushRoot();
+  }
+
+  py::tuple RangeIterator::next()
+  {
+    if (tree->version != treeVersion)
+      throw std::runtime_error("pyQuiri: tree was modified during iteration");
+    
+    std::vector<double>  points;
+    std::vector<int32_t> indices;
+    {
+      py::gil_scoped_release noGIL;
+      const LeafKernels &kernels = leafKernels();
+      while (indices.size() < chunkSize) {
+        if (currentNode < 0) {
+          if (stack.empty()) break;
+          const int nodeID = stack.pop(cellLower.data(),cellUpper.data());
+          // cull if cell doesn't overlap the box
+          bool overlaps = true;
+          for (int d=0;d<K;d++)
+            if (cellLower[d] > upper[d] || cellUpper[d] < lower[d])
+              overlaps = false;
+          if (!overlaps) continue;
+          
+          const KDTree::Node &node = tree->nodes[nodeID];
+          if (node.lChild >= 0)
+            stack.push(node.lChild,cellLower.data(),cellUpper.data(),
+                       node.splitDim,node.splitPos,true);
+          if (node.rChild >= 0)
+            stack.push(node.rChild,cellLower.data(),cellUpper.data(),
+                       node.splitDim,node.splitPos,false);
+          if (node.count == 0) continue;
+          
+          inside.resize(node.count);
+          if (!tree->nodeInBox(kernels,node,
+                               lower.data(),upper.data(),inside.data()))
+            continue;
+          currentNode = nodeID;
+          currentItem = 0;
+        }
+
+        const KDTree::Node &node = tree->nodes[currentNode];
+        for (;currentItem<node.count && indices.size()<chunkSize;currentItem++) {
+          if (!inside[currentItem]) continue;
+          const int item = tree->itemIDs[node.begin+currentItem];
+          indices.push_back(item);
+          for (int d=0;d<K;d++)
+            points.push_back(tree->pointCoord(item,d));
+        }
+        if (currentItem == node.count)
+          currentNode = -1;
+      }
+    }
+    if (indices.empty())
+      throw py::stop_iteration();
+
+    py::array_t<double>  pointsArray({indices.size(),size_t(K)});
+    py::array_t<int32_t> indicesArray(indices.size());
+    std::copy(points.begin(),points.end(),pointsArray.mutable_data());
+    std::copy(indices.begin(),indices.end(),indicesArray.mutable_data());
+    return py::make_tuple(pointsArray,indicesArray);
+  }
+  
+} // ::pyq
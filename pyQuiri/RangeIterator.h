@@ -0,0 +1,71 @@
+// ======================================================================== //
+// Copyright 2022-2022 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#pragma once
+
+#include "pyQuiri/KDTree.h"
+
+namespace pyq {
+
+  /*! a python iterator over all data points within a box, which
+      yields them in chunks (of numpy arrays) rather than all at
+      once: the traversal stops once a chunk is full, and resumes
+      from its saved stack (and position within the current node)
+      when asked for the next one. So memory stays bounded no matter
+      how many points are in the box, and the first chunk is
+      available right away */
+  struct RangeIterator {
+    typedef std::shared_ptr<RangeIterator> SP;
+
+    RangeIterator(const KDTree::SP &tree,
+                  const std::vector<double> &lower,
+                  const std::vector<double> &upper,
+                  size_t chunkSize);
+    
+    static SP create(const KDTree::SP &tree,
+                     const std::vector<double> &lower,
+                     const std::vector<double> &upper,
+                     size_t chunkSize)
+    { return std::make_shared<RangeIterator>(tree,lower,upper,chunkSize); }
+
+    /*! returns the next chunk as a tuple of a (n,K) array with the
+        points' coordinates, and an array with their indices (in
+        order of add()); throws py::stop_iteration once all points
+        have been returned */
+    py::tuple next();
+
+  private:
+    const KDTree::SP    tree;
+    /*! the tree's version when this iterator got created, to detect
+        modifications of the tree during iteration */
+    const uint64_t      treeVersion;
+    const int           K;
+    const size_t        chunkSize;
+    std::vector<double> lower, upper;
+    
+    /*! the nodes (and their cells) yet to be traversed */
+    CellStack           stack;
+    /*! the node currently being scanned, if any (else -1), and the
+        next of its points to look at */
+    int                 currentNode = -1;
+    int                 currentItem = 0;
+    /*! whether each of the current node's points is in the box */
+    std::vector<uint8_t> inside;
+    /*! scratch space for popping cells off the stack */
+    std::vector<double> cellLower, cellUpper;
+  };
+  
+} // ::pyq
@@ -0,0 +1,103 @@
+// ======================================================================== //
+// Copyright 2022-2022 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "pyQuiri/SharedMemory.h"
+#ifndef _WIN32
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <fcntl.h>
+# include <unistd.h>
+# include <errno.h>
+# include <string.h>
+#endif
+
+namespace pyq {
+
+#ifdef _WIN32
+  SharedMemory::SP SharedMemory::create(const std::string &name, size_t numBytes)
+  { throw std::runtime_error("pyQuiri: shared-memory trees are not supported on this platform"); }
+
+  SharedMemory::SP SharedMemory::attach(const std::string &name)
+  { throw std::runtime_error("pyQuiri: shared-memory trees are not supported on this platform"); }
+
+  void SharedMemory::unlink(const std::string &name)
+  { throw std::runtime_error("pyQuiri: shared-memory trees are not supported on this platform"); }
+
+  SharedMemory::~SharedMemory()
+  {}
+#else
+  /*! POSIX segment names have to start with a slash; we add that if
+      the user didn't (same as python's multiprocessing.shared_memory) */
+  static std::string posixName(const std::string &name)
+  {
+    return (!name.empty() && name[0] == '/') ? name : "/"+name;
+  }
+  
+  SharedMemory::SP SharedMemory::create(const std::string &name, size_t numBytes)
+  {
+    int fd = shm_open(posixName(name).c_str(),O_RDWR|O_CREAT|O_EXCL,0644);
+    if (fd < 0)
+      throw std::runtime_error("pyQuiri: could not create shared-memory segment '"+name+"' ("+strerror(errno)+")");
+    if (ftruncate(fd,(off_t)numBytes) != 0) {
+      ::close(fd);
+      shm_unlink(posixName(name).c_str());
+      throw std::runtime_error("pyQuiri: could not allocate shared-memory segment '"+name+"'");
+    }
+    void *ptr = mmap(NULL,numBytes,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+    ::close(fd);
+    if (ptr == MAP_FAILED) {
+      shm_unlink(posixName(name).c_str());
+      throw std::runtime_error("pyQuiri: could not map shared-memory segment '"+name+"'");
+    }
+    SharedMemory::SP shm(new SharedMemory);
+    shm->ptr      = ptr;
+    shm->numBytes = numBytes;
+    return shm;
+  }
+
+  SharedMemory::SP SharedMemory::attach(const std::string &name)
+  {
+    int fd = shm_open(posixName(name).c_str(),O_RDONLY,0);
+    if (fd < 0)
+      throw std::runtime_error("pyQuiri: could not open shared-memory segment '"+name+"' ("+strerror(errno)+")");
+    struct stat st;
+    if (fstat(fd,&st) != 0 || st.st_size == 0) {
+      ::close(fd);
+      throw std::runtime_error("pyQuiri: could not query size of shared-memory segment '"+name+"'");
+    }
+    void *ptr = mmap(NULL,(size_t)st.st_size,PROT_READ,MAP_SHARED,fd,0);
+    ::close(fd);
+    if (ptr == MAP_FAILED)
+      throw std::runtime_error("pyQuiri: could not map shared-memory segment '"+name+"'");
+    SharedMemory::SP shm(new SharedMemory);
+    shm->ptr      = ptr;
+    shm->numBytes = (size_t)st.st_size;
+    return shm;
+  }
+
+  void SharedMemory::unlink(const std::string &name)
+  {
+    if (shm_unlink(posixName(name).c_str()) != 0)
+      throw std::runtime_error("pyQuiri: could not unlink shared-memory segment '"+name+"'");
+  }
+
+  SharedMemory::~SharedMemory()
+  {
+    if (ptr) munmap(ptr,numBytes);
+  }
+#endif
+  
+} // ::pyq
@@ -0,0 +1,53 @@
+// ======================================================================== //
+// Copyright 2022-2022 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#pragma once
+
+#include "pyQuiri/common.h"
+
+namespace pyq {
+
+  /*! a named POSIX shared-memory segment, mapped into this process'
+      address space for as long as this object is alive. Segments
+      outlive the process that created them, until they get
+      unlink()'ed (and the last process detached from them) */
+  struct SharedMemory {
+    typedef std::shared_ptr<SharedMemory> SP;
+
+    /*! creates a new segment of given size, mapped writable; throws
+        an exception if a segment of that name already exists */
+    static SP create(const std::string &name, size_t numBytes);
+
+    /*! maps an existing segment, read-only */
+    static SP attach(const std::string &name);
+
+    /*! removes the segment's name; its memory gets released once the
+        last process has detached from it */
+    static void unlink(const std::string &name);
+
+    ~SharedMemory();
+
+    inline char  *data() const { return (char *)ptr; }
+    inline size_t size() const { return numBytes; }
+
+  private:
+    SharedMemory() = default;
+
+    void   *ptr      = nullptr;
+    size_t  numBytes = 0;
+  };
+
+} // ::pyq
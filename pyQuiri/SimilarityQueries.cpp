@@ -0,0 +1,167 @@
+// ======================================================================== //
+// Copyright 2022-2022 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "pyQuiri/KDTree.h"
+#include <queue>
+
+namespace pyq {
+
+  /*! relative slack on the similarity bounds, so that rounding
+      errors in computing them can never prune a subtree that
+      contains a point whose (computed) similarity is just as good */
+  static const double SIMILARITY_BOUND_SLACK = 1e-12;
+  
+  Metric KDTree::parseKNNMetric(const std::string &name)
+  {
+    const Metric metric = parseMetric(name);
+    if (metric == MANHATTAN || metric == CHEBYSHEV)
+      throw py::value_error("pyQuiri: kd-tree kNN queries only support metric"
+                            " 'euclidean', 'cosine', or 'inner_product'");
+    return metric;
+  }
+
+  /*! computes subtreeBounds and pointNorms, see KDTree.h */
+  void KDTree::prepareSimilarityBounds()
+  {
+    if (pointNorms.size() != numPoints()) {
+      pointNorms.resize(numPoints());
+      for (size_t i=0;i<numPoints();i++) {
+        double norm2 = 0.;
+        for (int d=0;d<K;d++)
+          norm2 += pointCoord(int(i),d)*pointCoord(int(i),d);
+        pointNorms[i] = sqrt(norm2);
+      }
+    }
+    if (subtreeBounds.size() != nodes.size()*2*K) {
+      const std::vector<double> bounds = computeNodeBounds();
+      subtreeBounds.resize(nodes.size()*2*K);
+      for (size_t nodeID=0;nodeID<nodes.size();nodeID++)
+        std::copy(bounds.data()+nodeID*4*K,bounds.data()+nodeID*4*K+2*K,
+                  subtreeBounds.data()+nodeID*2*K);
+    }
+  }
+
+  /*! returns an upper bound of the cosine similarity (for COSINE) or
+      dot product (for INNER_PRODUCT) between the query and any point
+      in the box [lower,upper]. The dot product is largest at the
+      corner that has the same sign as the query in each dimension;
+      for the cosine, that gets divided by the smallest norm of any
+      point in the box if it is positive, and by the largest one if
+      it is negative */
+  static double similarityBound(const double *query, double queryNorm, Metric metric,
+                                const double *lower, const double *upper, int K)
+  {
+    double maxDot = 0., magnitude = 0.;
+    for (int d=0;d<K;d++) {
+      const double lo = query[d]*lower[d];
+      const double hi = query[d]*upper[d];
+      maxDot    += std::max(lo,hi);
+      magnitude += std::max(std::abs(lo),std::abs(hi));
+    }
+    maxDot += SIMILARITY_BOUND_SLACK*magnitude;
+    if (metric == INNER_PRODUCT)
+      return maxDot;
+
+    if (queryNorm == 0.)
+      // all similarities are 0
+      return 0.;
+    double minNorm2 = 0., maxNorm2 = 0.;
+    for (int d=0;d<K;d++) {
+      const double minAbs
+        = std::max(lower[d],0.)+std::max(-upper[d],0.);
+      const double maxAbs
+        = std::max(std::abs(lower[d]),std::abs(upper[d]));
+      minNorm2 += minAbs*minAbs;
+      maxNorm2 += maxAbs*maxAbs;
+    }
+    if (maxDot >= 0.)
+      return minNorm2 > 0.
+        ? std::min(1.,maxDot/(queryNorm*sqrt(minNorm2))*(1.+SIMILARITY_BOUND_SLACK))
+        : 1.;
+    return maxDot/(queryNorm*sqrt(maxNorm2))*(1.-SIMILARITY_BOUND_SLACK);
+  }
+  
+  int KDTree::similarityQuery(const double *query, int k, Metric metric,
+                              const std::vector<int32_t> *wantedLabels,
+                              uint64_t wantedMask,
+                              std::pair<double,int> *heap) const
+  {
+    int heapSize = 0;
+    if (nodes.empty() || k <= 0) return 0;
+    double queryNorm2 = 0.;
+    for (int d=0;d<K;d++)
+      queryNorm2 += query[d]*query[d];
+    const double queryNorm = sqrt(queryNorm2);
+
+    auto mayContainWanted = [&](int nodeID) {
+      const double *bounds = subtreeBounds.data()+size_t(nodeID)*2*K;
+      // subtrees without any points have inverted bounds
+      if (bounds[0] > bounds[K])
+        return false;
+      return !wantedLabels || (labelMasks[nodeID] & wantedMask) != 0;
+    };
+    auto bound = [&](int nodeID) {
+      const double *bounds = subtreeBounds.data()+size_t(nodeID)*2*K;
+      return similarityBound(query,queryNorm,metric,bounds,bounds+K,K);
+    };
+    
+    /* subtrees still to visit, with the best bound first */
+    std::priority_queue<std::pair<double,int>> queue;
+    if (mayContainWanted(0))
+      queue.push({bound(0),0});
+    while (!queue.empty()) {
+      const double nodeBound = queue.top().first;
+      const Node  &node      = nodes[queue.top().second];
+      queue.pop();
+      if (heapSize == k && -nodeBound > heap[0].first)
+        break;
+
+      for (int i=node.begin;i<node.begin+node.count;i++) {
+        const int item = itemIDs[i];
+        if (wantedLabels &&
+            !std::binary_search(wantedLabels->begin(),wantedLabels->end(),labels[item]))
+          continue;
+        double dot = 0.;
+        for (int d=0;d<K;d++)
+          dot += query[d]*pointCoord(item,d);
+        double similarity = dot;
+        if (metric == COSINE)
+          similarity = (queryNorm == 0. || pointNorms[item] == 0.)
+            ? 0.
+            : std::max(-1.,std::min(1.,dot/(queryNorm*pointNorms[item])));
+        const std::pair<double,int> candidate(-similarity,item);
+        if (heapSize < k) {
+          heap[heapSize++] = candidate;
+          std::push_heap(heap,heap+heapSize);
+        } else if (candidate < heap[0]) {
+          std::pop_heap(heap,heap+heapSize);
+          heap[heapSize-1] = candidate;
+          std::push_heap(heap,heap+heapSize);
+        }
+      }
+      
+      for (int child : { node.lChild, node.rChild }) {
+        if (child < 0 || !mayContainWanted(child)) continue;
+        const double childBound = bound(child);
+        if (heapSize < k || -childBound <= heap[0].first)
+          queue.push({childBound,child});
+      }
+    }
+    std::sort_heap(heap,heap+heapSize);
+    return heapSize;
+  }
+  
+} // ::pyq
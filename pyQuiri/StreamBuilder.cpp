@@ -0,0 +1,313 @@
+// ======================================================================== //
+// Copyright 2022-2022 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "pyQuiri/StreamBuilder.h"
+#include "pyQuiri/FileFormat.h"
+#include <stdio.h>
+
+namespace pyq {
+
+  /*! number of points we read/write at a time when streaming */
+  static const size_t STREAM_BLOCK_SIZE = 1<<16;
+  
+  /*! returns the prefix for all temporary files of a build */
+  static std::string makeTmpPrefix(const std::string &fileName,
+                                   const std::string &tmpDir)
+  {
+    if (tmpDir.empty())
+      return fileName+".tmp";
+    const size_t slash = fileName.find_last_of("/\\");
+    const std::string baseName
+      = (slash == std::string::npos) ? fileName : fileName.substr(slash+1);
+    return tmpDir+"/"+baseName+".tmp";
+  }
+  
+  StreamBuilder::StreamBuilder(int K,
+                               const std::string &fileName,
+                               const std::string &tmpDir,
+                               size_t partitionSize,
+                               size_t sampleSize)
+    : K(K),
+      fileName(fileName),
+      tmpPrefix(makeTmpPrefix(fileName,tmpDir)),
+      partitionSize(std::max(partitionSize,size_t(1))),
+      sampleSize(std::max(sampleSize,size_t(1))),
+      out(fileName,std::ios::binary|std::ios::trunc)
+  {
+    if (!out)
+      throw std::runtime_error("pyQuiri: could not open file '"+fileName+"' for writing");
+    // leave room for the header; points go right where the final
+    // file expects them
+    const FileHeader layout = makeFileHeader(K,0,0,sizeof(KDTree::Node),0);
+    std::vector<char> zeroes(layout.points.offset,0);
+    out.write(zeroes.data(),zeroes.size());
+  }
+
+  StreamBuilder::~StreamBuilder()
+  {
+    for (int i=0;i<numPartitions;i++)
+      remove(partitionFileName(i).c_str());
+  }
+
+  /*! returns the name of the temporary file for given partition */
+  std::string StreamBuilder::partitionFileName(int partitionID) const
+  {
+    return tmpPrefix+".part"+std::to_string(partitionID);
+  }
+  
+  /*! adds the given points (K doubles each) to output and sample */
+  void StreamBuilder::addPoints(const double *points, size_t count)
+  {
+    if (finished)
+      throw std::runtime_error("pyQuiri: stream builder has already been finished");
+    if (numPoints+count > (size_t)std::numeric_limits<int>::max())
+      throw std::runtime_error("pyQuiri: too many points for a single kd-tree");
+    
+    out.write((const char *)points,count*K*sizeof(double));
+    if (!out)
+      throw std::runtime_error("pyQuiri: error writing to '"+fileName+"'");
+
+    // reservoir sampling, so every point has the same chance of
+    // ending up in the sample
+    for (size_t i=0;i<count;i++, numPoints++) {
+      const double *point = points+i*K;
+      if (sample.size() < sampleSize*K) {
+        sample.insert(sample.end(),point,point+K);
+        continue;
+      }
+      const size_t slot
+        = std::uniform_int_distribution<size_t>(0,numPoints)(rng);
+      if (slot < sampleSize)
+        std::copy(point,point+K,sample.begin()+slot*K);
+    }
+  }
+  
+  /*! adds a chunk of points, given as a (N,K) array */
+  void StreamBuilder::addChunk(const py::array_t<double,py::array::c_style|py::array::forcecast> &chunk)
+  {
+    if (chunk.ndim() != 2 || chunk.shape(1) != K)
+      throw py::type_error("pyQuiri: chunk needs to be a (N,K) array matching the builder's dimensionality");
+    addPoints(chunk.data(),(size_t)chunk.shape(0));
+  }
+
+  /*! adds all points from a raw binary file of (native-endian)
+    float64's, K per point */
+  void StreamBuilder::addFile(const std::string &pointsFileName)
+  {
+    std::ifstream in(pointsFileName,std::ios::binary);
+    if (!in)
+      throw std::runtime_error("pyQuiri: could not open file '"+pointsFileName+"'");
+    std::vector<double> block(STREAM_BLOCK_SIZE*K);
+    while (in) {
+      in.read((char *)block.data(),block.size()*sizeof(double));
+      const size_t numBytes = (size_t)in.gcount();
+      if (numBytes % (K*sizeof(double)))
+        throw std::runtime_error("pyQuiri: size of '"+pointsFileName+"' is not a multiple of K float64's");
+      addPoints(block.data(),numBytes/(K*sizeof(double)));
+    }
+  }
+
+  /*! recursively builds the top levels of the tree over the given
+    sample points; returns either the ID of the created node, or (if
+    the sample is small enough) a new partition, encoded as
+    -2-partitionID */
+  int StreamBuilder::buildTopRec(std::vector<int> &sampleIDs)
+  {
+    const double pointsPerSample = numPoints / double(sample.size()/K);
+    if (sampleIDs.size() < 2 ||
+        sampleIDs.size()*pointsPerSample <= partitionSize)
+      return -2-(numPartitions++);
+
+    Box bounds(K);
+    for (auto id : sampleIDs)
+      bounds.grow(&sample[size_t(id)*K]);
+    const int splitDim = widestDimension(bounds);
+    if (bounds.lower[splitDim] == bounds.upper[splitDim])
+      // all sample points are the same; no use splitting any further
+      return -2-(numPartitions++);
+
+    // split at the sample median, but make sure neither side ends up
+    // empty (which could happen if many points share the minimum)
+    std::vector<double> values;
+    for (auto id : sampleIDs)
+      values.push_back(sample[size_t(id)*K+splitDim]);
+    std::nth_element(values.begin(),values.begin()+values.size()/2,values.end());
+    double splitPos = values[values.size()/2];
+    if (splitPos == bounds.lower[splitDim]) {
+      splitPos = bounds.upper[splitDim];
+      for (auto v : values)
+        if (v > bounds.lower[splitDim]) splitPos = std::min(splitPos,v);
+    }
+
+    std::vector<int> left, right;
+    for (auto id : sampleIDs)
+      (sample[size_t(id)*K+splitDim] < splitPos ? left : right).push_back(id);
+    sampleIDs.clear();
+
+    const int nodeID = (int)topNodes.size();
+    KDTree::Node node;
+    node.splitPos = splitPos;
+    node.splitDim = splitDim;
+    node.begin    = 0;
+    node.count    = 0;
+    node.lChild   = -1;
+    node.rChild   = -1;
+    node.pad      = 0;
+    topNodes.push_back(node);
+    
+    const int lChild = buildTopRec(left);
+    const int rChild = buildTopRec(right);
+    topNodes[nodeID].lChild = lChild;
+    topNodes[nodeID].rChild = rChild;
+    return nodeID;
+  }
+  
+  /*! builds the tree, writes the final file, and returns that file
+    loaded via (memory-mapped) KDTree::load() */
+  KDTree::SP StreamBuilder::finish()
+  {
+    if (finished)
+      throw std::runtime_error("pyQuiri: stream builder has already been finished");
+    finished = true;
+    
+    {
+      py::gil_scoped_release release;
+      out.flush();
+      // the section offsets only depend on the number of points
+      const FileHeader layout = makeFileHeader(K,numPoints,0,sizeof(KDTree::Node),0);
+      
+      // ------------------------------------------------------------------
+      // build top levels from the sample
+      // ------------------------------------------------------------------
+      std::vector<int> sampleIDs(sample.size()/K);
+      for (int i=0;i<(int)sampleIDs.size();i++)
+        sampleIDs[i] = i;
+      const int rootRef = numPoints ? buildTopRec(sampleIDs) : -1;
+      sample = {};
+
+      // ------------------------------------------------------------------
+      // spill each point into the file of the partition it falls into
+      // ------------------------------------------------------------------
+      {
+        std::vector<std::unique_ptr<std::ofstream>> partitionFiles;
+        for (int i=0;i<numPartitions;i++) {
+          partitionFiles.push_back(std::unique_ptr<std::ofstream>
+                                   (new std::ofstream(partitionFileName(i),std::ios::binary)));
+          if (!*partitionFiles.back())
+            throw std::runtime_error("pyQuiri: could not create temporary file '"
+                                     +partitionFileName(i)+"'");
+        }
+        std::ifstream in(fileName,std::ios::binary);
+        in.seekg(layout.points.offset);
+        std::vector<double> block(STREAM_BLOCK_SIZE*K);
+        for (size_t blockBegin=0;blockBegin<numPoints;blockBegin+=STREAM_BLOCK_SIZE) {
+          const size_t blockSize = std::min(STREAM_BLOCK_SIZE,numPoints-blockBegin);
+          in.read((char *)block.data(),blockSize*K*sizeof(double));
+          if (!in)
+            throw std::runtime_error("pyQuiri: error reading back '"+fileName+"'");
+          for (size_t i=0;i<blockSize;i++) {
+            const double *point = block.data()+i*K;
+            int ref = rootRef;
+            while (ref >= 0) {
+              const KDTree::Node &node = topNodes[ref];
+              ref = (point[node.splitDim] < node.splitPos) ? node.lChild : node.rChild;
+            }
+            std::ofstream &partition = *partitionFiles[-2-ref];
+            const int pointID = int(blockBegin+i);
+            partition.write((const char *)point,K*sizeof(double));
+            partition.write((const char *)&pointID,sizeof(pointID));
+          }
+        }
+        for (auto &partition : partitionFiles)
+          if (!partition->flush())
+            throw std::runtime_error("pyQuiri: error writing temporary partition file");
+      }
+
+      // ------------------------------------------------------------------
+      // build each partition in memory, and append it to the file
+      // ------------------------------------------------------------------
+      std::vector<int> partitionRoot(numPartitions,-1);
+      size_t itemBase = 0;
+      size_t nodeBase = topNodes.size();
+      for (int partitionID=0;partitionID<numPartitions;partitionID++) {
+        std::vector<double> points;
+        std::vector<int>    pointIDs;
+        {
+          std::ifstream in(partitionFileName(partitionID),std::ios::binary);
+          std::vector<double> point(K);
+          int pointID;
+          while (in.read((char *)point.data(),K*sizeof(double)) &&
+                 in.read((char *)&pointID,sizeof(pointID))) {
+            points.insert(points.end(),point.begin(),point.end());
+            pointIDs.push_back(pointID);
+          }
+        }
+        remove(partitionFileName(partitionID).c_str());
+        if (pointIDs.empty())
+          continue;
+
+        KDTree partition(K);
+        partition.points.writable().swap(points);
+        // the overload without labels, which needs no GIL
+        partition.build("top_down",0,"midpoint_item",1,"none");
+        
+        std::vector<KDTree::Node> nodes(partition.nodes.data(),
+                                        partition.nodes.data()+partition.nodes.size());
+        for (auto &node : nodes) {
+          node.begin += (int)itemBase;
+          if (node.lChild >= 0) node.lChild += (int)nodeBase;
+          if (node.rChild >= 0) node.rChild += (int)nodeBase;
+        }
+        std::vector<int> itemIDs(partition.itemIDs.size());
+        for (size_t i=0;i<itemIDs.size();i++)
+          itemIDs[i] = pointIDs[partition.itemIDs[i]];
+
+        out.seekp(layout.itemIDs.offset+itemBase*sizeof(int));
+        out.write((const char *)itemIDs.data(),itemIDs.size()*sizeof(int));
+        out.seekp(layout.nodes.offset+nodeBase*sizeof(KDTree::Node));
+        out.write((const char *)nodes.data(),nodes.size()*sizeof(KDTree::Node));
+        
+        partitionRoot[partitionID] = (int)nodeBase;
+        itemBase += itemIDs.size();
+        nodeBase += nodes.size();
+      }
+
+      // ------------------------------------------------------------------
+      // link top levels to partitions, and finalize the file
+      // ------------------------------------------------------------------
+      for (auto &node : topNodes) {
+        if (node.lChild < -1) node.lChild = partitionRoot[-2-node.lChild];
+        if (node.rChild < -1) node.rChild = partitionRoot[-2-node.rChild];
+      }
+      out.seekp(layout.nodes.offset);
+      out.write((const char *)topNodes.data(),topNodes.size()*sizeof(KDTree::Node));
+
+      const FileHeader header = makeFileHeader(K,numPoints,nodeBase,sizeof(KDTree::Node),0);
+      out.seekp(0);
+      out.write((const char *)&header,sizeof(header));
+      // pad the file to its full size (the last sections are empty)
+      const uint64_t nodesEnd = header.nodes.offset+header.nodes.size;
+      std::vector<char> zeroes(header.fileSize()-nodesEnd,0);
+      out.seekp(nodesEnd);
+      out.write(zeroes.data(),zeroes.size());
+      out.close();
+      if (!out)
+        throw std::runtime_error("pyQuiri: error writing '"+fileName+"'");
+    }
+    return KDTree::load(fileName,true);
+  }
+  
+} // ::pyq
@@ -0,0 +1,100 @@
+// ======================================================================== //
+// Copyright 2022-2022 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#pragma once
+
+#include "pyQuiri/KDTree.h"
+#include <pybind11/numpy.h>
+#include <fstream>
+#include <random>
+
+namespace pyq {
+
+  /*! builds a kd-tree over more points than fit into memory: points
+      get streamed in (in chunks) and written straight into the
+      output file; finish() then builds the top levels of the tree
+      from a random sample, spills the points into one temporary
+      file per top-level partition, builds each partition in memory,
+      and writes the final tree in the format that KDTree::load() can
+      memory-map. The resulting tree is index-only, ie, each point's
+      value is its index in the order it was added */
+  struct StreamBuilder {
+    typedef std::shared_ptr<StreamBuilder> SP;
+
+    /*! creates a builder that writes the tree to 'fileName'. Each
+        partition will contain (about) at most 'partitionSize'
+        points, and the top levels get built from a random sample of
+        'sampleSize' points. Temporary files go into 'tmpDir', or
+        next to 'fileName' if that is empty */
+    StreamBuilder(int K,
+                  const std::string &fileName,
+                  const std::string &tmpDir,
+                  size_t partitionSize,
+                  size_t sampleSize);
+    ~StreamBuilder();
+
+    static SP create(int K,
+                     const std::string &fileName,
+                     const std::string &tmpDir,
+                     size_t partitionSize,
+                     size_t sampleSize)
+    { return std::make_shared<StreamBuilder>(K,fileName,tmpDir,partitionSize,sampleSize); }
+
+    /*! adds a chunk of points, given as a (N,K) array */
+    void addChunk(const py::array_t<double,py::array::c_style|py::array::forcecast> &chunk);
+
+    /*! adds all points from a raw binary file of (native-endian)
+        float64's, K per point */
+    void addFile(const std::string &fileName);
+
+    /*! builds the tree, writes the final file, and returns that
+        file loaded via (memory-mapped) KDTree::load() */
+    KDTree::SP finish();
+
+  private:
+    /*! adds the given points (K doubles each) to output and sample */
+    void addPoints(const double *points, size_t numPoints);
+    
+    /*! recursively builds the top levels of the tree over the given
+        sample points; returns either the ID of the created node, or
+        (if the sample is small enough) a new partition, encoded as
+        -2-partitionID */
+    int buildTopRec(std::vector<int> &sampleIDs);
+
+    /*! returns the name of the temporary file for given partition */
+    std::string partitionFileName(int partitionID) const;
+    
+    const int         K;
+    const std::string fileName;
+    const std::string tmpPrefix;
+    const size_t      partitionSize;
+    const size_t      sampleSize;
+
+    /*! the output file; points get written to it as they come in */
+    std::ofstream     out;
+    size_t            numPoints = 0;
+
+    /*! reservoir sample of the points added so far, K doubles each */
+    std::vector<double> sample;
+    std::mt19937_64     rng;
+
+    /*! the top levels of the tree, built from the sample */
+    std::vector<KDTree::Node> topNodes;
+    int                       numPartitions = 0;
+    bool                      finished = false;
+  };
+
+} // ::pyq
@@ -15,9 +15,59 @@
 // ======================================================================== //
 
 #include "pyQuiri/KDTree.h"
+#include "pyQuiri/SharedMemory.h"
+#include "pyQuiri/StreamBuilder.h"
+#include "pyQuiri/RangeIterator.h"
+#include "pyQuiri/NearestIterator.h"
+#include "pyQuiri/LeafKernels.h"
+#include "pyQuiri/IntKDTree.h"
+#include "pyQuiri/BallTree.h"
+#include "pyQuiri/RPForest.h"
+#include "pyQuiri/HNSW.h"
+#include "pyQuiri/GridIndex.h"
+#include "pyQuiri/BVH.h"
+#include "pyQuiri/RStarTree.h"
 
 PYBIND11_DECLARE_HOLDER_TYPE(T, std::shared_ptr<T>);
 
+/*! binds IntKDTree<T> under the given class name */
+template<typename T>
+static void bindIntKDTree(py::module &m, const char *name)
+{
+  typedef pyq::IntKDTree<T> Tree;
+  auto tree = py::class_<Tree,std::shared_ptr<Tree>>(m, name);
+  tree.doc() = "kd-tree over points with integer coordinates, with exact integer arithmetic; created by kd_tree(K,dtype='int32'/'int64')";
+  tree.def
+    ("add",
+     &Tree::add,
+     "adds a new ([coords],value) pair");
+  tree.def
+    ("build",
+     &Tree::build,
+     "builds the tree to prepare it for performing query operations; nodes with at most leaf_size points become leaves",
+     py::arg("leaf_size")=8);
+  tree.def
+    ("find",
+     &Tree::find,
+     "returns a list of all the values whose coordinates match the queried coordinates",
+     py::arg("query_point"));
+  tree.def
+    ("knn",
+     &Tree::kNN,
+     "finds the k nearest neighbors (within max_sqr_radius, if given); returns [([coords],value,squared_distance)], with exact squared distances",
+     py::arg("k"),
+     py::arg("query_point"),
+     py::arg("max_sqr_radius")=py::none());
+  tree.def
+    ("all_points_in_range",
+     &Tree::allPointsInRange,
+     "finds all points in given query range (ie, in a k-dimensional box, bounds included).");
+  tree.def
+    ("all_values_in_range",
+     &Tree::allValuesInRange,
+     "finds all values in given query range (ie, in a k-dimensional box, bounds included).");
+}
+
 PYBIND11_MODULE(pyQuiri, m) {
 
   // optional module docstring
@@ -40,39 +90,648 @@ PYBIND11_MODULE(pyQuiri, m) {
     "\n"
     "    KDTree\n"
     "\n"
+    "    StreamBuilder\n"
+    "\n"
     "Key methods to set up query operations:\n"
     "=======================================\n"
     "\n"
-    "    pyQuiri.kd_tree(N) -> creates a new KDTree object for N-dimensional data\n"
+    "    pyQuiri.kd_tree(N,dtype=\"float64\") -> creates a new KDTree object for\n"
+    "        N-dimensional data\n"
+    "        => dtype=\"float32\" rounds all coordinates to single precision on\n"
+    "           add(), and stores them (and the copy that queries scan) in half\n"
+    "           the memory; distances still get computed in double, so results\n"
+    "           are exact for the (rounded) points. find() and find_batch()\n"
+    "           round their query points the same way. Saved, pickled, and\n"
+    "           shared trees keep their dtype\n"
+    "        => dtype=\"int32\" or \"int64\" creates a KDTreeInt32/KDTreeInt64 for\n"
+    "           integer coordinates (eg, grid cells or voxel ids), in which all\n"
+    "           comparisons and distances are exact integer arithmetic. These\n"
+    "           support add(), build(leaf_size=8), find(), all_points_in_range(),\n"
+    "           all_values_in_range(), and knn(k,[query_coords],max_sqr_radius=None),\n"
+    "           which returns [ ([coords],value,squared_distance) ] with the\n"
+    "           exact squared distances as python ints\n"
     "\n"
     "    KDTree.add([coords],value) -> adds a new ([coords],value) pair\n"
     "\n"
-    "    KDTree.build() -> prepares the tree for executing queries\n"
+    "    KDTree.build(method=\"top_down\",n_threads=0,split_strategy=\"midpoint_item\",\n"
+    "                 leaf_size=1,labels=None,leaf_compression=\"none\")\n"
+    "        -> prepares the tree for executing queries\n"
+    "        => method=\"morton\" (up to 3D data only) builds the tree by sorting\n"
+    "           the points along a Z-curve (parallel radix sort over n_threads\n"
+    "           threads, 0 meaning one per core), which is much faster to build\n"
+    "        => split_strategy (for method=\"top_down\") is one of\n"
+    "           \"midpoint_item\": widest dimension, at the point closest to its middle\n"
+    "           \"median\": widest dimension, at the median point (balanced tree)\n"
+    "           \"sliding_midpoint\": middle of the cell, slid towards the points if\n"
+    "              needed (avoids long skinny cells on clustered data)\n"
+    "           \"cost_model\": minimizes the expected number of visited points\n"
+    "        => leaf_size: nodes with at most that many points become leaves;\n"
+    "           larger leaves (eg, 16) get scanned with SIMD kernels, which is\n"
+    "           typically faster for knn_batch, radius_batch, and range queries,\n"
+    "           but keeps a second, leaf-ordered copy of the points (which\n"
+    "           save(), export_shm() and pickling store along with the tree, so\n"
+    "           loaded trees use it in-place, too)\n"
+    "        => labels: optional int32 label per point (in order of add()), for\n"
+    "           knn(...,labels=[...]); not stored by save() or pickling\n"
+    "        => leaf_compression=\"u8\" or \"u16\" replaces the (8 or 4 bytes per\n"
+    "           coordinate) copy of the points that queries scan by 1- or 2-byte\n"
+    "           codes relative to each leaf's bounds; only points that these\n"
+    "           can't rule out get their exact coordinates fetched (from a\n"
+    "           memory-mapped file, for trees loaded with mmap=True). Results\n"
+    "           stay exact. Requires leaf_size >= 8; the codes get saved,\n"
+    "           shared, and pickled along with the tree. Can also be changed on\n"
+    "           an already built tree\n"
+    "\n"
+    "    KDTree.save(path,include_values=True) -> writes the built tree to a file\n"
+    "\n"
+    "    pyQuiri.load(path,mmap=True) -> loads a tree written by KDTree.save()\n"
+    "        => with mmap=True the file gets used in-place (no parsing, and\n"
+    "           pages shared between processes). Trees saved without values\n"
+    "           report each point's index (in order of add()) as its value\n"
+    "\n"
+    "    KDTree.export_shm(name,include_values=False) -> writes the built tree\n"
+    "        into a new POSIX shared-memory segment\n"
+    "\n"
+    "    pyQuiri.attach_shm(name) -> read-only tree using that segment in-place,\n"
+    "        so any number of processes share one physical copy of the tree\n"
+    "\n"
+    "    pyQuiri.unlink_shm(name) -> removes the segment once no longer needed\n"
+    "\n"
+    "    pyQuiri.ball_tree(N,metric=\"euclidean\") -> creates a new BallTree object\n"
+    "        for N-dimensional data, with the same add(), find(), find_closest(),\n"
+    "        knn(k,[query_coords],max_radius=inf), and all_points_in_radius() as\n"
+    "        KDTree, and build(leaf_size=16). Nodes are bounded by balls rather\n"
+    "        than boxes, which keeps pruning at 10-64 dimensions where kd-trees\n"
+    "        degrade to brute force; metric is \"euclidean\", \"manhattan\", or\n"
+    "        \"chebyshev\"\n"
+    "\n"
+    "    pyQuiri.rp_forest(N,n_trees=10,leaf_size=32,seed=0) -> RPForest\n"
+    "        => approximate kNN for high-dimensional data, using a forest of\n"
+    "           random-projection trees: RPForest.add([coords],value) or\n"
+    "           .add_batch(ndarray) (values are the point indices), .build(),\n"
+    "           then .knn(k,[query_coords],search_k=-1) -> list of\n"
+    "           ([coords],value), and .knn_batch(queries,k,search_k=-1) ->\n"
+    "           (indices,distances) arrays. Queries look at search_k\n"
+    "           candidates (default n_trees*k); more trees and larger search_k\n"
+    "           give higher recall at lower speed\n"
+    "\n"
+    "    pyQuiri.hnsw(dim,M=16,ef_construction=200,metric=\"euclidean\",seed=0)\n"
+    "        -> HNSW\n"
+    "        => approximate kNN for high-dimensional data, using a hierarchical\n"
+    "           navigable small world graph with (up to) M links per point:\n"
+    "           HNSW.add([coords],value) and .add_batch(ndarray,n_threads=0)\n"
+    "           (values are the point indices) link new points in right away,\n"
+    "           without a separate build. .knn(k,[query_coords],ef=50) -> list\n"
+    "           of ([coords],value), and .knn_batch(queries,k,ef=50) ->\n"
+    "           (indices,distances) arrays. Larger ef (and M, ef_construction)\n"
+    "           give higher recall at lower speed; metric is \"euclidean\",\n"
+    "           \"manhattan\", \"chebyshev\", \"cosine\" (distances are 1-cosine), or\n"
+    "           \"inner_product\" (reports the dot products, largest first)\n"
+    "\n"
+    "    pyQuiri.grid_index(K,cell_size,skin=0.) -> GridIndex\n"
+    "        => fixed-radius neighbor search over a hashed uniform grid, which\n"
+    "           beats trees for (typically 2D/3D) points and radii up to about\n"
+    "           cell_size: GridIndex.build(ndarray,n_threads=0) bins the rows of\n"
+    "           a (N,K) array (with a parallel counting sort); queries report\n"
+    "           points by row index. all_points_in_radius([query_coords],r) and\n"
+    "           radius_batch(queries,r,n_threads=0) work as for KDTree, and\n"
+    "           neighbor_lists(r,n_threads=0,include_self=False) returns the CSR\n"
+    "           neighbor lists of all points within r of each other\n"
+    "        => for simulations, update(ndarray) moves the points; with a skin\n"
+    "           they only get re-binned (and update returns True) once one of\n"
+    "           them moved more than skin/2, and until then neighbor_lists(r)\n"
+    "           re-uses its candidates within r+skin (Verlet lists)\n"
+    "\n"
+    "    pyQuiri.bvh(K) -> BVH\n"
+    "        => bounding volume hierarchy over K-dimensional primitives:\n"
+    "           BVH.add_box([lower],[upper],value), .add_sphere([center],radius,\n"
+    "           value), .add_segment([a],[b],value), and .add_boxes(lower,upper)\n"
+    "           (two (M,K) arrays; values are the indices), then\n"
+    "           .build(leaf_size=4,n_threads=0) (Morton-sorted, like the\n"
+    "           kd-tree's \"morton\" build). Queries:\n"
+    "           find_containing([point]) -> values of all primitives containing it\n"
+    "           find_overlapping([lower],[upper]) -> values of all primitives\n"
+    "               overlapping that box\n"
+    "           find_closest([point]) -> (value,distance) of the closest primitive\n"
+    "           overlap_pairs(n_threads=0) -> (indices_a,indices_b) of all pairs\n"
+    "               of primitives whose bounding boxes overlap (a collision\n"
+    "               detection's broad phase), with indices_a < indices_b\n"
+    "\n"
+    "    pyQuiri.rstar_tree(K,max_entries=16) -> RStarTree\n"
+    "        => dynamic R*-tree for data sets that keep changing: every\n"
+    "           RStarTree.add([coords],value) and .remove([coords],value=None)\n"
+    "           (which removes one entry at those coordinates, with an equal\n"
+    "           value unless None, and returns whether there was one) only\n"
+    "           updates one path of the balanced tree, so there is no build()\n"
+    "           and queries always see the current points.\n"
+    "           bulk_load(ndarray,values=None) adds the rows of a (N,K) array\n"
+    "           (whose values are the given list's, or their row indices) and\n"
+    "           re-packs the whole tree with Sort-Tile-Recursive, which is both\n"
+    "           faster and gives better nodes than adding them one by one.\n"
+    "           find(), find_closest(), knn(k,[query_coords],max_radius=inf),\n"
+    "           all_points_in_radius(), all_points_in_range(), and\n"
+    "           all_values_in_range() work as for KDTree\n"
+    "\n"
+    "    pyQuiri.stream_builder(K,path,tmp_dir=\"\",partition_size=2**24,\n"
+    "                           sample_size=2**20) -> StreamBuilder\n"
+    "        => builds (index-only) trees over more points than fit into\n"
+    "           memory: StreamBuilder.add_chunk(ndarray) and .add_file(raw_path)\n"
+    "           stream points to disk, and .finish() builds the tree in\n"
+    "           partitions of at most ~partition_size points, writes it to\n"
+    "           path, and returns it memory-mapped\n"
+    "\n"
+    "    pyQuiri.simd_level() -> name of the instruction set used for scanning\n"
+    "        leaf points: \"scalar\", \"sse4\", \"avx2\", or \"avx512\" (leaves with\n"
+    "        fewer points than one instruction handles get scanned by the\n"
+    "        scalar code, as do all leaves of trees built with leaf_size=1)\n"
+    "    pyQuiri.set_simd_level(name) -> selects one of supported_simd_levels(),\n"
+    "        or \"auto\" for the fastest one (the default)\n"
+    "\n"
+    "    KDTree objects can be pickled (eg, to pass them to multiprocessing\n"
+    "    workers) without having to re-build them; with pickle protocol 5\n"
+    "    the tree's arrays get passed as out-of-band buffers. Trees that are\n"
+    "    not built get pickled with just their points and values, and come\n"
+    "    back unbuilt\n"
     "\n"
     "Query operations on a KDTree:\n"
     "=============================\n"
     "\n"
     "    KDTree.find([query_coords]) -> list of value(s) at these exact coords\n"
     "\n"
+    "    KDTree.enable_hash_index() -> adds a hash index over the coordinates,\n"
+    "        kept up to date by add(), with which find() and find_batch() take\n"
+    "        O(1) expected time and work without (re-)building the tree\n"
+    "\n"
+    "    KDTree.find_batch(queries) -> (indptr,indices)\n"
+    "        => find() for each row of a (M,K) array of query points, returned\n"
+    "           as CSR arrays: the indices (in order of add()) of the points at\n"
+    "           exactly query i are indices[indptr[i]:indptr[i+1]], sorted\n"
+    "\n"
     "    KDTree.find_closest([query_coords]) -> ([coords],[value(s)])\n"
     "        => finds the closest data point, and returns both\n"
     "           that point and all value(s) at that point\n"
     "\n"
-    "    KDTree.kNN(k,[query_coords],maxRange=inf) -> [ ([coords],[value(s)]) ]\n"
+    "    KDTree.kNN(k,[query_coords],maxRange=inf,labels=None,metric=\"euclidean\")\n"
+    "        -> [ ([coords],[value(s)]) ]\n"
     "        => runs a kNN query with given k and (optionally) maximum search radius.\n"
     "           Returns a list of (coords:value) pairs that is sorted by distance.\n"
     "           In case of more than one element at exactly the same distance the\n"
     "           result list *can* contain more than k elements\n"
+    "        => with labels=[...] only points whose label (see build) is in that\n"
+    "           list count; subtrees without any such label get skipped, so this\n"
+    "           stays fast even for rare labels\n"
+    "        => metric=\"cosine\" or \"inner_product\" instead returns the k points\n"
+    "           with the largest cosine similarity or dot product to the query\n"
+    "           (exact, using bounds of these over each subtree's bounding box);\n"
+    "           these do not support maxRange\n"
     "\n"
     "    KDTree.all_points_in_range([coords_lower],[coords_upper]) -> ([coords],value])\n"
     "        => finds all point:value pairs within given box, and returns those in a list\n"
     "\n"
     "    KDTree.all_values_in_range([coords_lower],[coords_upper]) -> ([coords],value])\n"
     "        => same as all_points_in_range, but returns only the values.\n"
+    "\n"
+    "    KDTree.all_points_in_radius([query_coords],r) -> [ ([coords],value) ]\n"
+    "        => all point:value pairs within distance r, sorted by distance\n"
+    "\n"
+    "    KDTree.iter_points_in_range([coords_lower],[coords_upper],chunk_size=65536)\n"
+    "        -> iterator over (points,indices)\n"
+    "        => same points as all_points_in_range, but yielded in chunks of\n"
+    "           up to chunk_size: a (n,K) array of coordinates and an array of\n"
+    "           their indices (in order of add()). Memory stays bounded however\n"
+    "           many points are in the box, and the first chunk comes right away\n"
+    "\n"
+    "    KDTree.nearest_iter([query_coords]) -> iterator over ([coords],value)\n"
+    "        => all points in order of increasing distance, found one at a time\n"
+    "           on demand (each step in amortized logarithmic time) - for when k\n"
+    "           isn't known up front, eg to walk outwards until some condition\n"
+    "           holds\n"
+    "\n"
+    "    KDTree.knn_batch(queries,k,max_radius=inf,n_threads=0,order=\"morton\",\n"
+    "                     packet_size=1,metric=\"euclidean\") -> (indices,distances)\n"
+    "        => k nearest neighbors for each row of a (M,K) array of query\n"
+    "           points, as two (M,k) arrays (closest first; padded with -1\n"
+    "           and inf if fewer than k points are within max_radius)\n"
+    "        => order=\"morton\" or \"hilbert\" internally sorts the queries\n"
+    "           along that curve, so consecutive queries touch the same\n"
+    "           parts of the tree; results are always in input order\n"
+    "        => packet_size>1 (eg, 8 or 16) lets groups of that many consecutive\n"
+    "           queries traverse the tree together, visiting a node if any of\n"
+    "           them needs it - which pays off for coherent (eg, sorted) queries\n"
+    "        => metric=\"cosine\" reports 1-cosine similarity as distance, and\n"
+    "           metric=\"inner_product\" the dot products (largest first, padded\n"
+    "           with -inf); see KDTree.kNN\n"
+    "\n"
+    "    KDTree.radius_batch(queries,r,n_threads=0,order=\"morton\",packet_size=1)\n"
+    "        -> (indptr,indices,distances)\n"
+    "        => all points within distance r of each query point, in CSR\n"
+    "           layout (see knn_graph); order and packet_size as for knn_batch\n"
+    "\n"
+    "    KDTree.knn_graph(k,n_threads=0,include_self=False) -> (indptr,indices,distances)\n"
+    "        => k nearest neighbors of every data point, as numpy arrays in CSR\n"
+    "           layout: the neighbors of point i (in order of add()) are\n"
+    "           indices[indptr[i]:indptr[i+1]], closest first. Nearby points\n"
+    "           share one traversal of the tree, over n_threads threads\n"
+    "\n"
+    "    pyQuiri.radius_join(tree_a,tree_b,r,n_threads=0) -> (indices_a,indices_b)\n"
+    "        => all pairs of points (one from each tree) within distance r of\n"
+    "           each other, as two numpy arrays of indices (in order of add()),\n"
+    "           found by traversing both trees simultaneously\n"
     ;
 
-  m.def("kd_tree", &pyq::KDTree::create,
-        "creates a new k-dimenional kd-tree object'");
+  m.def("kd_tree",
+        [](int K, const std::string &dtype) -> py::object {
+          if (dtype == "int32") return py::cast(pyq::IntKDTree<int32_t>::create(K));
+          if (dtype == "int64") return py::cast(pyq::IntKDTree<int64_t>::create(K));
+          return py::cast(pyq::KDTree::create(K,dtype));
+        },
+        "creates a new k-dimenional kd-tree object'; dtype='float32' stores coordinates in single precision, and 'int32'/'int64' creates a tree over integer coordinates",
+        py::arg("K"),
+        py::arg("dtype")="float64");
+  m.def("ball_tree", &pyq::BallTree::create,
+        "creates a new k-dimensional ball tree object; metric is 'euclidean', 'manhattan', or 'chebyshev'",
+        py::arg("K"),
+        py::arg("metric")="euclidean");
+  m.def("rp_forest", &pyq::RPForest::create,
+        "creates a new forest of random-projection trees for approximate kNN queries over k-dimensional data",
+        py::arg("K"),
+        py::arg("n_trees")=10,
+        py::arg("leaf_size")=32,
+        py::arg("seed")=0);
+  m.def("hnsw", &pyq::HNSW::create,
+        "creates a new hierarchical navigable small world graph for approximate kNN queries over dim-dimensional data; metric is 'euclidean', 'manhattan', 'chebyshev', 'cosine', or 'inner_product'",
+        py::arg("dim"),
+        py::arg("M")=16,
+        py::arg("ef_construction")=200,
+        py::arg("metric")="euclidean",
+        py::arg("seed")=0);
+  m.def("grid_index", &pyq::GridIndex::create,
+        "creates a new uniform grid with cells of size cell_size for fixed-radius neighbor searches over k-dimensional points; with a skin > 0, points only get re-binned once one of them moved more than skin/2",
+        py::arg("K"),
+        py::arg("cell_size"),
+        py::arg("skin")=0.);
+  m.def("bvh", &pyq::BVH::create,
+        "creates a new bounding volume hierarchy over k-dimensional boxes, spheres, and segments",
+        py::arg("K"));
+  m.def("rstar_tree", &pyq::RStarTree::create,
+        "creates a new (empty) R*-tree over k-dimensional points, whose nodes hold up to max_entries children; points can be added and removed at any time",
+        py::arg("K"),
+        py::arg("max_entries")=16);
+  m.def("load", &pyq::KDTree::load,
+        "loads a kd-tree previously written by KDTree.save(); with mmap=True the file gets memory-mapped and used in-place",
+        py::arg("path"),
+        py::arg("mmap")=true);
+  m.def("attach_shm", &pyq::KDTree::attachSharedMemory,
+        "attaches (read-only) to a kd-tree that another process wrote into a shared-memory segment via KDTree.export_shm()",
+        py::arg("name"));
+  m.def("unlink_shm", &pyq::SharedMemory::unlink,
+        "removes the shared-memory segment of the given name; its memory gets freed once the last attached tree is gone",
+        py::arg("name"));
+
+  m.def("radius_join", &pyq::KDTree::radiusJoin,
+        "finds all pairs of points (one from each tree) within distance r, and returns them as two arrays of indices",
+        py::arg("tree_a"),
+        py::arg("tree_b"),
+        py::arg("r"),
+        py::arg("n_threads")=0);
+  m.def("simd_level",
+        []() { return std::string(pyq::leafKernels().name); },
+        "returns the instruction set used for scanning the points in leaves");
+  m.def("set_simd_level", &pyq::selectLeafKernels,
+        "selects the instruction set used for scanning the points in leaves ('scalar', 'sse4', 'avx2', 'avx512', or 'auto' for the fastest supported one)",
+        py::arg("name"));
+  m.def("supported_simd_levels", &pyq::supportedLeafKernels,
+        "returns the instruction sets that this CPU supports, slowest first");
+  m.def("stream_builder", &pyq::StreamBuilder::create,
+        "creates a builder for kd-trees over more points than fit into memory; points get added in chunks, and finish() writes the tree to 'path' and returns it memory-mapped",
+        py::arg("K"),
+        py::arg("path"),
+        py::arg("tmp_dir")="",
+        py::arg("partition_size")=size_t(1)<<24,
+        py::arg("sample_size")=size_t(1)<<20);
+
+  // -------------------------------------------------------
+  auto streamBuilder
+    = py::class_<pyq::StreamBuilder,
+                 std::shared_ptr<pyq::StreamBuilder>>(m, "StreamBuilder");
+  streamBuilder.doc() = "out-of-core builder for (index-only) kd-trees over more points than fit into memory";
+  streamBuilder.def
+    ("add_chunk",
+     &pyq::StreamBuilder::addChunk,
+     "adds a chunk of points, given as a (N,K) array",
+     py::arg("points"));
+  streamBuilder.def
+    ("add_file",
+     &pyq::StreamBuilder::addFile,
+     "adds all points from a raw binary file of native-endian float64's, K per point",
+     py::arg("path"));
+  streamBuilder.def
+    ("finish",
+     &pyq::StreamBuilder::finish,
+     "builds the tree, writes it to the builder's output file, and returns it (memory-mapped)");
+
+  // -------------------------------------------------------
+  auto rangeIterator
+    = py::class_<pyq::RangeIterator,
+                 std::shared_ptr<pyq::RangeIterator>>(m, "RangeIterator");
+  rangeIterator.doc() = "iterator over the points in a box, returned by KDTree.iter_points_in_range()";
+  rangeIterator.def
+    ("__iter__",
+     [](const std::shared_ptr<pyq::RangeIterator> &it) { return it; });
+  rangeIterator.def
+    ("__next__",
+     &pyq::RangeIterator::next,
+     "returns the next chunk of (points, indices)");
+
+  // -------------------------------------------------------
+  auto ballTree
+    = py::class_<pyq::BallTree,
+                 std::shared_ptr<pyq::BallTree>>(m, "BallTree");
+  ballTree.doc() = "ball tree with the same query API as KDTree, for higher-dimensional data and other metrics; created by ball_tree()";
+  ballTree.def
+    ("add",
+     &pyq::BallTree::add,
+     "adds a new ([coords],value) pair");
+  ballTree.def
+    ("build",
+     &pyq::BallTree::build,
+     "builds the tree to prepare it for performing query operations; nodes with at most leaf_size points become leaves",
+     py::arg("leaf_size")=16);
+  ballTree.def
+    ("find",
+     &pyq::BallTree::find,
+     "returns a list of all the elements whose coordinates match the queried coordinates",
+     py::arg("query_point"));
+  ballTree.def
+    ("find_closest",
+     &pyq::BallTree::findClosest,
+     "find closest data point(s), and return tuple [coords, (values)].",
+     py::arg("query_point"));
+  ballTree.def
+    ("knn",
+     &pyq::BallTree::kNN,
+     "find k-nearest neighbors (kNN) to a query point.",
+     py::arg("k"),
+     py::arg("query_point"),
+     py::arg("max_radius")=std::numeric_limits<double>::infinity());
+  ballTree.def
+    ("all_points_in_radius",
+     &pyq::BallTree::allPointsInRadius,
+     "finds all points within distance r of the query point, sorted by distance.",
+     py::arg("query_point"),
+     py::arg("r"));
+  
+  // -------------------------------------------------------
+  auto rpForest
+    = py::class_<pyq::RPForest,
+                 std::shared_ptr<pyq::RPForest>>(m, "RPForest");
+  rpForest.doc() = "forest of random-projection trees for approximate kNN queries; created by rp_forest()";
+  rpForest.def
+    ("add",
+     &pyq::RPForest::add,
+     "adds a new ([coords],value) pair");
+  rpForest.def
+    ("add_batch",
+     &pyq::RPForest::addBatch,
+     "adds all rows of a (M,K) array as data points; their values are their indices",
+     py::arg("points"));
+  rpForest.def
+    ("build",
+     &pyq::RPForest::build,
+     "builds all trees (using n_threads threads, 0 for all cores) to prepare the forest for queries",
+     py::arg("n_threads")=0);
+  rpForest.def
+    ("knn",
+     &pyq::RPForest::kNN,
+     "finds the (approximate) k nearest neighbors of a query point among search_k candidates (n_trees*k if negative); returns a list of ([coords],value), closest first",
+     py::arg("k"),
+     py::arg("query_point"),
+     py::arg("search_k")=-1);
+  rpForest.def
+    ("knn_batch",
+     &pyq::RPForest::kNNBatch,
+     "knn() for each row of a (M,K) array; returns (indices,distances) as (M,k) arrays, padded with -1 and inf",
+     py::arg("queries"),
+     py::arg("k"),
+     py::arg("search_k")=-1,
+     py::arg("n_threads")=0);
+  
+  // -------------------------------------------------------
+  auto hnsw
+    = py::class_<pyq::HNSW,
+                 std::shared_ptr<pyq::HNSW>>(m, "HNSW");
+  hnsw.doc() = "hierarchical navigable small world graph for approximate kNN queries; created by hnsw()";
+  hnsw.def
+    ("add",
+     &pyq::HNSW::add,
+     "adds (and links) a new ([coords],value) pair");
+  hnsw.def
+    ("add_batch",
+     &pyq::HNSW::addBatch,
+     "adds (and links) all rows of a (M,K) array as data points, using n_threads threads (0 for all cores); their values are their indices",
+     py::arg("points"),
+     py::arg("n_threads")=0);
+  hnsw.def
+    ("knn",
+     &pyq::HNSW::kNN,
+     "finds the (approximate) k nearest neighbors of a query point, with a candidate list of max(ef,k) points; returns a list of ([coords],value), closest first",
+     py::arg("k"),
+     py::arg("query_point"),
+     py::arg("ef")=50);
+  hnsw.def
+    ("knn_batch",
+     &pyq::HNSW::kNNBatch,
+     "knn() for each row of a (M,K) array; returns (indices,distances) as (M,k) arrays, padded with -1 and inf",
+     py::arg("queries"),
+     py::arg("k"),
+     py::arg("ef")=50,
+     py::arg("n_threads")=0);
+  
+  // -------------------------------------------------------
+  auto gridIndex
+    = py::class_<pyq::GridIndex,
+                 std::shared_ptr<pyq::GridIndex>>(m, "GridIndex");
+  gridIndex.doc() = "uniform grid for fixed-radius neighbor searches; created by grid_index()";
+  gridIndex.def
+    ("build",
+     &pyq::GridIndex::build,
+     "bins the rows of a (N,K) array of points into the grid (using n_threads threads, 0 for all cores); queries report points by row index",
+     py::arg("points"),
+     py::arg("n_threads")=0);
+  gridIndex.def
+    ("update",
+     &pyq::GridIndex::update,
+     "moves the points to the rows of a (N,K) array; returns whether that re-binned them (which only happens once a point moved more than skin/2)",
+     py::arg("points"),
+     py::arg("n_threads")=0);
+  gridIndex.def
+    ("all_points_in_radius",
+     &pyq::GridIndex::allPointsInRadius,
+     "finds all points within distance r of the query point; returns ([coords],index) pairs, closest first.",
+     py::arg("query_point"),
+     py::arg("r"));
+  gridIndex.def
+    ("radius_batch",
+     &pyq::GridIndex::radiusBatch,
+     "finds all points within distance r of each row of a (M,K) array of query points; returns CSR arrays (indptr, indices, distances).",
+     py::arg("queries"),
+     py::arg("r"),
+     py::arg("n_threads")=0);
+  gridIndex.def
+    ("neighbor_lists",
+     &pyq::GridIndex::neighborLists,
+     "finds all points within distance r of each point; returns CSR arrays (indptr, indices, distances), re-using the candidates of an earlier call with the same r while the points did not get re-binned.",
+     py::arg("r"),
+     py::arg("n_threads")=0,
+     py::arg("include_self")=false);
+  
+  // -------------------------------------------------------
+  auto bvh
+    = py::class_<pyq::BVH,
+                 std::shared_ptr<pyq::BVH>>(m, "BVH");
+  bvh.doc() = "bounding volume hierarchy over boxes, spheres, and segments; created by bvh()";
+  bvh.def
+    ("add_box",
+     &pyq::BVH::addBox,
+     "adds an axis-aligned box with given lower and upper corners",
+     py::arg("lower"),
+     py::arg("upper"),
+     py::arg("value"));
+  bvh.def
+    ("add_sphere",
+     &pyq::BVH::addSphere,
+     "adds a (solid) sphere",
+     py::arg("center"),
+     py::arg("radius"),
+     py::arg("value"));
+  bvh.def
+    ("add_segment",
+     &pyq::BVH::addSegment,
+     "adds the line segment between points a and b",
+     py::arg("a"),
+     py::arg("b"),
+     py::arg("value"));
+  bvh.def
+    ("add_boxes",
+     &pyq::BVH::addBoxes,
+     "adds one box per row of two (M,K) arrays of lower and upper corners; their values are their indices",
+     py::arg("lower"),
+     py::arg("upper"));
+  bvh.def
+    ("build",
+     &pyq::BVH::build,
+     "builds the hierarchy to prepare it for queries; nodes with at most leaf_size primitives become leaves",
+     py::arg("leaf_size")=4,
+     py::arg("n_threads")=0);
+  bvh.def
+    ("find_containing",
+     &pyq::BVH::findContaining,
+     "returns the values of all primitives that contain the given point",
+     py::arg("point"));
+  bvh.def
+    ("find_overlapping",
+     &pyq::BVH::findOverlapping,
+     "returns the values of all primitives that overlap the given box",
+     py::arg("lower"),
+     py::arg("upper"));
+  bvh.def
+    ("find_closest",
+     &pyq::BVH::findClosest,
+     "returns (value,distance) of the primitive closest to the given point, or None if there are none",
+     py::arg("point"));
+  bvh.def
+    ("overlap_pairs",
+     &pyq::BVH::overlapPairs,
+     "finds all pairs of primitives whose bounding boxes overlap; returns them as two arrays (indices_a, indices_b), with indices_a < indices_b",
+     py::arg("n_threads")=0);
+  
+  // -------------------------------------------------------
+  auto rstarTree
+    = py::class_<pyq::RStarTree,
+                 std::shared_ptr<pyq::RStarTree>>(m, "RStarTree");
+  rstarTree.doc() = "dynamic R*-tree with the same query API as KDTree, for points that get added and removed all the time; created by rstar_tree()";
+  rstarTree.def
+    ("add",
+     &pyq::RStarTree::add,
+     "adds a new ([coords],value) pair",
+     py::arg("coords"),
+     py::arg("value"));
+  rstarTree.def
+    ("remove",
+     &pyq::RStarTree::remove,
+     "removes one point at the given coordinates (with an equal value, unless value is None); returns whether there was one",
+     py::arg("coords"),
+     py::arg("value")=py::none());
+  rstarTree.def
+    ("bulk_load",
+     &pyq::RStarTree::bulkLoad,
+     "adds the rows of a (N,K) array (with the given values, or their row indices if None), and re-packs the whole tree with Sort-Tile-Recursive",
+     py::arg("points"),
+     py::arg("values")=py::none());
+  rstarTree.def
+    ("find",
+     &pyq::RStarTree::find,
+     "returns a list of all the values whose coordinates match the queried coordinates",
+     py::arg("query_point"));
+  rstarTree.def
+    ("find_closest",
+     &pyq::RStarTree::findClosest,
+     "find closest data point(s), and return tuple [coords, (values)].",
+     py::arg("query_point"));
+  rstarTree.def
+    ("knn",
+     &pyq::RStarTree::kNN,
+     "find k-nearest neighbors (kNN) to a query point; returns a list of ([coords],value), closest first",
+     py::arg("k"),
+     py::arg("query_point"),
+     py::arg("max_radius")=std::numeric_limits<double>::infinity());
+  rstarTree.def
+    ("all_points_in_radius",
+     &pyq::RStarTree::allPointsInRadius,
+     "finds all points within distance r of the query point, sorted by distance.",
+     py::arg("query_point"),
+     py::arg("r"));
+  rstarTree.def
+    ("all_points_in_range",
+     &pyq::RStarTree::allPointsInRange,
+     "finds all points in given query range (ie, in a k-dimensional box, bounds included).");
+  rstarTree.def
+    ("all_values_in_range",
+     &pyq::RStarTree::allValuesInRange,
+     "finds all values in given query range (ie, in a k-dimensional box, bounds included).");
+  rstarTree.def
+    ("height",
+     &pyq::RStarTree::height,
+     "returns the number of levels of the tree");
+  rstarTree.def
+    ("__len__",
+     &pyq::RStarTree::numEntries);
+  
+  // -------------------------------------------------------
+  bindIntKDTree<int32_t>(m,"KDTreeInt32");
+  bindIntKDTree<int64_t>(m,"KDTreeInt64");
+  
+  // -------------------------------------------------------
+  auto nearestIterator
+    = py::class_<pyq::NearestIterator,
+                 std::shared_ptr<pyq::NearestIterator>>(m, "NearestIterator");
+  nearestIterator.doc() = "iterator over points by increasing distance, returned by KDTree.nearest_iter()";
+  nearestIterator.def
+    ("__iter__",
+     [](const std::shared_ptr<pyq::NearestIterator> &it) { return it; });
+  nearestIterator.def
+    ("__next__",
+     &pyq::NearestIterator::next,
+     "returns the next closest ([coords],value)");
+
+  // -------------------------------------------------------
+  py::class_<pyq::MemoryRef>(m, "_MemoryRef", py::buffer_protocol())
+    .def_buffer([](pyq::MemoryRef &ref) -> py::buffer_info {
+        return py::buffer_info((void *)ref.ptr,1,
+                               py::format_descriptor<uint8_t>::format(),
+                               (py::ssize_t)ref.numBytes,
+                               /*readonly*/true);
+      });
 
   // -------------------------------------------------------
   auto kdTree
@@ -87,14 +746,55 @@ PYBIND11_MODULE(pyQuiri, m) {
      "Adds a new (coordinates,object) tuple to the tree");
   kdTree.def
     ("build",
-     &pyq::KDTree::build,
-     "(re-)builds the kd-tree to prepare it for performing query operations");
+     py::overload_cast<const std::string &,int,const std::string &,int,
+                       const py::object &,const std::string &>(&pyq::KDTree::build),
+     "(re-)builds the kd-tree to prepare it for performing query operations; method='morton' uses a (parallel) Morton-order build for up to 3-dimensional data; split_strategy selects how method='top_down' splits nodes; nodes with at most leaf_size points become leaves; labels optionally assigns an int32 label to each point, for knn(labels=...); leaf_compression='u8' or 'u16' stores the coordinates that queries scan as compressed codes (requires leaf_size >= 8)",
+     py::arg("method")="top_down",
+     py::arg("n_threads")=0,
+     py::arg("split_strategy")="midpoint_item",
+     py::arg("leaf_size")=1,
+     py::arg("labels")=py::none(),
+     py::arg("leaf_compression")="none");
+  kdTree.def
+    ("save",
+     &pyq::KDTree::save,
+     "writes the built kd-tree to a binary file that pyQuiri.load() can memory-map; with include_values=False only the points get stored",
+     py::arg("path"),
+     py::arg("include_values")=true);
+  kdTree.def
+    ("export_shm",
+     &pyq::KDTree::exportSharedMemory,
+     "writes the built kd-tree into a new POSIX shared-memory segment that other processes can pyQuiri.attach_shm(); this tree then uses that shared copy, too",
+     py::arg("name"),
+     py::arg("include_values")=false);
+  kdTree.def
+    (py::pickle([](pyq::KDTree &tree) -> py::object { return tree.getState(); },
+                [](const py::object &state) {
+                  if (py::isinstance<py::bytes>(state))
+                    return pyq::KDTree::fromState(state);
+                  // state from __reduce_ex__ with pickle protocol 5
+                  py::tuple args = state;
+                  return pyq::KDTree::fromBuffers(args[0],args[1],args[2]);
+                }));
+  kdTree.def
+    ("__reduce_ex__",
+     &pyq::KDTree::reduceEx,
+     "pickles the tree without copying its arrays; protocol 5 passes them as out-of-band buffers. Trees that are not built get pickled (and unpickled) unbuilt");
   kdTree.def
     ("find",
      &pyq::KDTree::find,
      "returns a list of all the elements whose coordinates match the queried coordinates"
      ,py::arg("query_point")
      );
+  kdTree.def
+    ("enable_hash_index",
+     &pyq::KDTree::enableHashIndex,
+     "adds a hash index over the points' coordinates that gets maintained by add(); find() and find_batch() then take O(1) expected time, and no longer require the tree to be built");
+  kdTree.def
+    ("find_batch",
+     &pyq::KDTree::findBatch,
+     "finds all points with exactly the coordinates of each row of a (M,K) array of query points; returns CSR arrays (indptr, indices).",
+     py::arg("queries"));
   kdTree.def
     ("find_closest",
      &pyq::KDTree::findClosest,
@@ -107,12 +807,64 @@ PYBIND11_MODULE(pyQuiri, m) {
     ("all_points_in_range",
      &pyq::KDTree::allPointsInRange,
      "finds all points in given query range (ie, in a k-dimensional box).");
+  kdTree.def
+    ("all_points_in_radius",
+     &pyq::KDTree::allPointsInRadius,
+     "finds all points within distance r of the query point, sorted by distance.",
+     py::arg("query_point"),
+     py::arg("r"));
   kdTree.def
     ("knn",
      &pyq::KDTree::kNN,
-     "find k-nearest neighbors (kNN) to a query point.",
+     "find k-nearest neighbors (kNN) to a query point; with labels=[...] only points with one of these labels are considered. metric='cosine' or 'inner_product' finds the points with the largest cosine similarity or dot product instead.",
      py::arg("k"),
      py::arg("query_point"),
-     py::arg("max_radius")=std::numeric_limits<double>::infinity());
+     py::arg("max_radius")=std::numeric_limits<double>::infinity(),
+     py::arg("labels")=py::none(),
+     py::arg("metric")="euclidean");
+  kdTree.def
+    ("iter_points_in_range",
+     [](const pyq::KDTree::SP &tree,
+        const std::vector<double> &lower,
+        const std::vector<double> &upper,
+        size_t chunkSize)
+     { return pyq::RangeIterator::create(tree,lower,upper,chunkSize); },
+     "returns an iterator that yields all points in given query range in chunks of (points, indices) arrays.",
+     py::arg("lower"),
+     py::arg("upper"),
+     py::arg("chunk_size")=65536);
+  kdTree.def
+    ("nearest_iter",
+     [](const pyq::KDTree::SP &tree, const std::vector<double> &query)
+     { return pyq::NearestIterator::create(tree,query); },
+     "returns an iterator over all points in order of increasing distance to the query point, each as ([coords],value).",
+     py::arg("query_point"));
+  kdTree.def
+    ("knn_batch",
+     &pyq::KDTree::kNNBatch,
+     "finds the k nearest neighbors of each row of a (M,K) array of query points; returns (indices, distances) as (M,k) arrays. With metric='cosine' the distances are 1-cosine similarity, with 'inner_product' they are the dot products (largest first).",
+     py::arg("queries"),
+     py::arg("k"),
+     py::arg("max_radius")=std::numeric_limits<double>::infinity(),
+     py::arg("n_threads")=0,
+     py::arg("order")="morton",
+     py::arg("packet_size")=1,
+     py::arg("metric")="euclidean");
+  kdTree.def
+    ("radius_batch",
+     &pyq::KDTree::radiusBatch,
+     "finds all points within distance r of each row of a (M,K) array of query points; returns CSR arrays (indptr, indices, distances).",
+     py::arg("queries"),
+     py::arg("r"),
+     py::arg("n_threads")=0,
+     py::arg("order")="morton",
+     py::arg("packet_size")=1);
+  kdTree.def
+    ("knn_graph",
+     &pyq::KDTree::knnGraph,
+     "computes the k nearest neighbors of every data point, and returns them as CSR arrays (indptr, indices, distances).",
+     py::arg("k"),
+     py::arg("n_threads")=0,
+     py::arg("include_self")=false);
   
 }
@@ -36,6 +36,9 @@
 #include <cmath>
 #include <algorithm>
 #include <sstream>
+#include <limits>
+#include <vector>
+#include <stdint.h>
 #ifdef __GNUC__
 #include <execinfo.h>
 #include <sys/time.h>
@@ -0,0 +1,89 @@
+// ======================================================================== //
+// Copyright 2022-2022 Ingo Wald                                            //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#pragma once
+
+#include "pyQuiri/common.h"
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <exception>
+
+namespace pyq {
+
+  /*! returns the number of threads to use if the user asked for
+      'numThreads' threads, where anything <= 0 means 'one per core' */
+  inline int resolveNumThreads(int numThreads)
+  {
+    if (numThreads > 0)
+      return numThreads;
+    return std::max(1,(int)std::thread::hardware_concurrency());
+  }
+  
+  /*! calls 'task(taskID)' for all taskID's in [0,numTasks), using (up
+      to) the given number of threads. Tasks get handed out
+      dynamically, so they do not need to be of similar cost. If any
+      task throws, the first such exception gets re-thrown once all
+      threads are done. Tasks must not touch any python objects */
+  template<typename Task>
+  void parallel_for(size_t numTasks, int numThreads, const Task &task)
+  {
+    numThreads = (int)std::min(size_t(resolveNumThreads(numThreads)),numTasks);
+    if (numThreads <= 1) {
+      for (size_t taskID=0;taskID<numTasks;taskID++)
+        task(taskID);
+      return;
+    }
+    
+    std::atomic<size_t> nextTaskID(0);
+    std::exception_ptr  firstException;
+    std::mutex          mutex;
+    auto worker = [&]() {
+      try {
+        while (true) {
+          const size_t taskID = nextTaskID++;
+          if (taskID >= numTasks) break;
+          task(taskID);
+        }
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!firstException) firstException = std::current_exception();
+        nextTaskID = numTasks;
+      }
+    };
+    std::vector<std::thread> threads;
+    for (int i=1;i<numThreads;i++)
+      threads.push_back(std::thread(worker));
+    worker();
+    for (auto &thread : threads)
+      thread.join();
+    if (firstException)
+      std::rethrow_exception(firstException);
+  }
+
+  /*! calls 'task(begin,end)' for consecutive blocks of (at most)
+      'blockSize' items each, covering [0,numItems) */
+  template<typename Task>
+  void parallel_for_blocked(size_t numItems, size_t blockSize, int numThreads, const Task &task)
+  {
+    const size_t numBlocks = (numItems+blockSize-1)/blockSize;
+    parallel_for(numBlocks,numThreads,[&](size_t blockID) {
+      const size_t begin = blockID*blockSize;
+      task(begin,std::min(begin+blockSize,numItems));
+    });
+  }
+  
+} // ::pyq
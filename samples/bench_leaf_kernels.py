@@ -0,0 +1,57 @@
+#!/usr/bin/env python3
+
+# micro-benchmark for the SIMD leaf kernels: runs the same batch of
+# kNN, radius and box queries with every instruction set this CPU
+# supports, and reports the speed-up over the scalar kernels (and
+# checks that they all return the same results)
+
+import pyQuiri as pyq
+import numpy as np
+import time
+
+def timed(func, repeats=3):
+    # best of a few runs, to filter out noise from other processes
+    best = None
+    for i in range(repeats):
+        begin = time.perf_counter()
+        result = func()
+        elapsed = time.perf_counter()-begin
+        best = elapsed if best is None else min(best,elapsed)
+    return best, result
+
+def main():
+    rng = np.random.default_rng(0)
+    numPoints, numQueries, K = 1000000, 100000, 3
+    points = rng.random((numPoints,K))
+    queries = rng.random((numQueries,K))
+    boxes = rng.random((1000,K))
+
+    for leafSize in [1,16,64]:
+        # build() on an already built tree does nothing, so each leaf
+        # size needs a tree of its own
+        tree = pyq.kd_tree(K)
+        for i in range(numPoints):
+            tree.add(list(points[i]),i)
+        tree.build("morton",leaf_size=leafSize)
+        print("leaf_size=%d:" % leafSize)
+        reference = None
+        scalarTimes = None
+        for level in pyq.supported_simd_levels():
+            pyq.set_simd_level(level)
+            tKNN, knn = timed(lambda: tree.knn_batch(queries,8,n_threads=1))
+            tRadius, radius = timed(lambda: tree.radius_batch(queries,0.01,n_threads=1))
+            tBox, box = timed(lambda: [tree.all_values_in_range(list(b),list(b+0.05))
+                                       for b in boxes])
+            results = (knn[0].tolist(), radius[1].tolist(), box)
+            if reference is None:
+                reference, scalarTimes = results, (tKNN,tRadius,tBox)
+            elif results != reference:
+                print("  %s: results differ from scalar kernels!" % level)
+            print("  %-7s knn %6.2fs (%.2fx)  radius %6.2fs (%.2fx)  box %6.2fs (%.2fx)"
+                  % (level,
+                     tKNN,scalarTimes[0]/tKNN,
+                     tRadius,scalarTimes[1]/tRadius,
+                     tBox,scalarTimes[2]/tBox))
+    pyq.set_simd_level("auto")
+
+main()
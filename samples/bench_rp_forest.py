@@ -0,0 +1,63 @@
+#!/usr/bin/env python3
+
+# recall-vs-speed benchmark for the random-projection forest: builds
+# forests with different numbers of trees over clustered
+# high-dimensional points, and for different search_k's reports the
+# recall of knn_batch() (the fraction of the true k nearest neighbors
+# it found) and its speed-up over a brute-force search in numpy
+
+import pyQuiri as pyq
+import numpy as np
+import time
+
+def timed(func, repeats=3):
+    # best of a few runs, to filter out noise from other processes
+    best = None
+    for i in range(repeats):
+        begin = time.perf_counter()
+        result = func()
+        elapsed = time.perf_counter()-begin
+        best = elapsed if best is None else min(best,elapsed)
+    return best, result
+
+def bruteForceKNN(points, queries, k, chunkSize=256):
+    # exact kNN via |q|^2 - 2 q.p + |p|^2, a chunk of queries at a time
+    pointNorms = (points**2).sum(axis=1)
+    result = []
+    for begin in range(0,len(queries),chunkSize):
+        chunk = queries[begin:begin+chunkSize]
+        dist2 = pointNorms[None,:] - 2.*(chunk @ points.T)
+        closest = np.argpartition(dist2,k,axis=1)[:,:k]
+        result.append(closest)
+    return np.vstack(result)
+
+def recall(found, truth):
+    k = truth.shape[1]
+    return np.mean([len(set(f) & set(t)) / k for f,t in zip(found,truth)])
+
+def main():
+    rng = np.random.default_rng(0)
+    numPoints, numQueries, K, k = 100000, 1000, 64, 10
+    # gaussian blobs around random centers, which is closer to real
+    # embeddings than uniformly distributed points
+    centers = rng.standard_normal((200,K))*4.
+    points = centers[rng.integers(0,len(centers),numPoints)] \
+        + rng.standard_normal((numPoints,K))
+    queries = centers[rng.integers(0,len(centers),numQueries)] \
+        + rng.standard_normal((numQueries,K))
+
+    tBrute, truth = timed(lambda: bruteForceKNN(points,queries,k))
+    print("brute force: %.3fs for %d queries" % (tBrute,numQueries))
+
+    for numTrees in [5,10,25,50]:
+        forest = pyq.rp_forest(K,n_trees=numTrees)
+        forest.add_batch(points)
+        tBuild, _ = timed(lambda: forest.build(), repeats=1)
+        print("n_trees=%d (build %.2fs):" % (numTrees,tBuild))
+        for searchK in [numTrees*k,1000,4000,16000]:
+            tQuery, (indices,distances) \
+                = timed(lambda: forest.knn_batch(queries,k,search_k=searchK))
+            print("  search_k=%-6d recall %.3f  %6.3fs (%.1fx brute force)"
+                  % (searchK,recall(indices,truth),tQuery,tBrute/tQuery))
+
+main()
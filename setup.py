@@ -35,8 +35,7 @@ setup(
     # This package is called pyQuiri
     name='pyQuiri',
 
-    #install_requires = ['numpy>=1.19.5'],
-    install_requires = [],
+    install_requires = ['numpy>=1.19.5,<2'],
 
     #packages = ['pyQuiri'],
     packages = ['build/install'],